@@ -0,0 +1,279 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include "common.h"
+#include "batch.h"
+
+namespace dangdal {
+
+namespace {
+
+struct BatchJob {
+	size_t line_no;
+	std::vector<std::string> args;
+};
+
+// Splits a line into arguments on whitespace.  Single or double quotes
+// group words into one argument, as in the shell (but without escapes).
+// Returns false on an unterminated quote.
+bool split_job_line(const std::string &line, std::vector<std::string> &out) {
+	out.clear();
+	size_t i = 0;
+	for(;;) {
+		while(i < line.size() && isspace((unsigned char)line[i])) i++;
+		if(i == line.size()) return true;
+		if(line[i] == '#' && out.empty()) return true;
+
+		std::string arg;
+		while(i < line.size() && !isspace((unsigned char)line[i])) {
+			char c = line[i++];
+			if(c == '\'' || c == '"') {
+				size_t end = line.find(c, i);
+				if(end == std::string::npos) return false;
+				arg += line.substr(i, end-i);
+				i = end+1;
+			} else {
+				arg += c;
+			}
+		}
+		out.push_back(arg);
+	}
+}
+
+std::vector<BatchJob> read_job_list(const std::string &fn) {
+	FILE *fh = (fn == "-") ? stdin : fopen(fn.c_str(), "r");
+	if(!fh) fatal_error("cannot open batch list file '%s'", fn.c_str());
+
+	std::vector<BatchJob> jobs;
+	std::string line;
+	size_t line_no = 0;
+	for(;;) {
+		int c = getc(fh);
+		if(c != EOF && c != '\n') {
+			line += char(c);
+			continue;
+		}
+		if(c == EOF && line.empty()) break;
+		line_no++;
+
+		BatchJob job;
+		job.line_no = line_no;
+		if(!split_job_line(line, job.args)) {
+			fatal_error("unterminated quote on line %zd of batch list", line_no);
+		}
+		if(!job.args.empty()) jobs.push_back(job);
+		line.clear();
+		if(c == EOF) break;
+	}
+
+	if(fh != stdin) fclose(fh);
+	return jobs;
+}
+
+void redirect_fd(const std::string &fn, int fd) {
+	int new_fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(new_fd < 0 || dup2(new_fd, fd) < 0) {
+		fprintf(stderr, "cannot open %s: %s\n", fn.c_str(), strerror(errno));
+		_exit(127);
+	}
+	close(new_fd);
+}
+
+// Takes any '-timings fn' out of args, returning true if there was one.
+bool remove_timings_arg(std::vector<std::string> &args) {
+	bool found = false;
+	std::vector<std::string> args_out;
+	for(size_t argp=0; argp<args.size(); argp++) {
+		if(argp && args[argp] == "-timings" && argp+1 < args.size()) {
+			found = true;
+			argp++;
+		} else {
+			args_out.push_back(args[argp]);
+		}
+	}
+	args.swap(args_out);
+	return found;
+}
+
+} // anonymous namespace
+
+void BatchOpts::printUsage() {
+	printf(
+"Batch:\n"
+"  -batch listfile              Run one job per line of listfile ('-' for stdin).\n"
+"                               Each line holds the arguments for one run; other\n"
+"                               options given on the command line apply to all jobs\n"
+"  -batch-jobs N                Run up to N jobs at once (default is 1)\n"
+"  -batch-out prefix            Send the console output of the job on line n to\n"
+"                               <prefix><n>.out and <prefix><n>.err\n"
+"                               (default prefix is listfile followed by '.')\n"
+"                               With -timings, each job writes its timings to\n"
+"                               <prefix><n>.timings.json\n"
+	);
+}
+
+BatchOpts::BatchOpts(std::vector<std::string> &arg_list) :
+	num_jobs(1)
+{
+	std::vector<std::string> args_out;
+	const std::string cmdname = arg_list[0];
+	args_out.push_back(cmdname);
+
+	bool got_batch_opts = false;
+
+	size_t argp = 1;
+	while(argp < arg_list.size()) {
+		const std::string arg = arg_list[argp++];
+		if(arg[0] == '-') {
+			try {
+				if(arg == "-batch") {
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
+					list_fn = arg_list[argp++];
+				} else if(arg == "-batch-jobs") {
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
+					num_jobs = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!num_jobs) fatal_error("-batch-jobs must be positive");
+					got_batch_opts = true;
+				} else if(arg == "-batch-out") {
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
+					out_prefix = arg_list[argp++];
+					got_batch_opts = true;
+				} else {
+					args_out.push_back(arg);
+				}
+			} catch(boost::bad_lexical_cast &e) {
+				fatal_error("cannot parse number given on command line");
+			}
+		} else {
+			args_out.push_back(arg);
+		}
+	}
+
+	if(got_batch_opts && list_fn.empty()) {
+		fatal_error("-batch-jobs and -batch-out require -batch");
+	}
+	if(out_prefix.empty()) {
+		out_prefix = (list_fn == "-") ? std::string("batch.") : list_fn + ".";
+	}
+
+	arg_list = args_out;
+}
+
+size_t BatchOpts::run(const std::vector<std::string> &common_args_in, JobMain job_main) const {
+	std::vector<BatchJob> jobs = read_job_list(list_fn);
+
+	// Jobs running at the same time would all write the same -timings file, so each one
+	// gets its own, named after its output files.
+	std::vector<std::string> common_args = common_args_in;
+	const bool want_timings = remove_timings_arg(common_args);
+
+	// Done once here rather than once per job; the children inherit it.
+	GDALAllRegister();
+
+	std::map<pid_t, size_t> running;
+	size_t next_job = 0;
+	size_t num_failed = 0;
+
+	while(next_job < jobs.size() || !running.empty()) {
+		while(next_job < jobs.size() && running.size() < num_jobs) {
+			const BatchJob &job = jobs[next_job];
+			const std::string fn_base = out_prefix +
+				boost::lexical_cast<std::string>(job.line_no);
+
+			// don't let the child inherit (and later repeat) buffered output
+			fflush(stdout);
+			fflush(stderr);
+
+			pid_t pid = fork();
+			if(pid < 0) fatal_error("fork failed: %s", strerror(errno));
+			if(pid == 0) {
+				redirect_fd(fn_base+".out", 1);
+				redirect_fd(fn_base+".err", 2);
+
+				std::vector<std::string> args = common_args;
+				if(want_timings) {
+					args.push_back("-timings");
+					args.push_back(fn_base+".timings.json");
+				}
+				args.insert(args.end(), job.args.begin(), job.args.end());
+				std::vector<char *> argv;
+				for(size_t i=0; i<args.size(); i++) {
+					argv.push_back(const_cast<char *>(args[i].c_str()));
+				}
+				argv.push_back(NULL);
+
+				exit(job_main(int(args.size()), &argv[0]));
+			}
+
+			if(VERBOSE) fprintf(stderr, "started job on line %zd (pid %d)\n",
+				job.line_no, int(pid));
+			running[pid] = next_job++;
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if(pid < 0) {
+			if(errno == EINTR) continue;
+			fatal_error("waitpid failed: %s", strerror(errno));
+		}
+		std::map<pid_t, size_t>::iterator it = running.find(pid);
+		if(it == running.end()) continue;
+		const BatchJob &job = jobs[it->second];
+		running.erase(it);
+
+		bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		if(!ok) num_failed++;
+		if(ok) {
+			printf("job on line %zd: ok\n", job.line_no);
+		} else {
+			printf("job on line %zd: FAILED (see %s%zd.err)\n",
+				job.line_no, out_prefix.c_str(), job.line_no);
+		}
+		fflush(stdout);
+	}
+
+	printf("%zd of %zd jobs failed\n", num_failed, jobs.size());
+	return num_failed;
+}
+
+} // namespace dangdal
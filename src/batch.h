@@ -0,0 +1,64 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+#ifndef DANGDAL_BATCH_H
+#define DANGDAL_BATCH_H
+
+#include <string>
+#include <vector>
+
+namespace dangdal {
+
+// Runs a list of jobs from one invocation of a tool.  Each line of the list
+// file holds the arguments for one job; the options left on the command
+// line are put in front of each job's arguments.  Jobs run in child
+// processes forked from an already initialized parent so that a job that
+// fails (which for these tools usually means exit() from fatal_error) does
+// not take the others with it.  Each job's stdout and stderr go to
+// <prefix><n>.out and <prefix><n>.err, n being the job's line number, and a
+// -timings option is replaced by one writing to <prefix><n>.timings.json.
+struct BatchOpts {
+	typedef int (*JobMain)(int argc, char **argv);
+
+	static void printUsage();
+	explicit BatchOpts(std::vector<std::string> &arg_list);
+
+	bool empty() const { return list_fn.empty(); }
+	// common_args is the command name followed by the options shared by all
+	// jobs.  Returns the number of jobs that failed.
+	size_t run(const std::vector<std::string> &common_args, JobMain job_main) const;
+
+	std::string list_fn;
+	std::string out_prefix;
+	size_t num_jobs;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_BATCH_H
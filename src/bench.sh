@@ -0,0 +1,61 @@
+#!/bin/bash
+
+# Times whole runs of the tools on the inputs that dangdal_bench writes, to go
+# along with its timings of the separate stages.  The results are printed in
+# the same form, one JSON object per line; the output of the tools themselves
+# goes to bench_out/.
+#
+# Usage: bench.sh [input_dir]     (run from the directory holding the tools)
+
+INDIR=${1:-bench_inputs}
+OUTDIR=bench_out
+THREADS=${BENCH_THREADS:-1}
+
+#BINDIR="valgrind -q ."
+BINDIR=.
+
+mkdir -p $OUTDIR
+
+# timed <bench name> <input name> <command...>
+timed() {
+	local name=$1 input=$2
+	shift 2
+	local t0=$(date +%s.%N)
+	if "$@" >$OUTDIR/last.log 2>&1 ; then
+		local t1=$(date +%s.%N)
+		echo "{\"bench\": \"$name\", \"input\": \"$input\", \"threads\": $THREADS, \"seconds\": $(awk "BEGIN { printf \"%.3f\", $t1 - $t0 }")}"
+	else
+		echo "{\"bench\": \"$name\", \"input\": \"$input\", \"threads\": $THREADS, \"failed\": true}"
+	fi
+}
+
+for i in noise islands uniform landcover ; do
+	IN=$INDIR/bench_$i.tif
+	[ -e $IN ] || continue
+	if [ $i = landcover ] ; then
+		timed gdal_trace_outline_classify $i $BINDIR/gdal_trace_outline $IN -classify -threads $THREADS \
+			-out-cs ll -wkt-out $OUTDIR/$i.wkt
+	else
+		timed gdal_trace_outline $i $BINDIR/gdal_trace_outline $IN -ndv 0 -threads $THREADS \
+			-out-cs ll -wkt-out $OUTDIR/$i.wkt
+		# the mask held as runs rather than a bitmap
+		timed gdal_trace_outline_rle $i $BINDIR/gdal_trace_outline $IN -ndv 0 -threads $THREADS \
+			-out-cs ll -wkt-out $OUTDIR/${i}_rle.wkt -rle
+	fi
+	timed gdal_make_ndv_mask $i $BINDIR/gdal_make_ndv_mask $IN -ndv 0 $OUTDIR/${i}_mask.pbm
+	timed gdal_make_ndv_mask_rle $i $BINDIR/gdal_make_ndv_mask $IN -ndv 0 $OUTDIR/${i}_mask_rle.pbm -rle
+done
+
+IN=$INDIR/bench_uniform.tif
+if [ -e $IN ] ; then
+	timed gdal_list_corners_rect4 uniform $BINDIR/gdal_list_corners $IN -ndv 0 -inspect-rect4
+fi
+
+IN=$INDIR/bench_dem.tif
+if [ -e $IN ] ; then
+	timed gdal_dem2rgb dem $BINDIR/gdal_dem2rgb $IN $OUTDIR/dem_rgb.tif -default-palette -threads $THREADS
+	timed gdal_contrast_stretch_linear dem $BINDIR/gdal_contrast_stretch -ndv -9999 -threads $THREADS \
+		-linear-stretch 128 40 $IN $OUTDIR/dem_linear.tif
+	timed gdal_contrast_stretch_histeq dem $BINDIR/gdal_contrast_stretch -ndv -9999 -threads $THREADS \
+		-histeq 50 $IN $OUTDIR/dem_histeq.tif
+fi
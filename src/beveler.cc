@@ -27,9 +27,13 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <cassert>
+#include <cmath>
+
+#include <boost/thread.hpp>
 
 #include "common.h"
 #include "polygon.h"
+#include "beveler.h"
 
 namespace dangdal {
 
@@ -88,25 +92,136 @@ private:
 	const Mpoly *mp;
 };
 
-static inline double sgn(double v) {
-	return v<0 ? -1 : v>0 ? 1 : 0;
+static inline uint64_t mix_hash(uint64_t h) {
+	// finalizer from MurmurHash3
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
 }
 
-// This function is only meant to be called on polygons
-// that have orthogonal sides on an integer lattice.
-void bevel_self_intersections(Mpoly &mp, double amount) {
-	if(VERBOSE) {
-		printf("Beveling\n");
+static inline bool is_int32(double v) {
+	return v == floor(v) && v >= -2147483648.0 && v <= 2147483647.0;
+}
+
+static inline uint64_t vertex_key(const Vertex &v) {
+	return (uint64_t(uint32_t(int32_t(v.x))) << 32) | uint32_t(int32_t(v.y));
+}
+
+// Finds the vertices shared by exactly two corners, using a hash table keyed on
+// the integer coordinates.  The hash space is split into num_parts parts, each
+// handled by one thread with its own table.  Every part scans all of the vertices,
+// which is cheap compared to the table lookups.
+struct FindTouchesJob {
+	FindTouchesJob(const Mpoly &_mp, size_t _num_parts) :
+		mp(_mp), num_parts(_num_parts),
+		touches(_num_parts), found_triple(_num_parts, 0)
+	{ }
+
+	void operator()(size_t part);
+
+	const Mpoly &mp;
+	size_t num_parts;
+	// output of each part, ordered by ring_idx,vert_idx
+	std::vector<std::vector<VertRef> > touches;
+	std::vector<char> found_triple;
+};
+
+void FindTouchesJob::operator()(size_t part) {
+	size_t num_owned = 0;
+	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+		const std::vector<Vertex> &pts = mp.rings[r_idx].pts;
+		for(size_t v_idx=0; v_idx<pts.size(); v_idx++) {
+			uint64_t h = mix_hash(vertex_key(pts[v_idx]));
+			if((h >> 32) % num_parts == part) num_owned++;
+		}
+	}
+
+	size_t num_slots = 16;
+	while(num_slots < num_owned*2) num_slots *= 2;
+	const size_t mask = num_slots - 1;
+	std::vector<uint64_t> keys(num_slots);
+	// 0 means empty, saturates at 3
+	std::vector<uint8_t> counts(num_slots, 0);
+	const uint8_t CLAIMED = 0xff;
+
+	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+		const std::vector<Vertex> &pts = mp.rings[r_idx].pts;
+		for(size_t v_idx=0; v_idx<pts.size(); v_idx++) {
+			uint64_t key = vertex_key(pts[v_idx]);
+			uint64_t h = mix_hash(key);
+			if((h >> 32) % num_parts != part) continue;
+			size_t slot = size_t(h) & mask;
+			while(counts[slot] && keys[slot] != key) slot = (slot+1) & mask;
+			keys[slot] = key;
+			if(counts[slot] < 3) counts[slot]++;
+		}
+	}
+
+	// A second pass in ring/vertex order picks the first vertex of each pair,
+	// same as the sort based search.
+	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+		const std::vector<Vertex> &pts = mp.rings[r_idx].pts;
+		for(size_t v_idx=0; v_idx<pts.size(); v_idx++) {
+			uint64_t key = vertex_key(pts[v_idx]);
+			uint64_t h = mix_hash(key);
+			if((h >> 32) % num_parts != part) continue;
+			size_t slot = size_t(h) & mask;
+			while(keys[slot] != key) slot = (slot+1) & mask;
+			if(counts[slot] == 2) {
+				touches[part].push_back(VertRef(r_idx, v_idx));
+				counts[slot] = CLAIMED;
+			} else if(counts[slot] == 3) {
+				found_triple[part] = 1;
+			}
+		}
+	}
+}
+
+static void run_find_touches(FindTouchesJob *job, size_t part, WorkerError *error) {
+	try {
+		(*job)(part);
+	} catch(const std::exception &e) {
+		error->failed = true;
+		error->what = e.what();
+	} catch(...) {
+		error->failed = true;
+		error->what = "unknown error on worker thread";
+	}
+}
+
+static std::vector<VertRef> find_touches_hashed(const Mpoly &mp, size_t total_pts, size_t num_threads) {
+	// not worth starting threads for small inputs
+	if(total_pts < (1<<20)) num_threads = 1;
+	if(num_threads < 1) num_threads = 1;
+
+	FindTouchesJob job(mp, num_threads);
+	if(num_threads == 1) {
+		job(0);
 	} else {
-		printf("Beveling: ");
-		GDALTermProgress(0, NULL, NULL);
+		std::vector<WorkerError> errors(num_threads);
+		boost::thread_group threads;
+		for(size_t i=0; i<num_threads; i++) {
+			threads.add_thread(new boost::thread(&run_find_touches, &job, i, &errors[i]));
+		}
+		threads.join_all();
+		for(size_t i=0; i<num_threads; i++) errors[i].check();
 	}
 
-	size_t total_pts = 0;
-	for(size_t i=0; i<mp.rings.size(); i++) {
-		total_pts += mp.rings[i].pts.size();
+	std::vector<VertRef> entries;
+	for(size_t i=0; i<num_threads; i++) {
+		if(job.found_triple[i]) fatal_error("should not have triple intersections in beveler");
+		entries.insert(entries.end(), job.touches[i].begin(), job.touches[i].end());
 	}
+	// sort by ring_idx,vert_idx
+	std::sort(entries.begin(), entries.end(), RingsComparator(NULL));
+	return entries;
+}
 
+// The general case, for polygons that are not on an integer lattice.
+static std::vector<VertRef> find_touches_sorted(Mpoly &mp, size_t total_pts) {
 	if(VERBOSE) printf("allocating %zd megs for beveler\n",
 		(total_pts*sizeof(VertRef)) >> 20);
 	std::vector<VertRef> entries;
@@ -114,20 +229,13 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
 		const Ring &ring = mp.rings[r_idx];
 		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
-			if(VERBOSE >= 2) {
-				printf("mp[%zd][%zd] = %g, %g\n", r_idx, v_idx,
-					ring.pts[v_idx].x, ring.pts[v_idx].y);
-			}
 			entries.push_back(VertRef(r_idx, v_idx));
 		}
 	}
 	assert(total_pts == entries.size());
 
-	if(VERBOSE) printf("finding self-intersections\n");
-	GDALTermProgress(0.1, NULL, NULL);
 	// sort by x,y
 	std::sort(entries.begin(), entries.end(), CoordsComparator(&mp));
-	GDALTermProgress(0.8, NULL, NULL);
 
 	if(VERBOSE >= 2) {
 		printf("\nbefore grep:\n");
@@ -142,7 +250,7 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 
 	size_t total_num_touch = 0;
 	bool prev_was_same = 0;
-	for(size_t i=0; i<total_pts-1; i++) {
+	for(size_t i=0; i+1<total_pts; i++) {
 		//printf("%lf %lf %zd %zd\n",
 		//	entries[i].x, entries[i].y,
 		//	entries[i].ring_idx, entries[i].vert_idx);
@@ -162,17 +270,60 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 		}
 	}
 
+	entries.resize(total_num_touch);
+	// sort by ring_idx,vert_idx
+	std::sort(entries.begin(), entries.end(), RingsComparator(&mp));
+	return entries;
+}
+
+static inline double sgn(double v) {
+	return v<0 ? -1 : v>0 ? 1 : 0;
+}
+
+// This function is only meant to be called on polygons
+// that have orthogonal sides on an integer lattice.
+void bevel_self_intersections(Mpoly &mp, double amount, size_t num_threads,
+bool show_progress) {
+	if(VERBOSE) {
+		report_message("Beveling\n");
+	} else if(show_progress) {
+		report_message("Beveling: ");
+		report_progress(0);
+	}
+
+	size_t total_pts = 0;
+	for(size_t i=0; i<mp.rings.size(); i++) {
+		total_pts += mp.rings[i].pts.size();
+	}
+
+	bool on_lattice = true;
+	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+		const Ring &ring = mp.rings[r_idx];
+		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
+			if(VERBOSE >= 2) {
+				printf("mp[%zd][%zd] = %g, %g\n", r_idx, v_idx,
+					ring.pts[v_idx].x, ring.pts[v_idx].y);
+			}
+			on_lattice = on_lattice &&
+				is_int32(ring.pts[v_idx].x) && is_int32(ring.pts[v_idx].y);
+		}
+	}
+
+	if(VERBOSE) printf("finding self-intersections\n");
+	if(show_progress) report_progress(0.1);
+	std::vector<VertRef> entries = on_lattice ?
+		find_touches_hashed(mp, total_pts, num_threads) :
+		find_touches_sorted(mp, total_pts);
+	if(show_progress) report_progress(0.8);
+
+	const size_t total_num_touch = entries.size();
 	if(VERBOSE) printf("found %zd self-intersections\n", total_num_touch);
 	if(!total_num_touch) {
-		GDALTermProgress(1, NULL, NULL);
+		if(show_progress) report_progress(1);
 		if(VERBOSE) printf("beveler finish\n");
 		return;
 	}
 
-	entries.resize(total_num_touch);
-	// sort by ring_idx,vert_idx
-	std::sort(entries.begin(), entries.end(), RingsComparator(&mp));
-
 	if(VERBOSE >= 2) {
 		printf("\nafter sort:\n");
 		for(size_t i=0; i<total_num_touch; i++) {
@@ -255,12 +406,12 @@ void bevel_self_intersections(Mpoly &mp, double amount) {
 
 		// "ring" variable was const
 		Ring &mutable_ring = mp.rings[entries[entry_idx].ring_idx];
-		mutable_ring.pts = new_ring.pts;
+		mutable_ring.pts.swap(new_ring.pts);
 
 		entry_idx += ring_num_touch;
 	}
 
-	GDALTermProgress(1, NULL, NULL);
+	if(show_progress) report_progress(1);
 	if(VERBOSE) printf("beveler finish\n");
 }
 
@@ -33,7 +33,11 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 namespace dangdal {
 
-void bevel_self_intersections(Mpoly &mp, double amount);
+// Shaves the corners where a polygon touches itself.  With num_threads > 1 the search
+// for touching corners is split across threads for large polygons.  With show_progress
+// false nothing is printed.
+void bevel_self_intersections(Mpoly &mp, double amount, size_t num_threads=1,
+	bool show_progress=true);
 
 } // namespace dangdal
 
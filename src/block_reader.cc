@@ -0,0 +1,322 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstring>
+
+#include <boost/foreach.hpp>
+
+#include "common.h"
+#include "block_reader.h"
+#include "ndv.h"
+
+namespace dangdal {
+
+static size_t gcd(size_t a, size_t b) {
+	while(b) {
+		size_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// least common multiple, or 'limit' if that is smaller
+static size_t lcm_up_to(size_t a, size_t b, size_t limit) {
+	size_t m = a / gcd(a, b) * b;
+	return std::min(m, limit);
+}
+
+BlockReader::BlockReader(
+	GDALDatasetH _ds, const std::vector<size_t> &_band_ids,
+	const NdvDef *_ndv_def, size_t num_threads, Processor *_processor,
+	size_t sample_step, size_t _halo, GDALRasterBandH align_band
+) :
+	w(GDALGetRasterXSize(_ds)),
+	h(GDALGetRasterYSize(_ds)),
+	halo(_halo),
+	ds(_ds),
+	band_ids(_band_ids),
+	ndv_def(_ndv_def),
+	processor(_processor),
+	same_datatype(true),
+	window_producer(this),
+	read_ahead(NULL)
+{
+	assert(!band_ids.empty());
+
+	if(VERBOSE) printf("input is %zd x %zd x %d\n", w, h, GDALGetRasterCount(ds));
+
+	if(VERBOSE) {
+		BOOST_FOREACH(const size_t band_id, band_ids) printf("opening band %zd\n", band_id);
+	}
+	bands = get_bands(ds);
+	BOOST_FOREACH(const GDALRasterBandH band, bands) {
+		datatypes.push_back(GDALGetRasterDataType(band));
+		if(datatypes.back() != datatypes[0]) same_datatype = false;
+	}
+	BOOST_FOREACH(const size_t band_id, band_ids) band_map.push_back(int(band_id));
+
+	plan_windows(num_threads, align_band);
+	buf_w = blocksize_x + 2*halo;
+	buf_h = blocksize_y + 2*halo;
+
+	num_blocks_x = (w + blocksize_x - 1) / blocksize_x;
+	num_blocks_y = (h + blocksize_y - 1) / blocksize_y;
+	for(size_t by=0; by<num_blocks_y; by++) {
+		for(size_t bx=0; bx<num_blocks_x; bx++) {
+			if(sample_step <= 1 || (bx + by) % sample_step == 0) {
+				windows.push_back(by * num_blocks_x + bx);
+			}
+		}
+	}
+	num_blocks = windows.size();
+
+	if(num_threads > 1) reopen_for_workers(num_threads);
+	if(worker_ds.empty()) {
+		worker_ds.push_back(ds);
+		worker_bands.push_back(bands);
+	}
+	read_ahead = new ReadAhead<Block>(&window_producer, num_blocks,
+		worker_ds.size(), 2 * worker_ds.size());
+}
+
+BlockReader::~BlockReader() {
+	// stops the workers
+	delete read_ahead;
+	BOOST_FOREACH(GDALDatasetH wds, reopened_ds) GDALClose(wds);
+}
+
+// Only datasets that GDALOpen can find again by name can be reopened.  MEM datasets and VRTs
+// built in memory have no file behind them, and /vsistdin/ can only be read once.  A dataset
+// opened with open options or a forced driver may come back different when reopened by name,
+// so the result is checked against the original.
+static bool can_reopen(GDALDatasetH ds) {
+	const char *fn = GDALGetDescription(ds);
+	if(!fn || !fn[0]) return false;
+	if(!strncmp(fn, "/vsistdin", 9)) return false;
+	GDALDriverH driver = GDALGetDatasetDriver(ds);
+	const char *driver_name = driver ? GDALGetDriverShortName(driver) : "";
+	if(!strcmp(driver_name, "MEM")) return false;
+	// The description of a VRT made in memory is empty or is the XML itself.
+	if(!strcmp(driver_name, "VRT") && strstr(fn, "<VRTDataset")) return false;
+	return true;
+}
+
+static bool same_layout(GDALDatasetH a, GDALDatasetH b) {
+	if(GDALGetRasterXSize(a) != GDALGetRasterXSize(b)) return false;
+	if(GDALGetRasterYSize(a) != GDALGetRasterYSize(b)) return false;
+	if(GDALGetRasterCount(a) != GDALGetRasterCount(b)) return false;
+	for(int i=1; i<=GDALGetRasterCount(a); i++) {
+		if(GDALGetRasterDataType(GDALGetRasterBand(a, i)) !=
+			GDALGetRasterDataType(GDALGetRasterBand(b, i))) return false;
+	}
+	return true;
+}
+
+// Gives each worker its own handle on the dataset.  If that can't be done, worker_ds is left
+// empty and the caller's handle is used by a single worker.
+void BlockReader::reopen_for_workers(size_t num_threads) {
+	if(!can_reopen(ds)) {
+		if(VERBOSE) printf("dataset can't be reopened, reading with one thread\n");
+		return;
+	}
+	const char *fn = GDALGetDescription(ds);
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+	for(size_t i=0; i<num_threads; i++) {
+		GDALDatasetH wds = GDALOpen(fn, GA_ReadOnly);
+		if(!wds) break;
+		reopened_ds.push_back(wds);
+		if(!same_layout(ds, wds)) break;
+		worker_ds.push_back(wds);
+		worker_bands.push_back(get_bands(wds));
+	}
+	CPLPopErrorHandler();
+
+	if(worker_ds.size() < num_threads) {
+		if(VERBOSE) printf("could not reopen %s, reading with one thread\n", fn);
+		BOOST_FOREACH(GDALDatasetH wds, reopened_ds) GDALClose(wds);
+		reopened_ds.clear();
+		worker_ds.clear();
+		worker_bands.clear();
+	}
+}
+
+std::vector<GDALRasterBandH> BlockReader::get_bands(GDALDatasetH ds) const {
+	std::vector<GDALRasterBandH> ret;
+	BOOST_FOREACH(const size_t band_id, band_ids) {
+		GDALRasterBandH band = GDALGetRasterBand(ds, band_id);
+		if(!band) fatal_error("Could not open band %zd.", band_id);
+		ret.push_back(band);
+	}
+	return ret;
+}
+
+// Windows are a multiple of the block size of every band, so that no block is split between
+// two windows, then are made long enough to use a good fraction of the GDAL cache.  Blocks
+// that are full rows (strips) can be stacked arbitrarily, so a strip-organized image is read
+// a few hundred rows at a time rather than a row at a time.
+void BlockReader::plan_windows(size_t num_threads, GDALRasterBandH align_band) {
+	std::vector<GDALRasterBandH> align_to = bands;
+	if(align_band) align_to.push_back(align_band);
+	size_t common_x = 1, common_y = 1;
+	BOOST_FOREACH(const GDALRasterBandH band, align_to) {
+		int bx, by;
+		GDALGetBlockSize(band, &bx, &by);
+		common_x = lcm_up_to(common_x, std::max(bx, 1), w);
+		common_y = lcm_up_to(common_y, std::max(by, 1), h);
+	}
+
+	size_t bytes_per_pixel = 1; // for the NDV mask
+	BOOST_FOREACH(const GDALDataType dt, datatypes) {
+		bytes_per_pixel += GDALGetDataTypeSize(dt) / 8;
+	}
+	// Each thread has a window being read and GDAL has to hold its blocks in the cache while
+	// that happens, so leave plenty of room.
+	int64_t budget = int64_t(GDALGetCacheMax64()) / 4 / int64_t(std::max(num_threads, size_t(1)));
+	size_t max_pixels = std::max(int64_t(1), budget / int64_t(bytes_per_pixel));
+
+	blocksize_x = common_x;
+	blocksize_y = common_y;
+	size_t n = max_pixels / (blocksize_x * blocksize_y);
+	if(n > 1) blocksize_x = std::min(w, blocksize_x * n);
+	n = max_pixels / (blocksize_x * blocksize_y);
+	if(n > 1) blocksize_y = std::min(h, blocksize_y * n);
+
+	if(VERBOSE) {
+		printf("reading in %zd x %zd windows (common block size is %zd x %zd)\n",
+			blocksize_x, blocksize_y, common_x, common_y);
+	}
+}
+
+void BlockReader::read_block(
+	GDALDatasetH src_ds, const std::vector<GDALRasterBandH> &src_bands,
+	size_t job, Block *b
+) {
+	size_t block_idx = windows[job];
+	b->block_x = block_idx % num_blocks_x;
+	b->block_y = block_idx / num_blocks_x;
+	b->boff_x = blocksize_x * b->block_x;
+	b->boff_y = blocksize_y * b->block_y;
+	b->bsize_x = std::min(blocksize_x, w - b->boff_x);
+	b->bsize_y = std::min(blocksize_y, h - b->boff_y);
+
+	size_t buf_size = buf_w * buf_h;
+	if(b->band_buf.empty()) {
+		size_t total_size = 0;
+		BOOST_FOREACH(const GDALDataType dt, datatypes) {
+			total_size += buf_size * (GDALGetDataTypeSize(dt) / 8);
+		}
+		b->data.resize(total_size);
+		size_t offset = 0;
+		for(size_t i=0; i<src_bands.size(); i++) {
+			b->band_buf.push_back(&b->data[offset]);
+			offset += buf_size * (GDALGetDataTypeSize(datatypes[i]) / 8);
+		}
+		b->ndv_mask.resize(buf_size);
+	}
+
+	// The window and as much of its halo as lies within the image.  The rest of the
+	// halo is filled in afterwards.
+	size_t left = std::min(halo, b->boff_x);
+	size_t top = std::min(halo, b->boff_y);
+	size_t read_x = b->boff_x - left;
+	size_t read_y = b->boff_y - top;
+	size_t read_w = std::min(b->boff_x + b->bsize_x + halo, w) - read_x;
+	size_t read_h = std::min(b->boff_y + b->bsize_y + halo, h) - read_y;
+	size_t buf_offset = (halo - top) * buf_w + (halo - left);
+
+	GDALDatasetAdviseRead(src_ds, read_x, read_y, read_w, read_h, read_w, read_h,
+		datatypes[0], int(band_map.size()), &band_map[0], NULL);
+
+	CPLErr err = CE_None;
+	if(same_datatype) {
+		// the bands of a window are laid out one after another in 'data'
+		int dt_size = GDALGetDataTypeSize(datatypes[0]) / 8;
+		err = GDALDatasetRasterIO(src_ds, GF_Read,
+			read_x, read_y, read_w, read_h,
+			&b->data[buf_offset * dt_size], read_w, read_h, datatypes[0],
+			int(band_map.size()), &band_map[0],
+			dt_size, dt_size * buf_w, dt_size * buf_size);
+	} else {
+		for(size_t i=0; i<src_bands.size() && err == CE_None; i++) {
+			int dt_size = GDALGetDataTypeSize(datatypes[i]) / 8;
+			err = GDALRasterIO(src_bands[i], GF_Read,
+				read_x, read_y, read_w, read_h,
+				b->band_buf[i] + buf_offset * dt_size, read_w, read_h, datatypes[i],
+				dt_size, dt_size * buf_w);
+		}
+	}
+	if(err != CE_None) {
+		fatal_error("Could not read %zd x %zd pixels at %zd,%zd.",
+			read_w, read_h, read_x, read_y);
+	}
+
+	if(halo) {
+		for(size_t i=0; i<src_bands.size(); i++) {
+			fill_halo(b->band_buf[i], GDALGetDataTypeSize(datatypes[i]) / 8,
+				halo - left, halo - top, read_w, read_h,
+				b->bsize_x + 2*halo, b->bsize_y + 2*halo);
+		}
+	}
+
+	if(ndv_def) {
+		std::vector<const void *> band_p(b->band_buf.begin(), b->band_buf.end());
+		ndv_def->getNdvMask(band_p, datatypes, &b->ndv_mask[0], buf_size);
+	}
+}
+
+// The pixels at x0..x0+nx-1, y0..y0+ny-1 of buf have been read.  Copy the outermost of
+// them into the rest of the first fill_w x fill_h pixels.
+void BlockReader::fill_halo(uint8_t *buf, size_t dt_size,
+	size_t x0, size_t y0, size_t nx, size_t ny, size_t fill_w, size_t fill_h
+) const {
+	size_t row_bytes = buf_w * dt_size;
+	for(size_t y=y0; y<y0+ny; y++) {
+		uint8_t *row = buf + y * row_bytes;
+		for(size_t x=0; x<x0; x++) {
+			memcpy(row + x * dt_size, row + x0 * dt_size, dt_size);
+		}
+		for(size_t x=x0+nx; x<fill_w; x++) {
+			memcpy(row + x * dt_size, row + (x0+nx-1) * dt_size, dt_size);
+		}
+	}
+	for(size_t y=0; y<y0; y++) {
+		memcpy(buf + y * row_bytes, buf + y0 * row_bytes, fill_w * dt_size);
+	}
+	for(size_t y=y0+ny; y<fill_h; y++) {
+		memcpy(buf + y * row_bytes, buf + (y0+ny-1) * row_bytes, fill_w * dt_size);
+	}
+}
+
+void BlockReader::produce(size_t job, size_t worker_idx, Block &b) {
+	read_block(worker_ds[worker_idx], worker_bands[worker_idx], job, &b);
+	if(processor) processor->process(*this, &b, worker_idx);
+}
+
+} // namespace dangdal
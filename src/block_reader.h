@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+#ifndef DANGDAL_BLOCK_READER_H
+#define DANGDAL_BLOCK_READER_H
+
+#include <vector>
+
+#include <gdal.h>
+
+#include "common.h"
+#include "ndv.h"
+#include "read_ahead.h"
+
+namespace dangdal {
+
+// Reads a dataset in windows, in row-major order.  The window size is picked from the block
+// layouts of all of the bands (which need not match) and from the size of the GDAL block
+// cache, so that each block is decoded only once and inputs made of many small strips are
+// read with few calls.  Windows are read (and their NDV masks computed) on background
+// threads a couple of windows ahead of the caller, so that reading overlaps with whatever
+// the caller does with each window.  Each window is announced to GDAL with AdviseRead before
+// it is read, which lets drivers for remote files (e.g. /vsis3/) fetch all of its blocks at
+// once.  With one thread the reader uses the caller's handle on the dataset, which must not
+// be used elsewhere until the BlockReader is destroyed.  With more than one thread each
+// worker opens its own handle since GDAL handles can't be shared between threads.  Datasets
+// that can't be reopened by name (e.g. MEM datasets, VRTs made in memory, /vsistdin/) are
+// read with a single thread on the caller's handle instead.  Windows
+// are handed back in order, so the result is the same no matter how many threads are used.
+//
+// A Processor can be given to do further work on each window on the thread that read it, so
+// that this work is spread over the pool too.
+//
+// With a sample_step greater than one, only one window in sample_step is read.  The ones
+// read are those on every sample_step'th diagonal, so that they are spread over both the
+// rows and the columns of the image.
+//
+// A halo of pixels around each window can also be read, for filters that need neighboring
+// pixels.  Past the edges of the image the halo repeats the outermost pixels.  If an
+// align_band is given then windows are also a multiple of its block size, so that output
+// written one window at a time fills whole blocks.
+class BlockReader {
+public:
+	struct Block;
+
+	class Processor {
+	public:
+		virtual ~Processor() { }
+		// Called once for each window, after its NDV mask is ready.  worker_idx is less
+		// than the number of threads (or is zero when there is one thread) and can be used
+		// to index per-thread state.  Calls with different worker_idx may happen at the
+		// same time.
+		virtual void process(const BlockReader &reader, Block *b, size_t worker_idx) = 0;
+	};
+
+	struct Block {
+		size_t block_x, block_y;
+		// offset and size of the part of the window that lies within the image
+		size_t boff_x, boff_y;
+		size_t bsize_x, bsize_y;
+		// a full window plus halo (buf_w * buf_h pixels) for each band, pointing into 'data'
+		std::vector<uint8_t *> band_buf;
+		// nonzero for NDV pixels
+		std::vector<uint8_t> ndv_mask;
+		std::vector<uint8_t> data;
+		// For use by a Processor.  It is kept when the Block is reused.
+		std::vector<uint8_t> out;
+	};
+
+	// If ndv_def is NULL, ndv_mask is all zeros.
+	BlockReader(GDALDatasetH ds, const std::vector<size_t> &band_ids,
+		const NdvDef *ndv_def, size_t num_threads, Processor *processor=NULL,
+		size_t sample_step=1, size_t halo=0, GDALRasterBandH align_band=NULL);
+	~BlockReader();
+
+	// The next window, or NULL after the last one.  It is valid until the next call.
+	Block *next_block() { return read_ahead->next(); }
+
+	// How far through the image a window is, for GDALTermProgress.
+	double progress(const Block *b) const {
+		return double(b->boff_y * w + b->boff_x * b->bsize_y) / (double(w) * h);
+	}
+
+	size_t w, h;
+	// size of the windows
+	size_t blocksize_x, blocksize_y;
+	size_t num_blocks_x, num_blocks_y;
+	// Size of the buffers.  Pixel (boff_x+x, boff_y+y) of a window is at index
+	// (y+halo)*buf_w + x+halo.  Without a halo, buf_w is blocksize_x.
+	size_t halo;
+	size_t buf_w, buf_h;
+	std::vector<GDALDataType> datatypes;
+
+private:
+	// not copyable
+	BlockReader(const BlockReader &);
+	BlockReader &operator=(const BlockReader &);
+
+	std::vector<GDALRasterBandH> get_bands(GDALDatasetH ds) const;
+	void reopen_for_workers(size_t num_threads);
+	void plan_windows(size_t num_threads, GDALRasterBandH align_band);
+	void read_block(GDALDatasetH src_ds, const std::vector<GDALRasterBandH> &src_bands,
+		size_t job, Block *b);
+	void fill_halo(uint8_t *buf, size_t dt_size, size_t x0, size_t y0, size_t nx, size_t ny,
+		size_t fill_w, size_t fill_h) const;
+	void produce(size_t job, size_t worker_idx, Block &b);
+
+	// Block is nested in BlockReader, so BlockReader can't itself be the Producer.
+	class WindowProducer : public ReadAhead<Block>::Producer {
+	public:
+		explicit WindowProducer(BlockReader *_reader) : reader(_reader) { }
+		virtual void produce(size_t job, size_t worker_idx, Block &b) {
+			reader->produce(job, worker_idx, b);
+		}
+		BlockReader *reader;
+	};
+
+	GDALDatasetH ds;
+	std::vector<size_t> band_ids;
+	// band_ids, as GDALDatasetRasterIO wants them
+	std::vector<int> band_map;
+	const NdvDef *ndv_def;
+	Processor *processor;
+	std::vector<GDALRasterBandH> bands;
+	// if all bands have the same type they are read with a single GDALDatasetRasterIO call
+	bool same_datatype;
+	// the windows to read, by index in row-major order
+	std::vector<size_t> windows;
+	size_t num_blocks;
+
+	// the handle on the dataset used by each worker, and its bands
+	std::vector<GDALDatasetH> worker_ds;
+	std::vector<std::vector<GDALRasterBandH> > worker_bands;
+	// handles opened for the workers, to be closed at the end
+	std::vector<GDALDatasetH> reopened_ds;
+	WindowProducer window_producer;
+	ReadAhead<Block> *read_ahead;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_BLOCK_READER_H
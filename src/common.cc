@@ -28,6 +28,11 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cstdarg>
+
+#include <sys/resource.h>
+#include <sys/time.h>
 
 #include "common.h"
 
@@ -35,23 +40,70 @@ namespace dangdal {
 
 int VERBOSE = 0;
 
+static bool fatal_errors_throw = false;
+
+void throw_fatal_errors(bool enable) {
+	fatal_errors_throw = enable;
+}
+
 void fatal_error(const std::string &s) {
+	if(fatal_errors_throw) throw FatalError(s);
 	fprintf(stderr, "\n\nerror:\n%s\n\n", s.c_str());
 	exit(1);
 }
 
 void fatal_error(const char *fmt, ...) {
 	va_list argp;
-	
-	fprintf(stderr, "\n\nerror:\n");
-	
+
 	va_start(argp, fmt);
-	vfprintf(stderr, fmt, argp);
+	int len = vsnprintf(NULL, 0, fmt, argp);
 	va_end(argp);
 
-	fprintf(stderr, "\n\n");
+	std::vector<char> buf(std::max(len, 0) + 1);
+	va_start(argp, fmt);
+	vsnprintf(&buf[0], buf.size(), fmt, argp);
+	va_end(argp);
 
-	exit(1);
+	fatal_error(std::string(&buf[0]));
+}
+
+static ProgressHook progress_hook = print_progress;
+static void *progress_hook_arg = NULL;
+
+void set_progress_hook(ProgressHook hook, void *arg) {
+	progress_hook = hook;
+	progress_hook_arg = arg;
+}
+
+void print_progress(const char *message, double fraction, void *arg) {
+	(void)arg;
+	if(message) {
+		fputs(message, stdout);
+		fflush(stdout);
+	} else {
+		GDALTermProgress(fraction, NULL, NULL);
+	}
+}
+
+void report_message(const char *fmt, ...) {
+	if(!progress_hook) return;
+
+	va_list argp;
+
+	va_start(argp, fmt);
+	int len = vsnprintf(NULL, 0, fmt, argp);
+	va_end(argp);
+
+	std::vector<char> buf(std::max(len, 0) + 1);
+	va_start(argp, fmt);
+	vsnprintf(&buf[0], buf.size(), fmt, argp);
+	va_end(argp);
+
+	progress_hook(&buf[0], -1, progress_hook_arg);
+}
+
+void report_progress(double fraction) {
+	if(progress_hook) progress_hook(NULL, fraction, progress_hook_arg);
 }
 
 std::vector<std::string> argv_to_list(int argc, char **argv) {
@@ -62,4 +114,233 @@ std::vector<std::string> argv_to_list(int argc, char **argv) {
 	return ret;
 }
 
+namespace {
+
+struct StageTotals {
+	std::string name;
+	std::string units;
+	size_t calls;
+	double wall, cpu;
+	int64_t read_bytes; // -1 if not known
+	uint64_t items;
+	int64_t peak_rss;
+	bool stage_peak_rss; // false if peak_rss is for the process so far
+	int64_t gdal_cache;
+};
+
+std::string timings_fn;
+std::string timings_tool;
+double timings_wall0, timings_cpu0;
+std::vector<StageTotals> stage_totals;
+// Timers that have started but not stopped.
+std::vector<StageTimer *> running_timers;
+// Peak RSS of the process before the last reset of the high-water mark.
+int64_t process_peak_rss = 0;
+
+double get_wall_seconds() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return double(tv.tv_sec) + double(tv.tv_usec) * 1e-6;
+}
+
+double get_cpu_seconds() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return double(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+		double(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+// Peak RSS of the process.  On Linux this drops when the high-water mark is reset (see
+// StageTimer::start_peak_rss), so it is then only the peak since the reset.
+int64_t get_peak_rss() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	return int64_t(ru.ru_maxrss);
+#else
+	// kilobytes on Linux and the BSDs
+	return int64_t(ru.ru_maxrss) * 1024;
+#endif
+}
+
+// The high-water mark of RSS (VmHWM), which can be reset by writing 5 to
+// /proc/self/clear_refs.  Only Linux has this; -1 elsewhere.
+int64_t get_rss_high_water() {
+	FILE *fh = fopen("/proc/self/status", "r");
+	if(!fh) return -1;
+	int64_t ret = -1;
+	char line[100];
+	while(fgets(line, sizeof(line), fh)) {
+		long long v;
+		if(sscanf(line, "VmHWM: %lld kB", &v) == 1) {
+			ret = int64_t(v) * 1024;
+			break;
+		}
+	}
+	fclose(fh);
+	return ret;
+}
+
+// Bytes read by the process so far, including reads that were served by the OS page
+// cache (but not those served by the GDAL block cache).  Only Linux has this.
+int64_t get_bytes_read() {
+	FILE *fh = fopen("/proc/self/io", "r");
+	if(!fh) return -1;
+	int64_t ret = -1;
+	char line[100];
+	while(fgets(line, sizeof(line), fh)) {
+		long long v;
+		if(sscanf(line, "rchar: %lld", &v) == 1) {
+			ret = int64_t(v);
+			break;
+		}
+	}
+	fclose(fh);
+	return ret;
+}
+
+std::string json_string(const std::string &s) {
+	std::string ret = "\"";
+	for(size_t i=0; i<s.size(); i++) {
+		if(s[i] == '"' || s[i] == '\\') ret += '\\';
+		ret += s[i];
+	}
+	return ret + "\"";
+}
+
+void write_timings() {
+	FILE *fh = fopen(timings_fn.c_str(), "w");
+	if(!fh) {
+		fprintf(stderr, "cannot open %s for writing timings\n", timings_fn.c_str());
+		return;
+	}
+
+	fprintf(fh, "{\n");
+	fprintf(fh, "  \"tool\": %s,\n", json_string(timings_tool).c_str());
+	fprintf(fh, "  \"wall_seconds\": %.6f,\n", get_wall_seconds() - timings_wall0);
+	fprintf(fh, "  \"cpu_seconds\": %.6f,\n", get_cpu_seconds() - timings_cpu0);
+	const int64_t peak_rss = std::max(process_peak_rss,
+		std::max(get_peak_rss(), get_rss_high_water()));
+	fprintf(fh, "  \"peak_rss_bytes\": %lld,\n", (long long)peak_rss);
+	fprintf(fh, "  \"stages\": [");
+	for(size_t i=0; i<stage_totals.size(); i++) {
+		const StageTotals &st = stage_totals[i];
+		fprintf(fh, "%s\n    {\"stage\": %s, \"calls\": %zd, "
+			"\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, "
+			"\"items\": %llu, \"units\": %s, \"peak_rss_bytes\": %lld, "
+			"\"peak_rss_scope\": \"%s\", \"read_bytes\": %lld, \"gdal_cache_bytes\": %lld}",
+			i ? "," : "", json_string(st.name).c_str(), st.calls,
+			st.wall, st.cpu, (unsigned long long)st.items, json_string(st.units).c_str(),
+			(long long)st.peak_rss, st.stage_peak_rss ? "stage" : "process",
+			(long long)st.read_bytes, (long long)st.gdal_cache);
+	}
+	fprintf(fh, "\n  ]\n}\n");
+	fclose(fh);
+}
+
+} // anonymous namespace
+
+void StageTimer::printUsage() {
+	printf(
+"Timings:\n"
+"  -timings fn.json             Write the time, memory and I/O used by each stage\n"
+"                               to fn.json\n"
+	);
+}
+
+void StageTimer::parseArgs(std::vector<std::string> &arg_list) {
+	std::vector<std::string> args_out;
+	for(size_t argp=0; argp<arg_list.size(); argp++) {
+		if(argp && arg_list[argp] == "-timings") {
+			if(argp+1 == arg_list.size()) fatal_error("-timings needs a filename");
+			timings_fn = arg_list[++argp];
+		} else {
+			args_out.push_back(arg_list[argp]);
+		}
+	}
+	arg_list = args_out;
+
+	if(timings_fn.size() && timings_tool.empty()) {
+		const std::string &cmdname = arg_list[0];
+		size_t slash = cmdname.rfind('/');
+		timings_tool = (slash == std::string::npos) ? cmdname : cmdname.substr(slash+1);
+		timings_wall0 = get_wall_seconds();
+		timings_cpu0 = get_cpu_seconds();
+		if(atexit(write_timings)) fatal_error("could not register timings output");
+	}
+}
+
+StageTimer::StageTimer(const char *stage, const char *units) :
+	stage_idx(-1), wall0(0), cpu0(0), read0(0), num_items(0),
+	peak_rss(0), stage_peak_rss(false)
+{
+	if(timings_fn.empty()) return;
+
+	for(size_t i=0; i<stage_totals.size(); i++) {
+		if(stage_totals[i].name == stage) stage_idx = int(i);
+	}
+	if(stage_idx < 0) {
+		StageTotals st;
+		st.name = stage;
+		st.units = units;
+		st.calls = 0;
+		st.wall = st.cpu = 0;
+		st.read_bytes = 0;
+		st.items = 0;
+		st.peak_rss = 0;
+		st.stage_peak_rss = true;
+		st.gdal_cache = 0;
+		stage_idx = int(stage_totals.size());
+		stage_totals.push_back(st);
+	}
+
+	start_peak_rss();
+	read0 = get_bytes_read();
+	cpu0 = get_cpu_seconds();
+	wall0 = get_wall_seconds();
+}
+
+// The high-water mark is for the whole process, so before it is reset its value is
+// passed on to the timers that are still running (timers can nest) and to the total
+// for the process.
+void StageTimer::start_peak_rss() {
+	const int64_t hwm = get_rss_high_water();
+	if(hwm >= 0) {
+		for(size_t i=0; i<running_timers.size(); i++) {
+			running_timers[i]->peak_rss = std::max(running_timers[i]->peak_rss, hwm);
+		}
+		process_peak_rss = std::max(process_peak_rss, hwm);
+		FILE *fh = fopen("/proc/self/clear_refs", "w");
+		if(fh) {
+			stage_peak_rss = fputs("5", fh) >= 0;
+			if(fclose(fh)) stage_peak_rss = false;
+		}
+	}
+	running_timers.push_back(this);
+}
+
+StageTimer::~StageTimer() {
+	stop();
+}
+
+void StageTimer::stop() {
+	if(stage_idx < 0) return;
+
+	StageTotals &st = stage_totals[stage_idx];
+	st.calls++;
+	st.wall += get_wall_seconds() - wall0;
+	st.cpu += get_cpu_seconds() - cpu0;
+	st.items += num_items;
+	int64_t read1 = get_bytes_read();
+	if(read0 < 0 || read1 < 0) st.read_bytes = -1;
+	else if(st.read_bytes >= 0) st.read_bytes += read1 - read0;
+	running_timers.erase(std::find(running_timers.begin(), running_timers.end(), this));
+	const int64_t hwm = get_rss_high_water();
+	peak_rss = std::max(peak_rss, stage_peak_rss && hwm >= 0 ? hwm : get_peak_rss());
+	st.peak_rss = std::max(st.peak_rss, peak_rss);
+	if(!stage_peak_rss) st.stage_peak_rss = false;
+	st.gdal_cache = std::max(st.gdal_cache, int64_t(GDALGetCacheUsed64()));
+	stage_idx = -1;
+}
+
 } // namespace dangdal
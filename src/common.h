@@ -32,38 +32,19 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <vector>
 #include <string>
+#include <stdexcept>
 
 #include <ogr_spatialref.h>
 #include <cpl_string.h>
 #include <gdal.h>
 
-// these constants from GDAL interfere with config.h
-#undef PACKAGE_VERSION
-#undef PACKAGE_TARNAME
-#undef PACKAGE_STRING
-#undef PACKAGE_NAME
-#undef PACKAGE_BUGREPORT
-
-#include "config.h"
-
+// This header is installed with libdangdal, so it can't depend on config.h.
 #include <cmath>
 #include <stdio.h>
-
-#if HAVE_STDINT_H
-#  include <stdint.h>
-#endif
-
-#if HAVE_INTTYPES_H
-#  include <inttypes.h>
-#endif
-
-#if HAVE_STDLIB_H
-#  include <stdlib.h>
-#endif
-
-#if HAVE_STRING_H
-#  include <string.h>
-#endif
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 
 // see http://www.unixwiz.net/techtips/gnu-c-attributes.html
 #ifndef __GNUC__
@@ -80,10 +61,94 @@ namespace dangdal {
 
 extern int VERBOSE;
 
+// Prints the message and exits, or throws FatalError if throw_fatal_errors was called.
 void fatal_error(const std::string &s) __attribute__((noreturn));
 void fatal_error(const char *s, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+class FatalError : public std::runtime_error {
+public:
+	explicit FatalError(const std::string &s) : std::runtime_error(s) { }
+};
+
+// For programs using libdangdal: makes fatal_error throw a FatalError rather than exit.
+// This should be called before any other threads are started.  A fatal_error on one of the
+// raster reader threads is passed back and thrown on the thread that is reading.
+void throw_fatal_errors(bool enable=true);
+
+// What a worker thread threw, such as a FatalError with throw_fatal_errors.  An exception
+// that escapes a boost::thread ends the program, so workers catch it into one of these, and
+// the thread that joins them calls check() to raise it there, as ReadAhead does.
+struct WorkerError {
+	WorkerError() : failed(false) { }
+
+	// Calls fatal_error with the message if the worker failed.
+	void check() const {
+		if(failed) fatal_error(what);
+	}
+
+	bool failed;
+	std::string what;
+};
+
+// Where the library's progress goes: messages such as "Tracing: " or "Trace found 12
+// rings.\n", and the fraction done of the stage being shown as a progress bar.  The hook
+// is given either a message (and a fraction of -1) or a NULL message and a fraction.  The
+// default, print_progress, prints messages to stdout and draws the bars with
+// GDALTermProgress.  A program using libdangdal can install its own hook, or NULL to keep
+// the library quiet.  Like throw_fatal_errors, this should be called before any other
+// threads are started.  The hook is called from one thread at a time.
+typedef void (*ProgressHook)(const char *message, double fraction, void *arg);
+void set_progress_hook(ProgressHook hook, void *arg=NULL);
+void print_progress(const char *message, double fraction, void *arg);
+
+// Give a printf style message, or the fraction done, to the progress hook.
+void report_message(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void report_progress(double fraction);
+
 std::vector<std::string> argv_to_list(int argc, char **argv);
 
+// Timing of the stages of a tool, for the -timings option.  A StageTimer adds the wall
+// and CPU time between its construction and its destruction (or stop()) to the totals
+// for its stage, along with the bytes read by the process and the number of items
+// (pixels, vertices) given to add_items.  CPU time is for the whole process, so it
+// includes worker threads.  Timers for the same stage are added together, so a stage
+// that runs once per feature gets one entry.  If -timings was given, the totals are
+// written as JSON when the program exits.  Timers are to be used only from the main
+// thread, and cost next to nothing when -timings was not given.
+//
+// The peak memory (resident set size) of a stage is measured on Linux by resetting the
+// kernel's high-water mark when the timer starts, so it is the peak during the stage.
+// Elsewhere it is the peak of the process so far when the stage ended.  The JSON says
+// which with "peak_rss_scope" ("stage" or "process").
+class StageTimer {
+public:
+	static void printUsage();
+	// Takes the -timings option out of arg_list.
+	static void parseArgs(std::vector<std::string> &arg_list);
+
+	explicit StageTimer(const char *stage, const char *units="");
+	~StageTimer();
+
+	void add_items(uint64_t n) { num_items += n; }
+	// Ends the timing before the timer goes out of scope.
+	void stop();
+
+private:
+	StageTimer(const StageTimer &);
+	StageTimer &operator=(const StageTimer &);
+
+	void start_peak_rss();
+
+	int stage_idx;
+	double wall0, cpu0;
+	int64_t read0;
+	uint64_t num_items;
+	// Peak RSS seen before the high-water mark was reset by timers started after this
+	// one, and whether the high-water mark was reset when this one started.
+	int64_t peak_rss;
+	bool stage_peak_rss;
+};
+
 } // namespace dangdal
 
 #endif // ifndef DANGDAL_COMMON_H
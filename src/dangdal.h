@@ -0,0 +1,60 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+#ifndef DANGDAL_DANGDAL_H
+#define DANGDAL_DANGDAL_H
+
+// The parts of dangdal that are usable as a library (libdangdal), for tracing and
+// simplifying masks without running the command line tools.  Masks can come from a
+// dataset (get_bitgrid_for_dataset, which works just as well on a /vsimem/ dataset) or
+// from buffers owned by the caller (get_bitgrid_for_buffers).  An NdvDef saying which
+// pixels are no-data can be built from the same range strings that the -ndv option takes.
+// The results are Mpoly and Ring in pixel coordinates.
+//
+// Call throw_fatal_errors() first so that errors are thrown as FatalError rather than
+// ending the process.  Progress messages and bars (from reading masks, trace_mask, and
+// compute_reduced_pointset and bevel_self_intersections unless show_progress is false) go
+// to stdout unless set_progress_hook is given another hook, or NULL for none.
+//
+// A minimal use:
+//
+//	dangdal::throw_fatal_errors();
+//	dangdal::set_progress_hook(NULL);
+//	dangdal::NdvDef ndv_def(std::vector<std::string>(1, "0"), false);
+//	dangdal::BitGrid mask = dangdal::get_bitgrid_for_buffers(bands, datatypes, w, h, ndv_def);
+//	dangdal::Mpoly outline = dangdal::trace_mask(mask, w, h, min_area, false);
+//	outline = dangdal::compute_reduced_pointset(outline, 1.0, 1, false);
+
+#include "common.h"
+#include "polygon.h"
+#include "ndv.h"
+#include "mask.h"
+#include "mask-tracer.h"
+#include "dp.h"
+#include "beveler.h"
+#include "rectangle_finder.h"
+
+#endif // ifndef DANGDAL_DANGDAL_H
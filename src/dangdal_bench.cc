@@ -0,0 +1,567 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+// Times the stages of the tracing pipeline, and the per-pixel kernels they are
+// built on, on synthetic rasters.  This is run by 'make bench' and is not
+// installed.  Each result is printed as one JSON object per line.
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include "common.h"
+#include "polygon.h"
+#include "georef.h"
+#include "ndv.h"
+#include "mask.h"
+#include "mask-tracer.h"
+#include "dp.h"
+#include "excursion_pincher.h"
+#include "beveler.h"
+#include "palette.h"
+
+using namespace dangdal;
+
+void usage(const std::string &cmdname) {
+	printf("Usage: %s [options]\n\n", cmdname.c_str());
+	printf(
+"Options:\n"
+"  -size N                      Width and height of the synthetic rasters\n"
+"                               (default is 1024)\n"
+"  -reps N                      Run each stage N times and report the fastest\n"
+"                               (default is 3)\n"
+"  -threads N                   Threads for the stages that can use them\n"
+"                               (default is 1)\n"
+"  -only name                   Only use this input (noise, islands, uniform,\n"
+"                               landcover, dem).  Can be given more than once.\n"
+"  -dir dir                     Where to write the inputs, as GeoTIFFs (default\n"
+"                               is bench_inputs).  bench.sh uses the same files\n"
+"                               for timing the tools themselves.\n"
+"\n"
+"Output is one line per stage and input:\n"
+"  {\"bench\": stage, \"input\": name, \"width\": w, \"height\": h,\n"
+"   \"threads\": n, \"reps\": n, \"seconds\": t, \"items\": n}\n"
+"where seconds is the fastest of the runs and items is the size of the output\n"
+"of the stage (pixels or vertices).\n"
+	);
+	exit(1);
+}
+
+static double now_seconds() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return double(tv.tv_sec) + double(tv.tv_usec) * 1e-6;
+}
+
+// Fixed seed, so every run sees exactly the same inputs.
+class Lcg {
+public:
+	Lcg() : state(12345) { }
+	// uniform in [0, 1)
+	double next() {
+		state = state * 1664525u + 1013904223u;
+		return double(state >> 8) / double(1 << 24);
+	}
+private:
+	uint32_t state;
+};
+
+struct BenchInput {
+	std::string name;
+	GDALDatasetH ds;
+	// passed to NdvDef, as on the command line of the tools
+	std::string ndv_opt, ndv_val;
+	// whether the pipeline stages (tracing onwards) are run on this input
+	bool is_mask;
+};
+
+struct BenchSettings {
+	size_t size;
+	size_t reps;
+	size_t num_threads;
+	// where the results go (the stages print progress to stdout)
+	FILE *results_fh;
+};
+
+static GDALDatasetH create_mem_dataset(size_t w, size_t h, GDALDataType dt) {
+	GDALDriverH driver = GDALGetDriverByName("MEM");
+	if(!driver) fatal_error("could not get MEM driver");
+	GDALDatasetH ds = GDALCreate(driver, "", int(w), int(h), 1, dt, NULL);
+	if(!ds) fatal_error("could not create in-memory dataset");
+
+	// UTM cells of 30 meters in interior Alaska, so that xy2ll has something
+	// realistic to do
+	double affine[6] = { 400000, 30, 0, 7200000, 0, -30 };
+	GDALSetGeoTransform(ds, affine);
+	return ds;
+}
+
+static void fill_byte_band(GDALDatasetH ds, const std::vector<uint8_t> &pixels) {
+	int w = GDALGetRasterXSize(ds);
+	int h = GDALGetRasterYSize(ds);
+	GDALRasterBandH band = GDALGetRasterBand(ds, 1);
+	CPLErr err = GDALRasterIO(band, GF_Write, 0, 0, w, h,
+		const_cast<uint8_t *>(&pixels[0]), w, h, GDT_Byte, 0, 0);
+	if(err != CE_None) fatal_error("could not write synthetic raster");
+}
+
+// Scattered one pixel holes and small clumps, like a lossy compressed image
+// with a no-data value.  Gives a great many tiny rings.
+static BenchInput make_noise(size_t n) {
+	Lcg rng;
+	std::vector<uint8_t> pixels(n*n, 255);
+	for(size_t i=0; i<pixels.size(); i++) {
+		if(rng.next() < 0.02) pixels[i] = 0;
+	}
+	for(size_t k=0; k<n; k++) {
+		size_t cx = size_t(rng.next() * n);
+		size_t cy = size_t(rng.next() * n);
+		size_t r = 1 + size_t(rng.next() * 6);
+		for(size_t y=cy; y<std::min(n, cy+r); y++) {
+			for(size_t x=cx; x<std::min(n, cx+r); x++) {
+				pixels[y*n + x] = 0;
+			}
+		}
+	}
+
+	BenchInput in;
+	in.name = "noise";
+	in.ds = create_mem_dataset(n, n, GDT_Byte);
+	fill_byte_band(in.ds, pixels);
+	in.ndv_opt = "-ndv";
+	in.ndv_val = "0";
+	in.is_mask = true;
+	return in;
+}
+
+// Grid of targets, each a set of concentric rings, so that the rings are
+// nested many levels deep.
+static BenchInput make_islands(size_t n) {
+	const size_t cell = 128;
+	const double band_width = 6;
+	std::vector<uint8_t> pixels(n*n);
+	for(size_t y=0; y<n; y++) {
+		for(size_t x=0; x<n; x++) {
+			double dx = double(x % cell) - cell/2.0 + 0.5;
+			double dy = double(y % cell) - cell/2.0 + 0.5;
+			double r = sqrt(dx*dx + dy*dy);
+			bool in_band = int(r / band_width) % 2 == 0;
+			pixels[y*n + x] = (in_band && r < cell/2.0 - 2) ? 1 : 0;
+		}
+	}
+
+	BenchInput in;
+	in.name = "islands";
+	in.ds = create_mem_dataset(n, n, GDT_Byte);
+	fill_byte_band(in.ds, pixels);
+	in.ndv_opt = "-ndv";
+	in.ndv_val = "0";
+	in.is_mask = true;
+	return in;
+}
+
+// One big valid region with a ragged border, like a scanned map or a
+// reprojected scene.  Almost all of the time goes to reading the pixels.
+static BenchInput make_uniform(size_t n) {
+	Lcg rng;
+	std::vector<uint8_t> pixels(n*n, 0);
+	size_t margin = n / 16;
+	for(size_t y=margin; y<n-margin; y++) {
+		size_t x0 = margin + size_t(rng.next() * 3);
+		size_t x1 = n - margin - size_t(rng.next() * 3);
+		for(size_t x=x0; x<x1; x++) pixels[y*n + x] = 200;
+	}
+
+	BenchInput in;
+	in.name = "uniform";
+	in.ds = create_mem_dataset(n, n, GDT_Byte);
+	fill_byte_band(in.ds, pixels);
+	in.ndv_opt = "-ndv";
+	in.ndv_val = "0";
+	in.is_mask = true;
+	return in;
+}
+
+// Eight classes laid out as the cells of a jittered Voronoi diagram, like a
+// land cover map.  The pipeline stages trace class 3.
+static BenchInput make_landcover(size_t n) {
+	Lcg rng;
+	const size_t cell = 64;
+	const size_t gn = (n + cell - 1) / cell;
+	std::vector<double> seed_x(gn*gn), seed_y(gn*gn);
+	std::vector<uint8_t> seed_class(gn*gn);
+	for(size_t i=0; i<gn*gn; i++) {
+		seed_x[i] = (double(i % gn) + rng.next()) * cell;
+		seed_y[i] = (double(i / gn) + rng.next()) * cell;
+		seed_class[i] = uint8_t(1 + rng.next() * 8);
+	}
+
+	std::vector<uint8_t> pixels(n*n);
+	for(size_t y=0; y<n; y++) {
+		for(size_t x=0; x<n; x++) {
+			int gx = int(x / cell), gy = int(y / cell);
+			double best_d = 0;
+			uint8_t best_class = 0;
+			for(int sy=std::max(gy-1, 0); sy<=std::min(gy+1, int(gn)-1); sy++) {
+				for(int sx=std::max(gx-1, 0); sx<=std::min(gx+1, int(gn)-1); sx++) {
+					size_t si = size_t(sy)*gn + size_t(sx);
+					double dx = seed_x[si] - double(x);
+					double dy = seed_y[si] - double(y);
+					double d = dx*dx + dy*dy;
+					if(!best_class || d < best_d) {
+						best_d = d;
+						best_class = seed_class[si];
+					}
+				}
+			}
+			pixels[y*n + x] = best_class;
+		}
+	}
+
+	BenchInput in;
+	in.name = "landcover";
+	in.ds = create_mem_dataset(n, n, GDT_Byte);
+	fill_byte_band(in.ds, pixels);
+	in.ndv_opt = "-valid-range";
+	in.ndv_val = "3..3";
+	in.is_mask = true;
+	return in;
+}
+
+// A tilted plane with hills, in meters, with a no-data corner.
+static BenchInput make_dem(size_t n) {
+	std::vector<float> pixels(n*n);
+	for(size_t y=0; y<n; y++) {
+		for(size_t x=0; x<n; x++) {
+			double v = 0.5*double(x) + 0.25*double(y) +
+				200.0 * sin(double(x) / 97.0) * cos(double(y) / 131.0);
+			if(x + y < n/8) v = -9999;
+			pixels[y*n + x] = float(v);
+		}
+	}
+
+	BenchInput in;
+	in.name = "dem";
+	in.ds = create_mem_dataset(n, n, GDT_Float32);
+	CPLErr err = GDALRasterIO(GDALGetRasterBand(in.ds, 1), GF_Write, 0, 0, int(n), int(n),
+		&pixels[0], int(n), int(n), GDT_Float32, 0, 0);
+	if(err != CE_None) fatal_error("could not write synthetic raster");
+	in.ndv_opt = "-ndv";
+	in.ndv_val = "-9999";
+	in.is_mask = false;
+	return in;
+}
+
+static void report(const std::string &bench, const BenchInput &in,
+	const BenchSettings &settings, double seconds, size_t items
+) {
+	fprintf(settings.results_fh, "{\"bench\": \"%s\", \"input\": \"%s\", \"width\": %d, \"height\": %d, "
+		"\"threads\": %zd, \"reps\": %zd, \"seconds\": %.6f, \"items\": %zd}\n",
+		bench.c_str(), in.name.c_str(),
+		GDALGetRasterXSize(in.ds), GDALGetRasterYSize(in.ds),
+		settings.num_threads, settings.reps, seconds, items);
+	fflush(settings.results_fh);
+}
+
+static size_t count_vertices(const Mpoly &mp) {
+	size_t n = 0;
+	for(size_t i=0; i<mp.rings.size(); i++) n += mp.rings[i].pts.size();
+	return n;
+}
+
+static void run_benchmarks(const BenchInput &in, const BenchSettings &settings) {
+	const size_t w = GDALGetRasterXSize(in.ds);
+	const size_t h = GDALGetRasterYSize(in.ds);
+	const size_t reps = settings.reps;
+	const size_t num_threads = settings.num_threads;
+
+	std::vector<std::string> ndv_args;
+	ndv_args.push_back("dangdal_bench");
+	ndv_args.push_back(in.ndv_opt);
+	ndv_args.push_back(in.ndv_val);
+	NdvDef ndv_def = NdvDef(ndv_args);
+
+	std::vector<size_t> bandlist(1, 1);
+
+	double best;
+
+	// The NdvDef kernel alone, on pixels that are already in memory.
+	{
+		GDALRasterBandH band = GDALGetRasterBand(in.ds, 1);
+		GDALDataType dt = GDALGetRasterDataType(band);
+		std::vector<uint8_t> pixels(w*h * GDALGetDataTypeSize(dt) / 8);
+		CPLErr err = GDALRasterIO(band, GF_Read, 0, 0, int(w), int(h),
+			&pixels[0], int(w), int(h), dt, 0, 0);
+		if(err != CE_None) fatal_error("could not read synthetic raster");
+		std::vector<uint8_t> mask(w*h);
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			double t0 = now_seconds();
+			ndv_def.getNdvMask(&pixels[0], dt, &mask[0], w*h);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+		}
+		report("ndv_mask", in, settings, best, w*h);
+	}
+
+	BitGrid mask(0, 0);
+	best = 0;
+	for(size_t rep=0; rep<reps; rep++) {
+		double t0 = now_seconds();
+		BitGrid m = get_bitgrid_for_dataset(in.ds, bandlist, ndv_def, NULL, num_threads);
+		double t = now_seconds() - t0;
+		if(!rep || t < best) best = t;
+		if(!rep) mask = m;
+	}
+	report("get_bitgrid_for_dataset", in, settings, best, w*h);
+
+	if(in.is_mask) {
+		Mpoly traced;
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			double t0 = now_seconds();
+			Mpoly mp = trace_mask(mask, w, h, 0, false);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+			if(!rep) traced.swap(mp);
+		}
+		report("trace_mask", in, settings, best, count_vertices(traced));
+
+		// The remaining stages are in the order gdal_trace_outline runs them,
+		// each getting the output of the one before.
+		Mpoly beveled;
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			Mpoly mp = traced;
+			double t0 = now_seconds();
+			bevel_self_intersections(mp, 0.1, num_threads);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+			if(!rep) beveled.swap(mp);
+		}
+		report("bevel_self_intersections", in, settings, best, count_vertices(beveled));
+
+		// pinch_excursions2 doesn't handle holes, so it gets only the top
+		// level rings (as with -no-donuts), and its output goes no further.
+		Mpoly outer;
+		for(size_t i=0; i<beveled.rings.size(); i++) {
+			if(beveled.rings[i].parent_id < 0) outer.rings.push_back(beveled.rings[i]);
+		}
+		Mpoly pinched;
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			double t0 = now_seconds();
+			Mpoly mp = pinch_excursions2(outer, NULL);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+			if(!rep) pinched.swap(mp);
+		}
+		report("pinch_excursions2", in, settings, best, count_vertices(pinched));
+
+		Mpoly reduced;
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			double t0 = now_seconds();
+			Mpoly mp = compute_reduced_pointset(beveled, 2.0, num_threads);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+			if(!rep) reduced.swap(mp);
+		}
+		report("compute_reduced_pointset", in, settings, best, count_vertices(reduced));
+
+		// fix_topology is the part of compute_reduced_pointset that scales with
+		// the number of rings rather than with the number of vertices, so it
+		// gets its own line.
+		{
+			std::vector<ReducedRing> reduced_rings;
+			for(size_t i=0; i<beveled.rings.size(); i++) {
+				reduced_rings.push_back(compute_reduced_ring(beveled.rings[i], 2.0));
+			}
+			best = 0;
+			for(size_t rep=0; rep<reps; rep++) {
+				std::vector<ReducedRing> rr = reduced_rings;
+				double t0 = now_seconds();
+				fix_topology(beveled, rr, num_threads);
+				double t = now_seconds() - t0;
+				if(!rep || t < best) best = t;
+			}
+			report("fix_topology", in, settings, best, beveled.rings.size());
+		}
+
+		// This is how the hierarchy of geometry read with ogr_to_mpoly is found.
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			double t0 = now_seconds();
+			RingNesting nesting(beveled);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+		}
+		report("ring_nesting", in, settings, best, beveled.rings.size());
+
+		std::vector<std::string> geo_args;
+		geo_args.push_back("dangdal_bench");
+		geo_args.push_back("-s_srs");
+		geo_args.push_back("+proj=utm +zone=6 +datum=WGS84");
+		GeoOpts geo_opts = GeoOpts(geo_args);
+		GeoRef georef = GeoRef(geo_opts, in.ds);
+
+		size_t ll_vertices = 0;
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			Mpoly mp = reduced;
+			double t0 = now_seconds();
+			mp.xy2ll_with_interp(georef, 1.0);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+			ll_vertices = count_vertices(mp);
+		}
+		report("xy2ll_with_interp", in, settings, best, ll_vertices);
+	} else {
+		// The color lookup of gdal_dem2rgb.
+		GDALRasterBandH band = GDALGetRasterBand(in.ds, 1);
+		std::vector<double> vals(w*h);
+		CPLErr err = GDALRasterIO(band, GF_Read, 0, 0, int(w), int(h),
+			&vals[0], int(w), int(h), GDT_Float64, 0, 0);
+		if(err != CE_None) fatal_error("could not read synthetic raster");
+
+		Palette pal = Palette::createDefault();
+		pal.compile(false);
+		std::vector<RGB> colors(w*h);
+		best = 0;
+		for(size_t rep=0; rep<reps; rep++) {
+			double t0 = now_seconds();
+			for(size_t i=0; i<w*h; i++) colors[i] = pal.get(vals[i]);
+			double t = now_seconds() - t0;
+			if(!rep || t < best) best = t;
+		}
+		report("palette_get", in, settings, best, w*h);
+	}
+}
+
+int main(int argc, char **argv) {
+	const std::string cmdname = argv[0];
+	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+
+	BenchSettings settings;
+	settings.size = 1024;
+	settings.reps = 3;
+	settings.num_threads = 1;
+	std::vector<std::string> only;
+	std::string input_dir = "bench_inputs";
+
+	size_t argp = 1;
+	while(argp < arg_list.size()) {
+		const std::string &arg = arg_list[argp++];
+		if(arg[0] == '-') {
+			try {
+				if(arg == "-size") {
+					if(argp == arg_list.size()) usage(cmdname);
+					settings.size = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(settings.size < 64) fatal_error("-size must be at least 64");
+				} else if(arg == "-reps") {
+					if(argp == arg_list.size()) usage(cmdname);
+					settings.reps = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!settings.reps) fatal_error("-reps must be positive");
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					settings.num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!settings.num_threads) fatal_error("-threads must be positive");
+				} else if(arg == "-only") {
+					if(argp == arg_list.size()) usage(cmdname);
+					only.push_back(arg_list[argp++]);
+				} else if(arg == "-dir") {
+					if(argp == arg_list.size()) usage(cmdname);
+					input_dir = arg_list[argp++];
+				} else {
+					usage(cmdname);
+				}
+			} catch(boost::bad_lexical_cast &e) {
+				fatal_error("cannot parse number given on command line");
+			}
+		} else {
+			usage(cmdname);
+		}
+	}
+
+	// Only the results go to stdout, so that they can be piped into other
+	// tools.  Progress messages from the stages go to stderr.
+	settings.results_fh = fdopen(dup(1), "w");
+	dup2(2, 1);
+
+	GDALAllRegister();
+
+	if(mkdir(input_dir.c_str(), 0777) && errno != EEXIST) {
+		fatal_error("could not create directory %s", input_dir.c_str());
+	}
+
+	typedef BenchInput (*InputMaker)(size_t);
+	const char *input_names[] = { "noise", "islands", "uniform", "landcover", "dem" };
+	InputMaker makers[] = { make_noise, make_islands, make_uniform, make_landcover, make_dem };
+	const size_t num_inputs = sizeof(makers) / sizeof(makers[0]);
+
+	for(size_t i=0; i<only.size(); i++) {
+		if(std::find(input_names, input_names+num_inputs, only[i]) == input_names+num_inputs) {
+			fatal_error("unknown input '%s'", only[i].c_str());
+		}
+	}
+
+	for(size_t i=0; i<num_inputs; i++) {
+		if(only.size() && std::find(only.begin(), only.end(), input_names[i]) == only.end()) {
+			continue;
+		}
+
+		BenchInput in = makers[i](settings.size);
+
+		// The stages read from a file rather than from the MEM dataset, as
+		// the tools would, and because BlockReader needs to reopen the
+		// input once for each thread.
+		std::string fn = input_dir + "/bench_" + in.name + ".tif";
+		GDALDriverH driver = GDALGetDriverByName("GTiff");
+		if(!driver) fatal_error("could not get GTiff driver");
+		GDALDatasetH out_ds = GDALCreateCopy(driver, fn.c_str(), in.ds, FALSE, NULL, NULL, NULL);
+		if(!out_ds) fatal_error("could not create %s", fn.c_str());
+		GDALClose(out_ds);
+		GDALClose(in.ds);
+		in.ds = GDALOpen(fn.c_str(), GA_ReadOnly);
+		if(!in.ds) fatal_error("could not open %s", fn.c_str());
+
+		run_benchmarks(in, settings);
+
+		GDALClose(in.ds);
+	}
+
+	return 0;
+}
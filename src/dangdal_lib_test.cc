@@ -0,0 +1,309 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+// Checks of libdangdal that the tool tests in tests/*.sh can't do, such as errors
+// being thrown (with throw_fatal_errors) rather than ending the process, progress going
+// to the hook given to set_progress_hook rather than stdout, the exact rings given by
+// the excursion pincher for rings that touch or overlap, or the fast hillshading
+// agreeing with the per-pixel version.  This is
+// built by 'make check' and run by tests/test1.sh.  Prints GOOD or BAD for each
+// check and exits nonzero if any were bad.
+
+#include <string>
+#include <vector>
+
+#include <gdal.h>
+#include <cpl_vsi.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include "common.h"
+#include "ndv.h"
+#include "mask.h"
+#include "mask-tracer.h"
+#include "read_ahead.h"
+#include "debugplot.h"
+#include "excursion_pincher.h"
+#include "hillshade.h"
+
+using namespace dangdal;
+
+static int num_bad = 0;
+
+static void report(const std::string &name, bool good) {
+	printf("%s %s\n", good ? "GOOD" : "BAD", name.c_str());
+	if(!good) num_bad++;
+}
+
+// Jobs before fail_at give their job number, fail_at throws.
+class FailingProducer : public ReadAhead<size_t>::Producer {
+public:
+	explicit FailingProducer(size_t _fail_at) : fail_at(_fail_at) { }
+	virtual void produce(size_t job, size_t worker_idx, size_t &out) {
+		(void)worker_idx;
+		if(job == fail_at) fatal_error("job %zd failed", job);
+		out = job;
+	}
+	size_t fail_at;
+};
+
+static void check_read_ahead(size_t num_workers) {
+	const std::string name = "read_ahead_error_" + boost::lexical_cast<std::string>(num_workers);
+	FailingProducer producer(5);
+	ReadAhead<size_t> read_ahead(&producer, 20, num_workers, 4);
+	size_t num_good = 0;
+	try {
+		while(size_t *job = read_ahead.next()) {
+			if(*job != num_good) break;
+			num_good++;
+		}
+		report(name, false);
+	} catch(const FatalError &e) {
+		report(name, num_good == 5 && std::string(e.what()) == "job 5 failed");
+	}
+}
+
+// A VRT whose source is missing.  The SourceProperties let GDAL open the VRT without
+// opening the source, so the error comes when the pixels are read.
+static void check_failed_read(size_t num_threads) {
+	const std::string name = "failed_read_" + boost::lexical_cast<std::string>(num_threads);
+	const char *vrt_fn = "/vsimem/dangdal_lib_test.vrt";
+	VSILFILE *fh = VSIFOpenL(vrt_fn, "wb");
+	if(!fh) fatal_error("cannot create %s", vrt_fn);
+	VSIFPrintfL(fh,
+		"<VRTDataset rasterXSize=\"256\" rasterYSize=\"256\">\n"
+		"  <VRTRasterBand dataType=\"Byte\" band=\"1\">\n"
+		"    <SimpleSource>\n"
+		"      <SourceFilename relativeToVRT=\"0\">/vsimem/dangdal_lib_test_missing.tif</SourceFilename>\n"
+		"      <SourceBand>1</SourceBand>\n"
+		"      <SourceProperties RasterXSize=\"256\" RasterYSize=\"256\" DataType=\"Byte\""
+			" BlockXSize=\"256\" BlockYSize=\"1\" />\n"
+		"      <SrcRect xOff=\"0\" yOff=\"0\" xSize=\"256\" ySize=\"256\" />\n"
+		"      <DstRect xOff=\"0\" yOff=\"0\" xSize=\"256\" ySize=\"256\" />\n"
+		"    </SimpleSource>\n"
+		"  </VRTRasterBand>\n"
+		"</VRTDataset>\n");
+	VSIFCloseL(fh);
+
+	GDALDatasetH ds = GDALOpen(vrt_fn, GA_ReadOnly);
+	if(!ds) {
+		report(name, false);
+	} else {
+		std::vector<size_t> bandlist(1, 1);
+		NdvDef ndv_def(std::vector<std::string>(1, "0"), false);
+		try {
+			get_bitgrid_for_dataset(ds, bandlist, ndv_def, NULL, num_threads);
+			report(name, false);
+		} catch(const FatalError &) {
+			report(name, true);
+		}
+		GDALClose(ds);
+	}
+	VSIUnlink(vrt_fn);
+}
+
+struct ProgressLog {
+	ProgressLog() : last_fraction(-1) { }
+	std::string messages;
+	double last_fraction;
+};
+
+static void log_progress(const char *message, double fraction, void *arg) {
+	ProgressLog *log = static_cast<ProgressLog *>(arg);
+	if(message) {
+		log->messages += message;
+	} else {
+		log->last_fraction = fraction;
+	}
+}
+
+// A 4x3 block in a 6x5 mask.
+static void check_progress_hook() {
+	BitGrid mask(6, 5);
+	for(int y=1; y<4; y++) {
+		for(int x=1; x<5; x++) mask.set(x, y, true);
+	}
+	ProgressLog log;
+	set_progress_hook(log_progress, &log);
+	Mpoly out = trace_mask(mask, 6, 5, 0, false);
+	set_progress_hook(print_progress);
+	report("progress_hook", out.rings.size() == 1 && log.last_fraction == 1 &&
+		log.messages == "Tracing: Trace found 1 rings.\n");
+}
+
+static Ring make_ring(const double *xy, size_t num_pts) {
+	Ring ring;
+	for(size_t i=0; i<num_pts; i++) ring.pts.push_back(Vertex(xy[i*2], xy[i*2+1]));
+	return ring;
+}
+
+// The pincher merges rings that touch or overlap into the outline of their union,
+// which starts at the bottom-left vertex and goes counterclockwise.
+static void check_pinch(const std::string &name, const Mpoly &in, const Ring &want) {
+	const Mpoly out = pinch_excursions2(in, NULL);
+	bool good = out.rings.size() == 1 && out.rings[0].pts.size() == want.pts.size();
+	for(size_t i=0; good && i<want.pts.size(); i++) {
+		const Vertex &v = out.rings[0].pts[i];
+		good = v.x == want.pts[i].x && v.y == want.pts[i].y;
+	}
+	report("pinch_" + name, good);
+}
+
+static void check_pinch() {
+	const double square[] = { 0,0, 4,0, 4,4, 0,4 };
+	const double overlapping[] = { 2,1, 6,1, 6,3, 2,3 };
+	const double touching_edge[] = { 4,1, 8,1, 8,3, 4,3 };
+	const double touching_corner[] = { 4,4, 6,4, 6,6, 4,6 };
+	const double inside[] = { 1,1, 2,1, 2,2, 1,2 };
+	const double notched[] = { 0,0, 6,0, 6,4, 4,4, 4,1, 2,1, 2,4, 0,4 };
+
+	{
+		Mpoly in;
+		in.rings.push_back(make_ring(square, 4));
+		in.rings.push_back(make_ring(overlapping, 4));
+		const double want[] = { 0,0, 4,0, 4,1, 6,1, 6,3, 4,3, 4,4, 0,4 };
+		check_pinch("overlap", in, make_ring(want, 8));
+	}
+	{
+		Mpoly in;
+		in.rings.push_back(make_ring(square, 4));
+		in.rings.push_back(make_ring(touching_edge, 4));
+		const double want[] = { 0,0, 4,0, 4,1, 8,1, 8,3, 4,3, 4,4, 0,4 };
+		check_pinch("touch_edge", in, make_ring(want, 8));
+	}
+	{
+		// the outline passes through the shared corner twice
+		Mpoly in;
+		in.rings.push_back(make_ring(square, 4));
+		in.rings.push_back(make_ring(touching_corner, 4));
+		const double want[] = { 0,0, 4,0, 4,4, 6,4, 6,6, 4,6, 4,4, 0,4 };
+		check_pinch("touch_corner", in, make_ring(want, 8));
+	}
+	{
+		Mpoly in;
+		in.rings.push_back(make_ring(square, 4));
+		in.rings.push_back(make_ring(inside, 4));
+		check_pinch("inside", in, make_ring(square, 4));
+	}
+	{
+		// all at once and out of order, one of them clockwise
+		Mpoly in;
+		in.rings.push_back(make_ring(overlapping, 4));
+		in.rings.push_back(make_ring(square, 4));
+		in.rings.push_back(make_ring(touching_edge, 4));
+		in.rings.back().reverse();
+		in.rings.push_back(make_ring(inside, 4));
+		const double want[] = { 0,0, 4,0, 4,1, 6,1, 8,1, 8,3, 6,3, 4,3, 4,4, 0,4 };
+		check_pinch("chain", in, make_ring(want, 10));
+	}
+	{
+		// the notch is pinched off where it meets the top edge
+		Mpoly in;
+		in.rings.push_back(make_ring(notched, 8));
+		const double want[] = { 0,0, 6,0, 6,4, 4,4, 2,4, 0,4 };
+		check_pinch("notch", in, make_ring(want, 6));
+	}
+}
+
+// A value in [0,1) from a fixed sequence, so that the checks are repeatable.
+static double next_random(uint32_t &seed) {
+	seed = seed * 1103515245u + 12345u;
+	return double(seed >> 8) / double(1 << 24);
+}
+
+// shade_row and shade_row_reference on the same random rows, with invalid pixels
+// scattered through them and slopes steep enough for some to be off the edge of the
+// tables, using both constant and interpolated invaffine.  Each table entry holds a
+// different value, so any difference in the entry picked shows.
+static void check_shading() {
+	const size_t n = 61;
+	const size_t stride = n + 2;
+
+	ShadeSettings ss;
+	ss.slope_exageration = 2;
+	ss.shade_table.resize(SHADE_TABLE_WIDTH * SHADE_TABLE_WIDTH);
+	ss.spec_table.resize(SHADE_TABLE_WIDTH * SHADE_TABLE_WIDTH);
+	for(size_t i=0; i<ss.shade_table.size(); i++) {
+		ss.shade_table[i] = double(i);
+		ss.spec_table[i] = -double(i);
+	}
+
+	uint32_t seed = 1;
+	std::vector<double> dem(stride * 3);
+	std::vector<uint8_t> good(stride * 3);
+	std::vector<double> invaffine_above(n * 4), invaffine_below(n * 4);
+	std::vector<double> ref_brite(n), ref_spec(n), brite(n), spec(n);
+	std::vector<double> dx, dy;
+	std::vector<int> table_idx;
+	bool same = true;
+	for(int pass=0; pass<200; pass++) {
+		const double relief = (pass % 10) ? 20 : 2000;
+		for(size_t i=0; i<dem.size(); i++) {
+			dem[i] = (next_random(seed) - .5) * relief;
+			good[i] = next_random(seed) < .8;
+		}
+		for(size_t i=0; i<n*4; i++) {
+			invaffine_above[i] = (next_random(seed) - .5) * .2;
+			invaffine_below[i] = (next_random(seed) - .5) * .2;
+		}
+
+		ShadeRow sr;
+		sr.prev = &dem[1];
+		sr.cur = &dem[stride + 1];
+		sr.next = &dem[stride*2 + 1];
+		sr.good_prev = &good[1];
+		sr.good_this = &good[stride + 1];
+		sr.good_next = &good[stride*2 + 1];
+		sr.invaffine_above = &invaffine_above[0];
+		sr.invaffine_below = &invaffine_below[0];
+		sr.grid_fraction = next_random(seed);
+		sr.constant_invaffine = (pass & 1) ? &invaffine_above[0] : NULL;
+		sr.n = n;
+
+		shade_row_reference(ss, sr, &ref_brite[0], &ref_spec[0]);
+		shade_row(ss, sr, dx, dy, table_idx, &brite[0], &spec[0]);
+		if(brite != ref_brite || spec != ref_spec) same = false;
+	}
+	report("shading", same);
+}
+
+int main() {
+	throw_fatal_errors();
+	GDALAllRegister();
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+
+	check_read_ahead(1);
+	check_read_ahead(4);
+	check_failed_read(1);
+	check_failed_read(4);
+	check_progress_hook();
+	check_pinch();
+	check_shading();
+
+	return num_bad ? 1 : 0;
+}
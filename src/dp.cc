@@ -30,6 +30,9 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include <utility>
 #include <cassert>
 
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
 #include "common.h"
 #include "polygon.h"
 #include "dp.h"
@@ -48,7 +51,94 @@ static inline double veclen(double x, double y) {
 	return sqrt(x*x + y*y);
 }
 
-Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance) {
+// Hands out ranges of items to worker threads.  Chunks are handed out in order.  If a
+// progress range is given, the progress meter goes from progress_from to progress_to as
+// they are.
+class WorkQueue {
+public:
+	WorkQueue(size_t _num_items, size_t _chunk_size) :
+		num_items(_num_items), chunk_size(_chunk_size), next_item(0),
+		show_progress(false), progress_from(0), progress_to(0)
+	{ }
+
+	WorkQueue(size_t _num_items, size_t _chunk_size, double _progress_from, double _progress_to) :
+		num_items(_num_items), chunk_size(_chunk_size), next_item(0),
+		show_progress(true), progress_from(_progress_from), progress_to(_progress_to)
+	{ }
+
+	void hide_progress() { show_progress = false; }
+
+	bool next(size_t &begin, size_t &end) {
+		boost::mutex::scoped_lock lock(mutex);
+		if(next_item >= num_items) return false;
+		if(show_progress) {
+			report_progress(progress_from + (progress_to - progress_from) *
+				double(next_item) / double(num_items));
+		}
+		begin = next_item;
+		end = std::min(num_items, next_item + chunk_size);
+		next_item = end;
+		return true;
+	}
+
+private:
+	size_t num_items, chunk_size, next_item;
+	bool show_progress;
+	double progress_from, progress_to;
+	boost::mutex mutex;
+};
+
+template <typename Job>
+static void run_job(Job *job, WorkQueue *queue, size_t thread_id, WorkerError *error) {
+	try {
+		(*job)(*queue, thread_id);
+	} catch(const std::exception &e) {
+		error->failed = true;
+		error->what = e.what();
+	} catch(...) {
+		error->failed = true;
+		error->what = "unknown error on worker thread";
+	}
+}
+
+// Runs job(queue, thread_id) on each of num_threads threads.  With one thread the job
+// runs on the calling thread.  An error on one of the threads is raised on the calling
+// thread once they have all finished.
+template <typename Job>
+static void run_parallel(Job &job, WorkQueue &queue, size_t num_threads) {
+	if(num_threads <= 1) {
+		job(queue, 0);
+		return;
+	}
+	std::vector<WorkerError> errors(num_threads);
+	boost::thread_group threads;
+	for(size_t i=0; i<num_threads; i++) {
+		threads.add_thread(new boost::thread(&run_job<Job>, &job, &queue, i, &errors[i]));
+	}
+	threads.join_all();
+	for(size_t i=0; i<num_threads; i++) errors[i].check();
+}
+
+struct ReduceRingsJob {
+	ReduceRingsJob(const Mpoly &_in_mpoly, double _tolerance, std::vector<ReducedRing> &_out) :
+		in_mpoly(_in_mpoly), tolerance(_tolerance), out(_out) { }
+
+	void operator()(WorkQueue &queue, size_t) {
+		size_t begin, end;
+		while(queue.next(begin, end)) {
+			for(size_t c_idx=begin; c_idx<end; c_idx++) {
+				out[c_idx] = compute_reduced_ring(in_mpoly.rings[c_idx], tolerance);
+			}
+		}
+	}
+
+	const Mpoly &in_mpoly;
+	double tolerance;
+	std::vector<ReducedRing> &out;
+};
+
+Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance, size_t num_threads,
+bool show_progress) {
 	if(VERBOSE) printf("reducing...\n");
 
 	if(!in_mpoly.rings.size()) {
@@ -57,12 +147,15 @@ Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance) {
 
 	std::vector<ReducedRing> reduced_rings(in_mpoly.rings.size());
 
-	for(size_t c_idx=0; c_idx<in_mpoly.rings.size(); c_idx++) {
-		reduced_rings[c_idx] = compute_reduced_ring(
-			in_mpoly.rings[c_idx], tolerance);
+	// Rings are independent, so they are reduced in parallel.  Each ring is handled by a
+	// single thread, so the result doesn't depend on the number of threads.
+	{
+		WorkQueue queue(in_mpoly.rings.size(), 16);
+		ReduceRingsJob job(in_mpoly, tolerance, reduced_rings);
+		run_parallel(job, queue, num_threads);
 	}
 
-	fix_topology(in_mpoly, reduced_rings);
+	fix_topology(in_mpoly, reduced_rings, num_threads, show_progress);
 
 	return reduction_to_mpoly(in_mpoly, reduced_rings);
 }
@@ -335,12 +428,14 @@ static inline int segs_cross(
 		1);
 }
 
+typedef std::pair<size_t, size_t> segptr_t;
+typedef BboxTree<segptr_t> segbsp_t;
+
 // This allows rapidly finding which segments intersect each other.
 // The std::pair consists of the ring and segment indices.
-BboxBinarySpacePartition<std::pair<size_t, size_t> > get_bsp_for_reduced_rings(
+segbsp_t get_bsp_for_reduced_rings(
 	const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings
 ) {
-	typedef std::pair<size_t, size_t> segptr_t;
 	std::vector<std::pair<Bbox, segptr_t> > items;
 
 	for(size_t ring_idx=0; ring_idx < mpoly.rings.size(); ring_idx++) {
@@ -352,13 +447,133 @@ BboxBinarySpacePartition<std::pair<size_t, size_t> > get_bsp_for_reduced_rings(
 		}
 	}
 
-	return BboxBinarySpacePartition<segptr_t>(items);
+	return segbsp_t(items);
+}
+
+// Collects the segments that cross a given segment, as they come out of the BboxTree.
+struct CrossingCollector {
+	CrossingCollector(
+		const Mpoly &_mpoly, const std::vector<ReducedRing> &_reduced_rings,
+		size_t _r1_idx, size_t _seg1_idx, bool _only_lower, std::vector<segptr_t> &_out
+	) :
+		mpoly(_mpoly), reduced_rings(_reduced_rings),
+		r1_idx(_r1_idx), seg1_idx(_seg1_idx), only_lower(_only_lower), out(_out)
+	{ }
+
+	void operator()(const segptr_t &seg2) {
+		size_t r2_idx = seg2.first;
+		size_t seg2_idx = seg2.second;
+
+		if(only_lower) {
+			if(r2_idx > r1_idx) return;
+			if(r2_idx == r1_idx && seg2_idx > seg1_idx) return;
+		}
+
+		const Ring &c1 = mpoly.rings[r1_idx];
+		const ReducedRing &r1 = reduced_rings[r1_idx];
+		const Ring &c2 = mpoly.rings[r2_idx];
+		const ReducedRing &r2 = reduced_rings[r2_idx];
+
+		if(segs_cross(r1_idx==r2_idx, c1, r1.segs[seg1_idx], c2, r2.segs[seg2_idx])) {
+			out.push_back(seg2);
+		}
+	}
+
+	const Mpoly &mpoly;
+	const std::vector<ReducedRing> &reduced_rings;
+	size_t r1_idx, seg1_idx;
+	bool only_lower;
+	std::vector<segptr_t> &out;
+};
+
+// All segments that cross segment seg1_idx of ring r1_idx.  If only_lower is set, only
+// segments that come before it (by ring, then segment index) are returned.
+static std::vector<segptr_t> find_crossings(
+	const Mpoly &mpoly, const std::vector<ReducedRing> &reduced_rings, const segbsp_t &bsp,
+	size_t r1_idx, size_t seg1_idx, bool only_lower
+) {
+	std::vector<segptr_t> ret;
+	Bbox seg1_bbox = reduced_rings[r1_idx].segs[seg1_idx].get_bbox(mpoly.rings[r1_idx]);
+	CrossingCollector collector(mpoly, reduced_rings, r1_idx, seg1_idx, only_lower, ret);
+	bsp.visit_intersecting_items(seg1_bbox, collector);
+	return ret;
 }
 
-void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
+// Flags every segment that crosses another.  Each thread has its own problem bitmap,
+// indexed by seg_base[ring]+seg, and these are OR'ed together afterwards.
+struct FindProblemsJob {
+	FindProblemsJob(
+		const Mpoly &_mpoly, const std::vector<ReducedRing> &_reduced_rings,
+		const segbsp_t &_bsp, const std::vector<size_t> &_seg_base, size_t num_threads
+	) :
+		mpoly(_mpoly), reduced_rings(_reduced_rings), bsp(_bsp), seg_base(_seg_base),
+		problems(num_threads), num_problems(num_threads)
+	{ }
+
+	void operator()(WorkQueue &queue, size_t thread_id) {
+		std::vector<bool> &p = problems[thread_id];
+		p.resize(seg_base.back(), 0);
+		size_t begin, end;
+		while(queue.next(begin, end)) {
+			for(size_t r1_idx=begin; r1_idx<end; r1_idx++) {
+				const ReducedRing &r1 = reduced_rings[r1_idx];
+				for(size_t seg1_idx=0; seg1_idx < r1.segs.size(); seg1_idx++) {
+					// symmetry optimization
+					std::vector<segptr_t> crossings = find_crossings(
+						mpoly, reduced_rings, bsp, r1_idx, seg1_idx, true);
+					BOOST_FOREACH(const segptr_t &c2, crossings) {
+						//printf("found a crossing: %d,%d,%d,%d\n",
+						//	r1_idx, seg1_idx, c2.first, c2.second);
+						p[seg_base[r1_idx] + seg1_idx] = 1;
+						p[seg_base[c2.first] + c2.second] = 1;
+						num_problems[thread_id] += 2;
+					}
+				}
+			}
+		}
+	}
+
+	const Mpoly &mpoly;
+	const std::vector<ReducedRing> &reduced_rings;
+	const segbsp_t &bsp;
+	const std::vector<size_t> &seg_base;
+	std::vector<std::vector<bool> > problems;
+	std::vector<int> num_problems;
+};
+
+// Finds the crossings of each of the given segments.
+struct ListCrossingsJob {
+	ListCrossingsJob(
+		const Mpoly &_mpoly, const std::vector<ReducedRing> &_reduced_rings,
+		const segbsp_t &_bsp, const std::vector<segptr_t> &_todo
+	) :
+		mpoly(_mpoly), reduced_rings(_reduced_rings), bsp(_bsp), todo(_todo),
+		crossings(todo.size())
+	{ }
+
+	void operator()(WorkQueue &queue, size_t) {
+		size_t begin, end;
+		while(queue.next(begin, end)) {
+			for(size_t i=begin; i<end; i++) {
+				crossings[i] = find_crossings(mpoly, reduced_rings, bsp,
+					todo[i].first, todo[i].second, false);
+			}
+		}
+	}
+
+	const Mpoly &mpoly;
+	const std::vector<ReducedRing> &reduced_rings;
+	const segbsp_t &bsp;
+	const std::vector<segptr_t> &todo;
+	std::vector<std::vector<segptr_t> > crossings;
+};
+
+void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings, size_t num_threads,
+bool show_progress) {
 	const double firsthalf_progress = 0.5;
-	printf("Fixing topology: ");
-	fflush(stdout);
+	if(show_progress) {
+		report_message("Fixing topology: ");
+	}
 
 	assert(mpoly.rings.size() == reduced_rings.size());
 
@@ -371,49 +586,34 @@ void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 
 	int num_problems = 0;
 	{
-		const BboxBinarySpacePartition<std::pair<size_t, size_t> > bsp =
-			get_bsp_for_reduced_rings(mpoly, reduced_rings);
+		const segbsp_t bsp = get_bsp_for_reduced_rings(mpoly, reduced_rings);
 
-		// flag segments that cross
+		std::vector<size_t> seg_base(mpoly.rings.size() + 1, 0);
 		for(size_t r1_idx=0; r1_idx < mpoly.rings.size(); r1_idx++) {
-			GDALTermProgress(firsthalf_progress*
-				pow((double)r1_idx / (double)mpoly.rings.size(), 2), NULL, NULL);
-			const Ring &c1 = mpoly.rings[r1_idx];
-			const ReducedRing &r1 = reduced_rings[r1_idx];
-			std::vector<bool> &p1 = mp_problems[r1_idx];
-
-			for(size_t seg1_idx=0; seg1_idx < r1.segs.size(); seg1_idx++) {
-				Bbox seg1_bbox = r1.segs[seg1_idx].get_bbox(c1);
-				std::vector<std::pair<size_t, size_t> > intersecting_segments =
-					bsp.get_intersecting_items(seg1_bbox);
-				for(size_t i_s_idx=0; i_s_idx < intersecting_segments.size(); i_s_idx++) {
-					size_t r2_idx = intersecting_segments[i_s_idx].first;
-					size_t seg2_idx = intersecting_segments[i_s_idx].second;
-
-					// symmetry optimization
-					if(r2_idx > r1_idx) continue;
-					if(r2_idx == r1_idx && seg2_idx > seg1_idx) continue;
-
-					const Ring &c2 = mpoly.rings[r2_idx];
-					const ReducedRing &r2 = reduced_rings[r2_idx];
-					std::vector<bool> &p2 = mp_problems[r2_idx];
+			seg_base[r1_idx+1] = seg_base[r1_idx] + reduced_rings[r1_idx].segs.size();
+		}
 
-					int crosses = segs_cross(r1_idx==r2_idx, 
-						c1, r1.segs[seg1_idx], c2, r2.segs[seg2_idx]);
-					if(crosses) {
-						//printf("found a crossing: %d,%d,%d,%d\n",
-						//	r1_idx, seg1_idx, r2_idx, seg2_idx);
-						p1[seg1_idx] = 1;
-						p2[seg2_idx] = 1;
-						num_problems += 2;
-					}
-				} // ring2/seg2 loop
-			} // seg1 loop
-		} // ring1 loop
+		// flag segments that cross
+		WorkQueue queue(mpoly.rings.size(), 16, 0, firsthalf_progress);
+		if(!show_progress) queue.hide_progress();
+		FindProblemsJob job(mpoly, reduced_rings, bsp, seg_base, std::max(num_threads, size_t(1)));
+		run_parallel(job, queue, num_threads);
+
+		for(size_t t=0; t<job.problems.size(); t++) {
+			const std::vector<bool> &p = job.problems[t];
+			if(p.empty()) continue; // thread got no work
+			for(size_t r1_idx=0; r1_idx < mpoly.rings.size(); r1_idx++) {
+				std::vector<bool> &p1 = mp_problems[r1_idx];
+				for(size_t seg1_idx=0; seg1_idx < p1.size(); seg1_idx++) {
+					if(p[seg_base[r1_idx] + seg1_idx]) p1[seg1_idx] = 1;
+				}
+			}
+			num_problems += job.num_problems[t];
+		}
 	}
 
 	double progress = firsthalf_progress;
-	GDALTermProgress(progress, NULL, NULL);
+	if(show_progress) report_progress(progress);
 
 	if(num_problems) {
 		if(VERBOSE) printf("fixing %d crossed segments from reduction\n", num_problems/2);
@@ -444,18 +644,28 @@ void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 			} // seg loop
 		} // ring loop
 
-		const BboxBinarySpacePartition<std::pair<size_t, size_t> > bsp =
-			get_bsp_for_reduced_rings(mpoly, reduced_rings);
+		const segbsp_t bsp = get_bsp_for_reduced_rings(mpoly, reduced_rings);
 
-		num_problems = 0;
-		// now test for resolved problems and new problems
+		// The crossings of the segments that are flagged now are looked up in parallel.
+		// The loop below then goes through the segments in order just as if it had done
+		// the lookups itself.  Segments that it flags along the way that it hasn't
+		// gotten to yet weren't looked up, and it does those itself.
+		std::vector<segptr_t> todo;
 		for(size_t r1_idx=0; r1_idx < mpoly.rings.size(); r1_idx++) {
-			{
-				double alpha = double(r1_idx) / mpoly.rings.size();
-				double p = progress + (1.0-progress)/2*alpha;
-				GDALTermProgress(p, NULL, NULL);
+			const std::vector<bool> &p1 = mp_problems[r1_idx];
+			for(size_t seg1_idx=0; seg1_idx < p1.size(); seg1_idx++) {
+				if(p1[seg1_idx]) todo.push_back(segptr_t(r1_idx, seg1_idx));
 			}
+		}
+		WorkQueue queue(todo.size(), 64, progress, progress + (1.0-progress)/2);
+		if(!show_progress) queue.hide_progress();
+		ListCrossingsJob job(mpoly, reduced_rings, bsp, todo);
+		run_parallel(job, queue, num_threads);
+		size_t todo_idx = 0;
 
+		num_problems = 0;
+		// now test for resolved problems and new problems
+		for(size_t r1_idx=0; r1_idx < mpoly.rings.size(); r1_idx++) {
 			const Ring &c1 = mpoly.rings[r1_idx];
 			const ReducedRing &r1 = reduced_rings[r1_idx];
 			std::vector<bool> &p1 = mp_problems[r1_idx];
@@ -463,47 +673,46 @@ void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings) {
 				if(!p1[seg1_idx]) continue;
 				p1[seg1_idx] = 0;
 
-				Bbox seg1_bbox = r1.segs[seg1_idx].get_bbox(c1);
-				std::vector<std::pair<size_t, size_t> > intersecting_segments =
-					bsp.get_intersecting_items(seg1_bbox);
-				for(size_t i_s_idx=0; i_s_idx < intersecting_segments.size(); i_s_idx++) {
-					size_t r2_idx = intersecting_segments[i_s_idx].first;
-					size_t seg2_idx = intersecting_segments[i_s_idx].second;
-
-					const Ring &c2 = mpoly.rings[r2_idx];
-					const ReducedRing &r2 = reduced_rings[r2_idx];
-
-					int crosses = segs_cross(r1_idx==r2_idx,
-						c1, r1.segs[seg1_idx], c2, r2.segs[seg2_idx]);
-					if(crosses) {
-						if(VERBOSE) {
-							printf("found a crossing (still): %zd,%zd,%zd,%zd (%f,%f)-(%f,%f) (%f,%f)-(%f,%f)\n",
-								r1_idx, seg1_idx, r2_idx, seg2_idx,
-								c1.pts[r1.segs[seg1_idx].begin].x,
-								c1.pts[r1.segs[seg1_idx].begin].y,
-								c1.pts[r1.segs[seg1_idx].end].x,
-								c1.pts[r1.segs[seg1_idx].end].y,
-								c2.pts[r2.segs[seg2_idx].begin].x,
-								c2.pts[r2.segs[seg2_idx].begin].y,
-								c2.pts[r2.segs[seg2_idx].end].x,
-								c2.pts[r2.segs[seg2_idx].end].y);
-						}
-						p1[seg1_idx] = 1;
-						std::vector<bool> &p2 = mp_problems[r2_idx];
-						p2[seg2_idx] = 1;
-						num_problems++;
+				std::vector<segptr_t> crossings;
+				if(todo_idx < todo.size() && todo[todo_idx] == segptr_t(r1_idx, seg1_idx)) {
+					crossings.swap(job.crossings[todo_idx++]);
+				} else {
+					crossings = find_crossings(mpoly, reduced_rings, bsp, r1_idx, seg1_idx, false);
+				}
+
+				BOOST_FOREACH(const segptr_t &c2_seg, crossings) {
+					size_t r2_idx = c2_seg.first;
+					size_t seg2_idx = c2_seg.second;
+					if(VERBOSE) {
+						const Ring &c2 = mpoly.rings[r2_idx];
+						const ReducedRing &r2 = reduced_rings[r2_idx];
+						printf("found a crossing (still): %zd,%zd,%zd,%zd (%f,%f)-(%f,%f) (%f,%f)-(%f,%f)\n",
+							r1_idx, seg1_idx, r2_idx, seg2_idx,
+							c1.pts[r1.segs[seg1_idx].begin].x,
+							c1.pts[r1.segs[seg1_idx].begin].y,
+							c1.pts[r1.segs[seg1_idx].end].x,
+							c1.pts[r1.segs[seg1_idx].end].y,
+							c2.pts[r2.segs[seg2_idx].begin].x,
+							c2.pts[r2.segs[seg2_idx].begin].y,
+							c2.pts[r2.segs[seg2_idx].end].x,
+							c2.pts[r2.segs[seg2_idx].end].y);
 					}
+					p1[seg1_idx] = 1;
+					std::vector<bool> &p2 = mp_problems[r2_idx];
+					p2[seg2_idx] = 1;
+					num_problems++;
 				} // ring2/seg2 loop
 			} // seg1 loop
 		} // ring1 loop
+		assert(todo_idx == todo.size());
 
 		progress += (1.0-progress)/2;
 	} // while problems
 
-	GDALTermProgress(1, NULL, NULL);
+	if(show_progress) report_progress(1);
 
 	if(num_problems) {
-		printf("WARNING: Could not fix all topology problems.\n  Please inspect output shapefile manually.\n");
+		report_message("WARNING: Could not fix all topology problems.\n  Please inspect output shapefile manually.\n");
 	}
 }
 
@@ -54,9 +54,14 @@ struct ReducedRing {
 	std::vector<segment_t> segs;
 };
 
-Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance);
+// Rings are reduced, and crossings between the reduced rings are found, using num_threads
+// threads.  The result doesn't depend on the number of threads.  With show_progress false
+// nothing is printed other than warnings.
+Mpoly compute_reduced_pointset(const Mpoly &in_mpoly, double tolerance, size_t num_threads=1,
+	bool show_progress=true);
 ReducedRing compute_reduced_ring(const Ring &orig_string, double res);
-void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings);
+void fix_topology(const Mpoly &mpoly, std::vector<ReducedRing> &reduced_rings,
+	size_t num_threads=1, bool show_progress=true);
 Mpoly reduction_to_mpoly(const Mpoly &in_mpoly, const std::vector<ReducedRing> &reduced_rings);
 
 } // namespace dangdal
@@ -27,6 +27,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <limits>
+#include <map>
+#include <algorithm>
 #include <cassert>
 
 #include "common.h"
@@ -528,28 +530,204 @@ static Ring pinch_ring_excursions(const Ring &ring_in) {
 	return outring;
 }
 
-static OGRGeometryH ring_to_ogrpoly(const Ring &r) {
-	OGRGeometryH ogr = OGR_G_CreateGeometry(wkbPolygon);
-	OGR_G_AddGeometry(ogr, ring_to_ogr(r));
-	return ogr;
+// A point where the boundary of the other ring meets an edge, along with its
+// position along the edge (0 to 1).
+struct EdgeCut {
+	EdgeCut(double _t, Vertex _v) : t(_t), v(_v) { }
+	bool operator<(const EdgeCut &other) const { return t < other.t; }
+
+	double t;
+	Vertex v;
+};
+
+typedef std::vector<std::vector<EdgeCut> > EdgeCuts;
+
+struct VertexLess {
+	bool operator()(const Vertex &a, const Vertex &b) const {
+		return a.x < b.x || (a.x == b.x && a.y < b.y);
+	}
+};
+
+// Cuts segment a-b at v, if v lies strictly inside it.  The points must be
+// collinear.
+static void cut_collinear(Vertex a, Vertex b, Vertex v, std::vector<EdgeCut> &cuts) {
+	double dx = b.x - a.x;
+	double dy = b.y - a.y;
+	double t = ((v.x - a.x)*dx + (v.y - a.y)*dy) / (dx*dx + dy*dy);
+	if(t > 0 && t < 1) cuts.push_back(EdgeCut(t, v));
 }
 
-// rings must cross for this function
-static Ring ring_ring_union(const Ring &r1, const Ring &r2) {
-	OGRGeometryH og1 = ring_to_ogrpoly(r1);
-	OGRGeometryH og2 = ring_to_ogrpoly(r2);
-	OGRGeometryH og3 = OGR_G_Union(og1, og2);
-	if(!og3) fatal_error("OGR_G_Union failed");
-	OGRwkbGeometryType type = OGR_G_GetGeometryType(og3);
-	if(type == wkbPolygon) {
-		// only take outer ring
-		Ring r3 = ogr_to_ring(OGR_G_GetGeometryRef(og3, 0));
-		r3.is_hole = 0;
-		r3.parent_id = 0;
-		return r3;
-	} else {
-		fatal_error("result of ring union wasn't a wkbPolygon");
+// Records where segments p1-p2 and q1-q2 meet.  Where a segment is cut at an
+// endpoint of the other segment the exact endpoint coordinates are used, so that
+// both rings see the same node.
+static void cut_edges(
+	Vertex p1, Vertex p2, Vertex q1, Vertex q2,
+	std::vector<EdgeCut> &p_cuts, std::vector<EdgeCut> &q_cuts
+) {
+	double rx = p2.x - p1.x, ry = p2.y - p1.y;
+	double sx = q2.x - q1.x, sy = q2.y - q1.y;
+	double qpx = q1.x - p1.x, qpy = q1.y - p1.y;
+	double denom = rx*sy - ry*sx;
+	double numer_t = qpx*sy - qpy*sx;
+	double numer_u = qpx*ry - qpy*rx;
+
+	if(denom == 0) {
+		if(numer_u != 0) return; // parallel
+		// collinear, each segment is cut by the endpoints of the other
+		cut_collinear(p1, p2, q1, p_cuts);
+		cut_collinear(p1, p2, q2, p_cuts);
+		cut_collinear(q1, q2, p1, q_cuts);
+		cut_collinear(q1, q2, p2, q_cuts);
+		return;
 	}
+
+	double t = numer_t / denom;
+	double u = numer_u / denom;
+	if(t < 0 || t > 1 || u < 0 || u > 1) return;
+	Vertex v =
+		t == 0 ? p1 : t == 1 ? p2 :
+		u == 0 ? q1 : u == 1 ? q2 :
+		Vertex(p1.x + t*rx, p1.y + t*ry);
+	p_cuts.push_back(EdgeCut(t, v));
+	q_cuts.push_back(EdgeCut(u, v));
+}
+
+static Bbox edge_bbox(Vertex a, Vertex b) {
+	return Bbox(
+		std::min(a.x, b.x), std::max(a.x, b.x),
+		std::min(a.y, b.y), std::max(a.y, b.y));
+}
+
+static void find_edge_cuts(const Ring &r1, const Ring &r2, EdgeCuts &cuts1, EdgeCuts &cuts2) {
+	size_t n1 = r1.pts.size();
+	size_t n2 = r2.pts.size();
+	cuts1.assign(n1, std::vector<EdgeCut>());
+	cuts2.assign(n2, std::vector<EdgeCut>());
+
+	std::vector<std::pair<Bbox, size_t> > edges2(n2);
+	for(size_t i=0; i<n2; i++) {
+		edges2[i] = std::make_pair(edge_bbox(r2.pts[i], r2.pts[(i+1)%n2]), i);
+	}
+	BboxTree<size_t> tree2(edges2);
+
+	std::vector<size_t> hits;
+	for(size_t i=0; i<n1; i++) {
+		Vertex p1 = r1.pts[i];
+		Vertex p2 = r1.pts[(i+1)%n1];
+		hits.clear();
+		tree2.get_intersecting_items(edge_bbox(p1, p2), hits);
+		for(size_t k=0; k<hits.size(); k++) {
+			size_t j = hits[k];
+			cut_edges(p1, p2, r2.pts[j], r2.pts[(j+1)%n2], cuts1[i], cuts2[j]);
+		}
+	}
+}
+
+class RingGraph {
+public:
+	RingGraph() : num_edges(0) { }
+
+	// Adds the ring, with its edges cut at the given points, to the graph.
+	void addRing(const Ring &ring, EdgeCuts &cuts) {
+		size_t npts = ring.pts.size();
+		std::vector<size_t> seq;
+		for(size_t i=0; i<npts; i++) {
+			seq.push_back(getNode(ring.pts[i]));
+			std::sort(cuts[i].begin(), cuts[i].end());
+			for(size_t k=0; k<cuts[i].size(); k++) {
+				seq.push_back(getNode(cuts[i][k].v));
+			}
+		}
+		for(size_t i=0; i<seq.size(); i++) {
+			addEdge(seq[i], seq[(i+1)%seq.size()]);
+		}
+	}
+
+	// Traces the outer boundary counterclockwise.  Starting at the bottom-left
+	// node, which must be on the outer boundary, the walk always takes the
+	// rightmost turn so that everything stays on its left.
+	Ring traceOuter() const {
+		size_t start = 0;
+		for(size_t i=1; i<nodes.size(); i++) {
+			const Vertex &v = nodes[i];
+			const Vertex &s = nodes[start];
+			if(v.y < s.y || (v.y == s.y && v.x < s.x)) start = i;
+		}
+
+		Ring out;
+		size_t cur = start;
+		size_t first_next = 0;
+		// pretend to have arrived from the west, since nothing lies below start
+		double back_ang = M_PI;
+		for(size_t step=0; ; step++) {
+			if(step > 2*num_edges) fatal_error("could not trace outline of ring union");
+
+			const std::vector<size_t> &adj = neighbors[cur];
+			size_t best = cur;
+			double best_turn = 0;
+			for(size_t k=0; k<adj.size(); k++) {
+				double turn = seg_ang(nodes[cur], nodes[adj[k]]) - back_ang;
+				while(turn <= 0) turn += 2.0 * M_PI;
+				while(turn > 2.0 * M_PI) turn -= 2.0 * M_PI;
+				if(best == cur || turn < best_turn) {
+					best = adj[k];
+					best_turn = turn;
+				}
+			}
+			if(best == cur) fatal_error("isolated node in ring union");
+
+			if(step == 0) {
+				first_next = best;
+			} else if(cur == start && best == first_next) {
+				break;
+			}
+			out.pts.push_back(nodes[cur]);
+			back_ang = seg_ang(nodes[best], nodes[cur]);
+			cur = best;
+		}
+		return out;
+	}
+
+private:
+	size_t getNode(Vertex v) {
+		std::pair<std::map<Vertex, size_t, VertexLess>::iterator, bool> ins =
+			node_ids.insert(std::make_pair(v, nodes.size()));
+		if(ins.second) {
+			nodes.push_back(v);
+			neighbors.push_back(std::vector<size_t>());
+		}
+		return ins.first->second;
+	}
+
+	void addEdge(size_t a, size_t b) {
+		if(a == b) return;
+		std::vector<size_t> &adj = neighbors[a];
+		if(std::find(adj.begin(), adj.end(), b) != adj.end()) return;
+		adj.push_back(b);
+		neighbors[b].push_back(a);
+		num_edges++;
+	}
+
+	std::map<Vertex, size_t, VertexLess> node_ids;
+	std::vector<Vertex> nodes;
+	std::vector<std::vector<size_t> > neighbors;
+	size_t num_edges;
+};
+
+// Returns the outer boundary of the union of two rings.  Rings must cross for
+// this function.
+static Ring ring_ring_union(const Ring &r1, const Ring &r2) {
+	EdgeCuts cuts1, cuts2;
+	find_edge_cuts(r1, r2, cuts1, cuts2);
+
+	RingGraph graph;
+	graph.addRing(r1, cuts1);
+	graph.addRing(r2, cuts2);
+
+	Ring r3 = graph.traceOuter();
+	r3.is_hole = 0;
+	r3.parent_id = -1;
+	return r3;
 }
 
 Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
@@ -562,6 +740,9 @@ Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
 		if(mp_in.rings[r_idx].is_hole) fatal_error("pincher cannot be used on holes");
 		mp_out.rings[r_idx] = pinch_ring_excursions(mp_in.rings[r_idx]);
 	}
+	// kept in sync with mp_out.rings, so that most pairs are rejected without
+	// looking at the rings
+	std::vector<Bbox> bboxes = mp_out.getRingBboxes();
 	for(size_t r1_idx=0; r1_idx<mp_out.rings.size(); r1_idx++) {
 		REDO_R1:
 		if(r1_idx >= mp_out.rings.size()) break;
@@ -570,6 +751,8 @@ Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
 			REDO_R2:
 			if(r2_idx >= mp_out.rings.size()) break;
 
+			if(is_disjoint(bboxes[r1_idx], bboxes[r2_idx])) continue;
+
 			RingRelation rel = ring_ring_relation(mp_out.rings[r1_idx], mp_out.rings[r2_idx]);
 //printf("relation of %zd and %zd is %zd\n", r1_idx, r2_idx, rel);
 			if(rel == RINGREL_CONTAINS) {
@@ -578,6 +761,7 @@ Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
 				//	dbuf->debugPlotRing(mp_out.rings[r2_idx], 0, 0, 128);
 				//}
 				mp_out.deleteRing(r2_idx);
+				bboxes.erase(bboxes.begin() + r2_idx);
 				goto REDO_R2; // indexes shifted - reset loop
 			} else if(rel == RINGREL_CONTAINED_BY) {
 //printf("deleting %zd\n", r1_idx);
@@ -585,6 +769,7 @@ Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
 				//	dbuf->debugPlotRing(mp_out.rings[r1_idx], 0, 0, 128);
 				//}
 				mp_out.deleteRing(r1_idx);
+				bboxes.erase(bboxes.begin() + r1_idx);
 				goto REDO_R1; // indexes shifted - reset loop
 			} else if(rel == RINGREL_CROSSES) {
 //printf("merging %zd and %zd\n", r1_idx, r2_idx);
@@ -594,7 +779,9 @@ Mpoly pinch_excursions2(const Mpoly &mp_in, DebugPlot *dbuf) {
 				//	dbuf->debugPlotRing(mp_out.rings[r2_idx], 0, 0, 128);
 				//}
 				mp_out.deleteRing(r2_idx);
-				mp_out.rings[r1_idx] = r3;
+				bboxes.erase(bboxes.begin() + r2_idx);
+				mp_out.rings[r1_idx].swap(r3);
+				bboxes[r1_idx] = mp_out.rings[r1_idx].getBbox();
 				//if(dbuf && dbuf->mode == PLOT_PINCH) {
 				//	dbuf->debugPlotRing(mp_out.rings[r1_idx], 255, 128, 0);
 				//}
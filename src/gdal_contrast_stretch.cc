@@ -27,12 +27,17 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <cassert>
+#include <sys/stat.h>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/numeric/conversion/cast.hpp>
+#include <boost/thread.hpp>
 
 #include "common.h"
+#include "batch.h"
 #include "ndv.h"
+#include "block_reader.h"
+#include "overview_builder.h"
 
 using namespace dangdal;
 
@@ -67,7 +72,8 @@ struct Binning {
 struct Histogram {
 	Histogram() :
 		min(0), max(0), mean(0), stddev(0),
-		data_count(0), ndv_count(0)
+		data_count(0), ndv_count(0),
+		mean_error(0), percentile_error(0)
 	{ }
 
 	Binning binning;
@@ -75,16 +81,226 @@ struct Histogram {
 	size_t data_count;
 	size_t ndv_count;
 	std::vector<size_t> counts;
+	// For statistics taken from a sample of the input, 95% confidence bounds
+	// on the error of the mean and of any percentile (as a fraction).  Zero
+	// if the whole input was used.
+	double mean_error, percentile_error;
 };
 
-std::vector<std::pair<double, double> > compute_minmax(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h
-);
+// A compromise between memory usage and datavalue resolution.  Adaptive
+// histograms end up with between half of this and this many bins.  There is
+// one of these per band, shared by the workers.
+static const size_t ADAPTIVE_MAX_BINS = 1<<24;
+
+// Number of bins each worker gathers counts in before handing them to the
+// shared histogram (see WorkerBins).
+static const size_t WORKER_MAX_BINS = 1<<16;
+
+// A histogram that doesn't need the data range to be known up front, so that
+// statistics can be gathered in a single pass.  Bins are 'scale' wide, where
+// scale is a power of two, and bin k holds values in [k*scale, (k+1)*scale).
+// When values arrive that would need more than max_bins bins, adjacent pairs
+// of bins are merged and scale is doubled.
+//
+// The final scale is the smallest one that fits the whole data range (and is
+// at least min_scale), no matter what order the values came in.  So partial
+// histograms of parts of the data can be merged and give the same result as a
+// single histogram over all of it.
+class AdaptiveHistogram {
+public:
+	// min_scale is the narrowest bin to use (1 for integer data, 0 for
+	// floating point).
+	AdaptiveHistogram(double _min_scale, size_t _max_bins) :
+		min_scale(_min_scale), max_bins(_max_bins),
+		scale(0), inv_scale(0),
+		pending_val(0), pending_count(0),
+		first_key(0), lo_key(0), hi_key(-1)
+	{ }
+
+	// Make room for finite values in [lo, hi].  Must be called before add().
+	void reserve(double lo, double hi);
+
+	// v must be finite and within a range passed to reserve().
+	void add(double v) {
+		if(!scale) {
+			assert(v == pending_val);
+			pending_count++;
+		} else {
+			add_to_bin(key(v), 1);
+		}
+	}
+
+	// Adds counts[i] to the bin holding the values of bin first+i of a
+	// histogram with the given bin width, which must be a power of two no
+	// wider than the current scale.
+	void add_bins(double bin_scale, int64_t first, const uint32_t *bin_counts, size_t n);
+
+	// The occupied bins, as a Binning whose bin centers are the centers of
+	// the values each bin can hold.
+	void get_histogram(Binning &binning, std::vector<size_t> &counts_out) const;
+
+	// zero until two different values have been reserved
+	double get_scale() const { return scale; }
+	int64_t key(double v) const { return int64_t(floor(v * inv_scale)); }
+
+private:
+	bool empty() const { return hi_key < lo_key; }
+	void set_scale(double s) { scale = s; inv_scale = 1.0 / s; }
+	void add_to_bin(int64_t k, size_t cnt) {
+		assert(k >= first_key && k < first_key + int64_t(counts.size()));
+		counts[k - first_key] += cnt;
+		if(empty()) lo_key = hi_key = k;
+		else if(k < lo_key) lo_key = k;
+		else if(k > hi_key) hi_key = k;
+	}
+	void merge_pairs();
+
+	double min_scale;
+	size_t max_bins;
+	// zero until two different values have been seen
+	double scale, inv_scale;
+	// Until then, the only value seen and how many times.  Picking a scale
+	// from a single value would make the final scale depend on which value
+	// came first.
+	double pending_val;
+	size_t pending_count;
+	// counts[i] is bin first_key+i.  Bins lo_key..hi_key are the occupied ones.
+	int64_t first_key;
+	int64_t lo_key, hi_key;
+	std::vector<size_t> counts;
+};
+
+// Smallest power of two that is >= x (x must be positive).
+static double pow2_at_least(double x) {
+	int e;
+	double m = frexp(x, &e);
+	return m == 0.5 ? x : ldexp(1.0, e);
+}
+
+void AdaptiveHistogram::reserve(double lo, double hi) {
+	if(!scale) {
+		if(pending_count) {
+			lo = std::min(lo, pending_val);
+			hi = std::max(hi, pending_val);
+		}
+		if(lo == hi) {
+			pending_val = lo;
+			return;
+		}
+		// This is never more than the final scale, since the range can only
+		// grow from here.
+		set_scale(std::max(pow2_at_least((hi - lo) / double(max_bins)), min_scale));
+	}
+
+	for(;;) {
+		double new_lo = floor(lo * inv_scale);
+		double new_hi = floor(hi * inv_scale);
+		if(!empty()) {
+			new_lo = std::min(new_lo, double(lo_key));
+			new_hi = std::max(new_hi, double(hi_key));
+		}
+		// The second test keeps keys small enough that key*scale is exact.
+		if(new_hi - new_lo + 1 <= double(max_bins) &&
+			std::max(fabs(new_lo), fabs(new_hi)) < ldexp(1.0, 52)
+		) break;
+		merge_pairs();
+	}
+
+	int64_t need_lo = key(lo);
+	int64_t need_hi = key(hi);
+	if(!empty()) {
+		need_lo = std::min(need_lo, lo_key);
+		need_hi = std::max(need_hi, hi_key);
+	}
+	if(need_lo < first_key || need_hi >= first_key + int64_t(counts.size())) {
+		// Grow with some slack, toward the side that ran out, so that data
+		// that slowly widens its range doesn't cause a reallocation for every
+		// block.
+		size_t span = size_t(need_hi - need_lo + 1);
+		size_t alloc = std::min(max_bins, std::max(span, 2*counts.size()));
+		int64_t new_first = (need_lo < first_key) ?
+			need_hi - int64_t(alloc) + 1 : need_lo;
+		std::vector<size_t> new_counts(alloc, 0);
+		for(int64_t k=lo_key; k<=hi_key; k++) {
+			new_counts[k - new_first] = counts[k - first_key];
+		}
+		counts.swap(new_counts);
+		first_key = new_first;
+	}
+
+	if(pending_count) {
+		add_to_bin(key(pending_val), pending_count);
+		pending_count = 0;
+	}
+}
+
+void AdaptiveHistogram::merge_pairs() {
+	set_scale(scale * 2);
+	if(empty()) return;
+
+	// Arithmetic shift, so that keys are floored for negative values too.
+	int64_t new_lo = lo_key >> 1;
+	int64_t new_hi = hi_key >> 1;
+	std::vector<size_t> new_counts(size_t(new_hi - new_lo + 1), 0);
+	for(int64_t k=lo_key; k<=hi_key; k++) {
+		new_counts[(k >> 1) - new_lo] += counts[k - first_key];
+	}
+	counts.swap(new_counts);
+	first_key = lo_key = new_lo;
+	hi_key = new_hi;
+}
+
+void AdaptiveHistogram::add_bins(
+	double bin_scale, int64_t first, const uint32_t *bin_counts, size_t n
+) {
+	if(!n) return;
+	assert(scale && bin_scale <= scale);
+	// The left edge of each of the given bins falls in the bin of ours that
+	// holds it.
+	reserve(double(first) * bin_scale, double(first + int64_t(n) - 1) * bin_scale);
+	for(size_t i=0; i<n; i++) {
+		if(bin_counts[i]) add_to_bin(key(double(first + int64_t(i)) * bin_scale), bin_counts[i]);
+	}
+}
+
+void AdaptiveHistogram::get_histogram(Binning &binning, std::vector<size_t> &counts_out) const {
+	if(!scale) {
+		binning.nbins = 1;
+		binning.offset = pending_val;
+		binning.scale = 1;
+		counts_out.assign(1, pending_count);
+		return;
+	}
+	binning.nbins = int(hi_key - lo_key + 1);
+	binning.scale = scale;
+	// An integer bin that is 'scale' wide holds the values k*scale ..
+	// k*scale+scale-1, so its center is not the same as for floating point.
+	double quantum = min_scale ? 1 : 0;
+	binning.offset = double(lo_key) * scale + (scale - quantum) / 2.0;
+	counts_out.assign(
+		counts.begin() + (lo_key - first_key),
+		counts.begin() + (hi_key - first_key + 1));
+}
+
+// Bands whose binning has nbins==0 get a binning chosen to fit their data,
+// which is returned in Histogram::binning.
+// Only one window in sample_step is read if sample_step > 1.
 std::vector<Histogram> compute_histogram(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h, const std::vector<Binning> &binnings
+	GDALDatasetH src_ds, const std::vector<size_t> &bandlist, const NdvDef &ndv_def,
+	const std::vector<Binning> &binnings, size_t num_threads, size_t sample_step
+);
+std::vector<Histogram> compute_histogram_from_overview(
+	GDALDatasetH src_ds, const std::vector<size_t> &bandlist, const NdvDef &ndv_def,
+	const std::vector<Binning> &binnings, size_t num_threads
 );
+std::string stats_cache_key(
+	const std::string &src_fn, GDALDatasetH src_ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const std::string &sampling
+);
+bool read_stats_cache(const std::string &fn, const std::string &key,
+	std::vector<Histogram> &histograms_out);
+void write_stats_cache(const std::string &fn, const std::string &key,
+	const std::vector<Histogram> &histograms);
 void get_scale_from_percentile(
 	const Histogram &histogram, int output_range,
 	double from_percentile, double to_percentile,
@@ -94,11 +310,77 @@ std::vector<uint8_t> invert_histogram_to_gaussian(const Histogram &histogram_in,
 	int output_range);
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds);
 
+// How valid pixels are mapped to output values: either through a table indexed
+// by bin, or by a linear stretch.
+struct StretchParams {
+	StretchParams(const Binning &_binning, const std::vector<uint8_t> &_table) :
+		use_table(true), binning(_binning), table(&_table), scale(0), offset(0) { }
+	StretchParams(double _scale, double _offset) :
+		use_table(false), table(NULL), scale(_scale), offset(_offset) { }
+
+	bool use_table;
+	Binning binning;
+	const std::vector<uint8_t> *table;
+	double scale, offset;
+};
+
+std::vector<uint8_t> build_direct_lut(GDALDataType dt, const StretchParams &params,
+	int output_range, uint8_t out_ndv);
+
+// lut is indexed by the raw value plus index_offset.
+template <typename T>
+void apply_direct_lut(
+	const T *p_in, int index_offset, const uint8_t *lut,
+	const uint8_t *p_ndv, uint8_t out_ndv, uint8_t *p_out, size_t num_pixels
+) {
+	for(size_t i=0; i<num_pixels; i++) {
+		p_out[i] = p_ndv[i] ? out_ndv : lut[int(p_in[i]) + index_offset];
+	}
+}
+
+void apply_binned_table(
+	const double *p_in, const Binning &binning, const uint8_t *xform,
+	const uint8_t *p_ndv, uint8_t out_ndv, uint8_t *p_out, size_t num_pixels
+);
+void apply_linear(
+	const double *p_in, double scale, double offset, int output_range,
+	const uint8_t *p_ndv, uint8_t out_ndv, uint8_t *p_out, size_t num_pixels
+);
+
+// Computes the output of each window on the thread that read it.  The output
+// of band i goes into b->out at offset i*blocksize_x*blocksize_y, laid out
+// like the input window.
+class ApplyProcessor : public BlockReader::Processor {
+public:
+	ApplyProcessor(
+		const std::vector<StretchParams> &_params,
+		const std::vector<std::vector<uint8_t> > &_direct_luts,
+		int _output_range, uint8_t _out_ndv, size_t num_threads
+	) :
+		params(_params), direct_luts(_direct_luts),
+		output_range(_output_range), out_ndv(_out_ndv),
+		bufs(std::max(num_threads, size_t(1)))
+	{ }
+
+	virtual void process(const BlockReader &reader, BlockReader::Block *b, size_t worker_idx);
+
+private:
+	const std::vector<StretchParams> &params;
+	// empty for bands that don't use a direct lookup table
+	const std::vector<std::vector<uint8_t> > &direct_luts;
+	int output_range;
+	uint8_t out_ndv;
+	// scratch space for each worker
+	std::vector<std::vector<double> > bufs;
+};
+
 void usage(const std::string &cmdname) {
 	printf("Usage: %s <options> src.tif dst.tif\n\n", cmdname.c_str());
 	NdvDef::printUsage();
 	printf(
 "  -outndv <output_nodata_val>        Output no-data value\n"
+"  -threads N                         Use N threads for reading the input and\n"
+"                                     computing the output (default is 1)\n"
 "\n"
 "Operation:\n"
 "  -linear-stretch <target_avg> <target_stddev>      Linear stretch to a target range\n"
@@ -106,15 +388,33 @@ void usage(const std::string &cmdname) {
 "  -histeq <target_stddev>                           Histogram normalize to a target bell curve\n"
 "  -dump-histogram                                   Just print the histogram to console\n"
 "\n"
+"Statistics:\n"
+"  -stats-from-overview               Compute statistics from an overview rather\n"
+"                                     than from the full resolution image\n"
+"  -sample N                          Compute statistics from one in N windows\n"
+"                                     of the input\n"
+"  -stats-cache <filename>            Save the statistics to this file, and use\n"
+"                                     them on later runs if the input and the\n"
+"                                     no-data values have not changed\n"
+"\n"
+	);
+	OverviewBuilder::printUsage();
+	printf("\n");
+	BatchOpts::printUsage();
+	printf("\n");
+	StageTimer::printUsage();
+	printf(
+"\n"
 "Input can be any integer or floating type (but not complex).  Output is 8-bit.\n"
 );
 	exit(1);
 }
 
-int main(int argc, char *argv[]) {
+static int tool_main(int argc, char *argv[]) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string src_fn;
 	std::string dst_fn;
@@ -129,6 +429,12 @@ int main(int argc, char *argv[]) {
 	double from_percentile = -1;
 	double to_percentile = -1;
 	int out_ndv = 0, set_out_ndv = 0;
+	size_t num_threads = 1;
+	int stats_from_overview = 0;
+	size_t sample_step = 1;
+	std::string stats_cache_fn;
+	std::vector<int> overview_levels;
+	bool overview_average = true;
 
 	NdvDef ndv_def = NdvDef(arg_list);
 
@@ -170,6 +476,27 @@ int main(int argc, char *argv[]) {
 					if(ndv_long < 0 || ndv_long > 255) fatal_error("ndv must be in the range 0..255");
 					out_ndv = boost::numeric_cast<uint8_t>(ndv_long);
 					set_out_ndv++;
+				} else if(arg == "-stats-from-overview") {
+					stats_from_overview = 1;
+				} else if(arg == "-sample") {
+					if(argp == arg_list.size()) usage(cmdname);
+					sample_step = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!sample_step) fatal_error("-sample must be positive");
+				} else if(arg == "-stats-cache") {
+					if(argp == arg_list.size()) usage(cmdname);
+					stats_cache_fn = arg_list[argp++];
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!num_threads) fatal_error("-threads must be positive");
+				} else if(arg == "-overviews") {
+					if(argp == arg_list.size()) usage(cmdname);
+					overview_levels = OverviewBuilder::parseLevels(arg_list[argp++]);
+				} else if(arg == "-overview-resampling") {
+					if(argp == arg_list.size()) usage(cmdname);
+					if(!OverviewBuilder::parseResampling(arg_list[argp++], &overview_average)) {
+						usage(cmdname);
+					}
 				} else {
 					usage(cmdname);
 				}
@@ -192,6 +519,7 @@ int main(int argc, char *argv[]) {
 	if(src_fn.empty()) usage(cmdname);
 	if(dst_fn.empty() != (mode_dump_histogram > 0)) usage(cmdname);
 	if(mode_percentile + mode_stddev + mode_histeq + mode_dump_histogram > 1) usage(cmdname);
+	if(stats_from_overview && sample_step > 1) usage(cmdname);
 	if(mode_stddev && (dst_avg < 0 || dst_stddev < 0)) usage(cmdname);
 	if(mode_percentile && !(
 		0 <= from_percentile && 
@@ -266,9 +594,6 @@ int main(int argc, char *argv[]) {
 
 	std::vector<Binning> binnings(dst_band_count);
 	{
-		// computed on demand
-		std::vector<std::pair<double, double> > minmax;
-
 		for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
 			Binning &binning = binnings[band_idx];
 			GDALDataType dt = GDALGetRasterDataType(src_bands[band_idx]);
@@ -289,30 +614,54 @@ int main(int argc, char *argv[]) {
 					binning.scale = 1;
 					break;
 				default:
-					if(minmax.empty()) {
-						printf("Computing min/max values...\n");
-						minmax = compute_minmax(src_bands, ndv_def, w, h);
-					}
-					double min = minmax[band_idx].first;
-					double max = minmax[band_idx].second;
-					// a compromise between memory usage and datavalue resolution
-					binning.nbins = 10000000;
-					binning.offset = min;
-					binning.scale = (max - min) / double(binning.nbins-1);
+					// chosen by compute_histogram once the range is known
+					binning.nbins = 0;
 			}
 		}
 	}
 
 	//////// compute lookup table ////////
 
-	printf("\nComputing histogram...\n");
-	std::vector<Histogram> histograms =
-		compute_histogram(src_bands, ndv_def, w, h, binnings);
+	std::string sampling = stats_from_overview ? "overview" :
+		"1/" + boost::lexical_cast<std::string>(sample_step);
+	std::string stats_key;
+	std::vector<Histogram> histograms;
+	bool got_cached_stats = false;
+	if(!stats_cache_fn.empty()) {
+		stats_key = stats_cache_key(src_fn, src_ds, bandlist, ndv_def, sampling);
+		got_cached_stats = read_stats_cache(stats_cache_fn, stats_key, histograms);
+		if(got_cached_stats) {
+			if(histograms.size() != dst_band_count) fatal_error("wrong band count in stats cache");
+			printf("\nUsing statistics from %s\n", stats_cache_fn.c_str());
+		}
+	}
+	if(!got_cached_stats) {
+		printf("\nComputing histogram...\n");
+		StageTimer timer("statistics", "pixels");
+		if(stats_from_overview) {
+			histograms = compute_histogram_from_overview(src_ds, bandlist, ndv_def, binnings,
+				num_threads);
+		} else {
+			histograms = compute_histogram(src_ds, bandlist, ndv_def, binnings,
+				num_threads, sample_step);
+		}
+		if(!stats_cache_fn.empty()) write_stats_cache(stats_cache_fn, stats_key, histograms);
+		for(size_t band_idx=0; band_idx<histograms.size(); band_idx++) {
+			timer.add_items(histograms[band_idx].data_count + histograms[band_idx].ndv_count);
+		}
+	}
+	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
+		binnings[band_idx] = histograms[band_idx].binning;
+	}
 
 	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
 		Histogram &hg = histograms[band_idx];
 		printf("band %zd: min=%g, max=%g, mean=%g, stddev=%g, valid_count=%zd, ndv_count=%zd\n",
 			band_idx+1, hg.min, hg.max, hg.mean, hg.stddev, hg.data_count, hg.ndv_count);
+		if(hg.mean_error || hg.percentile_error) {
+			printf("  sampled: mean is within +/-%g and percentiles within +/-%g (95%% confidence)\n",
+				hg.mean_error, hg.percentile_error);
+		}
 		if(mode_dump_histogram) {
 			for(int i=0; i<hg.binning.nbins; i++) {
 				printf("bin %d: val=%g cnt=%zd\n",
@@ -334,6 +683,12 @@ int main(int argc, char *argv[]) {
 		dst_bands.push_back(GDALGetRasterBand(dst_ds, band_idx+1));
 	}
 
+	OverviewBuilder *overviews = NULL;
+	if(!overview_levels.empty()) {
+		overviews = new OverviewBuilder(dst_ds, overview_levels, overview_average,
+			set_out_ndv ? out_ndv : -1);
+	}
+
 	//////// compute tranformation parameters ////////
 
 	const int output_range = 256;
@@ -404,233 +759,376 @@ int main(int argc, char *argv[]) {
 
 	printf("\nComputing output...\n");
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t block_len = blocksize_x*blocksize_y;
-
-	std::vector<std::vector<double> > buf_in(dst_band_count);
-	std::vector<std::vector<uint8_t> > buf_out(dst_band_count);
+	// Byte, UInt16 and Int16 bands are mapped through a table with an entry
+	// for every possible value.  Other types are converted to double.
+	std::vector<StretchParams> stretch_params;
+	std::vector<std::vector<uint8_t> > direct_luts(dst_band_count);
 	for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-		buf_in[band_idx].resize(block_len);
-		buf_out[band_idx].resize(block_len);
+		stretch_params.push_back(use_table ?
+			StretchParams(binnings[band_idx], xform_table[band_idx]) :
+			StretchParams(lin_scales[band_idx], lin_offsets[band_idx]));
+		GDALDataType dt = GDALGetRasterDataType(src_bands[band_idx]);
+		if(dt == GDT_Byte || dt == GDT_UInt16 || dt == GDT_Int16) {
+			direct_luts[band_idx] = build_direct_lut(dt, stretch_params[band_idx],
+				output_range, out_ndv);
+		}
 	}
-	std::vector<uint8_t> ndv_mask(block_len);
-
-	for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
-
-			block_len = bsize_x*bsize_y;
-
-			double progress = 
-				((double)boff_y * (double)w +
-				(double)boff_x * (double)bsize_y) /
-				((double)w * (double)h);
-			GDALTermProgress(progress, NULL, NULL);
-
-			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-				GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_in[band_idx][0], bsize_x, bsize_y, GDT_Float64, 0, 0);
-			}
 
-			ndv_def.getNdvMask(buf_in, &ndv_mask[0], block_len);
+	{
+		// Windows are read and transformed by the reader's workers, and
+		// written here in order.
+		StageTimer timer("read_apply_write", "pixels");
+		timer.add_items(uint64_t(w) * h * dst_band_count);
+		ApplyProcessor processor(stretch_params, direct_luts,
+			output_range, out_ndv, num_threads);
+		BlockReader reader(src_ds, bandlist, &ndv_def, num_threads, &processor);
+		size_t blocksize_x = reader.blocksize_x;
+		size_t blocksize_xy = reader.blocksize_x * reader.blocksize_y;
+
+		while(BlockReader::Block *block = reader.next_block()) {
+			size_t boff_x = block->boff_x;
+			size_t boff_y = block->boff_y;
+			size_t bsize_x = block->bsize_x;
+			size_t bsize_y = block->bsize_y;
+
+			GDALTermProgress(reader.progress(block), NULL, NULL);
 
 			for(size_t band_idx=0; band_idx<dst_band_count; band_idx++) {
-				double *p_in = &buf_in[band_idx][0];
-				uint8_t *p_out = &buf_out[band_idx][0];
-				uint8_t *p_ndv = &ndv_mask[0];
-				if(use_table) {
-					uint8_t *xform = &xform_table[band_idx][0];
-					Binning binning = binnings[band_idx];
-
-					for(size_t i=0; i<block_len; i++) {
-						if(*p_ndv) {
-							*p_out = out_ndv;
-						} else {
-							*p_out = xform[binning.to_bin(*p_in)];
-							//printf("%g %d %d\n", *p_in, binning.to_bin(*p_in), *p_out);
-						}
-						p_in++; p_out++; p_ndv++;
-					}
-				} else {
-					double scale = lin_scales[band_idx];
-					double offset = lin_offsets[band_idx];
-					for(size_t i=0; i<block_len; i++) {
-						if(*p_ndv) {
-							*p_out = out_ndv;
-						} else {
-							double out_dbl = (*p_in - offset) * scale;
-							uint8_t v =
-								(out_dbl < 0) ? 0 :
-								(out_dbl > output_range-1) ? output_range-1 :
-								uint8_t(out_dbl);
-							if(v == out_ndv) {
-								if(out_ndv < output_range/2) v++;
-								else v--;
-							}
-							*p_out = v;
-						}
-						p_in++; p_out++; p_ndv++;
-					}
+				CPLErr err = GDALRasterIO(dst_bands[band_idx], GF_Write,
+					boff_x, boff_y, bsize_x, bsize_y,
+					&block->out[band_idx * blocksize_xy], bsize_x, bsize_y, GDT_Byte,
+					1, blocksize_x);
+				if(err != CE_None) fatal_error("Could not write output.");
+				if(overviews) {
+					overviews->add_block(band_idx, boff_x, boff_y, bsize_x, bsize_y,
+						&block->out[band_idx * blocksize_xy], blocksize_x);
 				}
+			}
+		}
+	}
 
-				GDALRasterIO(dst_bands[band_idx], GF_Write, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_out[band_idx][0], bsize_x, bsize_y, GDT_Byte, 0, 0);
-			} // band
-		} // block x
-	} // block y
+	if(overviews) {
+		StageTimer timer("overviews");
+		overviews->finish();
+		delete overviews;
+	}
 
 	GDALClose(src_ds);
-	GDALClose(dst_ds);
+	{
+		StageTimer timer("write");
+		GDALClose(dst_ds);
+	}
 
 	GDALTermProgress(1, NULL, NULL);
 
 	return 0;
 }
 
-std::vector<std::pair<double, double> > compute_minmax(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h
+// Copies the part of a window that lies within the image into 'out' as
+// doubles, bsize_x values per row.
+static void window_to_double(
+	const BlockReader &reader, const BlockReader::Block *b, size_t band_idx, double *out
 ) {
-	size_t band_count = src_bands.size();
-	std::vector<std::pair<double, double> > minmax(band_count);
-
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t block_len = blocksize_x*blocksize_y;
+	GDALDataType dt = reader.datatypes[band_idx];
+	int dt_size = GDALGetDataTypeSize(dt) / 8;
+	for(size_t y=0; y<b->bsize_y; y++) {
+		GDALCopyWords(b->band_buf[band_idx] + y * reader.blocksize_x * dt_size, dt, dt_size,
+			out + y * b->bsize_x, GDT_Float64, sizeof(double), int(b->bsize_x));
+	}
+}
 
-	std::vector<std::vector<double> > buf_in(band_count);
-	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-		buf_in[band_idx].resize(block_len);
+// The adaptive histograms of the bands, shared by the workers.
+struct SharedHistograms {
+	explicit SharedHistograms(const std::vector<double> &min_scales) {
+		for(size_t band_idx=0; band_idx<min_scales.size(); band_idx++) {
+			hists.push_back(AdaptiveHistogram(min_scales[band_idx], ADAPTIVE_MAX_BINS));
+		}
 	}
-	std::vector<uint8_t> ndv_mask(block_len);
 
-	std::vector<bool> got_data(band_count);
+	std::vector<AdaptiveHistogram> hists;
+	boost::mutex mutex;
+};
 
-	for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
+// Counts that one worker gathers for a shared AdaptiveHistogram, so that the
+// lock is taken once every few windows rather than once per value.  These are
+// WORKER_MAX_BINS bins at the scale that the shared histogram had when they
+// were started, which can only be finer than its final scale.  They are handed
+// over when a window doesn't fit in them, or when the scale has changed.
+// 32-bit counts are enough since they are handed over before they could
+// overflow.
+struct WorkerBins {
+	WorkerBins() : scale(0), first_key(0), lo(1), hi(0), total(0) { }
 
-			block_len = bsize_x*bsize_y;
+	double scale;
+	int64_t first_key;
+	// the occupied part of counts
+	size_t lo, hi;
+	size_t total;
+	std::vector<uint32_t> counts;
+};
 
-			double progress = 
-				((double)boff_y * (double)w +
-				(double)boff_x * (double)bsize_y) /
-				((double)w * (double)h);
-			GDALTermProgress(progress, NULL, NULL);
+// Statistics of one band, over the windows that one worker has handled.  For
+// bands without a fixed binning the histogram itself is kept in 'shared'.
+struct BandStats {
+	BandStats(const Binning &binning, AdaptiveHistogram *_shared, boost::mutex *_mutex) :
+		counts(binning.nbins, 0),
+		shared(_shared), mutex(_mutex),
+		neg_inf_count(0), pos_inf_count(0),
+		got_valid(false), min(0), max(0),
+		ndv_count(0)
+	{ }
 
-			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_in[band_idx][0], bsize_x, bsize_y, GDT_Float64, 0, 0);
-			}
+	void add_minmax(double v) {
+		if(!got_valid) {
+			min = max = v;
+			got_valid = true;
+		}
+		if(v < min) min = v;
+		if(v > max) max = v;
+	}
 
-			ndv_def.getNdvMask(buf_in, &ndv_mask[0], block_len);
-
-			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				for(size_t i=0; i<block_len; i++) {
-					if(ndv_mask[i]) continue;
-					double v = buf_in[band_idx][i];
-					if(std::isnan(v) || std::isinf(v)) continue;
-
-					assert(!minmax.empty());
-					double &min = minmax[band_idx].first;
-					double &max = minmax[band_idx].second;
-					if(!got_data[band_idx]) {
-						min = v;
-						max = v;
-						got_data[band_idx] = true;
-					}
-					if(v < min) min = v;
-					if(v > max) max = v;
-				}
-			}
+	// Adds an nx by ny window, with rows of p packed together and rows of
+	// ndv_mask ndv_stride apart.
+	void add_window(const Binning &binning, const double *p,
+		const uint8_t *ndv_mask, size_t ndv_stride, size_t nx, size_t ny);
+
+	// Hands the worker's bins over to the shared histogram.
+	void flush_bins();
+
+	void merge(const BandStats &other) {
+		for(size_t i=0; i<counts.size(); i++) counts[i] += other.counts[i];
+		neg_inf_count += other.neg_inf_count;
+		pos_inf_count += other.pos_inf_count;
+		if(other.got_valid) {
+			add_minmax(other.min);
+			add_minmax(other.max);
 		}
+		ndv_count += other.ndv_count;
+		window_sums.insert(window_sums.end(),
+			other.window_sums.begin(), other.window_sums.end());
 	}
-	GDALTermProgress(1, NULL, NULL);
 
-	return minmax;
+	// used if the band has a fixed binning
+	std::vector<size_t> counts;
+	// used otherwise
+	AdaptiveHistogram *shared;
+	boost::mutex *mutex;
+	WorkerBins bins;
+	size_t neg_inf_count, pos_inf_count;
+
+	bool got_valid;
+	double min, max;
+	size_t ndv_count;
+
+	// sum and count of the finite valid values of each window, for
+	// estimating the sampling error
+	std::vector<std::pair<double, size_t> > window_sums;
+};
+
+void BandStats::flush_bins() {
+	if(bins.lo <= bins.hi) {
+		{
+			boost::mutex::scoped_lock lock(*mutex);
+			shared->add_bins(bins.scale, bins.first_key + int64_t(bins.lo),
+				&bins.counts[bins.lo], bins.hi - bins.lo + 1);
+		}
+		std::fill(bins.counts.begin() + bins.lo, bins.counts.begin() + bins.hi + 1, 0);
+	}
+	bins.lo = 1;
+	bins.hi = 0;
+	bins.total = 0;
 }
 
-std::vector<Histogram> compute_histogram(
-	const std::vector<GDALRasterBandH> &src_bands, const NdvDef &ndv_def, 
-	size_t w, size_t h, const std::vector<Binning> &binnings
+void BandStats::add_window(const Binning &binning, const double *p_window,
+	const uint8_t *ndv_mask, size_t ndv_stride, size_t nx, size_t ny
 ) {
-	size_t band_count = src_bands.size();
-	std::vector<Histogram> histograms(band_count);
+	double sum = 0;
+	size_t num_finite = 0;
+
+	if(binning.nbins) {
+		for(size_t y=0; y<ny; y++) {
+			const double *p = p_window + y * nx;
+			const uint8_t *p_ndv = ndv_mask + y * ndv_stride;
+			for(size_t x=0; x<nx; x++) {
+				if(p_ndv[x]) {
+					ndv_count++;
+				} else {
+					double v = p[x];
+					counts[binning.to_bin(v)]++;
+					add_minmax(v);
+					if(!std::isinf(v)) {
+						sum += v;
+						num_finite++;
+					}
+				}
+			}
+		}
+		window_sums.push_back(std::make_pair(sum, num_finite));
+		return;
+	}
 
-	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-		histograms[band_idx].binning = binnings[band_idx];
-		histograms[band_idx].counts.assign(binnings[band_idx].nbins, 0);
+	bool got_finite = false;
+	double lo = 0, hi = 0;
+	for(size_t y=0; y<ny; y++) {
+		const double *p = p_window + y * nx;
+		const uint8_t *p_ndv = ndv_mask + y * ndv_stride;
+		for(size_t x=0; x<nx; x++) {
+			if(p_ndv[x]) continue;
+			double v = p[x];
+			if(std::isnan(v)) fatal_error("input has NaN values that are not no-data");
+			if(std::isinf(v)) continue;
+			if(!got_finite) {
+				lo = hi = v;
+				got_finite = true;
+			}
+			if(v < lo) lo = v;
+			if(v > hi) hi = v;
+		}
 	}
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(src_bands[0], &blocksize_x_int, &blocksize_y_int);
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t block_len = blocksize_x*blocksize_y;
+	// Values go into the worker's bins if the window fits in them at the
+	// shared scale, otherwise straight into the shared histogram, with the
+	// lock held from the reserve until they have all been added.
+	boost::mutex::scoped_lock lock(*mutex, boost::defer_lock);
+	bool use_bins = false;
+	if(got_finite) {
+		lock.lock();
+		shared->reserve(lo, hi);
+		const double scale = shared->get_scale();
+		const int64_t key_lo = shared->key(lo);
+		const int64_t key_hi = shared->key(hi);
+		const size_t span = size_t(key_hi - key_lo + 1);
+		if(scale && span <= WORKER_MAX_BINS) {
+			lock.unlock();
+			use_bins = true;
+			if(bins.scale != scale ||
+				key_lo < bins.first_key ||
+				key_hi >= bins.first_key + int64_t(WORKER_MAX_BINS) ||
+				bins.total + nx * ny > size_t(UINT32_MAX)
+			) {
+				flush_bins();
+				bins.scale = scale;
+				// centered on the window, leaving room on both sides
+				bins.first_key = key_lo - int64_t((WORKER_MAX_BINS - span) / 2);
+				if(bins.counts.empty()) bins.counts.assign(WORKER_MAX_BINS, 0);
+			}
+			bins.total += nx * ny;
+		}
+	}
 
-	std::vector<std::vector<double> > buf_in(band_count);
-	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-		buf_in[band_idx].resize(block_len);
+	const double inv_scale = use_bins ? 1.0 / bins.scale : 0;
+	for(size_t y=0; y<ny; y++) {
+		const double *p = p_window + y * nx;
+		const uint8_t *p_ndv = ndv_mask + y * ndv_stride;
+		for(size_t x=0; x<nx; x++) {
+			if(p_ndv[x]) {
+				ndv_count++;
+				continue;
+			}
+			double v = p[x];
+			if(std::isinf(v)) {
+				if(v < 0) neg_inf_count++;
+				else pos_inf_count++;
+			} else {
+				if(use_bins) {
+					size_t i = size_t(int64_t(floor(v * inv_scale)) - bins.first_key);
+					bins.counts[i]++;
+					if(bins.lo > bins.hi) bins.lo = bins.hi = i;
+					else if(i < bins.lo) bins.lo = i;
+					else if(i > bins.hi) bins.hi = i;
+				} else {
+					shared->add(v);
+				}
+				sum += v;
+				num_finite++;
+			}
+			add_minmax(v);
+		}
 	}
-	std::vector<uint8_t> ndv_mask(block_len);
+	window_sums.push_back(std::make_pair(sum, num_finite));
+}
 
-	std::vector<bool> first_valid_pixel(band_count, true);
+// Gathers statistics on the reader's workers.  Each worker has its own
+// BandStats, and these are merged once the whole input has been read, while
+// the adaptive histograms are shared (see WorkerBins).  The result doesn't
+// depend on which worker handled which window.
+class HistogramProcessor : public BlockReader::Processor {
+public:
+	HistogramProcessor(
+		const std::vector<Binning> &_binnings, SharedHistograms &shared,
+		size_t num_threads
+	) :
+		binnings(_binnings),
+		stats(std::max(num_threads, size_t(1))),
+		bufs(stats.size())
+	{
+		for(size_t i=0; i<stats.size(); i++) {
+			for(size_t band_idx=0; band_idx<binnings.size(); band_idx++) {
+				stats[i].push_back(BandStats(binnings[band_idx],
+					&shared.hists[band_idx], &shared.mutex));
+			}
+		}
+	}
 
-	for(size_t boff_y=0; boff_y<h; boff_y+=blocksize_y) {
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t boff_x=0; boff_x<w; boff_x+=blocksize_x) {
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
+	virtual void process(const BlockReader &reader, BlockReader::Block *b, size_t worker_idx);
 
-			block_len = bsize_x*bsize_y;
+	std::vector<Binning> binnings;
+	// stats[worker_idx][band_idx]
+	std::vector<std::vector<BandStats> > stats;
+	// scratch space for each worker
+	std::vector<std::vector<double> > bufs;
+};
 
-			double progress = 
-				((double)boff_y * (double)w +
-				(double)boff_x * (double)bsize_y) /
-				((double)w * (double)h);
-			GDALTermProgress(progress, NULL, NULL);
+void HistogramProcessor::process(
+	const BlockReader &reader, BlockReader::Block *b, size_t worker_idx
+) {
+	std::vector<double> &buf = bufs[worker_idx];
+	buf.resize(b->bsize_x * b->bsize_y);
 
-			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				GDALRasterIO(src_bands[band_idx], GF_Read, boff_x, boff_y, bsize_x, bsize_y, 
-					&buf_in[band_idx][0], bsize_x, bsize_y, GDT_Float64, 0, 0);
-			}
+	for(size_t band_idx=0; band_idx<binnings.size(); band_idx++) {
+		window_to_double(reader, b, band_idx, &buf[0]);
+		stats[worker_idx][band_idx].add_window(binnings[band_idx], &buf[0],
+			&b->ndv_mask[0], reader.blocksize_x, b->bsize_x, b->bsize_y);
+	}
+}
 
-			ndv_def.getNdvMask(buf_in, &ndv_mask[0], block_len);
+// bin width for the bands that don't have a fixed binning
+static std::vector<double> get_min_scales(
+	GDALDatasetH src_ds, const std::vector<size_t> &bandlist
+) {
+	std::vector<double> min_scales;
+	for(size_t band_idx=0; band_idx<bandlist.size(); band_idx++) {
+		GDALDataType dt = GDALGetRasterDataType(GDALGetRasterBand(src_ds, bandlist[band_idx]));
+		bool is_int = (dt == GDT_Int32 || dt == GDT_UInt32);
+		min_scales.push_back(is_int ? 1 : 0);
+	}
+	return min_scales;
+}
 
-			for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-				Histogram &hg = histograms[band_idx];
-				double *p = &buf_in[band_idx][0];
-				
-				for(size_t i=0; i<block_len; i++) {
-					if(ndv_mask[i]) {
-						hg.ndv_count++;
-					} else {
-						double v = p[i];
-						hg.counts[hg.binning.to_bin(v)]++;
-						if(first_valid_pixel[band_idx]) {
-							hg.min = hg.max = v;
-							first_valid_pixel[band_idx] = false;
-						}
-						if(v < hg.min) hg.min = v;
-						if(v > hg.max) hg.max = v;
-					}
-				}
-			}
+// Turns the gathered statistics into histograms, and computes the mean and
+// standard deviation.  If 'sampled' then error bounds are estimated too.
+static std::vector<Histogram> finish_histograms(
+	std::vector<BandStats> &stats, const std::vector<Binning> &binnings, bool sampled
+) {
+	size_t band_count = stats.size();
+	std::vector<Histogram> histograms(band_count);
+
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		Histogram &hg = histograms[band_idx];
+		BandStats &st = stats[band_idx];
+		hg.binning = binnings[band_idx];
+		hg.min = st.min;
+		hg.max = st.max;
+		hg.ndv_count = st.ndv_count;
+		if(hg.binning.nbins) {
+			hg.counts.swap(st.counts);
+		} else {
+			st.shared->get_histogram(hg.binning, hg.counts);
+			// same as what Binning::to_bin does with infinities
+			hg.counts.front() += st.neg_inf_count;
+			hg.counts.back() += st.pos_inf_count;
 		}
 	}
-	GDALTermProgress(1, NULL, NULL);
 
 	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
 		Histogram &hg = histograms[band_idx];
@@ -652,9 +1150,409 @@ std::vector<Histogram> compute_histogram(
 		hg.stddev = sqrt(var_accum / hg.data_count);
 	}
 
+	if(!sampled) return histograms;
+
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		Histogram &hg = histograms[band_idx];
+		const std::vector<std::pair<double, size_t> > &ws = stats[band_idx].window_sums;
+		if(!hg.data_count) continue;
+
+		// Standard error of the mean if the pixels were independent.
+		double n = double(hg.data_count);
+		double se2 = hg.stddev * hg.stddev / n;
+		// Nearby pixels are alike, so a sample of whole windows tells less
+		// than the same number of scattered pixels would.  Use the spread of
+		// the window means to estimate the standard error of a cluster
+		// sample.
+		double total_sum = 0, total_n = 0;
+		size_t k = 0;
+		for(size_t i=0; i<ws.size(); i++) {
+			if(!ws[i].second) continue;
+			total_sum += ws[i].first;
+			total_n += double(ws[i].second);
+			k++;
+		}
+		if(k >= 2) {
+			double m = total_sum / total_n;
+			double dev_accum = 0;
+			for(size_t i=0; i<ws.size(); i++) {
+				double d = ws[i].first - m * double(ws[i].second);
+				dev_accum += d * d;
+			}
+			double cluster_se2 = double(k) / double(k-1) * dev_accum / (total_n * total_n);
+			se2 = std::max(se2, cluster_se2);
+		}
+		// The effective number of independent samples, for the
+		// Dvoretzky-Kiefer-Wolfowitz bound on the error of the CDF.
+		double n_eff = (se2 > 0) ? std::min(n, hg.stddev * hg.stddev / se2) : n;
+		hg.mean_error = 1.96 * sqrt(se2);
+		hg.percentile_error = std::min(1.0, sqrt(log(2.0 / 0.05) / (2.0 * n_eff)));
+	}
+
 	return histograms;
 }
 
+std::vector<Histogram> compute_histogram(
+	GDALDatasetH src_ds, const std::vector<size_t> &bandlist, const NdvDef &ndv_def,
+	const std::vector<Binning> &binnings, size_t num_threads, size_t sample_step
+) {
+	size_t band_count = bandlist.size();
+
+	SharedHistograms shared(get_min_scales(src_ds, bandlist));
+	HistogramProcessor processor(binnings, shared, num_threads);
+	{
+		BlockReader reader(src_ds, bandlist, &ndv_def, num_threads, &processor, sample_step);
+		while(BlockReader::Block *block = reader.next_block()) {
+			GDALTermProgress(reader.progress(block), NULL, NULL);
+		}
+	}
+	GDALTermProgress(1, NULL, NULL);
+
+	// Merge in a fixed order.  The counts are the same in any order, but this
+	// keeps everything else reproducible too.
+	std::vector<BandStats> &total = processor.stats[0];
+	for(size_t i=0; i<processor.stats.size(); i++) {
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			processor.stats[i][band_idx].flush_bins();
+			if(i) total[band_idx].merge(processor.stats[i][band_idx]);
+		}
+	}
+
+	return finish_histograms(total, binnings, sample_step > 1);
+}
+
+// Overviews smaller than this are only used if there is nothing bigger.
+static const size_t STATS_MIN_OVERVIEW_PIXELS = 1<<20;
+
+// The smallest overview with at least STATS_MIN_OVERVIEW_PIXELS pixels, or
+// the biggest one if none are that big.  Returns -1 if there are no
+// overviews.
+static int pick_stats_overview(GDALRasterBandH band) {
+	int best = -1;
+	size_t best_pixels = 0;
+	for(int i=0; i<GDALGetOverviewCount(band); i++) {
+		GDALRasterBandH ovr = GDALGetOverview(band, i);
+		size_t pixels = size_t(GDALGetRasterBandXSize(ovr)) * size_t(GDALGetRasterBandYSize(ovr));
+		bool better;
+		if(best < 0) {
+			better = true;
+		} else if(best_pixels < STATS_MIN_OVERVIEW_PIXELS) {
+			better = pixels > best_pixels;
+		} else {
+			better = pixels >= STATS_MIN_OVERVIEW_PIXELS && pixels < best_pixels;
+		}
+		if(better) {
+			best = i;
+			best_pixels = pixels;
+		}
+	}
+	return best;
+}
+
+std::vector<Histogram> compute_histogram_from_overview(
+	GDALDatasetH src_ds, const std::vector<size_t> &bandlist, const NdvDef &ndv_def,
+	const std::vector<Binning> &binnings, size_t num_threads
+) {
+	size_t band_count = bandlist.size();
+	std::vector<GDALRasterBandH> src_bands;
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		src_bands.push_back(GDALGetRasterBand(src_ds, bandlist[band_idx]));
+	}
+
+	int level = pick_stats_overview(src_bands[0]);
+	if(level < 0) {
+		printf("Input has no overviews, using the full resolution image.\n");
+		return compute_histogram(src_ds, bandlist, ndv_def, binnings, num_threads, 1);
+	}
+
+	std::vector<GDALRasterBandH> ovr_bands;
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		GDALRasterBandH ovr = (level < GDALGetOverviewCount(src_bands[band_idx])) ?
+			GDALGetOverview(src_bands[band_idx], level) : NULL;
+		if(!ovr) fatal_error("band %zd is missing overview %d", band_idx+1, level+1);
+		ovr_bands.push_back(ovr);
+	}
+	size_t ow = GDALGetRasterBandXSize(ovr_bands[0]);
+	size_t oh = GDALGetRasterBandYSize(ovr_bands[0]);
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		if(size_t(GDALGetRasterBandXSize(ovr_bands[band_idx])) != ow ||
+			size_t(GDALGetRasterBandYSize(ovr_bands[band_idx])) != oh
+		) fatal_error("overviews of the bands are not all the same size");
+	}
+	printf("Using overview %d (%zd x %zd).\n", level+1, ow, oh);
+
+	SharedHistograms shared(get_min_scales(src_ds, bandlist));
+	std::vector<BandStats> stats;
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+		stats.push_back(BandStats(binnings[band_idx], &shared.hists[band_idx], &shared.mutex));
+	}
+
+	// Read a strip of rows at a time, each strip being a window for the
+	// sampling error estimate.
+	const size_t strip_rows = std::max(size_t(1), STATS_MIN_OVERVIEW_PIXELS / 16 / ow);
+	std::vector<std::vector<double> > buf(band_count,
+		std::vector<double>(ow * strip_rows));
+	std::vector<uint8_t> ndv_mask(ow * strip_rows);
+
+	for(size_t y0=0; y0<oh; y0+=strip_rows) {
+		GDALTermProgress(double(y0) / oh, NULL, NULL);
+		size_t ny = std::min(strip_rows, oh - y0);
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			CPLErr err = GDALRasterIO(ovr_bands[band_idx], GF_Read, 0, y0, ow, ny,
+				&buf[band_idx][0], ow, ny, GDT_Float64, 0, 0);
+			if(err != CE_None) fatal_error("Could not read overview.");
+		}
+		ndv_def.getNdvMask(buf, &ndv_mask[0], ow * ny);
+		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
+			stats[band_idx].add_window(binnings[band_idx], &buf[band_idx][0],
+				&ndv_mask[0], ow, ow, ny);
+		}
+	}
+	GDALTermProgress(1, NULL, NULL);
+
+	for(size_t band_idx=0; band_idx<band_count; band_idx++) stats[band_idx].flush_bins();
+	return finish_histograms(stats, binnings, true);
+}
+
+// Identifies the source file, the bands and the NDV definition that a set of
+// histograms was computed for.
+std::string stats_cache_key(
+	const std::string &src_fn, GDALDatasetH src_ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, const std::string &sampling
+) {
+	std::string key = "src=" + src_fn;
+	char buf[1000];
+
+	struct stat st;
+	if(stat(src_fn.c_str(), &st)) fatal_error("cannot stat %s", src_fn.c_str());
+	snprintf(buf, sizeof(buf), " size=%lld mtime=%lld",
+		(long long)st.st_size, (long long)st.st_mtime);
+	key += buf;
+
+	key += " bands=";
+	for(size_t band_idx=0; band_idx<bandlist.size(); band_idx++) {
+		GDALDataType dt = GDALGetRasterDataType(GDALGetRasterBand(src_ds, bandlist[band_idx]));
+		snprintf(buf, sizeof(buf), "%s%zd:%s", band_idx ? "," : "",
+			bandlist[band_idx], GDALGetDataTypeName(dt));
+		key += buf;
+	}
+
+	key += ndv_def.isInvert() ? " valid=" : " ndv=";
+	for(size_t i=0; i<ndv_def.slabs.size(); i++) {
+		const std::vector<NdvInterval> &ranges = ndv_def.slabs[i].range_by_band;
+		key += i ? ";" : "";
+		for(size_t j=0; j<ranges.size(); j++) {
+			snprintf(buf, sizeof(buf), "%s%.17g..%.17g", j ? "," : "",
+				ranges[j].first, ranges[j].second);
+			key += buf;
+		}
+	}
+
+	key += " sampling=" + sampling;
+	return key;
+}
+
+static const char *STATS_CACHE_MAGIC = "dangdal-contrast-stretch-stats 1";
+
+// Returns false if the file doesn't exist, can't be parsed, or is for a
+// different key.
+bool read_stats_cache(const std::string &fn, const std::string &key,
+	std::vector<Histogram> &histograms_out
+) {
+	FILE *fh = fopen(fn.c_str(), "r");
+	if(!fh) return false;
+
+	std::vector<Histogram> histograms;
+	bool ok = true;
+	std::string line;
+	for(int line_num=0; ok && line_num<2; line_num++) {
+		line.clear();
+		int c;
+		while((c = fgetc(fh)) != EOF && c != '\n') line += char(c);
+		ok = (line == (line_num ? "key " + key : std::string(STATS_CACHE_MAGIC)));
+	}
+
+	size_t band_count = 0;
+	ok = ok && fscanf(fh, "bands %zd\n", &band_count) == 1;
+	for(size_t band_idx=0; ok && band_idx<band_count; band_idx++) {
+		Histogram hg;
+		size_t num_nonzero;
+		ok = fscanf(fh, "band %d %lf %lf %lf %lf %lf %lf %lf %lf %zd %zd %zd\n",
+			&hg.binning.nbins, &hg.binning.offset, &hg.binning.scale,
+			&hg.min, &hg.max, &hg.mean, &hg.stddev,
+			&hg.mean_error, &hg.percentile_error,
+			&hg.data_count, &hg.ndv_count, &num_nonzero) == 12 && hg.binning.nbins > 0;
+		if(ok) hg.counts.assign(hg.binning.nbins, 0);
+		for(size_t i=0; ok && i<num_nonzero; i++) {
+			int bin;
+			size_t cnt;
+			ok = fscanf(fh, "%d %zd\n", &bin, &cnt) == 2 && bin >= 0 && bin < hg.binning.nbins;
+			if(ok) hg.counts[bin] = cnt;
+		}
+		histograms.push_back(hg);
+	}
+	fclose(fh);
+
+	if(!ok) {
+		printf("Statistics in %s are not for this input, recomputing.\n", fn.c_str());
+		return false;
+	}
+	histograms_out.swap(histograms);
+	return true;
+}
+
+void write_stats_cache(const std::string &fn, const std::string &key,
+	const std::vector<Histogram> &histograms
+) {
+	FILE *fh = fopen(fn.c_str(), "w");
+	if(!fh) fatal_error("cannot write statistics to %s", fn.c_str());
+
+	fprintf(fh, "%s\nkey %s\nbands %zd\n", STATS_CACHE_MAGIC, key.c_str(), histograms.size());
+	for(size_t band_idx=0; band_idx<histograms.size(); band_idx++) {
+		const Histogram &hg = histograms[band_idx];
+		size_t num_nonzero = 0;
+		for(int i=0; i<hg.binning.nbins; i++) {
+			if(hg.counts[i]) num_nonzero++;
+		}
+		fprintf(fh, "band %d %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %zd %zd %zd\n",
+			hg.binning.nbins, hg.binning.offset, hg.binning.scale,
+			hg.min, hg.max, hg.mean, hg.stddev,
+			hg.mean_error, hg.percentile_error,
+			hg.data_count, hg.ndv_count, num_nonzero);
+		for(int i=0; i<hg.binning.nbins; i++) {
+			if(hg.counts[i]) fprintf(fh, "%d %zd\n", i, hg.counts[i]);
+		}
+	}
+
+	if(fclose(fh)) fatal_error("cannot write statistics to %s", fn.c_str());
+}
+
+// Output value of a valid pixel under a linear stretch.  Valid pixels are
+// kept off of the output no-data value.
+static inline uint8_t linear_pixel(double v, double scale, double offset,
+	int output_range, uint8_t out_ndv
+) {
+	double out_dbl = (v - offset) * scale;
+	uint8_t out =
+		(out_dbl < 0) ? 0 :
+		(out_dbl > output_range-1) ? output_range-1 :
+		uint8_t(out_dbl);
+	if(out == out_ndv) {
+		if(out_ndv < output_range/2) out++;
+		else out--;
+	}
+	return out;
+}
+
+std::vector<uint8_t> build_direct_lut(GDALDataType dt, const StretchParams &params,
+	int output_range, uint8_t out_ndv
+) {
+	int min_val, max_val;
+	switch(dt) {
+		case GDT_Byte:   min_val = 0;      max_val = 255;   break;
+		case GDT_UInt16: min_val = 0;      max_val = 65535; break;
+		case GDT_Int16:  min_val = -32768; max_val = 32767; break;
+		default: fatal_error("no direct lookup table for this datatype");
+	}
+
+	std::vector<uint8_t> lut(max_val - min_val + 1);
+	for(int v=min_val; v<=max_val; v++) {
+		uint8_t out;
+		if(params.use_table) {
+			out = (*params.table)[params.binning.to_bin(v)];
+		} else {
+			out = linear_pixel(v, params.scale, params.offset, output_range, out_ndv);
+		}
+		lut[v - min_val] = out;
+	}
+	return lut;
+}
+
+void apply_binned_table(
+	const double *p_in, const Binning &binning, const uint8_t *xform,
+	const uint8_t *p_ndv, uint8_t out_ndv, uint8_t *p_out, size_t num_pixels
+) {
+	for(size_t i=0; i<num_pixels; i++) {
+		p_out[i] = p_ndv[i] ? out_ndv : xform[binning.to_bin(p_in[i])];
+	}
+}
+
+void apply_linear(
+	const double *p_in, double scale, double offset, int output_range,
+	const uint8_t *p_ndv, uint8_t out_ndv, uint8_t *p_out, size_t num_pixels
+) {
+	// The stretch and clamp is kept free of branches so that the compiler
+	// can vectorize it.  No-data pixels are fixed up in a second pass.
+	const double max_out = output_range-1;
+	for(size_t i=0; i<num_pixels; i++) {
+		double out_dbl = (p_in[i] - offset) * scale;
+		out_dbl = out_dbl < 0 ? 0 : out_dbl;
+		out_dbl = out_dbl > max_out ? max_out : out_dbl;
+		p_out[i] = uint8_t(int(out_dbl));
+	}
+	const uint8_t ndv_bump = (out_ndv < output_range/2) ? out_ndv+1 : out_ndv-1;
+	for(size_t i=0; i<num_pixels; i++) {
+		if(p_ndv[i]) p_out[i] = out_ndv;
+		else if(p_out[i] == out_ndv) p_out[i] = ndv_bump;
+	}
+}
+
+void ApplyProcessor::process(
+	const BlockReader &reader, BlockReader::Block *b, size_t worker_idx
+) {
+	size_t blocksize_x = reader.blocksize_x;
+	size_t blocksize_xy = reader.blocksize_x * reader.blocksize_y;
+	size_t bsize_x = b->bsize_x;
+	size_t bsize_y = b->bsize_y;
+	b->out.resize(params.size() * blocksize_xy);
+
+	for(size_t band_idx=0; band_idx<params.size(); band_idx++) {
+		const StretchParams &sp = params[band_idx];
+		uint8_t *out = &b->out[band_idx * blocksize_xy];
+		const uint8_t *ndv = &b->ndv_mask[0];
+
+		if(!direct_luts[band_idx].empty()) {
+			const uint8_t *lut = &direct_luts[band_idx][0];
+			const void *in = b->band_buf[band_idx];
+			for(size_t y=0; y<bsize_y; y++) {
+				size_t row = y * blocksize_x;
+				switch(reader.datatypes[band_idx]) {
+					case GDT_Byte:
+						apply_direct_lut(static_cast<const uint8_t *>(in) + row, 0,
+							lut, ndv + row, out_ndv, out + row, bsize_x);
+						break;
+					case GDT_UInt16:
+						apply_direct_lut(static_cast<const uint16_t *>(in) + row, 0,
+							lut, ndv + row, out_ndv, out + row, bsize_x);
+						break;
+					case GDT_Int16:
+						apply_direct_lut(static_cast<const int16_t *>(in) + row, 32768,
+							lut, ndv + row, out_ndv, out + row, bsize_x);
+						break;
+					default:
+						fatal_error("direct lookup table given for wrong datatype");
+				}
+			}
+			continue;
+		}
+
+		std::vector<double> &buf = bufs[worker_idx];
+		buf.resize(bsize_x * bsize_y);
+		window_to_double(reader, b, band_idx, &buf[0]);
+		for(size_t y=0; y<bsize_y; y++) {
+			size_t row = y * blocksize_x;
+			const double *p_in = &buf[y * bsize_x];
+			if(sp.use_table) {
+				apply_binned_table(p_in, sp.binning, &(*sp.table)[0],
+					ndv + row, out_ndv, out + row, bsize_x);
+			} else {
+				apply_linear(p_in, sp.scale, sp.offset, output_range,
+					ndv + row, out_ndv, out + row, bsize_x);
+			}
+		}
+	}
+}
+
 void get_scale_from_percentile(
 	const Histogram &histogram, int output_range,
 	double from_percentile, double to_percentile,
@@ -743,3 +1641,10 @@ void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds) {
 	}
 	GDALSetProjection(dst_ds, GDALGetProjectionRef(src_ds));
 }
+
+int main(int argc, char **argv) {
+	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	BatchOpts batch_opts = BatchOpts(arg_list);
+	if(batch_opts.empty()) return tool_main(argc, argv);
+	return batch_opts.run(arg_list, tool_main) ? 1 : 0;
+}
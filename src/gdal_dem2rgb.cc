@@ -27,13 +27,18 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <cassert>
+#include <algorithm>
 
+#include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include "common.h"
 #include "georef.h"
 #include "ndv.h"
 #include "palette.h"
+#include "block_reader.h"
+#include "overview_builder.h"
+#include "hillshade.h"
 
 using namespace dangdal;
 
@@ -42,18 +47,79 @@ double default_slope_exageration = 2.0;
 double default_lightvec[] = { 0, 1, 1.5 };
 double default_shade_params[] = { 0, 1, .5, 10 };
 
-static const int SHADE_TABLE_SIZE = 500;
-static const double SHADE_TABLE_SCALE = 100.0;
 static const double EARTH_RADIUS = 6370997.0;
 
 void scale_values(double *vals, size_t w, double scale, double offset);
 
+// Computes the interpolated invaffine for columns col0..col0+tile_cols-1 of a
+// row.  The result for a column is the same no matter which range it is in.
 void compute_tierow_invaffine(
 	const GeoRef &georef,
 	int num_cols, int row, int grid_spacing,
+	int col0, int tile_cols,
 	double *invaffine_tierow
 );
 
+// Everything needed to render a pixel, set up once in main().
+struct RenderSettings {
+	size_t w, h;
+	bool do_shade;
+	bool use_palette;
+	Palette palette;
+	bool data24bit;
+	bool alpha_overlay;
+	bool use_texture;
+	int out_numbands;
+	double src_scale, src_offset;
+	ShadeSettings shade;
+	double alpha_thresh;
+	double thresh_brite;
+	bool use_constant_invaffine;
+	std::vector<double> constant_invaffine;
+	int grid_spacing;
+};
+
+// Renders each window of the DEM on the thread that read it.  Output band i
+// goes into b->out at offset i*blocksize_x*blocksize_y, with rows
+// blocksize_x apart.
+class Renderer : public BlockReader::Processor {
+public:
+	// georefs and tex_bands have an entry for each worker, since neither can
+	// be shared between threads.
+	Renderer(const RenderSettings &_rs, const std::vector<const GeoRef *> &georefs,
+		const std::vector<std::vector<GDALRasterBandH> > &tex_bands);
+
+	virtual void process(const BlockReader &reader, BlockReader::Block *b, size_t worker_idx);
+
+	// combined over all workers
+	void get_stats(bool *got_nan, bool *got_valid, bool *got_overflow,
+		double *min, double *max) const;
+
+private:
+	struct Worker {
+		Worker() :
+			georef(NULL),
+			got_nan(false), got_valid(false), got_overflow(false),
+			min(0), max(0)
+		{ }
+
+		const GeoRef *georef;
+		std::vector<GDALRasterBandH> tex_bands;
+		std::vector<double> dem;
+		std::vector<uint8_t> good_prev, good_this, good_next;
+		std::vector<double> dx, dy;
+		std::vector<int> table_idx;
+		std::vector<double> brite, spec;
+		std::vector<double> invaffine_tierow_above;
+		std::vector<double> invaffine_tierow_below;
+		bool got_nan, got_valid, got_overflow;
+		double min, max;
+	};
+
+	const RenderSettings &rs;
+	std::vector<Worker> workers;
+};
+
 void usage(const std::string &cmdname) {
 	printf("Usage: %s <options> src_dataset dst_dataset\n\n", cmdname.c_str());
 	
@@ -61,9 +127,14 @@ void usage(const std::string &cmdname) {
 	printf("\n");
 	NdvDef::printUsage();
 	printf("\n");
+	OverviewBuilder::printUsage();
+	printf("\n");
+	StageTimer::printUsage();
+	printf("\n");
 	printf("Input/Output:\n");
 	printf("  -b input_band_id\n");
 	printf("  -of output_format\n");
+	printf("  -threads N                          Use N threads (default is 1)\n");
 	printf("  -offset X -scale X                  Multiply and add to source values\n");
 	printf("\n");
 	printf("Texture: (choose one of these - default is gray background)\n");
@@ -95,6 +166,7 @@ int main(int argc, char *argv[]) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	double slope_exageration = default_slope_exageration;
 	double lightvec[3];
@@ -114,6 +186,9 @@ int main(int argc, char *argv[]) {
 	double src_scale = 1;
 	bool data24bit = 0;
 	bool alpha_overlay = 0;
+	size_t num_threads = 1;
+	std::vector<int> overview_levels;
+	bool overview_average = true;
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 	NdvDef ndv_def = NdvDef(arg_list);
@@ -157,6 +232,18 @@ int main(int argc, char *argv[]) {
 						if(argp == arg_list.size()) usage(cmdname);
 						shade_params[i] = boost::lexical_cast<double>(arg_list[argp++]);
 					}
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!num_threads) fatal_error("-threads must be positive");
+				} else if(arg == "-overviews") {
+					if(argp == arg_list.size()) usage(cmdname);
+					overview_levels = OverviewBuilder::parseLevels(arg_list[argp++]);
+				} else if(arg == "-overview-resampling") {
+					if(argp == arg_list.size()) usage(cmdname);
+					if(!OverviewBuilder::parseResampling(arg_list[argp++], &overview_average)) {
+						usage(cmdname);
+					}
 				} else if(arg == "-offset") {
 					if(argp == arg_list.size()) usage(cmdname);
 					src_offset = boost::lexical_cast<double>(arg_list[argp++]);
@@ -230,7 +317,7 @@ int main(int argc, char *argv[]) {
 	GDALDatasetH src_ds = GDALOpen(src_fn.c_str(), GA_ReadOnly);
 	if(!src_ds) fatal_error("open failed");
 
-	GDALRasterBandH src_band = GDALGetRasterBand(src_ds, band_id);
+	if(!GDALGetRasterBand(src_ds, band_id)) fatal_error("could not open band %d", band_id);
 
 	size_t w = GDALGetRasterXSize(src_ds);
 	size_t h = GDALGetRasterYSize(src_ds);
@@ -239,6 +326,24 @@ int main(int argc, char *argv[]) {
 
 	GeoRef georef = GeoRef(geo_opts, src_ds);
 
+	if(use_palette) {
+		// Integer elevations stay whole numbers if the scale and offset are
+		// too, and then the palette can be looked up by value.
+		bool integer_vals;
+		switch(GDALGetRasterDataType(GDALGetRasterBand(src_ds, band_id))) {
+			case GDT_Byte:
+			case GDT_UInt16:
+			case GDT_Int16:
+			case GDT_UInt32:
+			case GDT_Int32:
+				integer_vals = (src_scale == floor(src_scale)) && (src_offset == floor(src_offset));
+				break;
+			default:
+				integer_vals = false;
+		}
+		palette.compile(integer_vals);
+	}
+
 	//////// compute orientation ////////
 
 	std::vector<double> constant_invaffine;
@@ -296,19 +401,20 @@ int main(int argc, char *argv[]) {
 		dst_band.push_back(GDALGetRasterBand(dst_ds, i+1));
 	}
 
+	OverviewBuilder *overviews = NULL;
+	if(!overview_levels.empty()) {
+		overviews = new OverviewBuilder(dst_ds, overview_levels, overview_average, -1);
+	}
+
 	//////// setup shade table ////////
 
-	std::vector<std::vector<double> > shade_table;
-	std::vector<std::vector<double> > spec_table;
+	std::vector<double> shade_table;
+	std::vector<double> spec_table;
 	double ALPHA_THRESH = .5F;
 	double thresh_brite = 1;
 	if(do_shade) {
-		shade_table.resize(SHADE_TABLE_SIZE*2+1);
-		spec_table .resize(SHADE_TABLE_SIZE*2+1);
-		for(int i=0; i<SHADE_TABLE_SIZE*2+1; i++) {
-			shade_table[i].resize(SHADE_TABLE_SIZE*2+1);
-			spec_table [i].resize(SHADE_TABLE_SIZE*2+1);
-		}
+		shade_table.resize(SHADE_TABLE_WIDTH*SHADE_TABLE_WIDTH);
+		spec_table .resize(SHADE_TABLE_WIDTH*SHADE_TABLE_WIDTH);
 		double lightvec_len = sqrt(
 			lightvec[0] * lightvec[0] +
 			lightvec[1] * lightvec[1] +
@@ -335,9 +441,9 @@ int main(int argc, char *argv[]) {
 				if(dotprod < 0) dotprod = 0;
 				double brite = shade_params[0] + shade_params[1]*dotprod;
 				if(brite > 1.0) brite = 1.0;
-				shade_table[row][col] = brite;
+				shade_table[row*SHADE_TABLE_WIDTH + col] = brite;
 				brite = shade_params[2]*pow(dotprod, shade_params[3]);
-				spec_table[row][col] = brite;
+				spec_table[row*SHADE_TABLE_WIDTH + col] = brite;
 			}
 		}
 					
@@ -359,175 +465,274 @@ int main(int argc, char *argv[]) {
 		ndv_def = NdvDef(src_ds, ndv_bandids);
 	}
 
-	std::vector<double> inbuf_prev(w);
-	std::vector<double> inbuf_this(w);
-	std::vector<double> inbuf_next(w);
-	std::vector<uint8_t> inbuf_ndv_prev(w);
-	std::vector<uint8_t> inbuf_ndv_this(w);
-	std::vector<uint8_t> inbuf_ndv_next(w);
-
-	std::vector<std::vector<uint8_t> > outbuf(out_numbands);
-	for(int i=0; i<out_numbands; i++) {
-		outbuf[i].resize(w);
+	RenderSettings rs;
+	rs.w = w;
+	rs.h = h;
+	rs.do_shade = do_shade;
+	rs.use_palette = use_palette;
+	rs.palette = palette;
+	rs.data24bit = data24bit;
+	rs.alpha_overlay = alpha_overlay;
+	rs.use_texture = (tex_ds != NULL);
+	rs.out_numbands = out_numbands;
+	rs.src_scale = src_scale;
+	rs.src_offset = src_offset;
+	rs.shade.slope_exageration = slope_exageration;
+	rs.shade.shade_table.swap(shade_table);
+	rs.shade.spec_table.swap(spec_table);
+	rs.alpha_thresh = ALPHA_THRESH;
+	rs.thresh_brite = thresh_brite;
+	rs.use_constant_invaffine = use_constant_invaffine;
+	rs.constant_invaffine = constant_invaffine;
+	rs.grid_spacing = grid_spacing;
+
+	// Each worker gets its own coordinate transformation and texture handle.
+	size_t num_workers = std::max(num_threads, size_t(1));
+	std::vector<GeoRef *> extra_georefs;
+	std::vector<GDALDatasetH> extra_tex_ds;
+	std::vector<const GeoRef *> worker_georefs(1, &georef);
+	std::vector<std::vector<GDALRasterBandH> > worker_tex_bands(1, tex_bands);
+	for(size_t i=1; i<num_workers; i++) {
+		if(do_shade && !use_constant_invaffine) {
+			extra_georefs.push_back(new GeoRef(geo_opts, src_ds));
+			worker_georefs.push_back(extra_georefs.back());
+		} else {
+			worker_georefs.push_back(&georef);
+		}
+		std::vector<GDALRasterBandH> bands;
+		if(tex_ds) {
+			GDALDatasetH wds = GDALOpen(tex_fn.c_str(), GA_ReadOnly);
+			if(!wds) fatal_error("Could not reopen %s for a worker thread.", tex_fn.c_str());
+			extra_tex_ds.push_back(wds);
+			for(int j=0; j<out_numbands; j++) {
+				bands.push_back(GDALGetRasterBand(wds, j+1));
+			}
+		}
+		worker_tex_bands.push_back(bands);
 	}
-	std::vector<uint8_t> pixel(out_numbands);
 
-	std::vector<double> invaffine_tierow_above;
-	std::vector<double> invaffine_tierow_below;
-	if(do_shade && !use_constant_invaffine) {
-		invaffine_tierow_above.resize(w * 4);
-		invaffine_tierow_below.resize(w * 4);
-	}
+	Renderer renderer(rs, worker_georefs, worker_tex_bands);
+
+	{
+		// Windows (with a one pixel halo for the slope) are rendered by the
+		// reader's workers and written here in order.  They are aligned to the
+		// blocks of the output too, so that each output block is written
+		// once.
+		StageTimer timer("read_render_write", "pixels");
+		timer.add_items(uint64_t(w) * h);
+		std::vector<size_t> src_bandids(1, band_id);
+		BlockReader reader(src_ds, src_bandids, &ndv_def, num_threads, &renderer,
+			1, 1, dst_band[0]);
+		size_t blocksize_x = reader.blocksize_x;
+		size_t blocksize_xy = reader.blocksize_x * reader.blocksize_y;
+
+		while(BlockReader::Block *block = reader.next_block()) {
+			size_t boff_x = block->boff_x;
+			size_t boff_y = block->boff_y;
+			size_t bsize_x = block->bsize_x;
+			size_t bsize_y = block->bsize_y;
+
+			GDALTermProgress(reader.progress(block), NULL, NULL);
 
-	double min=0, max=0; // initialized to prevent compiler warning
-	bool got_nan=0, got_valid=0, got_overflow=0;
-	for(size_t row=0; row<h; row++) {
-		GDALTermProgress((double)row / (double)h, NULL, NULL);
-		if(row == 0) {
-			GDALRasterIO(src_band, GF_Read, 0, 0, w, 1, &inbuf_prev[0], w, 1, GDT_Float64, 0, 0);
-			GDALRasterIO(src_band, GF_Read, 0, 0, w, 1, &inbuf_this[0], w, 1, GDT_Float64, 0, 0);
-			GDALRasterIO(src_band, GF_Read, 0, 1, w, 1, &inbuf_next[0], w, 1, GDT_Float64, 0, 0);
-			ndv_def.getNdvMask(&inbuf_prev[0], GDT_Float64, &inbuf_ndv_prev[0], w);
-			ndv_def.getNdvMask(&inbuf_this[0], GDT_Float64, &inbuf_ndv_this[0], w);
-			ndv_def.getNdvMask(&inbuf_next[0], GDT_Float64, &inbuf_ndv_next[0], w);
-			scale_values(&inbuf_prev[0], w, src_scale, src_offset);
-			scale_values(&inbuf_this[0], w, src_scale, src_offset);
-			scale_values(&inbuf_next[0], w, src_scale, src_offset);
-		} else {
-			// rotate buffers
-			std::vector<double> swapd;
-			std::swap(swapd, inbuf_prev);
-			std::swap(inbuf_prev, inbuf_this);
-			std::swap(inbuf_this, inbuf_next);
-			std::swap(inbuf_next, swapd);
-			std::vector<uint8_t> swapc;
-			std::swap(swapc, inbuf_ndv_prev);
-			std::swap(inbuf_ndv_prev, inbuf_ndv_this);
-			std::swap(inbuf_ndv_this, inbuf_ndv_next);
-			std::swap(inbuf_ndv_next, swapc);
-
-			int read_row = (row == h-1) ? row : row+1;
-			GDALRasterIO(src_band, GF_Read, 0, read_row, w, 1, &inbuf_next[0], w, 1, GDT_Float64, 0, 0);
-			ndv_def.getNdvMask(&inbuf_next[0], GDT_Float64, &inbuf_ndv_next[0], w);
-			scale_values(&inbuf_next[0], w, src_scale, src_offset);
-		}
-		if(!tex_bands.empty()) {
 			for(int i=0; i<out_numbands; i++) {
-				GDALRasterIO(tex_bands[i], GF_Read, 0, row, w, 1, &outbuf[i][0], w, 1, GDT_Byte, 0, 0);
+				CPLErr err = GDALRasterIO(dst_band[i], GF_Write,
+					boff_x, boff_y, bsize_x, bsize_y,
+					&block->out[i * blocksize_xy], bsize_x, bsize_y, GDT_Byte,
+					1, blocksize_x);
+				if(err != CE_None) fatal_error("Could not write output.");
+				if(overviews) {
+					overviews->add_block(i, boff_x, boff_y, bsize_x, bsize_y,
+						&block->out[i * blocksize_xy], blocksize_x);
+				}
 			}
 		}
+	}
+
+	double min, max;
+	bool got_nan, got_valid, got_overflow;
+	renderer.get_stats(&got_nan, &got_valid, &got_overflow, &min, &max);
+
+	if(overviews) {
+		StageTimer timer("overviews");
+		overviews->finish();
+		delete overviews;
+	}
+
+	BOOST_FOREACH(GeoRef *g, extra_georefs) delete g;
+	BOOST_FOREACH(GDALDatasetH wds, extra_tex_ds) GDALClose(wds);
+
+	GDALTermProgress(1, NULL, NULL);
+
+	if(tex_ds) GDALClose(tex_ds);
+	GDALClose(src_ds);
+	{
+		StageTimer timer("write");
+		GDALClose(dst_ds);
+	}
+
+	printf("got_nan=%d, got_valid=%d, min=%f, max=%f\n",
+		got_nan?1:0, got_valid?1:0, min, max);
+	if(got_overflow) {
+		printf("got an overflow in conversion to 24-bit\n");
+	}
+
+	return 0;
+}
+
+Renderer::Renderer(
+	const RenderSettings &_rs, const std::vector<const GeoRef *> &georefs,
+	const std::vector<std::vector<GDALRasterBandH> > &tex_bands
+) :
+	rs(_rs),
+	workers(georefs.size())
+{
+	for(size_t i=0; i<workers.size(); i++) {
+		workers[i].georef = georefs[i];
+		workers[i].tex_bands = tex_bands[i];
+	}
+}
+
+void Renderer::process(const BlockReader &reader, BlockReader::Block *b, size_t worker_idx) {
+	Worker &wk = workers[worker_idx];
+	const size_t w = rs.w;
+	const size_t h = rs.h;
+	const int out_numbands = rs.out_numbands;
+	const size_t halo = reader.halo;
+	const size_t buf_w = reader.buf_w;
+	const size_t blocksize_x = reader.blocksize_x;
+	const size_t blocksize_xy = reader.blocksize_x * reader.blocksize_y;
+	const size_t bsize_x = b->bsize_x;
+	const size_t bsize_y = b->bsize_y;
+
+	size_t buf_size = reader.buf_w * reader.buf_h;
+	wk.dem.resize(buf_size);
+	GDALCopyWords(b->band_buf[0], reader.datatypes[0], GDALGetDataTypeSize(reader.datatypes[0]) / 8,
+		&wk.dem[0], GDT_Float64, sizeof(double), int(buf_size));
+	scale_values(&wk.dem[0], buf_size, rs.src_scale, rs.src_offset);
+
+	b->out.resize(out_numbands * blocksize_xy);
+	std::vector<uint8_t *> outbuf(out_numbands);
+	for(int i=0; i<out_numbands; i++) {
+		outbuf[i] = &b->out[i * blocksize_xy];
+	}
+	if(rs.use_texture) {
+		for(int i=0; i<out_numbands; i++) {
+			CPLErr err = GDALRasterIO(wk.tex_bands[i], GF_Read,
+				b->boff_x, b->boff_y, bsize_x, bsize_y,
+				outbuf[i], bsize_x, bsize_y, GDT_Byte, 1, blocksize_x);
+			if(err != CE_None) fatal_error("Could not read texture.");
+		}
+	}
+	std::vector<uint8_t> pixel(out_numbands);
+
+	bool use_tierows = rs.do_shade && !rs.use_constant_invaffine;
+	if(use_tierows) {
+		wk.invaffine_tierow_above.resize(bsize_x * 4);
+		wk.invaffine_tierow_below.resize(bsize_x * 4);
+	}
+	wk.good_prev.resize(bsize_x + 2);
+	wk.good_this.resize(bsize_x + 2);
+	wk.good_next.resize(bsize_x + 2);
+	wk.brite.assign(bsize_x, 1.0);
+	wk.spec.assign(bsize_x, 0.0);
+
+	// column bounds for the neighbor flags
+	bool has_left = b->boff_x > 0;
+	bool has_right = b->boff_x + bsize_x < w;
+
+	for(size_t sub_y=0; sub_y<bsize_y; sub_y++) {
+		size_t row = b->boff_y + sub_y;
+		const double *inbuf_this = &wk.dem[(sub_y + halo) * buf_w + halo];
+		const uint8_t *inbuf_ndv_this = &b->ndv_mask[(sub_y + halo) * buf_w + halo];
+		size_t out_row = sub_y * blocksize_x;
 
 		double grid_fraction = 0;
-		if(do_shade && !use_constant_invaffine) {
+		if(use_tierows) {
 			// the part sets up the bilinear interpolation of invaffine
+			int grid_spacing = rs.grid_spacing;
 			int above_tiept = grid_spacing * (row / grid_spacing);
 			int below_tiept = above_tiept + grid_spacing;
 			if(below_tiept > (int)h) below_tiept = (int)h;
-			if(row == (size_t)above_tiept) {
-				if(row == 0) {
-					compute_tierow_invaffine(georef, w, 0, grid_spacing, &invaffine_tierow_above[0]);
+			if(sub_y == 0 || row == (size_t)above_tiept) {
+				if(sub_y == 0) {
+					compute_tierow_invaffine(*wk.georef, w, above_tiept, grid_spacing,
+						b->boff_x, bsize_x, &wk.invaffine_tierow_above[0]);
 				} else {
-					std::swap(invaffine_tierow_above, invaffine_tierow_below);
+					std::swap(wk.invaffine_tierow_above, wk.invaffine_tierow_below);
 				}
-				compute_tierow_invaffine(georef, w, below_tiept, grid_spacing, &invaffine_tierow_below[0]);
+				compute_tierow_invaffine(*wk.georef, w, below_tiept, grid_spacing,
+					b->boff_x, bsize_x, &wk.invaffine_tierow_below[0]);
 			}
 			double segment_height = below_tiept - above_tiept;
 			grid_fraction = ((double)row - (double)above_tiept) / segment_height;
 		}
-//if(!row) printf("pixel[0,0]=%f\n", inbuf_this[0]);
-		for(size_t col=0; col<w; col++) {
-			double val = inbuf_this[col];
-			double brite, spec;
-			if(do_shade) {
-				double dx;
-				bool mid_good = !inbuf_ndv_this[col];
-				bool left_good = col>0 && !inbuf_ndv_this[col-1];
-				bool right_good = col<w-1 && !inbuf_ndv_this[col+1];
-				bool up_good = row>0 && !inbuf_ndv_prev[col];
-				bool down_good = row<h-1 && !inbuf_ndv_next[col];
-				if(left_good && right_good) {
-					dx = (inbuf_this[col+1] - inbuf_this[col-1]) / 2.0;
-				} else if(mid_good && right_good) {
-					dx = inbuf_this[col+1] - val;
-				} else if(mid_good && left_good) {
-					dx = val - inbuf_this[col-1];
-				} else {
-					dx = 0;
-				}
-				double dy;
-				if(up_good && down_good) {
-					dy = (inbuf_next[col] - inbuf_prev[col]) / 2.0;
-				} else if(mid_good && down_good) {
-					dy = inbuf_next[col] - val;
-				} else if(mid_good && up_good) {
-					dy = val - inbuf_prev[col];
-				} else {
-					dy = 0;
-				}
 
-				// convert from elevation per pixel to elevation per meter (unitless)
-				//double dx2 = invaffine_a * dx + invaffine_b * (-dy);
-				//double dy2 = invaffine_c * dx + invaffine_d * (-dy);
-				
-				double invaffine[4];
-				if(use_constant_invaffine) {
-					for(int i=0; i<4; i++) invaffine[i] = constant_invaffine[i];
-				} else {
-					for(int i=0; i<4; i++) {
-						invaffine[i] = invaffine_tierow_above[col*4 + i] * (1.0 - grid_fraction) +
-							invaffine_tierow_below[col*4 + i] * grid_fraction;
-					}
-					//compute_invaffine(georef, col, row, invaffine);
-				}
-				// FIXME - why the minus signs?
-				double dx2 = invaffine[0] * (-dx) + invaffine[1] * (-dy);
-				double dy2 = invaffine[2] * (-dx) + invaffine[3] * (-dy);
-				dx2 *= slope_exageration;
-				dy2 *= slope_exageration;
-				//if(col == 0) printf("row=%zd d=[%f, %f] d2=[%f, %f]\n", row, dx, dy, dx2, dy2);
-
-				int st_col = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dx2);
-				if(st_col < 0) st_col = 0;
-				if(st_col > SHADE_TABLE_SIZE*2) st_col = SHADE_TABLE_SIZE*2;
-				int st_row = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dy2);
-				if(st_row < 0) st_row = 0;
-				if(st_row > SHADE_TABLE_SIZE*2) st_row = SHADE_TABLE_SIZE*2;
-				brite = shade_table[st_row][st_col];
-				spec = spec_table[st_row][st_col];
-			} else {
-				brite = 1.0;
-				spec = 0.0;
+		if(rs.do_shade) {
+			// Which neighbors can be used for the slope.  Entry 0 is for column -1.
+			const uint8_t *ndv_prev = inbuf_ndv_this - buf_w - 1;
+			const uint8_t *ndv_this = inbuf_ndv_this - 1;
+			const uint8_t *ndv_next = inbuf_ndv_this + buf_w - 1;
+			bool has_up = row > 0;
+			bool has_down = row < h-1;
+			for(size_t i=0; i<bsize_x+2; i++) {
+				wk.good_prev[i] = has_up && !ndv_prev[i];
+				wk.good_this[i] = !ndv_this[i];
+				wk.good_next[i] = has_down && !ndv_next[i];
 			}
-			if(inbuf_ndv_this[col]) {
-				if(use_palette) {
-					outbuf[0][col] = palette.nan_color.r;
-					outbuf[1][col] = palette.nan_color.g;
-					outbuf[2][col] = palette.nan_color.b;
+			if(!has_left) wk.good_this[0] = 0;
+			if(!has_right) wk.good_this[bsize_x+1] = 0;
+
+			ShadeRow sr;
+			sr.prev = inbuf_this - buf_w;
+			sr.cur = inbuf_this;
+			sr.next = inbuf_this + buf_w;
+			sr.good_prev = &wk.good_prev[1];
+			sr.good_this = &wk.good_this[1];
+			sr.good_next = &wk.good_next[1];
+			sr.invaffine_above = use_tierows ? &wk.invaffine_tierow_above[0] : NULL;
+			sr.invaffine_below = use_tierows ? &wk.invaffine_tierow_below[0] : NULL;
+			sr.grid_fraction = grid_fraction;
+			sr.constant_invaffine = use_tierows ? NULL : &rs.constant_invaffine[0];
+			sr.n = bsize_x;
+
+			shade_row(rs.shade, sr, wk.dx, wk.dy, wk.table_idx, &wk.brite[0], &wk.spec[0]);
+		}
+
+		for(size_t sub_x=0; sub_x<bsize_x; sub_x++) {
+			size_t i_out = out_row + sub_x;
+			double val = inbuf_this[sub_x];
+			double brite = wk.brite[sub_x];
+			double spec = wk.spec[sub_x];
+			if(inbuf_ndv_this[sub_x]) {
+				if(rs.use_palette) {
+					outbuf[0][i_out] = rs.palette.nan_color.r;
+					outbuf[1][i_out] = rs.palette.nan_color.g;
+					outbuf[2][i_out] = rs.palette.nan_color.b;
 				} else {
-					for(int i=0; i<out_numbands; i++) outbuf[i][col] = 0;
+					for(int i=0; i<out_numbands; i++) outbuf[i][i_out] = 0;
 				}
-				got_nan=1;
+				wk.got_nan = 1;
 			} else {
-				if(data24bit) {
+				if(rs.data24bit) {
 					int ival = (int)round(val) + (1<<23);
 					if(ival >> 24) {
-						got_overflow = 1;
+						wk.got_overflow = 1;
 						ival = 0;
 					}
 					pixel[2] = (uint8_t)(ival & 0xff);
 					pixel[1] = (uint8_t)((ival >> 8) & 0xff);
 					pixel[0] = (uint8_t)((ival >> 16) & 0xff);
-				} else if(alpha_overlay) {
-					if(thresh_brite < 1.0) {
-						brite += (spec / ALPHA_THRESH) * (1.0 - thresh_brite);
+				} else if(rs.alpha_overlay) {
+					if(rs.thresh_brite < 1.0) {
+						brite += (spec / rs.alpha_thresh) * (1.0 - rs.thresh_brite);
 					}
 
 					double alpha, white;
-					if(spec < ALPHA_THRESH) {
+					if(spec < rs.alpha_thresh) {
 						alpha = 1.0 - brite;
 						white = 0;
 					} else {
-						alpha = spec - ALPHA_THRESH;
+						alpha = spec - rs.alpha_thresh;
 						white = 1;
 					}
 
@@ -539,13 +744,13 @@ int main(int argc, char *argv[]) {
 					pixel[0] = pixel[1] = pixel[2] = (uint8_t)(255.0 * white);
 					pixel[3] = (uint8_t)(255.0 * alpha);
 				} else {
-					if(use_palette) {
-						RGB c = palette.get(val);
+					if(rs.use_palette) {
+						RGB c = rs.palette.get(val);
 						pixel[0] = c.r;
 						pixel[1] = c.g;
 						pixel[2] = c.b;
-					} else if(tex_ds) {
-						for(int i=0; i<out_numbands; i++) pixel[i] = outbuf[i][col];
+					} else if(rs.use_texture) {
+						for(int i=0; i<out_numbands; i++) pixel[i] = outbuf[i][i_out];
 					} else {
 						for(int i=0; i<out_numbands; i++) pixel[i] = 128;
 					}
@@ -557,31 +762,30 @@ int main(int argc, char *argv[]) {
 						pixel[i] = (uint8_t)c;
 					}
 				}
-				for(int i=0; i<out_numbands; i++) outbuf[i][col] = pixel[i];
+				for(int i=0; i<out_numbands; i++) outbuf[i][i_out] = pixel[i];
 
-				if(!got_valid || val < min) min = val;
-				if(!got_valid || val > max) max = val;
-				got_valid=1;
+				if(!wk.got_valid || val < wk.min) wk.min = val;
+				if(!wk.got_valid || val > wk.max) wk.max = val;
+				wk.got_valid = 1;
 			}
 		}
-		for(int i=0; i<out_numbands; i++) {
-			GDALRasterIO(dst_band[i], GF_Write, 0, row, w, 1, &outbuf[i][0], w, 1, GDT_Byte, 0, 0);
-		}
 	}
+}
 
-	GDALTermProgress(1, NULL, NULL);
-
-	if(tex_ds) GDALClose(tex_ds);
-	GDALClose(src_ds);
-	GDALClose(dst_ds);
-
-	printf("got_nan=%d, got_valid=%d, min=%f, max=%f\n",
-		got_nan?1:0, got_valid?1:0, min, max);
-	if(got_overflow) {
-		printf("got an overflow in conversion to 24-bit\n");
+void Renderer::get_stats(bool *got_nan, bool *got_valid, bool *got_overflow,
+	double *min, double *max
+) const {
+	*got_nan = *got_valid = *got_overflow = false;
+	*min = *max = 0;
+	BOOST_FOREACH(const Worker &wk, workers) {
+		*got_nan |= wk.got_nan;
+		*got_overflow |= wk.got_overflow;
+		if(wk.got_valid) {
+			if(!*got_valid || wk.min < *min) *min = wk.min;
+			if(!*got_valid || wk.max > *max) *max = wk.max;
+			*got_valid = true;
+		}
 	}
-
-	return 0;
 }
 
 void scale_values(double *vals, size_t w, double scale, double offset) {
@@ -670,10 +874,11 @@ void compute_invaffine(
 	//printf("invaffine=[%f, %f, %f, %f]\n", invaffine_a, invaffine_b, invaffine_c, invaffine_d);
 }
 
-// interpolate the invaffine for an entire row
+// interpolate the invaffine for part of a row
 void compute_tierow_invaffine(
 	const GeoRef &georef,
 	int num_cols, int row, int grid_spacing,
+	int col0, int tile_cols,
 	double *invaffine_tierow
 ) {
 	// this will be initialized on the first iteration, but it is set here to avoid a compiler
@@ -681,21 +886,23 @@ void compute_tierow_invaffine(
 	double tiecol_left[4] = { 0, 0, 0, 0 };
 	double tiecol_right[4] = { 0, 0, 0, 0 };
 
-	compute_invaffine(georef, 0, row, tiecol_right);
-
 	double segment_width = 0; // will be initialized on first iteration
-	for(int col=0; col<num_cols; col++) {
+	for(int col=col0; col<col0+tile_cols; col++) {
 		int left_tiept = grid_spacing * (col / grid_spacing);
-		if(col == left_tiept) {
-			for(int i=0; i<4; i++) tiecol_left[i] = tiecol_right[i];
-			int right_tiept = col+grid_spacing;
+		if(col == left_tiept || col == col0) {
+			if(col == col0) {
+				compute_invaffine(georef, left_tiept, row, tiecol_left);
+			} else {
+				for(int i=0; i<4; i++) tiecol_left[i] = tiecol_right[i];
+			}
+			int right_tiept = left_tiept+grid_spacing;
 			if(right_tiept > num_cols) right_tiept = num_cols;
 			segment_width = right_tiept - left_tiept;
 			compute_invaffine(georef, right_tiept, row, tiecol_right);
 		}
 		double grid_fraction = ((double)col - (double)left_tiept) / segment_width;
 		for(int i=0; i<4; i++) {
-			invaffine_tierow[col*4 + i] =
+			invaffine_tierow[(col-col0)*4 + i] =
 				tiecol_left[i] * (1.0 - grid_fraction) +
 				tiecol_right[i] * grid_fraction;
 		}
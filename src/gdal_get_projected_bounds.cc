@@ -26,6 +26,11 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <map>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
 #include "common.h"
 #include "polygon.h"
 #include "debugplot.h"
@@ -60,56 +65,159 @@ void usage(const std::string &cmdname) {
 	printf("  -s_srs <srs_def>      Source SRS\n");
 	printf("  -t_srs <srs_def>      Target SRS\n");
 	printf("  -report <out.ppm>     Output a graphical report (optional)\n");
+	printf("  -adaptive             Sample coarsely, refining only where the bounds could still\n");
+	printf("                        grow or where transforms start to fail\n");
+	printf("  -threads N            Transform points using N threads\n");
 	printf("\nOutput is the envelope of the source region projected into the target SRS.\n");
 	printf("If the -t_bounds_wkt option is given it will be used as a clip mask in the\n");
 	printf("projected space.\n");
 	printf("\n");
+	StageTimer::printUsage();
 	
 	exit(1);
 }
 
-// This function transforms a point, and then as a check transforms it back to
-// see if it comes back to the same place.  This allows us to detect cases
-// where OCTTransform reports success when really it just returned some
-// meaningless result.
-bool picky_transform(
+// This function transforms a list of points, and then as a check transforms
+// them back to see if they come back to the same place.  This allows us to
+// detect cases where OCTTransform reports success when really it just
+// returned some meaningless result.  Points that pass are replaced by their
+// transformed value and get ok[i] set.
+void picky_transform(
 	OGRCoordinateTransformationH fwd_xform,
 	OGRCoordinateTransformationH inv_xform,
-	Vertex *v_in
+	std::vector<Vertex> &pts,
+	std::vector<bool> &ok
 ) {
 	// tolerance in meters, could probably be much smaller
 	const double toler = 1.0;
 
-	Vertex v_out = *v_in;
-	if(!OCTTransform(fwd_xform, 1, &v_out.x, &v_out.y, NULL)) {
-		return 0;
-	}
+	const size_t n = pts.size();
+	ok.assign(n, true);
 
-	Vertex v_back = v_out;
-	if(!OCTTransform(inv_xform, 1, &v_back.x, &v_back.y, NULL)) {
-		return 0;
+	std::vector<double> out_x(n), out_y(n);
+	for(size_t i=0; i<n; i++) {
+		out_x[i] = pts[i].x;
+		out_y[i] = pts[i].y;
 	}
-
-	double err = hypot(v_in->x - v_back.x, v_in->y - v_back.y);
-	//fprintf(stderr, "err=%g\n", err);
-	if(err > toler) {
-		return 0;
+	GeoRef::transform_many(fwd_xform, out_x, out_y, ok);
+
+	// Points that failed the forward transform have ok[i] cleared and are
+	// not sent through the inverse.
+	std::vector<double> back_x(out_x), back_y(out_y);
+	GeoRef::transform_many(inv_xform, back_x, back_y, ok);
+
+	for(size_t i=0; i<n; i++) {
+		if(!ok[i]) continue;
+		double err = hypot(pts[i].x - back_x[i], pts[i].y - back_y[i]);
+		//fprintf(stderr, "err=%g\n", err);
+		if(err > toler) {
+			ok[i] = false;
+			continue;
+		}
+		pts[i] = Vertex(out_x[i], out_y[i]);
 	}
-
-	*v_in = v_out;
-	return 1;
 }
 
+// Does picky_transform on batches of points, split among several threads.  Each thread
+// has its own pair of transformations, since these can't be shared between threads.
+class PointProjector {
+public:
+	PointProjector(OGRSpatialReferenceH s_sref, OGRSpatialReferenceH t_sref, size_t num_threads);
+	~PointProjector();
+
+	// Source to target if 'forward' is set, otherwise target to source.
+	void transform(bool forward, std::vector<Vertex> &pts, std::vector<bool> &ok) const;
+
+private:
+	struct XformPair {
+		OGRCoordinateTransformationH fwd, inv;
+	};
+
+	static void transform_chunk(const XformPair *xf, bool forward,
+		std::vector<Vertex> *pts, std::vector<bool> *ok);
+
+	std::vector<XformPair> xforms;
+};
+
+// One point that was looked at.  It is 'ok' if it belongs to the region being sampled,
+// if it transforms without error, and if it lands inside of the target bounds.
+struct Sample {
+	Vertex tgt;
+	bool ok;
+};
+
+// Samples the source region (or the target bounds) coarsely at first, and then
+// subdivides only the cells or segments that could still push out the bounds found
+// so far, or where transforms start to fail or points fall out of the region.  Cells
+// that are entirely outside of the region or where transforms fail everywhere are not
+// refined further.  The finest level is the same as the fixed sampling.
+class AdaptiveSampler {
+public:
+	AdaptiveSampler(const PointProjector &_projector, const PreparedMpoly &_src_prep,
+		const PreparedMpoly *_t_bounds_prep, Ring &_pl) :
+		projector(_projector), src_prep(_src_prep), t_bounds_prep(_t_bounds_prep),
+		pl(_pl)
+	{ }
+
+	// A grid over the source bbox, num_grid_steps cells across at the finest level.
+	void sample_grid(const Bbox &src_bbox, int num_grid_steps, PointStats &ps);
+
+	// Points along the rings of the source region (if 'forward') or along the rings
+	// of the target bounds, max_step_len apart at the finest level.
+	void sample_rings(const Mpoly &mp, double max_step_len, bool forward, PointStats &ps);
+
+private:
+	// Points that are on the same edge/cell.  Returns true if a (finer) point in
+	// between them could be ok and past the current bounds.
+	bool worth_refining(const Sample *const *s, size_t n) const;
+
+	void grid_samples(const std::vector<Vertex> &pts, std::vector<Sample> &out, PointStats &ps);
+	void ring_samples(const std::vector<Vertex> &pts, bool forward,
+		std::vector<Sample> &out, PointStats &ps);
+	void add_ok(const Sample &s);
+
+	// Step 'from' to step 'to' of an edge that is split into 'num_steps' parts, as for the
+	// fixed sampling.
+	struct Segment {
+		Vertex v1, v2;
+		int num_steps;
+		int from, to;
+		size_t s_from, s_to;
+
+		Vertex at(int step) const {
+			double alpha = (double)step / (double)num_steps;
+			return Vertex(v1.x + (v2.x - v1.x) * alpha, v1.y + (v2.y - v1.y) * alpha);
+		}
+	};
+
+	// Grid points are numbered 0..num_grid_steps in each direction.
+	struct Cell {
+		int x0, y0, size;
+	};
+
+	// The coarsest level is this many times the finest.
+	static const int COARSE_STEP = 16;
+
+	const PointProjector &projector;
+	const PreparedMpoly &src_prep;
+	const PreparedMpoly *t_bounds_prep;
+	Ring &pl;
+	Bbox bounds;
+};
+
 int main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string src_wkt_fn;
 	std::string t_bounds_wkt_fn;
 	std::string s_srs;
 	std::string t_srs;
 	std::string report_fn;
+	bool adaptive = false;
+	size_t num_threads = 1;
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -133,6 +241,16 @@ int main(int argc, char **argv) {
 			} else if(arg == "-report") {
 				if(argp == arg_list.size()) usage(cmdname);
 				report_fn = arg_list[argp++];
+			} else if(arg == "-adaptive") {
+				adaptive = true;
+			} else if(arg == "-threads") {
+				if(argp == arg_list.size()) usage(cmdname);
+				try {
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+				} catch(boost::bad_lexical_cast &e) {
+					fatal_error("cannot parse number given on command line");
+				}
+				if(!num_threads) fatal_error("-threads must be positive");
 			} else {
 				usage(cmdname);
 			}
@@ -157,13 +275,12 @@ int main(int argc, char **argv) {
 	if(OSRImportFromProj4(t_sref, t_srs.c_str()) != OGRERR_NONE)
 		fatal_error("cannot parse proj4 definition for -t_srs");
 
-	OGRCoordinateTransformationH fwd_xform = 
-		OCTNewCoordinateTransformation(s_sref, t_sref);
-	OGRCoordinateTransformationH inv_xform = 
-		OCTNewCoordinateTransformation(t_sref, s_sref);
+	const PointProjector projector(s_sref, t_sref, num_threads);
 
+	StageTimer read_timer("read", "vertices");
 	Mpoly src_mp = mpoly_from_wktfile(src_wkt_fn);
 	Bbox src_bbox = src_mp.getBbox();
+	const PreparedMpoly src_prep(src_mp);
 
 	Mpoly t_bounds_mp;
 	bool use_t_bounds;
@@ -175,6 +292,9 @@ int main(int argc, char **argv) {
 	} else {
 		use_t_bounds = 0;
 	}
+	const PreparedMpoly t_bounds_prep(t_bounds_mp);
+	read_timer.add_items(src_mp.num_vertices() + t_bounds_mp.num_vertices());
+	read_timer.stop();
 
 	Ring pl;
 
@@ -182,12 +302,30 @@ int main(int argc, char **argv) {
 	PointStats ps_interior;
 	PointStats ps_bounds;
 
+	int num_grid_steps = 100;
+	double border_step_len = std::max(
+		src_bbox.max_x - src_bbox.min_x,
+		src_bbox.max_y - src_bbox.min_y) / 1000.0;
+	double t_bounds_step_len = std::max(
+		t_bounds_bbox.max_x - t_bounds_bbox.min_x,
+		t_bounds_bbox.max_y - t_bounds_bbox.min_y) / 1000.0;
+
+	if(adaptive) {
+		AdaptiveSampler sampler(projector, src_prep,
+			use_t_bounds ? &t_bounds_prep : NULL, pl);
+		// The edges are done first since they usually give the bounds, which then
+		// lets most of the grid be skipped.
+		sampler.sample_rings(src_mp, border_step_len, true, ps_border);
+		if(use_t_bounds) sampler.sample_rings(t_bounds_mp, t_bounds_step_len, false, ps_bounds);
+		sampler.sample_grid(src_bbox, num_grid_steps, ps_interior);
+	} else { // indented less, to keep the fixed sampling as it was
+
 	// Sample a regular grid of points, take the ones within the source region,
 	// and project them to the target projection.  This is done to handle the
 	// cases where the projected border does not necessarily encircle the
 	// source region (such as would be the case for a source region that
 	// encircles the pole with a target lonlat projection).
-	int num_grid_steps = 100;
+	std::vector<Vertex> grid_pts;
 	for(int grid_xi=0; grid_xi<=num_grid_steps; grid_xi++) {
 		Vertex src_pt;
 		double alpha_x = (double)grid_xi / (double)num_grid_steps;
@@ -195,28 +333,33 @@ int main(int argc, char **argv) {
 		for(int grid_yi=0; grid_yi<=num_grid_steps; grid_yi++) {
 			double alpha_y = (double)grid_yi / (double)num_grid_steps;
 			src_pt.y = src_bbox.min_y + (src_bbox.max_y - src_bbox.min_y) * alpha_y;
-			if(!src_mp.contains(src_pt)) continue;
-
-			ps_interior.total++;
+			grid_pts.push_back(src_pt);
+		}
+	}
+	std::vector<bool> grid_pt_inside = src_prep.contains(grid_pts);
+	std::vector<Vertex> tgt_pts;
+	for(size_t i=0; i<grid_pts.size(); i++) {
+		if(grid_pt_inside[i]) tgt_pts.push_back(grid_pts[i]);
+	}
+	std::vector<bool> proj_ok;
+	projector.transform(true, tgt_pts, proj_ok);
+	for(size_t i=0; i<tgt_pts.size(); i++) {
+		ps_interior.total++;
 
-			Vertex tgt_pt = src_pt;
-			if(!picky_transform(fwd_xform, inv_xform, &tgt_pt)) {
-				continue;
-			}
+		if(!proj_ok[i]) continue;
+		const Vertex &tgt_pt = tgt_pts[i];
 
-			ps_interior.proj_ok++;
+		ps_interior.proj_ok++;
 
-			if(!use_t_bounds || t_bounds_mp.contains(tgt_pt)) {
-				ps_interior.contained++;
-				pl.pts.push_back(tgt_pt);
-			}
+		if(!use_t_bounds || t_bounds_prep.contains(tgt_pt)) {
+			ps_interior.contained++;
+			pl.pts.push_back(tgt_pt);
 		}
 	}
 
 	// Project points along the source region border to the target projection.
-	double max_step_len = std::max(
-		src_bbox.max_x - src_bbox.min_x,
-		src_bbox.max_y - src_bbox.min_y) / 1000.0;
+	double max_step_len = border_step_len;
+	tgt_pts.clear();
 	for(size_t r_idx=0; r_idx<src_mp.rings.size(); r_idx++) {
 		const Ring &ring = src_mp.rings[r_idx];
 		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
@@ -231,30 +374,30 @@ int main(int argc, char **argv) {
 				Vertex src_pt;
 				src_pt.x = v1.x + dx * alpha;
 				src_pt.y = v1.y + dy * alpha;
+				tgt_pts.push_back(src_pt);
+			}
+		}
+	}
+	projector.transform(true, tgt_pts, proj_ok);
+	for(size_t i=0; i<tgt_pts.size(); i++) {
+		ps_border.total++;
 
-				ps_border.total++;
+		if(!proj_ok[i]) continue;
+		const Vertex &tgt_pt = tgt_pts[i];
 
-				Vertex tgt_pt = src_pt;
-				if(!picky_transform(fwd_xform, inv_xform, &tgt_pt)) {
-					continue;
-				}
+		ps_border.proj_ok++;
 
-				ps_border.proj_ok++;
-
-				if(!use_t_bounds || t_bounds_mp.contains(tgt_pt)) {
-					ps_border.contained++;
-					pl.pts.push_back(tgt_pt);
-				}
-			}
+		if(!use_t_bounds || t_bounds_prep.contains(tgt_pt)) {
+			ps_border.contained++;
+			pl.pts.push_back(tgt_pt);
 		}
 	}
 
 	// Take points along the border of the t_bounds clip shape that lie within the
 	// source region.
 	if(use_t_bounds) {
-		double max_step_len = std::max(
-			t_bounds_bbox.max_x - t_bounds_bbox.min_x,
-			t_bounds_bbox.max_y - t_bounds_bbox.min_y) / 1000.0;
+		double max_step_len = t_bounds_step_len;
+		tgt_pts.clear();
 		for(size_t r_idx=0; r_idx<t_bounds_mp.rings.size(); r_idx++) {
 			const Ring &ring = t_bounds_mp.rings[r_idx];
 			for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
@@ -269,25 +412,28 @@ int main(int argc, char **argv) {
 					Vertex tgt_pt;
 					tgt_pt.x = v1.x + dx * alpha;
 					tgt_pt.y = v1.y + dy * alpha;
+					tgt_pts.push_back(tgt_pt);
+				}
+			}
+		}
+		std::vector<Vertex> src_pts = tgt_pts;
+		projector.transform(false, src_pts, proj_ok);
+		for(size_t i=0; i<src_pts.size(); i++) {
+			ps_bounds.total++;
 
-					ps_bounds.total++;
-
-					Vertex src_pt = tgt_pt;
-					if(!picky_transform(inv_xform, fwd_xform, &src_pt)) {
-						continue;
-					}
+			if(!proj_ok[i]) continue;
 
-					ps_bounds.proj_ok++;
+			ps_bounds.proj_ok++;
 
-					if(src_mp.contains(src_pt)) {
-						ps_bounds.contained++;
-						pl.pts.push_back(tgt_pt);
-					}
-				}
+			if(src_prep.contains(src_pts[i])) {
+				ps_bounds.contained++;
+				pl.pts.push_back(tgt_pts[i]);
 			}
 		}
 	}
 
+	} // !adaptive
+
 	//bool debug = 1;
 	//if(debug) {
 	//	ps_border.printYaml("stats_border");
@@ -303,11 +449,280 @@ int main(int argc, char **argv) {
 	printf("  max_e: %.15f\n", bbox.max_x);
 	printf("  max_n: %.15f\n", bbox.max_y);
 
-	if(report_fn.size()) plot_points(pl, report_fn);
+	if(report_fn.size()) {
+		StageTimer timer("report");
+		plot_points(pl, report_fn);
+	}
 
 	return 0;
 }
 
+PointProjector::PointProjector(
+	OGRSpatialReferenceH s_sref, OGRSpatialReferenceH t_sref, size_t num_threads
+) {
+	for(size_t i=0; i<num_threads; i++) {
+		XformPair xf;
+		xf.fwd = OCTNewCoordinateTransformation(s_sref, t_sref);
+		xf.inv = OCTNewCoordinateTransformation(t_sref, s_sref);
+		xforms.push_back(xf);
+	}
+}
+
+PointProjector::~PointProjector() {
+	for(size_t i=0; i<xforms.size(); i++) {
+		if(xforms[i].fwd) OCTDestroyCoordinateTransformation(xforms[i].fwd);
+		if(xforms[i].inv) OCTDestroyCoordinateTransformation(xforms[i].inv);
+	}
+}
+
+void PointProjector::transform_chunk(
+	const XformPair *xf, bool forward, std::vector<Vertex> *pts, std::vector<bool> *ok
+) {
+	if(forward) {
+		picky_transform(xf->fwd, xf->inv, *pts, *ok);
+	} else {
+		picky_transform(xf->inv, xf->fwd, *pts, *ok);
+	}
+}
+
+void PointProjector::transform(bool forward, std::vector<Vertex> &pts, std::vector<bool> &ok) const {
+	StageTimer timer("project", "points");
+	timer.add_items(pts.size());
+
+	// not worth starting threads for just a few points
+	const size_t min_chunk = 256;
+	size_t num_chunks = std::min(xforms.size(), pts.size() / min_chunk);
+	if(num_chunks <= 1) {
+		transform_chunk(&xforms[0], forward, &pts, &ok);
+		return;
+	}
+
+	std::vector<std::vector<Vertex> > chunk_pts(num_chunks);
+	std::vector<std::vector<bool> > chunk_ok(num_chunks);
+	for(size_t i=0; i<num_chunks; i++) {
+		size_t from = pts.size() * i / num_chunks;
+		size_t to = pts.size() * (i+1) / num_chunks;
+		chunk_pts[i].assign(pts.begin() + from, pts.begin() + to);
+	}
+
+	boost::thread_group threads;
+	for(size_t i=0; i<num_chunks; i++) {
+		threads.add_thread(new boost::thread(&PointProjector::transform_chunk,
+			&xforms[i], forward, &chunk_pts[i], &chunk_ok[i]));
+	}
+	threads.join_all();
+
+	pts.clear();
+	ok.clear();
+	for(size_t i=0; i<num_chunks; i++) {
+		pts.insert(pts.end(), chunk_pts[i].begin(), chunk_pts[i].end());
+		ok.insert(ok.end(), chunk_ok[i].begin(), chunk_ok[i].end());
+	}
+}
+
+const int AdaptiveSampler::COARSE_STEP;
+
+void AdaptiveSampler::add_ok(const Sample &s) {
+	pl.pts.push_back(s.tgt);
+	bounds.expand(s.tgt);
+}
+
+bool AdaptiveSampler::worth_refining(const Sample *const *s, size_t n) const {
+	size_t num_ok = 0;
+	Bbox local;
+	for(size_t i=0; i<n; i++) {
+		if(!s[i]->ok) continue;
+		local.expand(s[i]->tgt);
+		num_ok++;
+	}
+	// nothing to go on
+	if(!num_ok) return false;
+	// the edge of the region, a singularity, or the target bounds is in here
+	if(num_ok < n) return true;
+
+	// Guess that points in between can stray from the corners by as much as the
+	// corners differ from each other.
+	double slack_x = local.max_x - local.min_x;
+	double slack_y = local.max_y - local.min_y;
+	return
+		local.max_x + slack_x >= bounds.max_x ||
+		local.min_x - slack_x <= bounds.min_x ||
+		local.max_y + slack_y >= bounds.max_y ||
+		local.min_y - slack_y <= bounds.min_y;
+}
+
+void AdaptiveSampler::grid_samples(
+	const std::vector<Vertex> &pts, std::vector<Sample> &out, PointStats &ps
+) {
+	out.resize(pts.size());
+	std::vector<bool> inside = src_prep.contains(pts);
+	std::vector<Vertex> tgt_pts;
+	for(size_t i=0; i<pts.size(); i++) {
+		out[i].ok = false;
+		if(inside[i]) tgt_pts.push_back(pts[i]);
+	}
+	std::vector<bool> proj_ok;
+	projector.transform(true, tgt_pts, proj_ok);
+
+	size_t j = 0;
+	for(size_t i=0; i<pts.size(); i++) {
+		if(!inside[i]) continue;
+		ps.total++;
+		Sample &s = out[i];
+		s.tgt = tgt_pts[j];
+		if(proj_ok[j]) {
+			ps.proj_ok++;
+			if(!t_bounds_prep || t_bounds_prep->contains(s.tgt)) {
+				ps.contained++;
+				s.ok = true;
+				add_ok(s);
+			}
+		}
+		j++;
+	}
+}
+
+void AdaptiveSampler::ring_samples(
+	const std::vector<Vertex> &pts, bool forward, std::vector<Sample> &out, PointStats &ps
+) {
+	std::vector<Vertex> xpts = pts;
+	std::vector<bool> proj_ok;
+	projector.transform(forward, xpts, proj_ok);
+
+	out.resize(pts.size());
+	for(size_t i=0; i<pts.size(); i++) {
+		ps.total++;
+		Sample &s = out[i];
+		s.ok = false;
+		if(!proj_ok[i]) continue;
+		ps.proj_ok++;
+		// The transformed point has to be inside of the other region.  The target
+		// point is either that one or the original.
+		s.tgt = forward ? xpts[i] : pts[i];
+		bool contained = forward ?
+			(!t_bounds_prep || t_bounds_prep->contains(xpts[i])) :
+			src_prep.contains(xpts[i]);
+		if(contained) {
+			ps.contained++;
+			s.ok = true;
+			add_ok(s);
+		}
+	}
+}
+
+void AdaptiveSampler::sample_rings(
+	const Mpoly &mp, double max_step_len, bool forward, PointStats &ps
+) {
+	std::vector<Sample> samples;
+	std::vector<Segment> segs;
+	std::vector<Vertex> pts;
+
+	for(size_t r_idx=0; r_idx<mp.rings.size(); r_idx++) {
+		const Ring &ring = mp.rings[r_idx];
+		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
+			Segment seg;
+			seg.v1 = ring.pts[v_idx];
+			seg.v2 = ring.pts[(v_idx+1) % ring.pts.size()];
+			double dx = seg.v2.x - seg.v1.x;
+			double dy = seg.v2.y - seg.v1.y;
+			double len = sqrt(dx*dx + dy*dy);
+			seg.num_steps = 1 + (int)(len / max_step_len);
+			for(int step=0; step<seg.num_steps; step+=COARSE_STEP) {
+				seg.from = step;
+				seg.to = std::min(step + COARSE_STEP, seg.num_steps);
+				seg.s_from = pts.size();
+				seg.s_to = pts.size() + 1;
+				pts.push_back(seg.at(seg.from));
+				pts.push_back(seg.at(seg.to));
+				segs.push_back(seg);
+			}
+		}
+	}
+	ring_samples(pts, forward, samples, ps);
+
+	while(!segs.empty()) {
+		std::vector<Segment> next;
+		pts.clear();
+		for(size_t i=0; i<segs.size(); i++) {
+			const Segment &seg = segs[i];
+			if(seg.to - seg.from < 2) continue;
+			const Sample *ends[2] = { &samples[seg.s_from], &samples[seg.s_to] };
+			if(!worth_refining(ends, 2)) continue;
+
+			int mid = (seg.from + seg.to) / 2;
+			size_t s_mid = samples.size() + pts.size();
+			pts.push_back(seg.at(mid));
+			Segment a = seg, b = seg;
+			a.to = mid;   a.s_to = s_mid;
+			b.from = mid; b.s_from = s_mid;
+			next.push_back(a);
+			next.push_back(b);
+		}
+		std::vector<Sample> new_samples;
+		ring_samples(pts, forward, new_samples, ps);
+		samples.insert(samples.end(), new_samples.begin(), new_samples.end());
+		segs.swap(next);
+	}
+}
+
+void AdaptiveSampler::sample_grid(const Bbox &src_bbox, int num_grid_steps, PointStats &ps) {
+	std::map<std::pair<int, int>, size_t> sample_idx;
+	std::vector<Sample> samples;
+
+	std::vector<Cell> cells;
+	for(int y=0; y<num_grid_steps; y+=COARSE_STEP) {
+		for(int x=0; x<num_grid_steps; x+=COARSE_STEP) {
+			Cell c = { x, y, COARSE_STEP };
+			cells.push_back(c);
+		}
+	}
+
+	while(!cells.empty()) {
+		// the corners that haven't been looked at yet
+		std::vector<std::pair<int, int> > keys;
+		std::vector<Vertex> pts;
+		for(size_t i=0; i<cells.size(); i++) {
+			const Cell &c = cells[i];
+			for(int corner=0; corner<4; corner++) {
+				int x = std::min(c.x0 + ((corner & 1) ? c.size : 0), num_grid_steps);
+				int y = std::min(c.y0 + ((corner & 2) ? c.size : 0), num_grid_steps);
+				std::pair<int, int> key(x, y);
+				if(sample_idx.count(key)) continue;
+				sample_idx[key] = samples.size() + keys.size();
+				keys.push_back(key);
+				double alpha_x = (double)x / (double)num_grid_steps;
+				double alpha_y = (double)y / (double)num_grid_steps;
+				pts.push_back(Vertex(
+					src_bbox.min_x + (src_bbox.max_x - src_bbox.min_x) * alpha_x,
+					src_bbox.min_y + (src_bbox.max_y - src_bbox.min_y) * alpha_y));
+			}
+		}
+		std::vector<Sample> new_samples;
+		grid_samples(pts, new_samples, ps);
+		samples.insert(samples.end(), new_samples.begin(), new_samples.end());
+
+		std::vector<Cell> next;
+		for(size_t i=0; i<cells.size(); i++) {
+			const Cell &c = cells[i];
+			if(c.size < 2) continue;
+			const Sample *corners[4];
+			for(int corner=0; corner<4; corner++) {
+				int x = std::min(c.x0 + ((corner & 1) ? c.size : 0), num_grid_steps);
+				int y = std::min(c.y0 + ((corner & 2) ? c.size : 0), num_grid_steps);
+				corners[corner] = &samples[sample_idx[std::make_pair(x, y)]];
+			}
+			if(!worth_refining(corners, 4)) continue;
+
+			int half = c.size / 2;
+			for(int sub=0; sub<4; sub++) {
+				Cell child = { c.x0 + ((sub & 1) ? half : 0), c.y0 + ((sub & 2) ? half : 0), half };
+				if(child.x0 < num_grid_steps && child.y0 < num_grid_steps) next.push_back(child);
+			}
+		}
+		cells.swap(next);
+	}
+}
+
 void plot_points(const Ring &pl, const std::string &fn) {
 	Bbox bbox = pl.getBbox();
 	bbox.min_x -= (bbox.max_x - bbox.min_x) * .05;
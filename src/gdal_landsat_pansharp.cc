@@ -27,17 +27,24 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include "common.h"
+#include "read_ahead.h"
 
 #include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
 
 #include <vector>
+#include <limits>
+#include <cstring>
 
 using namespace dangdal;
 
+// Rows of output computed by each job.
+static const size_t STRIP_ROWS = 64;
+
 struct ScaledBand {
 	ScaledBand() :
 		oversample(0), lo_w(0), lo_h(0), hi_w(0), hi_h(0),
-		delta_x(0), delta_y(0), band(NULL), line_buf_idx(0)
+		delta_x(0), delta_y(0), band(NULL), line_buf_idx(0), lores_origin(0)
 	{ }
 
 	int oversample;
@@ -49,10 +56,73 @@ struct ScaledBand {
 	GDALRasterBandH band;
 	std::vector<std::vector<double> > lines_buf;
 	int line_buf_idx;
+	// A lo-res row, with zeros on either side so that the kernel never
+	// reaches past the ends.  Column x is at lores_origin + x.
+	std::vector<double> lores_buf;
+	size_t lores_origin;
+};
+
+// The inputs and buffers used by one thread.
+struct SharpenInputs {
+	GDALRasterBandH pan_band;
+	std::vector<ScaledBand> rgb_bands;
+	std::vector<ScaledBand> lum_bands;
+	std::vector<std::vector<double> > lum_buf;
+	std::vector<double> pan_buf;
+	std::vector<double> rgb_buf;
+	std::vector<double> scale_buf;
+};
+
+struct SharpenParams {
+	size_t w, h;
+	std::vector<double> lum_weights;
+	bool use_ndv;
+	double ndv;
+	GDALDataType out_dt;
+};
+
+// Computes the output in strips of rows.  Strips are computed on background threads a couple
+// of strips ahead of the caller and are handed back in order.  With one thread the caller's
+// handles on the inputs are used, and must not be used elsewhere until the StripSharpener is
+// destroyed.  With more than one thread each worker opens its own handles since GDAL handles
+// can't be shared between threads.
+class StripSharpener : public ReadAhead<std::vector<uint8_t> >::Producer {
+public:
+	StripSharpener(const SharpenParams &params,
+		const std::vector<GDALDatasetH> &rgb_ds, const std::vector<GDALDatasetH> &lum_ds,
+		GDALDatasetH pan_ds, size_t num_threads);
+	~StripSharpener();
+
+	// The next strip, or NULL after the last one.  It is in the output datatype, with the
+	// bands of each pixel interleaved.  It is valid until the next call.
+	const uint8_t *next_strip(size_t *row0_out, size_t *num_rows_out);
+
+	size_t rgb_band_count;
+
+	virtual void produce(size_t job, size_t worker_idx, std::vector<uint8_t> &out);
+
+private:
+	// not copyable
+	StripSharpener(const StripSharpener &);
+	StripSharpener &operator=(const StripSharpener &);
+
+	const SharpenParams &params;
+	size_t num_strips;
+	size_t next_out;
+
+	// handles opened for the workers, if there is more than one
+	std::vector<std::vector<GDALDatasetH> > worker_ds;
+	// the inputs and buffers of each worker
+	std::vector<SharpenInputs> worker_inputs;
+	ReadAhead<std::vector<uint8_t> > *read_ahead;
 };
 
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds);
 ScaledBand getScaledBand(GDALDatasetH lores_ds, int band_id, GDALDatasetH hires_ds);
+SharpenInputs openInputs(const std::vector<GDALDatasetH> &rgb_ds,
+	const std::vector<GDALDatasetH> &lum_ds, GDALDatasetH pan_ds);
+void sharpenRow(const SharpenParams &p, SharpenInputs &in, size_t row,
+	const double *pan_row, uint8_t *out);
 void readLineScaled(ScaledBand &sb, int row, double *hires_buf);
 double avoidNDV(double in, double ndv, GDALDataType out_dt);
 
@@ -61,11 +131,12 @@ void usage(const std::string &cmdname) {
 	printf(
 "      -rgb <src_rgb.tif> [ -rgb <src.tif> ... ]\n"
 "      [ -lum <lum.tif> <weight> ... ] -pan <pan.tif>\n"
-"      [ -ndv <nodataval> ] -o <out-rgb.tif>\n"
+"      [ -ndv <nodataval> ] [ -threads N ] -o <out-rgb.tif>\n"
 "\nWhere:\n"
 "    rgb.tif    Source bands that are to be enhanced\n"
 "    lum.tif    Bands used to simulate lo-res pan band\n"
 "    pan.tif    Hi-res panchromatic band\n"
+"    N          Number of threads to use (default is 1)\n"
 "\nExamples, basic usage:\n"
 "    gdal_landsat_pansharp -rgb quickbird_rgb.tif -pan quickbird_pan.tif -o out.tif\n"
 "\nExamples, using simulated pan band (gives better results):\n"
@@ -76,6 +147,7 @@ void usage(const std::string &cmdname) {
 "      -lum landsat2.tif 0.25 -lum landsat3.tif 0.23 -lum landsat4.tif 0.52 \\\n"
 "      -pan landsat8.tif -ndv 0 -o out.tif\n\n"
 );
+	StageTimer::printUsage();
 	exit(1);
 }
 
@@ -83,6 +155,7 @@ int main(int argc, char *argv[]) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::vector<GDALDatasetH> rgb_ds;
 	std::vector<GDALDatasetH> lum_ds;
@@ -93,6 +166,7 @@ int main(int argc, char *argv[]) {
 	std::string output_format;
 	double ndv = 0;
 	bool use_ndv = 0;
+	size_t num_threads = 1;
 
 	GDALAllRegister();
 
@@ -107,6 +181,11 @@ int main(int argc, char *argv[]) {
 					ndv = boost::lexical_cast<double>(arg_list[argp++].c_str());
 					use_ndv = true;
 				} 
+				else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!num_threads) fatal_error("-threads must be positive");
+				}
 				else if(arg == "-of" ) { if(argp == arg_list.size()) usage(cmdname); output_format = arg_list[argp++]; }
 				else if(arg == "-o"  ) { if(argp == arg_list.size()) usage(cmdname); dst_fn = arg_list[argp++]; }
 				else if(arg == "-pan") { if(argp == arg_list.size()) usage(cmdname); pan_fn = arg_list[argp++]; }
@@ -163,31 +242,26 @@ int main(int argc, char *argv[]) {
 
 	/////
 
-	std::vector<ScaledBand> rgb_bands;
+	size_t rgb_band_count = 0;
 	for(size_t ds_idx=0; ds_idx<rgb_ds.size(); ds_idx++) {
 		int nb = GDALGetRasterCount(rgb_ds[ds_idx]);
 		for(int i=0; i<nb; i++) {
-			rgb_bands.push_back(getScaledBand(rgb_ds[ds_idx], i+1, pan_ds));
 			out_dt = GDALDataTypeUnion(out_dt, GDALGetRasterDataType(
 				GDALGetRasterBand(rgb_ds[ds_idx], i+1)));
+			rgb_band_count++;
 		}
 	}
-	size_t rgb_band_count = rgb_bands.size();
 	if(!rgb_band_count) usage(cmdname);
 
-	std::vector<ScaledBand> lum_bands;
+	size_t lum_band_count = rgb_band_count;
 	if(!lum_ds.empty()) {
+		lum_band_count = 0;
 		for(size_t ds_idx=0; ds_idx<lum_ds.size(); ds_idx++) {
-			int nb = GDALGetRasterCount(lum_ds[ds_idx]);
-			for(int i=0; i<nb; i++) {
-				lum_bands.push_back(getScaledBand(lum_ds[ds_idx], i+1, pan_ds));
-			}
+			lum_band_count += GDALGetRasterCount(lum_ds[ds_idx]);
 		}
 	} else {
-		lum_bands = rgb_bands;
 		lum_weights.assign(rgb_band_count, 1);
 	}
-	size_t lum_band_count = lum_bands.size();
 
 	double lum_weight_total = 0;
 	for(size_t i=0; i<lum_band_count; i++) {
@@ -200,6 +274,16 @@ int main(int argc, char *argv[]) {
 	}
 	//printf("\n");
 
+	// This opens the inputs, and starts the workers if there are any.
+	SharpenParams params;
+	params.w = w;
+	params.h = h;
+	params.lum_weights = lum_weights;
+	params.use_ndv = use_ndv;
+	params.ndv = ndv;
+	params.out_dt = out_dt;
+	StripSharpener sharpener(params, rgb_ds, lum_ds, pan_ds, num_threads);
+
 	//////// open output ////////
 
 	printf("Output size is %zd x %zd x %zd\n", w, h, rgb_band_count);
@@ -221,69 +305,28 @@ int main(int argc, char *argv[]) {
 
 	//////// process data ////////
 
-	std::vector<std::vector<double> > lum_buf(lum_band_count);
-	for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
-		lum_buf[band_idx].resize(w);
-	}
-	std::vector<double> pan_buf(w);
-	std::vector<double> rgb_buf(w);
-	std::vector<double> out_buf(w);
-	std::vector<double> scale_buf(w);
-
-	for(size_t row=0; row<h; row++) {
-		GDALTermProgress((double)row/h, NULL, NULL);
-
-		GDALRasterIO(pan_band, GF_Read, 0, row, w, 1, &pan_buf[0], w, 1, GDT_Float64, 0, 0);
-		for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
-			readLineScaled(lum_bands[band_idx], row, &lum_buf[band_idx][0]);
+	// All bands are written with one call, already in the output type.
+	const int dt_size = GDALGetDataTypeSize(out_dt) / 8;
+	const int pixel_size = dt_size * rgb_band_count;
+	size_t row0, num_rows;
+	for(;;) {
+		const uint8_t *strip;
+		{
+			StageTimer timer("read_and_sharpen", "rows");
+			strip = sharpener.next_strip(&row0, &num_rows);
+			if(strip) timer.add_items(num_rows);
 		}
+		if(!strip) break;
 
-		for(size_t col=0; col<w; col++) {
-			bool skip = 0;
+		GDALTermProgress((double)row0/h, NULL, NULL);
 
-			if(use_ndv) {
-				if(pan_buf[col] == ndv) skip = 1;
-				for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
-					if(lum_buf[band_idx][col] == ndv) {
-						skip = 1;
-					}
-				}
-			}
-
-			if(skip) {
-				scale_buf[col] = 1;
-			} else {
-				double lum_out = (double)pan_buf[col];
-				double lum_in = 0;
-				for(size_t i=0; i<lum_band_count; i++) {
-					lum_in += lum_buf[i][col] * lum_weights[i];
-				}
-
-				scale_buf[col] = lum_in>0 ? lum_out/lum_in : 0;
-			} // skip
-		} // col
-
-		for(size_t band_idx=0; band_idx<rgb_band_count; band_idx++) {
-			readLineScaled(rgb_bands[band_idx], row, &rgb_buf[0]);
-
-			for(size_t col=0; col<w; col++) {
-				if(use_ndv && rgb_buf[col] == ndv) {
-					out_buf[col] = ndv;
-				} else {
-					double dbl_val = rgb_buf[col] * scale_buf[col];
-
-					if(use_ndv) {
-						dbl_val = avoidNDV(dbl_val, ndv, out_dt);
-					}
-
-					out_buf[col] = dbl_val;
-				}
-			}
-
-			GDALRasterIO(dst_bands[band_idx], GF_Write, 0, row, w, 1,
-				&out_buf[0], w, 1, GDT_Float64, 0, 0);
-		}
-	} // row
+		StageTimer timer("write", "rows");
+		timer.add_items(num_rows);
+		CPLErr err = GDALDatasetRasterIO(dst_ds, GF_Write, 0, row0, w, num_rows,
+			const_cast<uint8_t *>(strip), w, num_rows, out_dt,
+			rgb_band_count, NULL, pixel_size, pixel_size * w, dt_size);
+		if(err != CE_None) fatal_error("could not write output");
+	}
 
 	for(size_t i=0; i<rgb_ds.size(); i++) {
 		GDALClose(rgb_ds[i]);
@@ -292,7 +335,10 @@ int main(int argc, char *argv[]) {
 		GDALClose(lum_ds[i]);
 	}
 	GDALClose(pan_ds);
-	GDALClose(dst_ds);
+	{
+		StageTimer timer("write");
+		GDALClose(dst_ds);
+	}
 
 	GDALTermProgress(1, NULL, NULL);
 
@@ -307,6 +353,258 @@ void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds) {
 	GDALSetProjection(dst_ds, GDALGetProjectionRef(src_ds));
 }
 
+StripSharpener::StripSharpener(
+	const SharpenParams &_params,
+	const std::vector<GDALDatasetH> &rgb_ds, const std::vector<GDALDatasetH> &lum_ds,
+	GDALDatasetH pan_ds, size_t num_threads
+) :
+	params(_params),
+	next_out(0),
+	read_ahead(NULL)
+{
+	num_strips = (params.h + STRIP_ROWS - 1) / STRIP_ROWS;
+
+	if(num_threads > 1) {
+		for(size_t i=0; i<num_threads; i++) {
+			// each worker reopens every input, in the same order
+			std::vector<GDALDatasetH> all_ds;
+			all_ds.insert(all_ds.end(), rgb_ds.begin(), rgb_ds.end());
+			all_ds.insert(all_ds.end(), lum_ds.begin(), lum_ds.end());
+			all_ds.push_back(pan_ds);
+			std::vector<GDALDatasetH> my_ds;
+			BOOST_FOREACH(GDALDatasetH ds, all_ds) {
+				const char *fn = GDALGetDescription(ds);
+				GDALDatasetH wds = GDALOpen(fn, GA_ReadOnly);
+				if(!wds) fatal_error("Could not reopen %s for a worker thread.", fn);
+				my_ds.push_back(wds);
+			}
+			std::vector<GDALDatasetH> my_rgb(my_ds.begin(), my_ds.begin() + rgb_ds.size());
+			std::vector<GDALDatasetH> my_lum(my_ds.begin() + rgb_ds.size(), my_ds.end() - 1);
+			worker_inputs.push_back(openInputs(my_rgb, my_lum, my_ds.back()));
+			worker_ds.push_back(my_ds);
+		}
+	} else {
+		worker_inputs.push_back(openInputs(rgb_ds, lum_ds, pan_ds));
+	}
+	rgb_band_count = worker_inputs[0].rgb_bands.size();
+
+	read_ahead = new ReadAhead<std::vector<uint8_t> >(this, num_strips,
+		worker_inputs.size(), 2 * worker_inputs.size());
+}
+
+StripSharpener::~StripSharpener() {
+	// stops the workers
+	delete read_ahead;
+
+	BOOST_FOREACH(const std::vector<GDALDatasetH> &v, worker_ds) {
+		BOOST_FOREACH(GDALDatasetH wds, v) GDALClose(wds);
+	}
+}
+
+void StripSharpener::produce(size_t job, size_t worker_idx, std::vector<uint8_t> &out) {
+	SharpenInputs &in = worker_inputs[worker_idx];
+	const size_t w = params.w;
+	size_t row0 = job * STRIP_ROWS;
+	size_t num_rows = std::min(STRIP_ROWS, params.h - row0);
+
+	in.pan_buf.resize(num_rows * w);
+	GDALRasterAdviseRead(in.pan_band, 0, row0, w, num_rows, w, num_rows, GDT_Float64, NULL);
+	CPLErr err = GDALRasterIO(in.pan_band, GF_Read, 0, row0, w, num_rows,
+		&in.pan_buf[0], w, num_rows, GDT_Float64, 0, 0);
+	if(err != CE_None) fatal_error("could not read pan band");
+
+	size_t row_size = w * rgb_band_count * (GDALGetDataTypeSize(params.out_dt) / 8);
+	out.resize(num_rows * row_size);
+	for(size_t j=0; j<num_rows; j++) {
+		sharpenRow(params, in, row0 + j, &in.pan_buf[j * w], &out[j * row_size]);
+	}
+}
+
+const uint8_t *StripSharpener::next_strip(size_t *row0_out, size_t *num_rows_out) {
+	const std::vector<uint8_t> *strip = read_ahead->next();
+	if(!strip) return NULL;
+	size_t job = next_out++;
+	*row0_out = job * STRIP_ROWS;
+	*num_rows_out = std::min(STRIP_ROWS, params.h - *row0_out);
+	return &(*strip)[0];
+}
+
+SharpenInputs openInputs(
+	const std::vector<GDALDatasetH> &rgb_ds,
+	const std::vector<GDALDatasetH> &lum_ds, GDALDatasetH pan_ds
+) {
+	SharpenInputs in;
+	in.pan_band = GDALGetRasterBand(pan_ds, 1);
+
+	for(size_t ds_idx=0; ds_idx<rgb_ds.size(); ds_idx++) {
+		int nb = GDALGetRasterCount(rgb_ds[ds_idx]);
+		for(int i=0; i<nb; i++) {
+			in.rgb_bands.push_back(getScaledBand(rgb_ds[ds_idx], i+1, pan_ds));
+		}
+	}
+
+	if(!lum_ds.empty()) {
+		for(size_t ds_idx=0; ds_idx<lum_ds.size(); ds_idx++) {
+			int nb = GDALGetRasterCount(lum_ds[ds_idx]);
+			for(int i=0; i<nb; i++) {
+				in.lum_bands.push_back(getScaledBand(lum_ds[ds_idx], i+1, pan_ds));
+			}
+		}
+	} else {
+		in.lum_bands = in.rgb_bands;
+	}
+
+	size_t w = GDALGetRasterXSize(pan_ds);
+	in.lum_buf.resize(in.lum_bands.size());
+	for(size_t band_idx=0; band_idx<in.lum_bands.size(); band_idx++) {
+		in.lum_buf[band_idx].resize(w);
+	}
+	in.rgb_buf.resize(w);
+	in.scale_buf.resize(w);
+
+	return in;
+}
+
+// Converts to an integer type the way GDAL does, by clamping and then rounding.
+template <typename T>
+T toIntType(double v) {
+	const double lo = std::numeric_limits<T>::min();
+	const double hi = std::numeric_limits<T>::max();
+	if(std::isnan(v)) return T(0);
+	if(v <= lo) return T(lo);
+	if(v >= hi) return T(hi);
+	return T(v >= 0 ? v + 0.5 : v - 0.5);
+}
+
+// Stores rgb*scale in an integer type, the same as avoidNDV() does followed by a write, but
+// without going through GDALCopyWords for each pixel.
+template <typename T>
+void storeBand_int(const double *rgb, const double *scale, size_t n,
+	bool use_ndv, double ndv, uint8_t *out, size_t stride
+) {
+	const int64_t ndv_int = int64_t(round(ndv));
+	const T ndv_out = toIntType<T>(ndv);
+	// move toward the center of the valid range, so as not to fall off the edge
+	const int64_t mid = (int64_t(std::numeric_limits<T>::min()) +
+		int64_t(std::numeric_limits<T>::max())) / 2;
+	const int64_t bump = (ndv < mid) ? 1 : -1;
+	for(size_t col=0; col<n; col++) {
+		T v;
+		if(use_ndv && rgb[col] == ndv) {
+			v = ndv_out;
+		} else {
+			v = toIntType<T>(rgb[col] * scale[col]);
+			if(use_ndv && int64_t(v) == ndv_int) v = T(int64_t(v) + bump);
+		}
+		memcpy(out + col*stride, &v, sizeof(T));
+	}
+}
+
+// Finite values too big for a float are clamped, as GDAL does.
+inline float toFloatType(double v) {
+	const double hi = std::numeric_limits<float>::max();
+	if(v > hi && !std::isinf(v)) return float(hi);
+	if(v < -hi && !std::isinf(v)) return float(-hi);
+	return float(v);
+}
+
+template <typename T>
+void storeBand_float(const double *rgb, const double *scale, size_t n,
+	bool use_ndv, double ndv, uint8_t *out, size_t stride
+) {
+	for(size_t col=0; col<n; col++) {
+		T v;
+		if(use_ndv && rgb[col] == ndv) {
+			v = T(ndv);
+		} else {
+			double d = rgb[col] * scale[col];
+			v = sizeof(T) < sizeof(double) ? T(toFloatType(d)) : T(d);
+			if(use_ndv && double(v) == ndv) v = T(double(v) + 1);
+		}
+		memcpy(out + col*stride, &v, sizeof(T));
+	}
+}
+
+// Any other type goes through GDALCopyWords.
+void storeBand_other(const double *rgb, const double *scale, size_t n,
+	bool use_ndv, double ndv, GDALDataType out_dt, uint8_t *out, size_t stride
+) {
+	for(size_t col=0; col<n; col++) {
+		double d;
+		if(use_ndv && rgb[col] == ndv) {
+			d = ndv;
+		} else {
+			d = rgb[col] * scale[col];
+			if(use_ndv) d = avoidNDV(d, ndv, out_dt);
+		}
+		GDALCopyWords(&d, GDT_Float64, 0, out + col*stride, out_dt, 0, 1);
+	}
+}
+
+// Computes one row of output, in out_dt with the bands of each pixel interleaved.
+void sharpenRow(const SharpenParams &p, SharpenInputs &in, size_t row,
+	const double *pan_row, uint8_t *out
+) {
+	const size_t w = p.w;
+	const size_t lum_band_count = in.lum_bands.size();
+	const size_t rgb_band_count = in.rgb_bands.size();
+	const std::vector<double> &lum_weights = p.lum_weights;
+	const bool use_ndv = p.use_ndv;
+	const double ndv = p.ndv;
+	std::vector<std::vector<double> > &lum_buf = in.lum_buf;
+	std::vector<double> &rgb_buf = in.rgb_buf;
+	std::vector<double> &scale_buf = in.scale_buf;
+
+	for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
+		readLineScaled(in.lum_bands[band_idx], row, &lum_buf[band_idx][0]);
+	}
+
+	for(size_t col=0; col<w; col++) {
+		bool skip = 0;
+
+		if(use_ndv) {
+			if(pan_row[col] == ndv) skip = 1;
+			for(size_t band_idx=0; band_idx<lum_band_count; band_idx++) {
+				if(lum_buf[band_idx][col] == ndv) {
+					skip = 1;
+				}
+			}
+		}
+
+		if(skip) {
+			scale_buf[col] = 1;
+		} else {
+			double lum_out = pan_row[col];
+			double lum_in = 0;
+			for(size_t i=0; i<lum_band_count; i++) {
+				lum_in += lum_buf[i][col] * lum_weights[i];
+			}
+
+			scale_buf[col] = lum_in>0 ? lum_out/lum_in : 0;
+		} // skip
+	} // col
+
+	const size_t dt_size = GDALGetDataTypeSize(p.out_dt) / 8;
+	const size_t stride = dt_size * rgb_band_count;
+	for(size_t band_idx=0; band_idx<rgb_band_count; band_idx++) {
+		readLineScaled(in.rgb_bands[band_idx], row, &rgb_buf[0]);
+		const double *rgb = &rgb_buf[0];
+		const double *scale = &scale_buf[0];
+		uint8_t *band_out = out + band_idx * dt_size;
+
+		switch(p.out_dt) {
+			case GDT_Byte:    storeBand_int< uint8_t>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			case GDT_UInt16:  storeBand_int<uint16_t>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			case GDT_Int16:   storeBand_int< int16_t>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			case GDT_UInt32:  storeBand_int<uint32_t>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			case GDT_Int32:   storeBand_int< int32_t>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			case GDT_Float32: storeBand_float<float>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			case GDT_Float64: storeBand_float<double>(rgb, scale, w, use_ndv, ndv, band_out, stride); break;
+			default: storeBand_other(rgb, scale, w, use_ndv, ndv, p.out_dt, band_out, stride);
+		}
+	}
+}
+
 ScaledBand getScaledBand(GDALDatasetH lores_ds, int band_id, GDALDatasetH hires_ds) {
 	double lores_affine[6];
 	double hires_affine[6];
@@ -382,30 +680,41 @@ ScaledBand getScaledBand(GDALDatasetH lores_ds, int band_id, GDALDatasetH hires_
 	}
 	sb.line_buf_idx = -1000000;
 
+	// The kernel reads columns delta_x-1 through the last x0 plus delta_x+2.
+	int max_x0 = int((sb.hi_w - 1) / sb.oversample);
+	int buf_lo = std::min(0, sb.delta_x - 1);
+	int buf_hi = std::max(int(sb.lo_w), max_x0 + sb.delta_x + 3);
+	sb.lores_buf.assign(buf_hi - buf_lo, 0);
+	sb.lores_origin = -buf_lo;
+
 	return sb;
 }
 
 void readLineScaled1D(ScaledBand &sb, int row, double *hires_buf) {
-	std::vector<double> lores_buf(sb.lo_w);
-
 	if(row < 0 || size_t(row) >= sb.lo_h) {
 		for(size_t col=0; col<sb.hi_w; col++) {
 			hires_buf[col] = 0;
 		}
 	} else {
-		GDALRasterIO(sb.band, GF_Read, 0, row, sb.lo_w, 1, &lores_buf[0], sb.lo_w, 1, GDT_Float64, 0, 0);
-		for(int mx=0; mx<sb.oversample; mx++) {
-			double *kernel = &sb.kernel_x[mx][0];
-			for(int x0=0; ; x0++) {
-				size_t col = x0 * sb.oversample + mx;
-				if(col >= sb.hi_w) break;
+		GDALRasterIO(sb.band, GF_Read, 0, row, sb.lo_w, 1, &sb.lores_buf[sb.lores_origin],
+			sb.lo_w, 1, GDT_Float64, 0, 0);
+		// src[x0+i] is tap i for output column x0*oversample+mx
+		const double *src = &sb.lores_buf[sb.lores_origin + sb.delta_x - 1];
+		const size_t os = sb.oversample;
+		for(size_t mx=0; mx<os && mx<sb.hi_w; mx++) {
+			const double k0 = sb.kernel_x[mx][0];
+			const double k1 = sb.kernel_x[mx][1];
+			const double k2 = sb.kernel_x[mx][2];
+			const double k3 = sb.kernel_x[mx][3];
+			double *out = hires_buf + mx;
+			size_t n = (sb.hi_w - mx + os - 1) / os;
+			for(size_t x0=0; x0<n; x0++) {
 				double accum = 0;
-				for(int i=0; i<4; i++) {
-					int x = x0 - 1 + i + sb.delta_x;
-					double v = (x<0 || size_t(x) >= sb.lo_w) ? 0 : lores_buf[x];
-					accum += v * kernel[i];
-				}
-				hires_buf[col] = accum;
+				accum += src[x0  ] * k0;
+				accum += src[x0+1] * k1;
+				accum += src[x0+2] * k2;
+				accum += src[x0+3] * k3;
+				out[x0 * os] = accum;
 			}
 		}
 	}
@@ -414,7 +723,6 @@ void readLineScaled1D(ScaledBand &sb, int row, double *hires_buf) {
 void readLineScaled(ScaledBand &sb, int row, double *hires_buf) {
 	int y0 = row / sb.oversample;
 	int my = row % sb.oversample;
-	double *kernel = &sb.kernel_y[my][0];
 
 	int top_y = y0 - 1 + sb.delta_y;
 	if(top_y == sb.line_buf_idx) {
@@ -435,11 +743,20 @@ void readLineScaled(ScaledBand &sb, int row, double *hires_buf) {
 		sb.line_buf_idx = top_y;
 	}
 
+	const double k0 = sb.kernel_y[my][0];
+	const double k1 = sb.kernel_y[my][1];
+	const double k2 = sb.kernel_y[my][2];
+	const double k3 = sb.kernel_y[my][3];
+	const double *l0 = &sb.lines_buf[0][0];
+	const double *l1 = &sb.lines_buf[1][0];
+	const double *l2 = &sb.lines_buf[2][0];
+	const double *l3 = &sb.lines_buf[3][0];
 	for(size_t col=0; col<sb.hi_w; col++) {
 		double accum = 0;
-		for(int j=0; j<4; j++) {
-			accum += sb.lines_buf[j][col] * kernel[j];
-		}
+		accum += l0[col] * k0;
+		accum += l1[col] * k1;
+		accum += l2[col] * k2;
+		accum += l3[col] * k3;
 		hires_buf[col] = accum;
 	}
 }
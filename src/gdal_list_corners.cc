@@ -29,6 +29,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include <boost/lexical_cast.hpp>
 
 #include "common.h"
+#include "batch.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
 #include "debugplot.h"
@@ -46,6 +47,12 @@ void usage(const std::string &cmdname) {
 	GeoOpts::printUsage();
 	printf("\n");
 	NdvDef::printUsage();
+	printf("\n");
+	MorphologyOpts::printUsage();
+	printf("\n");
+	BatchOpts::printUsage();
+	printf("\n");
+	StageTimer::printUsage();
 
 	printf(
 "\n"
@@ -53,9 +60,10 @@ void usage(const std::string &cmdname) {
 "  -inspect-rect4              Attempt to find 4-sided bounding polygon\n"
 "  -fuzzy-match                Try to exclude logos and other extraneous\n"
 "                              pixels from bounding polygon\n"
+"  -rect4-pyramid N            Find the 4-sided polygon on the image reduced by a\n"
+"                              factor of N (from an overview if there is one), then\n"
+"                              refine it by reading only the image near its sides\n"
 "  -b band_id -b band_id ...   Bands to inspect (default is all bands)\n"
-"  -erosion                    Erode pixels that don't have two consecutive\n"
-"                              neighbors\n"
 "  -report fn.ppm              Output graphical report of bounds found\n"
 "  -mask-out fn.pbm            Output mask of bounding polygon in PBM format\n"
 "\n"
@@ -72,19 +80,20 @@ void usage(const std::string &cmdname) {
 	exit(1);
 }
 
-int main(int argc, char **argv) {
+static int tool_main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string input_raster_fn;
 
 	bool inspect_rect4 = 0;
 	bool fuzzy_match = 0;
+	int pyramid_factor = 0;
 	std::string debug_report;
 	std::string mask_out_fn;
 	std::vector<size_t> inspect_bandids;
-	bool do_erosion = 0;
 
 	// We will be sending YAML to stdout, so stuff that would normally
 	// go to stdout (such as debug messages or progress bars) should
@@ -96,6 +105,7 @@ int main(int argc, char **argv) {
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 	NdvDef ndv_def = NdvDef(arg_list);
+	MorphologyOpts morph_opts = MorphologyOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -109,12 +119,14 @@ int main(int argc, char **argv) {
 					inspect_rect4 = 1;
 				} else if(arg == "-fuzzy-match") {
 					fuzzy_match = 1;
+				} else if(arg == "-rect4-pyramid") {
+					if(argp == arg_list.size()) usage(cmdname);
+					pyramid_factor = boost::lexical_cast<int>(arg_list[argp++]);
+					if(pyramid_factor < 1) fatal_error("-rect4-pyramid factor must be positive");
 				} else if(arg == "-b") {
 					if(argp == arg_list.size()) usage(cmdname);
 					int bandid = boost::lexical_cast<int>(arg_list[argp++]);
 					inspect_bandids.push_back(bandid);
-				} else if(arg == "-erosion") {
-					do_erosion = 1;
 				} else if(arg == "-report") {
 					if(argp == arg_list.size()) usage(cmdname);
 					debug_report = arg_list[argp++];
@@ -156,7 +168,11 @@ int main(int argc, char **argv) {
 		if(debug_report.size())      fatal_error("-report option"+suffix);
 		if(mask_out_fn.size())       fatal_error("-mask-out option"+suffix);
 		if(!inspect_bandids.empty()) fatal_error("-b option"+suffix);
-		if(do_erosion)               fatal_error("-erosion option"+suffix);
+		if(!morph_opts.empty())      fatal_error("erosion/dilation options"+suffix);
+		if(pyramid_factor)           fatal_error("-rect4-pyramid option"+suffix);
+	}
+	if(pyramid_factor && !morph_opts.empty()) {
+		fatal_error("erosion/dilation options can't be used with -rect4-pyramid");
 	}
 
 	CPLPushErrorHandler(CPLQuietErrorHandler);
@@ -164,7 +180,8 @@ int main(int argc, char **argv) {
 	GeoRef georef = GeoRef(geo_opts, ds);
 
 	DebugPlot *dbuf = NULL;
-	BitGrid mask(0, 0);
+	Vertex centroid;
+	Ring rect4;
 	if(do_inspect) {
 		if(ndv_def.empty()) {
 			ndv_def = NdvDef(ds, inspect_bandids);
@@ -174,10 +191,28 @@ int main(int argc, char **argv) {
 			dbuf = new DebugPlot(georef.w, georef.h, PLOT_RECT4);
 		}
 
-		mask = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, dbuf);
+		if(pyramid_factor) {
+			// reads only parts of the image, interleaved with the search
+			StageTimer timer("read_and_rect4");
+			rect4 = calc_rect4_pyramid(ds, inspect_bandids, ndv_def, pyramid_factor,
+				dbuf, fuzzy_match, &centroid);
+		} else {
+			const uint64_t num_pixels = uint64_t(georef.w) * georef.h;
+			StageTimer read_timer("read", "pixels");
+			BitGrid mask = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, dbuf, 1);
+			read_timer.add_items(num_pixels);
+			read_timer.stop();
+
+			if(!morph_opts.empty()) {
+				StageTimer timer("morphology", "pixels");
+				morph_opts.apply(mask);
+				timer.add_items(num_pixels);
+			}
 
-		if(do_erosion) {
-			mask.erode();
+			StageTimer timer("rect4", "pixels");
+			centroid = mask.centroid();
+			rect4 = calc_rect4_from_mask(mask, georef.w, georef.h, dbuf, fuzzy_match);
+			timer.add_items(num_pixels);
 		}
 	}
 
@@ -249,9 +284,7 @@ int main(int argc, char **argv) {
 	fprintf(yaml_fh, "  y: %.15f\n", center.y);
 
 	if(do_inspect) {
-		Vertex centroid;
 		fprintf(yaml_fh, "centroid:\n");
-		centroid = mask.centroid();
 		if(georef.fwd_xform && georef.hasAffine()) {
 			georef.xy2ll_or_die(centroid.x, centroid.y, &lon, &lat);
 			fprintf(yaml_fh, "  lon: %.15f\n", lon);
@@ -267,8 +300,6 @@ int main(int argc, char **argv) {
 	}
 
 	if(inspect_rect4) {
-		Ring rect4 = calc_rect4_from_mask(mask, georef.w, georef.h, dbuf, fuzzy_match);
-
 		if(rect4.pts.size() != 4) {
 			fatal_error("could not find four-sided region");
 		}
@@ -277,7 +308,9 @@ int main(int argc, char **argv) {
 			Mpoly bpoly;
 			bpoly.rings.push_back(rect4);
 
+			StageTimer timer("mask_out", "pixels");
 			mask_from_mpoly(bpoly, georef.w, georef.h, mask_out_fn);
+			timer.add_items(uint64_t(georef.w) * georef.h);
 		}
 
 		const char *labels[] = { "upper_left", "upper_right", "lower_right", "lower_left" };
@@ -333,7 +366,10 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if(dbuf) dbuf->writePlot(debug_report);
+	if(dbuf) {
+		StageTimer timer("report");
+		dbuf->writePlot(debug_report);
+	}
 	
 	GDALClose(ds);
 
@@ -341,3 +377,10 @@ int main(int argc, char **argv) {
 
 	return 0;
 }
+
+int main(int argc, char **argv) {
+	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	BatchOpts batch_opts = BatchOpts(arg_list);
+	if(batch_opts.empty()) return tool_main(argc, argv);
+	return batch_opts.run(arg_list, tool_main) ? 1 : 0;
+}
@@ -34,18 +34,82 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 using namespace dangdal;
 
+// Writes a mask one row at a time, either as a PBM or as a 1-bit DEFLATE compressed
+// GeoTIFF having the georeferencing of the source image.  Either way only a single row
+// is held in memory.
+class MaskWriter {
+public:
+	MaskWriter(const std::string &fn, GDALDatasetH src_ds);
+	~MaskWriter();
+
+	// Row of the mask, one byte per pixel, nonzero meaning 'true'.  Rows must be given
+	// in order.
+	void write_row(const uint8_t *row);
+
+	static bool is_tiff_name(const std::string &fn);
+
+private:
+	size_t w, h;
+	size_t next_row;
+	FILE *pbm_out;
+	GDALDatasetH tiff_ds;
+	GDALRasterBandH tiff_band;
+	std::vector<uint8_t> buf;
+};
+
+void write_mask(const RleMask &mask, const std::string &fn, GDALDatasetH src_ds) {
+	if(!MaskWriter::is_tiff_name(fn)) {
+		mask.write_pbm(fn);
+		return;
+	}
+
+	MaskWriter writer(fn, src_ds);
+	const int w = GDALGetRasterXSize(src_ds);
+	const int h = GDALGetRasterYSize(src_ds);
+	std::vector<uint8_t> row(w);
+	for(int y=0; y<h; y++) {
+		std::fill(row.begin(), row.end(), 0);
+		const row_crossings_t &r = mask.row_runs(y);
+		for(size_t i=0; i<r.size(); i+=2) {
+			std::fill(row.begin() + r[i], row.begin() + r[i+1], 1);
+		}
+		writer.write_row(&row[0]);
+	}
+}
+
+void write_mask(const BitGrid &mask, const std::string &fn, GDALDatasetH src_ds) {
+	MaskWriter writer(fn, src_ds);
+	const int w = GDALGetRasterXSize(src_ds);
+	const int h = GDALGetRasterYSize(src_ds);
+	std::vector<uint8_t> row(w);
+	for(int y=0; y<h; y++) {
+		for(int x=0; x<w; x++) row[x] = mask(x, y);
+		writer.write_row(&row[0]);
+	}
+}
+
 void usage(const std::string &cmdname) {
 	printf("Usage:\n  %s [options] [image_name] [mask_name.pbm]\n", cmdname.c_str());
 	printf("\n");
+	printf("If mask_name ends in .tif the mask is written as a 1-bit GeoTIFF.\n");
+	printf("\n");
 	
 	NdvDef::printUsage();
+	printf("\n");
+	MorphologyOpts::printUsage();
+	printf("\n");
+	StageTimer::printUsage();
 
 	printf(
 "\n"
 "Misc:\n"
 "  -b band_id -b band_id ...   Bands to inspect (default is all bands)\n"
 "  -invert              Make mask cover no-data pixels instead of data pixels\n"
-"  -erosion             Erode pixels that don't have two consecutive neighbors\n"
+"  -rle                 Hold the mask as runs rather than as a bitmap, which takes\n"
+"                       less memory for masks made of large uniform areas but\n"
+"                       more for noisy ones\n"
+"  -stripe-rows N       Read the input N rows at a time and write the mask as it\n"
+"                       goes, so that memory use doesn't depend on the image size\n"
 "  -v                   Verbose\n"
 "\n"
 	);
@@ -56,14 +120,17 @@ int main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string input_raster_fn;
 	std::string mask_out_fn;
-	bool do_erosion = 0;
 	bool do_invert = 0;
 	std::vector<size_t> inspect_bandids;
+	size_t stripe_rows = 0;
+	bool use_rle = 0;
 
 	NdvDef ndv_def = NdvDef(arg_list);
+	MorphologyOpts morph_opts = MorphologyOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -77,10 +144,14 @@ int main(int argc, char **argv) {
 					if(argp == arg_list.size()) usage(cmdname);
 					int bandid = boost::lexical_cast<int>(arg_list[argp++]);
 					inspect_bandids.push_back(bandid);
-				} else if(arg == "-erosion") {
-					do_erosion = 1;
 				} else if(arg == "-invert") {
 					do_invert = 1;
+				} else if(arg == "-rle") {
+					use_rle = 1;
+				} else if(arg == "-stripe-rows") {
+					if(argp == arg_list.size()) usage(cmdname);
+					stripe_rows = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!stripe_rows) fatal_error("-stripe-rows must be positive");
 				} else if(arg == "-mask-out") {
 					if(argp == arg_list.size()) usage(cmdname);
 					mask_out_fn = arg_list[argp++];
@@ -102,13 +173,16 @@ int main(int argc, char **argv) {
 	}
 
 	if(input_raster_fn.empty() || mask_out_fn.empty()) usage(cmdname);
+	if(use_rle) {
+		if(stripe_rows) fatal_error("-rle option is not compatible with -stripe-rows option");
+		if(!morph_opts.empty()) fatal_error(
+			"-rle option is not compatible with -erosion, -dilation or -opening options");
+	}
 
 	GDALAllRegister();
 
 	GDALDatasetH ds = GDALOpen(input_raster_fn.c_str(), GA_ReadOnly);
 	if(!ds) fatal_error("open failed");
-	size_t w = GDALGetRasterXSize(ds);
-	size_t h = GDALGetRasterYSize(ds);
 
 	if(inspect_bandids.empty()) {
 		size_t nbands = GDALGetRasterCount(ds);
@@ -125,35 +199,109 @@ int main(int argc, char **argv) {
 		fatal_error("cannot determine no-data-value");
 	}
 
-	BitGrid mask = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, NULL);
+	const uint64_t num_pixels = uint64_t(GDALGetRasterXSize(ds)) * GDALGetRasterYSize(ds);
+	if(stripe_rows) {
+		// Erosion/dilation is done on a rolling window of rows as they are read.
+		StageTimer timer("read_and_write", "pixels");
+		timer.add_items(num_pixels);
+		MaskStripeReader reader(ds, inspect_bandids, ndv_def, NULL,
+			stripe_rows, do_invert, morph_opts);
+		MaskWriter writer(mask_out_fn, ds);
+		for(size_t y=0; y<reader.h; y++) {
+			writer.write_row(reader.get_row(y));
+		}
+	} else {
+		// Runs take less memory than a bitmap only for masks made of large uniform
+		// areas, so they are used only with -rle.  Erosion/dilation needs the bitmap.
+		if(!use_rle) {
+			StageTimer read_timer("read", "pixels");
+			BitGrid grid = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, NULL, 1);
+			if(do_invert) grid.invert();
+			read_timer.add_items(num_pixels);
+			read_timer.stop();
+			{
+				StageTimer timer("morphology", "pixels");
+				morph_opts.apply(grid);
+				timer.add_items(num_pixels);
+			}
+			StageTimer timer("write", "pixels");
+			write_mask(grid, mask_out_fn, ds);
+			timer.add_items(num_pixels);
+		} else {
+			StageTimer read_timer("read", "pixels");
+			RleMask mask = get_rlemask_for_dataset(ds, inspect_bandids, ndv_def, NULL, 1);
+			if(do_invert) mask.invert();
+			read_timer.add_items(num_pixels);
+			read_timer.stop();
+			StageTimer timer("write", "pixels");
+			write_mask(mask, mask_out_fn, ds);
+			timer.add_items(num_pixels);
+		}
+	}
 
 	GDALClose(ds);
+}
 
-	if(do_invert) {
-		mask.invert();
-	}
+bool MaskWriter::is_tiff_name(const std::string &fn) {
+	const char *ext = CPLGetExtension(fn.c_str());
+	return EQUAL(ext, "tif") || EQUAL(ext, "tiff");
+}
 
-	if(do_erosion) {
-		mask.erode();
+MaskWriter::MaskWriter(const std::string &fn, GDALDatasetH src_ds) :
+	w(GDALGetRasterXSize(src_ds)),
+	h(GDALGetRasterYSize(src_ds)),
+	next_row(0),
+	pbm_out(NULL),
+	tiff_ds(NULL),
+	tiff_band(NULL)
+{
+	if(is_tiff_name(fn)) {
+		GDALDriverH driver = GDALGetDriverByName("GTiff");
+		if(!driver) fatal_error("unrecognized output format (GTiff)");
+		char **create_opts = NULL;
+		create_opts = CSLAddString(create_opts, "NBITS=1");
+		create_opts = CSLAddString(create_opts, "COMPRESS=DEFLATE");
+		tiff_ds = GDALCreate(driver, fn.c_str(), w, h, 1, GDT_Byte, create_opts);
+		CSLDestroy(create_opts);
+		if(!tiff_ds) fatal_error("cannot open mask output");
+
+		double affine[6];
+		if(GDALGetGeoTransform(src_ds, affine) == CE_None) {
+			GDALSetGeoTransform(tiff_ds, affine);
+		}
+		const char *wkt = GDALGetProjectionRef(src_ds);
+		if(wkt && wkt[0]) GDALSetProjection(tiff_ds, wkt);
+		tiff_band = GDALGetRasterBand(tiff_ds, 1);
+		buf.resize(w);
+	} else {
+		pbm_out = fopen(fn.c_str(), "wb");
+		if(!pbm_out) fatal_error("cannot open mask output");
+		fprintf(pbm_out, "P4\n%zd %zd\n", w, h);
+		buf.resize((w+7)/8);
 	}
+}
+
+MaskWriter::~MaskWriter() {
+	if(next_row != h) fatal_error("mask output is missing rows");
+	if(tiff_ds) GDALClose(tiff_ds);
+	if(pbm_out) fclose(pbm_out);
+}
 
-	FILE *fout = fopen(mask_out_fn.c_str(), "wb");
-	if(!fout) fatal_error("cannot open mask output");
-	fprintf(fout, "P4\n%zd %zd\n", w, h);
-	std::vector<uint8_t> buf((w+7)/8);
-	for(size_t y=0; y<h; y++) {
-		buf.assign((w+7)/8, 0);
-		uint8_t *p = &buf[0];
-		uint8_t bitp = 128;
+void MaskWriter::write_row(const uint8_t *row) {
+	assert(next_row < h);
+	if(tiff_ds) {
+		for(size_t x=0; x<w; x++) buf[x] = row[x] ? 1 : 0;
+		if(GDALRasterIO(tiff_band, GF_Write, 0, next_row, w, 1,
+			&buf[0], w, 1, GDT_Byte, 0, 0) != CE_None
+		) fatal_error("could not write mask output");
+	} else {
+		// same as RleMask::write_pbm: pixels that are not set are black, and the bits
+		// past the end of the row are cleared
+		std::fill(buf.begin(), buf.end(), 0);
 		for(size_t x=0; x<w; x++) {
-			if(!mask(x, y)) *p |= bitp;
-			bitp >>= 1;
-			if(!bitp) {
-				p++;
-				bitp = 128;
-			}
+			if(!row[x]) buf[x/8] |= uint8_t(0x80 >> (x % 8));
 		}
-		fwrite(&buf[0], (w+7)/8, 1, fout);
+		if(!buf.empty()) fwrite(&buf[0], buf.size(), 1, pbm_out);
 	}
-	fclose(fout);
+	next_row++;
 }
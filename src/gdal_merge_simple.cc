@@ -28,17 +28,62 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <vector>
 
+#include <boost/lexical_cast.hpp>
+#include <boost/foreach.hpp>
+
 #include "common.h"
+#include "read_ahead.h"
 
 using namespace dangdal;
 
+// Roughly how much data is copied at once.
+static const size_t STRIP_BYTES = 1 << 24;
+
+// Reads all bands of the inputs, in strips of rows, in a single datatype.  Strips are read on
+// background threads a couple of strips ahead of the caller and are handed back in order.
+// With one thread the caller's handles on the inputs are used, and must not be used
+// elsewhere until the StripReader is destroyed.  With more than one thread each worker opens
+// its own handles since GDAL handles can't be shared between threads.
+class StripReader : public ReadAhead<std::vector<uint8_t> >::Producer {
+public:
+	StripReader(const std::vector<GDALDatasetH> &src_ds, size_t strip_rows,
+		GDALDataType dt, size_t num_threads);
+	~StripReader();
+
+	// The next strip, or NULL after the last one.  Each band is a num_rows*w array, and they
+	// follow one another.  It is valid until the next call.
+	const uint8_t *next_strip(size_t *row0_out, size_t *num_rows_out);
+
+	virtual void produce(size_t job, size_t worker_idx, std::vector<uint8_t> &out);
+
+private:
+	// not copyable
+	StripReader(const StripReader &);
+	StripReader &operator=(const StripReader &);
+
+	size_t w, h;
+	size_t strip_rows;
+	GDALDataType dt;
+	size_t num_strips;
+	size_t next_out;
+
+	// the handles on the inputs used by each worker
+	std::vector<std::vector<GDALDatasetH> > worker_ds;
+	bool reopened;
+	ReadAhead<std::vector<uint8_t> > *read_ahead;
+};
+
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds);
 
 void usage(const std::string &cmdname) {
 	printf("Usage:\n");
 	printf("    %s -in <rgb.tif> -in <mask.tif> -out <out.tif>\n", cmdname.c_str());
+	printf("        [ -of <format> ] [ -ot <datatype> ] [ -threads N ]\n");
 	printf("\nMerges several images into one image with many bands.\n");
-	printf("Currently only 8-bit data is supported.\n");
+	printf("The output datatype is the smallest that holds all of the inputs, unless\n");
+	printf("-ot is given.  With -threads, the inputs are read by N threads.\n");
+	printf("\n");
+	StageTimer::printUsage();
 	exit(1);
 }
 
@@ -46,10 +91,13 @@ int main(int argc, char *argv[]) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string dst_fn;
 	std::vector<GDALDatasetH> src_ds;
 	std::string output_format;
+	std::string output_type;
+	size_t num_threads = 1;
 
 	GDALAllRegister();
 
@@ -64,6 +112,17 @@ int main(int argc, char *argv[]) {
 			} else if(arg == "-of") { 
 				if(argp == arg_list.size()) usage(cmdname);
 				output_format = arg_list[argp++];
+			} else if(arg == "-ot") {
+				if(argp == arg_list.size()) usage(cmdname);
+				output_type = arg_list[argp++];
+			} else if(arg == "-threads") {
+				if(argp == arg_list.size()) usage(cmdname);
+				try {
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+				} catch(boost::bad_lexical_cast &e) {
+					fatal_error("cannot parse number given on command line");
+				}
+				if(!num_threads) fatal_error("-threads must be positive");
 			} else if(arg == "-in") {
 				if(argp == arg_list.size()) usage(cmdname);
 				std::string fn = arg_list[argp++];
@@ -84,7 +143,8 @@ int main(int argc, char *argv[]) {
 
 	//////// open source ////////
 
-	std::vector<GDALRasterBandH> src_bands;
+	size_t band_count = 0;
+	GDALDataType out_dt = GDT_Unknown;
 
 	size_t w=0, h=0;
 
@@ -101,53 +161,64 @@ int main(int argc, char *argv[]) {
 
 		int nb = GDALGetRasterCount(src_ds[ds_idx]);
 		for(int i=0; i<nb; i++) {
-			src_bands.push_back(GDALGetRasterBand(src_ds[ds_idx], i+1));
+			GDALDataType dt = GDALGetRasterDataType(GDALGetRasterBand(src_ds[ds_idx], i+1));
+			out_dt = band_count ? GDALDataTypeUnion(out_dt, dt) : dt;
+			band_count++;
 		}
 	}
 
-	size_t band_count = src_bands.size();
 	if(!band_count) usage(cmdname);
 
+	if(output_type.size()) {
+		out_dt = GDALGetDataTypeByName(output_type.c_str());
+		if(out_dt == GDT_Unknown) fatal_error("unrecognized datatype (%s)", output_type.c_str());
+	}
+
 	//////// open output ////////
 
 	printf("Output size is %zd x %zd x %zd\n", w, h, band_count);
+	printf("Output datatype is %s\n", GDALGetDataTypeName(out_dt));
 
 	GDALDriverH dst_driver = GDALGetDriverByName(output_format.c_str());
 	if(!dst_driver) fatal_error("unrecognized output format (%s)", output_format.c_str());
-	GDALDatasetH dst_ds = GDALCreate(dst_driver, dst_fn.c_str(), w, h, band_count, GDT_Byte, NULL);
+	GDALDatasetH dst_ds = GDALCreate(dst_driver, dst_fn.c_str(), w, h, band_count, out_dt, NULL);
 	if(!dst_ds) fatal_error("could not create output");
 	copyGeoCode(dst_ds, src_ds[0]);
 
-	std::vector<GDALRasterBandH> dst_bands;
-	for(size_t i=0; i<band_count; i++) {
-		dst_bands.push_back(GDALGetRasterBand(dst_ds, i+1));
-	}
-
 	//////// process data ////////
 
-	int chunk_size = 200;
-
-	// FIXME - handle other datatypes
-	std::vector<uint8_t> buf(w * chunk_size);
-
-	for(size_t row=0; row<h; row+=chunk_size) {
-		GDALTermProgress((double)row/(double)h, NULL, NULL);
-
-		int num_lines = chunk_size;
-		if(row+num_lines > h) num_lines = h - row;
-		for(size_t band_idx=0; band_idx<band_count; band_idx++) {
-			if(GDALRasterIO(
-				src_bands[band_idx], GF_Read,
-				0, row, w, num_lines,
-				&buf[0], w, num_lines,
-				GDT_Byte, 0, 0
-			) != CE_None) fatal_error("read error");
-			if(GDALRasterIO(
-				dst_bands[band_idx], GF_Write,
-				0, row, w, num_lines,
-				&buf[0], w, num_lines,
-				GDT_Byte, 0, 0
+	// Strips are a whole number of output blocks high and span the whole width, so that each
+	// output block is written by one call.  If an input has the output type it is copied
+	// without conversion.
+	int block_w, block_h;
+	GDALGetBlockSize(GDALGetRasterBand(dst_ds, 1), &block_w, &block_h);
+	if(block_h < 1) block_h = 1;
+	const size_t dt_size = GDALGetDataTypeSize(out_dt) / 8;
+	size_t strip_rows = std::max(size_t(1), STRIP_BYTES / (w * band_count * dt_size));
+	strip_rows = (strip_rows + block_h - 1) / block_h * block_h;
+	strip_rows = std::min(strip_rows, h);
+
+	{
+		StripReader reader(src_ds, strip_rows, out_dt, num_threads);
+		size_t row0, num_rows;
+		for(;;) {
+			// the time spent waiting for the readers
+			StageTimer read_timer("read", "pixels");
+			const uint8_t *strip = reader.next_strip(&row0, &num_rows);
+			if(!strip) break;
+			const uint64_t num_pixels = uint64_t(num_rows) * w * band_count;
+			read_timer.add_items(num_pixels);
+			read_timer.stop();
+
+			GDALTermProgress((double)row0/(double)h, NULL, NULL);
+
+			StageTimer timer("write", "pixels");
+			if(GDALDatasetRasterIO(dst_ds, GF_Write,
+				0, row0, w, num_rows,
+				const_cast<uint8_t *>(strip), w, num_rows, out_dt,
+				band_count, NULL, 0, 0, 0
 			) != CE_None) fatal_error("write error");
+			timer.add_items(num_pixels);
 		}
 	}
 
@@ -156,13 +227,92 @@ int main(int argc, char *argv[]) {
 	for(size_t ds_idx=0; ds_idx<src_ds.size(); ds_idx++) {
 		GDALClose(src_ds[ds_idx]);
 	}
-	GDALClose(dst_ds);
+	{
+		StageTimer timer("write", "pixels");
+		GDALClose(dst_ds);
+	}
 
 	GDALTermProgress(1, NULL, NULL);
 
 	return 0;
 }
 
+StripReader::StripReader(
+	const std::vector<GDALDatasetH> &src_ds, size_t _strip_rows,
+	GDALDataType _dt, size_t num_threads
+) :
+	strip_rows(_strip_rows),
+	dt(_dt),
+	next_out(0),
+	reopened(num_threads > 1),
+	read_ahead(NULL)
+{
+	w = GDALGetRasterXSize(src_ds[0]);
+	h = GDALGetRasterYSize(src_ds[0]);
+	num_strips = (h + strip_rows - 1) / strip_rows;
+
+	if(reopened) {
+		for(size_t i=0; i<num_threads; i++) {
+			std::vector<GDALDatasetH> my_ds;
+			BOOST_FOREACH(GDALDatasetH ds, src_ds) {
+				const char *fn = GDALGetDescription(ds);
+				GDALDatasetH wds = GDALOpen(fn, GA_ReadOnly);
+				if(!wds) fatal_error("Could not reopen %s for a worker thread.", fn);
+				my_ds.push_back(wds);
+			}
+			worker_ds.push_back(my_ds);
+		}
+	} else {
+		worker_ds.push_back(src_ds);
+	}
+	read_ahead = new ReadAhead<std::vector<uint8_t> >(this, num_strips,
+		worker_ds.size(), 2 * worker_ds.size());
+}
+
+StripReader::~StripReader() {
+	// stops the workers
+	delete read_ahead;
+
+	if(reopened) {
+		BOOST_FOREACH(const std::vector<GDALDatasetH> &v, worker_ds) {
+			BOOST_FOREACH(GDALDatasetH wds, v) GDALClose(wds);
+		}
+	}
+}
+
+void StripReader::produce(size_t job, size_t worker_idx, std::vector<uint8_t> &out) {
+	const std::vector<GDALDatasetH> &ds = worker_ds[worker_idx];
+	size_t row0 = job * strip_rows;
+	size_t num_rows = std::min(strip_rows, h - row0);
+	size_t band_size = w * num_rows * (GDALGetDataTypeSize(dt) / 8);
+
+	size_t num_bands = 0;
+	BOOST_FOREACH(GDALDatasetH d, ds) num_bands += GDALGetRasterCount(d);
+	out.resize(num_bands * band_size);
+
+	// all bands of each input with one call
+	size_t band_idx = 0;
+	BOOST_FOREACH(GDALDatasetH d, ds) {
+		int nb = GDALGetRasterCount(d);
+		GDALDatasetAdviseRead(d, 0, row0, w, num_rows, w, num_rows, dt, nb, NULL, NULL);
+		if(GDALDatasetRasterIO(d, GF_Read,
+			0, row0, w, num_rows,
+			&out[band_idx * band_size], w, num_rows, dt,
+			nb, NULL, 0, 0, 0
+		) != CE_None) fatal_error("read error");
+		band_idx += nb;
+	}
+}
+
+const uint8_t *StripReader::next_strip(size_t *row0_out, size_t *num_rows_out) {
+	const std::vector<uint8_t> *strip = read_ahead->next();
+	if(!strip) return NULL;
+	size_t job = next_out++;
+	*row0_out = job * strip_rows;
+	*num_rows_out = std::min(strip_rows, h - *row0_out);
+	return &(*strip)[0];
+}
+
 void copyGeoCode(GDALDatasetH dst_ds, GDALDatasetH src_ds) {
 	double affine[6];
 	if(GDALGetGeoTransform(src_ds, affine) == CE_None) {
@@ -28,15 +28,67 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <vector>
 
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <cpl_conv.h>
+#include <cpl_vsi.h>
+
 #include "common.h"
 
 using namespace dangdal;
 
+struct SourceBand {
+	GDALDataType datatype;
+	int block_w, block_h;
+	bool has_ndv;
+	double ndv;
+	GDALColorInterp color_interp;
+};
+
+// What -direct needs to know about an input.  The georeference is only read from the
+// first input.
+struct SourceInfo {
+	size_t w, h;
+	std::vector<SourceBand> bands;
+	bool has_affine;
+	double affine[6];
+	std::string wkt;
+};
+
+// Opens the inputs one at a time on a pool of threads, keeping each open only long enough to
+// read its SourceInfo.  If one can't be read, the workers stop and the error is raised on the
+// thread that constructed this.
+class SourceInspector {
+public:
+	SourceInspector(const std::vector<std::string> &_src_fn, size_t num_threads);
+
+	std::vector<SourceInfo> info;
+
+private:
+	void worker_main(WorkerError *error);
+	void inspect(size_t idx);
+
+	const std::vector<std::string> &src_fn;
+	boost::mutex mutex;
+	size_t next_idx;
+};
+
+void write_direct_vrt(const std::string &dst_fn,
+	const std::vector<std::string> &src_fn, const std::vector<SourceInfo> &info);
+
 void usage(const std::string &cmdname) {
 	printf("Usage:\n");
 	printf("    %s -in <rgb.tif> -in <mask.tif> -out <out.vrt>\n", cmdname.c_str());
+	printf("        [ -direct [ -threads N ] ]\n");
 	printf("\nMerges several images into one image with many bands.\n");
 	printf("This program is obsoleted by \"gdalbuildvrt -separate\" from GDAL 1.7.\n");
+	printf("\nWith -direct, the VRT is written straight from the size, datatype, block size\n");
+	printf("and no-data value of each band, and each input is open only while these are\n");
+	printf("read (by N threads, with -threads).  This is much faster for many inputs, but\n");
+	printf("the metadata and color table of the first input are not copied.\n");
+	printf("\n");
+	StageTimer::printUsage();
 	exit(1);
 }
 
@@ -44,9 +96,12 @@ int main(int argc, char *argv[]) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string dst_fn;
 	std::vector<std::string> src_fn;
+	bool direct = 0;
+	size_t num_threads = 1;
 
 	GDALAllRegister();
 
@@ -61,6 +116,16 @@ int main(int argc, char *argv[]) {
 			} else if(arg == "-in") {
 				if(argp == arg_list.size()) usage(cmdname);
 				src_fn.push_back(arg_list[argp++]);
+			} else if(arg == "-direct") {
+				direct = 1;
+			} else if(arg == "-threads") {
+				if(argp == arg_list.size()) usage(cmdname);
+				try {
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+				} catch(boost::bad_lexical_cast &e) {
+					fatal_error("cannot parse number given on command line");
+				}
+				if(!num_threads) fatal_error("-threads must be positive");
 			} else {
 				usage(cmdname);
 			}
@@ -71,9 +136,27 @@ int main(int argc, char *argv[]) {
 
 	if(src_fn.empty()) usage(cmdname);
 	if(dst_fn.empty()) usage(cmdname);
+	if(num_threads > 1 && !direct) fatal_error("-threads option requires -direct option");
+
+	if(direct) {
+		StageTimer open_timer("open", "datasets");
+		SourceInspector inspector(src_fn, num_threads);
+		open_timer.add_items(src_fn.size());
+		open_timer.stop();
+
+		StageTimer timer("write", "bands");
+		write_direct_vrt(dst_fn, src_fn, inspector.info);
+		size_t num_bands = 0;
+		for(size_t i=0; i<inspector.info.size(); i++) {
+			num_bands += inspector.info[i].bands.size();
+		}
+		timer.add_items(num_bands);
+		return 0;
+	}
 
 	std::vector<GDALDatasetH> src_ds;
 
+	StageTimer open_timer("open", "datasets");
 	size_t w=0, h=0;
 	for(size_t ds_idx=0; ds_idx<src_fn.size(); ds_idx++) {
 		GDALDatasetH ds = GDALOpen(src_fn[ds_idx].c_str(), GA_ReadOnly);
@@ -91,7 +174,10 @@ int main(int argc, char *argv[]) {
 			h = ds_h;
 		}
 	}
+	open_timer.add_items(src_ds.size());
+	open_timer.stop();
 
+	StageTimer build_timer("build", "bands");
 	GDALDriverH dst_driver = GDALGetDriverByName("VRT");
 	if(!dst_driver) fatal_error("unrecognized output format (VRT)");
 	GDALDatasetH dst_ds = GDALCreateCopy(dst_driver, dst_fn.c_str(), src_ds[0], 0, NULL, NULL, NULL);
@@ -121,8 +207,13 @@ int main(int argc, char *argv[]) {
 			band_idx++;
 		}
 	}
+	build_timer.add_items(band_idx);
+	build_timer.stop();
 
-	GDALClose(dst_ds);
+	{
+		StageTimer timer("write");
+		GDALClose(dst_ds);
+	}
 
 	// These must be closed *after* dst_ds.
 	for(size_t i=0; i<to_close.size(); i++) {
@@ -134,3 +225,157 @@ int main(int argc, char *argv[]) {
 
 	return 0;
 }
+
+SourceInspector::SourceInspector(const std::vector<std::string> &_src_fn, size_t num_threads) :
+	info(_src_fn.size()),
+	src_fn(_src_fn),
+	next_idx(0)
+{
+	std::vector<WorkerError> errors(std::min(num_threads, src_fn.size()));
+	boost::thread_group threads;
+	for(size_t i=0; i<errors.size(); i++) {
+		threads.add_thread(new boost::thread(&SourceInspector::worker_main, this, &errors[i]));
+	}
+	threads.join_all();
+	for(size_t i=0; i<errors.size(); i++) errors[i].check();
+
+	for(size_t i=1; i<info.size(); i++) {
+		if(info[i].w != info[0].w || info[i].h != info[0].h) {
+			fatal_error("size mismatch for inputs");
+		}
+	}
+}
+
+void SourceInspector::worker_main(WorkerError *error) {
+	for(;;) {
+		size_t idx;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			if(next_idx == src_fn.size()) return;
+			idx = next_idx++;
+		}
+
+		try {
+			inspect(idx);
+		} catch(const std::exception &e) {
+			error->failed = true;
+			error->what = e.what();
+		} catch(...) {
+			error->failed = true;
+			error->what = "unknown error on worker thread";
+		}
+
+		if(error->failed) {
+			// no point in opening the rest
+			boost::mutex::scoped_lock lock(mutex);
+			next_idx = src_fn.size();
+			return;
+		}
+	}
+}
+
+void SourceInspector::inspect(size_t idx) {
+	GDALDatasetH ds = GDALOpen(src_fn[idx].c_str(), GA_ReadOnly);
+	if(!ds) fatal_error("open failed (%s)", src_fn[idx].c_str());
+
+	SourceInfo &si = info[idx];
+	si.w = GDALGetRasterXSize(ds);
+	si.h = GDALGetRasterYSize(ds);
+	if(!si.w || !si.h) fatal_error("missing width/height");
+
+	int nb = GDALGetRasterCount(ds);
+	for(int i=0; i<nb; i++) {
+		GDALRasterBandH band = GDALGetRasterBand(ds, i+1);
+		if(!band) fatal_error("could not get src_band");
+		SourceBand sb;
+		sb.datatype = GDALGetRasterDataType(band);
+		GDALGetBlockSize(band, &sb.block_w, &sb.block_h);
+		int has_ndv = 0;
+		sb.ndv = GDALGetRasterNoDataValue(band, &has_ndv);
+		sb.has_ndv = has_ndv;
+		sb.color_interp = GDALGetRasterColorInterpretation(band);
+		si.bands.push_back(sb);
+	}
+
+	si.has_affine = false;
+	if(idx == 0) {
+		si.has_affine = GDALGetGeoTransform(ds, si.affine) == CE_None;
+		const char *wkt = GDALGetProjectionRef(ds);
+		if(wkt) si.wkt = wkt;
+	}
+
+	GDALClose(ds);
+}
+
+static std::string xml_escape(const std::string &s) {
+	char *escaped = CPLEscapeString(s.c_str(), -1, CPLES_XML);
+	std::string ret(escaped);
+	CPLFree(escaped);
+	return ret;
+}
+
+// Writes the same XML that the VRT driver would, with a SimpleSource for each band of each
+// input.  SourceProperties lets GDAL open the VRT without opening every source.
+void write_direct_vrt(const std::string &dst_fn,
+	const std::vector<std::string> &src_fn, const std::vector<SourceInfo> &info
+) {
+	VSILFILE *fh = VSIFOpenL(dst_fn.c_str(), "wb");
+	if(!fh) fatal_error("could not create output");
+
+	const SourceInfo &first = info[0];
+	VSIFPrintfL(fh, "<VRTDataset rasterXSize=\"%zd\" rasterYSize=\"%zd\">\n", first.w, first.h);
+	if(!first.wkt.empty()) {
+		VSIFPrintfL(fh, "  <SRS>%s</SRS>\n", xml_escape(first.wkt).c_str());
+	}
+	if(first.has_affine) {
+		VSIFPrintfL(fh, "  <GeoTransform>%.16g, %.16g, %.16g, %.16g, %.16g, %.16g</GeoTransform>\n",
+			first.affine[0], first.affine[1], first.affine[2],
+			first.affine[3], first.affine[4], first.affine[5]);
+	}
+
+	// source paths are relative to the VRT where possible, as the VRT driver does it
+	const std::string vrt_dir = CPLGetPath(dst_fn.c_str());
+	int band_idx = 0;
+	for(size_t ds_idx=0; ds_idx<info.size(); ds_idx++) {
+		int is_relative = FALSE;
+		const std::string fn = CPLExtractRelativePath(
+			vrt_dir.c_str(), src_fn[ds_idx].c_str(), &is_relative);
+		const std::string fn_xml = xml_escape(fn);
+
+		const SourceInfo &si = info[ds_idx];
+		for(size_t i=0; i<si.bands.size(); i++) {
+			const SourceBand &sb = si.bands[i];
+			const char *dt_name = GDALGetDataTypeName(sb.datatype);
+			band_idx++;
+
+			VSIFPrintfL(fh, "  <VRTRasterBand dataType=\"%s\" band=\"%d\">\n", dt_name, band_idx);
+			if(sb.has_ndv) {
+				if(std::isnan(sb.ndv)) {
+					VSIFPrintfL(fh, "    <NoDataValue>nan</NoDataValue>\n");
+				} else {
+					VSIFPrintfL(fh, "    <NoDataValue>%.18g</NoDataValue>\n", sb.ndv);
+				}
+			}
+			if(sb.color_interp != GCI_Undefined) {
+				VSIFPrintfL(fh, "    <ColorInterp>%s</ColorInterp>\n",
+					GDALGetColorInterpretationName(sb.color_interp));
+			}
+			VSIFPrintfL(fh, "    <SimpleSource>\n");
+			VSIFPrintfL(fh, "      <SourceFilename relativeToVRT=\"%d\">%s</SourceFilename>\n",
+				is_relative ? 1 : 0, fn_xml.c_str());
+			VSIFPrintfL(fh, "      <SourceBand>%zd</SourceBand>\n", i+1);
+			VSIFPrintfL(fh, "      <SourceProperties RasterXSize=\"%zd\" RasterYSize=\"%zd\" "
+				"DataType=\"%s\" BlockXSize=\"%d\" BlockYSize=\"%d\" />\n",
+				si.w, si.h, dt_name, sb.block_w, sb.block_h);
+			VSIFPrintfL(fh, "      <SrcRect xOff=\"0\" yOff=\"0\" xSize=\"%zd\" ySize=\"%zd\" />\n",
+				si.w, si.h);
+			VSIFPrintfL(fh, "      <DstRect xOff=\"0\" yOff=\"0\" xSize=\"%zd\" ySize=\"%zd\" />\n",
+				si.w, si.h);
+			VSIFPrintfL(fh, "    </SimpleSource>\n");
+			VSIFPrintfL(fh, "  </VRTRasterBand>\n");
+		}
+	}
+	VSIFPrintfL(fh, "</VRTDataset>\n");
+
+	if(VSIFCloseL(fh)) fatal_error("could not write output");
+}
@@ -28,12 +28,74 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <vector>
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
 #include "common.h"
 
 using namespace dangdal;
 
+// Roughly how much input is written at once.
+static const size_t CHUNK_BYTES = 1 << 24;
+
+// The input, handed out in chunks of rows.
+class RawInput {
+public:
+	virtual ~RawInput() { }
+	// The next num_bytes of input.  This is valid until the next call.
+	virtual const uint8_t *next_chunk(size_t num_bytes) = 0;
+	// Whether there is data past what has been read.
+	virtual bool has_extra() = 0;
+};
+
+// A regular file, e.g. a huge raw dump, read by mapping it into memory.
+class MappedInput : public RawInput {
+public:
+	// Returns NULL if the file can't be mapped.
+	static MappedInput *open(FILE *fh, size_t expected_size);
+	~MappedInput();
+	const uint8_t *next_chunk(size_t num_bytes);
+	bool has_extra() { return file_size > pos; }
+
+private:
+	MappedInput() { }
+	uint8_t *data;
+	size_t file_size;
+	size_t pos;
+};
+
+// Anything else (e.g. stdin), read by a thread that stays one chunk ahead.
+class StreamInput : public RawInput {
+public:
+	// Chunks will be chunk_size bytes, other than the last.
+	StreamInput(FILE *_fh, size_t chunk_size, size_t total_size);
+	~StreamInput();
+	const uint8_t *next_chunk(size_t num_bytes);
+	bool has_extra();
+
+private:
+	void read_main();
+
+	FILE *fh;
+	size_t chunk_size, total_size;
+	// the read-ahead thread fills bufs[1-current] while bufs[current] is in use
+	std::vector<uint8_t> bufs[2];
+	int current;
+	size_t num_chunks;
+	size_t chunks_read, chunks_taken;
+	bool short_read;
+	boost::mutex mutex;
+	boost::condition_variable cond;
+	boost::thread *thread;
+};
+
+void swap_copy(const uint8_t *src, uint8_t *dst, size_t num_words, int word_size);
+
 void usage(const std::string &cmdname) {
 	printf("Usage: %s\n", cmdname.c_str());
 	printf("\t-wh <width> <height>\n");
@@ -42,7 +104,11 @@ void usage(const std::string &cmdname) {
 	printf("\t-srs <proj4>\n");
 	printf("\t[-datatype { UINT8 | UINT16 | INT16 | UINT32 | INT32 | FLOAT32 | FLOAT64 }]\n");
 	printf("\t[-lsb | -msb]\n");
+	printf("\t[-co NAME=VALUE ...]           GTiff creation option, e.g. TILED=YES,\n");
+	printf("\t                               COMPRESS=DEFLATE, NUM_THREADS=ALL_CPUS\n");
 	printf("\t<input.bil> <output.tif>\n");
+	printf("\n");
+	StageTimer::printUsage();
 	exit(1);
 }
 
@@ -50,6 +116,7 @@ int main(int argc, char *argv[]) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string src_fn;
 	std::string dst_fn;
@@ -64,6 +131,7 @@ int main(int argc, char *argv[]) {
 	double affine[6];
 	bool got_affine=0;
 	char endian=0;
+	std::vector<std::string> create_options;
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -109,6 +177,9 @@ int main(int argc, char *argv[]) {
 					endian = 'L';
 				} else if(arg == "-msb") {
 					endian = 'M';
+				} else if(arg == "-co") {
+					if(argp == arg_list.size()) usage(cmdname);
+					create_options.push_back(arg_list[argp++]);
 				} else {
 					usage(cmdname);
 				}
@@ -165,6 +236,7 @@ int main(int argc, char *argv[]) {
 		gdal_dt = GDT_Float64;
 		bytes_per_pixel = 8;
 	}
+	if(gdal_dt == GDT_Unknown) fatal_error("unrecognized datatype (%s)", datatype.c_str());
 
 	bool endian_mismatch;
 	if(bytes_per_pixel == 1) {
@@ -194,7 +266,12 @@ int main(int argc, char *argv[]) {
 
 	GDALDriverH dst_driver = GDALGetDriverByName("GTiff");
 	if(!dst_driver) fatal_error("unrecognized output format (GTiff)");
-	GDALDatasetH dst_ds = GDALCreate(dst_driver, dst_fn.c_str(), w, h, 1, gdal_dt, NULL);
+	char **create_opts = NULL;
+	for(size_t i=0; i<create_options.size(); i++) {
+		create_opts = CSLAddString(create_opts, create_options[i].c_str());
+	}
+	GDALDatasetH dst_ds = GDALCreate(dst_driver, dst_fn.c_str(), w, h, 1, gdal_dt, create_opts);
+	CSLDestroy(create_opts);
 	if(!dst_ds) fatal_error("couldn't create dst_dataset");
 
 	GDALSetGeoTransform(dst_ds, affine);
@@ -216,32 +293,180 @@ int main(int argc, char *argv[]) {
 
 	//////////// transfer data
 
-	std::vector<uint8_t> linebuf(w * bytes_per_pixel);
-	for(size_t row=0; row<h; row++) {
+	// Rows are written in groups that are a whole number of output blocks high, so that
+	// each block (e.g. a row of compressed tiles) is written once.
+	int block_w, block_h;
+	GDALGetBlockSize(dst_band, &block_w, &block_h);
+	if(block_h < 1) block_h = 1;
+	const size_t row_bytes = w * bytes_per_pixel;
+	size_t chunk_rows = std::max(size_t(1), CHUNK_BYTES / row_bytes);
+	chunk_rows = (chunk_rows + block_h - 1) / block_h * block_h;
+	chunk_rows = std::min(chunk_rows, h);
+
+	RawInput *input = NULL;
+	if(fin != stdin) input = MappedInput::open(fin, h * row_bytes);
+	if(!input) input = new StreamInput(fin, chunk_rows * row_bytes, h * row_bytes);
+
+	std::vector<uint8_t> swap_buf;
+	if(endian_mismatch) swap_buf.resize(chunk_rows * row_bytes);
+
+	for(size_t row=0; row<h; row+=chunk_rows) {
 		GDALTermProgress((double)row / h, NULL, NULL);
-		if(w != fread(&linebuf[0], bytes_per_pixel, w, fin)) {
-			fatal_error("input was short");
-		}
+		size_t num_rows = std::min(chunk_rows, h - row);
+		const uint64_t num_pixels = uint64_t(num_rows) * w;
+		StageTimer read_timer("read", "pixels");
+		const uint8_t *chunk = input->next_chunk(num_rows * row_bytes);
+		read_timer.add_items(num_pixels);
+		read_timer.stop();
 		if(endian_mismatch) {
-			GDALSwapWords(&linebuf[0], bytes_per_pixel, w, 0);
+			StageTimer timer("byteswap", "pixels");
+			swap_copy(chunk, &swap_buf[0], num_rows * w, bytes_per_pixel);
+			chunk = &swap_buf[0];
+			timer.add_items(num_pixels);
 		}
-		GDALRasterIO(dst_band, GF_Write, 0, row, w, 1, &linebuf[0], w, 1, gdal_dt, 0, 0);
+		StageTimer timer("write", "pixels");
+		if(GDALRasterIO(dst_band, GF_Write, 0, row, w, num_rows,
+			const_cast<uint8_t *>(chunk), w, num_rows, gdal_dt, 0, 0) != CE_None
+		) fatal_error("could not write output");
+		timer.add_items(num_pixels);
 	}
 
 	//////////// shutdown
 
-	GDALClose(dst_ds);
+	{
+		StageTimer timer("write", "pixels");
+		GDALClose(dst_ds);
+	}
 
 	GDALTermProgress(1, NULL, NULL);
 
 	// This error is checked after the output is closed.
 	// The script exits with error but the output is
 	// still saved to disk.
-	if(fread(&linebuf[0], 1, 1, fin)) {
+	bool extra = input->has_extra();
+	delete input;
+	fclose(fin);
+	if(extra) {
 		fatal_error("warning: input had extra data at end\n");
 	}
 
-	fclose(fin);
-
 	return 0;
 }
+
+MappedInput *MappedInput::open(FILE *fh, size_t expected_size) {
+	int fd = fileno(fh);
+	struct stat st;
+	if(fstat(fd, &st) || !S_ISREG(st.st_mode)) return NULL;
+	if(size_t(st.st_size) < expected_size) fatal_error("input was short");
+	if(!st.st_size) return NULL;
+
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(p == MAP_FAILED) return NULL;
+	madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+	MappedInput *in = new MappedInput();
+	in->data = static_cast<uint8_t *>(p);
+	in->file_size = st.st_size;
+	in->pos = 0;
+	return in;
+}
+
+MappedInput::~MappedInput() {
+	munmap(data, file_size);
+}
+
+const uint8_t *MappedInput::next_chunk(size_t num_bytes) {
+	if(pos + num_bytes > file_size) fatal_error("input was short");
+	// the pages before this chunk won't be needed again
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t done = pos / page * page;
+	if(done) madvise(data, done, MADV_DONTNEED);
+	const uint8_t *ret = data + pos;
+	pos += num_bytes;
+	return ret;
+}
+
+StreamInput::StreamInput(FILE *_fh, size_t _chunk_size, size_t _total_size) :
+	fh(_fh),
+	chunk_size(_chunk_size),
+	total_size(_total_size),
+	current(0),
+	chunks_read(0),
+	chunks_taken(0),
+	short_read(false)
+{
+	num_chunks = (total_size + chunk_size - 1) / chunk_size;
+	bufs[0].resize(chunk_size);
+	bufs[1].resize(chunk_size);
+	thread = new boost::thread(&StreamInput::read_main, this);
+}
+
+StreamInput::~StreamInput() {
+	thread->join();
+	delete thread;
+}
+
+void StreamInput::read_main() {
+	for(size_t i=0; i<num_chunks; i++) {
+		int which;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			// only one chunk ahead, since the other buffer is in use
+			while(chunks_read > chunks_taken) cond.wait(lock);
+			which = 1 - current;
+		}
+		size_t num_bytes = std::min(chunk_size, total_size - i*chunk_size);
+		bool ok = fread(&bufs[which][0], 1, num_bytes, fh) == num_bytes;
+
+		boost::mutex::scoped_lock lock(mutex);
+		if(!ok) short_read = true;
+		chunks_read++;
+		cond.notify_all();
+		if(!ok) return;
+	}
+}
+
+const uint8_t *StreamInput::next_chunk(size_t num_bytes) {
+	boost::mutex::scoped_lock lock(mutex);
+	while(chunks_read == chunks_taken && !short_read) cond.wait(lock);
+	if(short_read || num_bytes > chunk_size) fatal_error("input was short");
+	current = 1 - current;
+	chunks_taken++;
+	cond.notify_all();
+	return &bufs[current][0];
+}
+
+bool StreamInput::has_extra() {
+	thread->join();
+	uint8_t c;
+	return fread(&c, 1, 1, fh) == 1;
+}
+
+// Copies num_words words of word_size bytes, reversing the bytes of each.  These are simple
+// loops over whole words, which the compiler can vectorize.
+void swap_copy(const uint8_t *src, uint8_t *dst, size_t num_words, int word_size) {
+	switch(word_size) {
+		case 2:
+			for(size_t i=0; i<num_words; i++) {
+				dst[i*2  ] = src[i*2+1];
+				dst[i*2+1] = src[i*2  ];
+			}
+			break;
+		case 4:
+			for(size_t i=0; i<num_words; i++) {
+				dst[i*4  ] = src[i*4+3];
+				dst[i*4+1] = src[i*4+2];
+				dst[i*4+2] = src[i*4+1];
+				dst[i*4+3] = src[i*4  ];
+			}
+			break;
+		case 8:
+			for(size_t i=0; i<num_words; i++) {
+				for(int j=0; j<8; j++) dst[i*8+j] = src[i*8+7-j];
+			}
+			break;
+		default:
+			memcpy(dst, src, num_words * word_size);
+			GDALSwapWords(dst, word_size, num_words, word_size);
+	}
+}
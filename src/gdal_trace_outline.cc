@@ -28,11 +28,14 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 #include <map>
 #include <vector>
+#include <deque>
 
 #include <boost/lexical_cast.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
 
 #include "common.h"
+#include "batch.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
 #include "debugplot.h"
@@ -65,6 +68,12 @@ void usage(const std::string &cmdname) {
 	GeoOpts::printUsage();
 	printf("\n");
 	NdvDef::printUsage();
+	printf("\n");
+	MorphologyOpts::printUsage();
+	printf("\n");
+	BatchOpts::printUsage();
+	printf("\n");
+	StageTimer::printUsage();
 
 	printf(
 "\n"
@@ -75,8 +84,28 @@ void usage(const std::string &cmdname) {
 "                               the no-data-value)\n"
 "  -b band_id -b band_id ...    Bands to inspect (default is all bands)\n"
 "  -invert                      Trace no-data pixels rather than data pixels\n"
-"  -erosion                     Erode pixels that don't have two consecutive\n"
-"                               neighbors\n"
+"  -threads N                   Use N threads for decoding the input and for\n"
+"                               polygon simplification\n"
+"                               (default is 1)\n"
+"  -stripe-rows N               Read and trace the input N rows at a time rather\n"
+"                               than holding the whole mask in memory.\n"
+"  -stream                      Bevel, simplify and write each connected\n"
+"                               component as soon as it has been traced, using\n"
+"                               N worker threads if -threads is given.\n"
+"                               Self-intersections and crossings are then only\n"
+"                               fixed within each component.  Requires\n"
+"                               -split-polys.\n"
+"  -rle                         Hold the mask as runs rather than as a bitmap.\n"
+"                               This takes less memory for masks made of large\n"
+"                               uniform areas, but more (and is slower to trace)\n"
+"                               for noisy ones.\n"
+"  -pyramid N                   Trace the mask reduced by a factor of N (from\n"
+"                               an overview if there is one) and read full\n"
+"                               resolution pixels only near the boundaries\n"
+"                               found.  Details less than N pixels across\n"
+"                               away from these boundaries are lost, so N can\n"
+"                               be at most the -dp-toler value, and N*N at most\n"
+"                               the -min-ring-area value.\n"
 "  -major-ring                  Take only the biggest outer ring\n"
 "  -no-donuts                   Take only top-level rings\n"
 "  -min-ring-area val           Drop rings with less than this area\n"
@@ -111,10 +140,17 @@ void usage(const std::string &cmdname) {
 "  -llproj-toler val            Error tolerance for curved lines when\n"
 "                               using '-out-cs ll' (in pixels, default is 1.0)\n"
 "  -wkt-out fn.wkt              Output polygons in WKT format\n"
+"  -wkt-exact                   Write WKT coordinates with full precision, so\n"
+"                               they read back exactly, rather than rounding\n"
+"                               them like OGR does\n"
+"                               Must be specified before -wkt-out option\n"
 "  -wkb-out fn.wkb              Output polygons in WKB format\n"
 "  -ogr-out fn.shp              Output polygons using an OGR format\n"
 "  -ogr-fmt                     OGR format to use (default is 'ESRI Shapefile')\n"
 "                               Must be specified before -ogr-out option\n"
+"  -ogr-batch-size N            Number of features per OGR transaction, for\n"
+"                               formats that support them (default is 10000,\n"
+"                               0 disables transactions)\n"
 "  -split-polys                 Output several polygons rather than one\n"
 "                               multipolygon\n"
 "\n"
@@ -151,6 +187,7 @@ struct GeomOutput {
 	explicit GeomOutput(CoordSystem _out_cs=CS_UNKNOWN) :
 		out_cs(_out_cs),
 		wkt_fh(NULL),
+		wkt_exact(false),
 		wkb_fh(NULL),
 		ogr_ds(NULL),
 		ogr_layer(NULL)
@@ -160,6 +197,7 @@ struct GeomOutput {
 
 	std::string wkt_fn;
 	FILE *wkt_fh;
+	bool wkt_exact;
 
 	std::string wkb_fn;
 	FILE *wkb_fh;
@@ -177,21 +215,178 @@ struct ContainingOption {
 	bool wanted_point;
 };
 
-Mpoly take_largest_ring(const Mpoly &mp_in);
+// Writes shapes to the geometry outputs from a separate thread, so that
+// tracing of the next feature overlaps with writing of the previous one.
+// Shapes are written in the order they were queued.  For OGR layers that
+// support transactions, features are committed in batches of batch_size
+// (zero means no transactions).
+class GeomWriter {
+public:
+	GeomWriter(
+		std::vector<GeomOutput> &_outputs,
+		const FeatureInterpreter &_feature_interp,
+		bool _classify,
+		size_t _batch_size
+	);
+	~GeomWriter();
+
+	// The polygons are swapped out of the arguments.  Blocks while the queue
+	// is full.
+	void push(Mpoly &xy_poly, Mpoly &en_poly, Mpoly &ll_poly, const FeatureRawVal &val);
+
+	// Waits for everything queued to be written and commits any open
+	// transactions.  An error on the writer thread is raised here, or by
+	// the next push.
+	void finish();
+
+private:
+	struct Shape {
+		Mpoly xy_poly, en_poly, ll_poly;
+		FeatureRawVal val;
+		size_t num_pts;
+	};
+
+	static void run_thread(GeomWriter *writer) {
+		// The CPL error handler stack is per thread, so the quiet handler that main
+		// pushes doesn't cover OGR errors on this one.  Failed writes still end up
+		// in fatal_error.
+		CPLPushErrorHandler(CPLQuietErrorHandler);
+		writer->run();
+		CPLPopErrorHandler();
+	}
+	void run();
+	void stop();
+	void write(const Shape &shape);
+	void commit(size_t go_idx);
+
+	std::vector<GeomOutput> &outputs;
+	const FeatureInterpreter &feature_interp;
+	const bool classify;
+	const size_t batch_size;
+	// Number of features written since the start of the transaction, or
+	// -1 if no transaction is open.
+	std::vector<ssize_t> txn_count;
+
+	std::deque<Shape *> queue;
+	size_t queued_pts;
+	bool done;
+	// set if writing failed on the writer thread, which then stops
+	bool failed;
+	std::string error;
+	boost::mutex mutex;
+	boost::condition_variable not_empty;
+	boost::condition_variable not_full;
+	boost::thread *thread;
+};
+
+// Limit on the number of vertices waiting in the GeomWriter queue.  A single
+// shape bigger than this is still accepted when the queue is empty.
+static const size_t WRITER_MAX_QUEUED_PTS = 1<<22;
+
+// For -stream.  Runs the steps that follow tracing on each component (a top-level ring
+// with the rings nested within it) as soon as the tracer hands it over, so that only a
+// few components are held in memory at a time.  With more than one thread the beveling,
+// pinching and simplification are done by a pool of workers.  Either way the components
+// are projected and written in the order in which they were traced, so the output
+// doesn't depend on the number of threads.  Projection is left to the calling thread
+// since the OGR transforms of the GeoRef can't be shared between threads.
+class ComponentPipeline : public TraceSink {
+public:
+	struct Params {
+		double bevel_size;
+		bool do_pinch_excursions;
+		double reduction_tolerance;
+		bool do_geom_output;
+		const bool *need_cs;
+		double llproj_toler;
+		FeatureRawVal val;
+	};
+
+	ComponentPipeline(const Params &_params, const GeoRef &_georef, DebugPlot *_dbuf,
+		GeomWriter &_writer, size_t num_threads);
+	~ComponentPipeline();
+
+	// The rings are swapped out of the component.  Blocks while too many components are
+	// waiting for the workers.
+	void push(Mpoly &component);
+
+	// Waits for all components to be processed and queued for writing.
+	void finish();
+
+	// totals, after simplification
+	size_t num_outer, num_holes, total_pts;
+	size_t num_shapes;
+
+private:
+	struct Job {
+		Job() : done(false), failed(false) { }
+		Mpoly poly;
+		bool done;
+		// set if processing threw, the error being raised when the job is written
+		bool failed;
+		std::string error;
+	};
+
+	static void run_thread(ComponentPipeline *pipeline) { pipeline->run(); }
+	void run();
+	void process(Mpoly &poly, DebugPlot *pinch_dbuf) const;
+	void write(Mpoly &poly);
+	// Writes the finished jobs at the front of the queue, waiting for the workers until
+	// no more than max_left are still in flight.
+	void write_finished(size_t max_left);
+
+	const Params params;
+	const GeoRef &georef;
+	DebugPlot *dbuf;
+	GeomWriter &writer;
+	const size_t max_in_flight;
+
+	// All jobs not yet written, in the order they were pushed.  The ones not yet taken
+	// by a worker are also in todo.
+	std::deque<Job *> in_flight;
+	std::deque<Job *> todo;
+	bool stopping;
+	boost::mutex mutex;
+	boost::condition_variable have_todo;
+	boost::condition_variable job_done;
+	boost::thread_group threads;
+};
+
+// Computes the coordinate systems needed by the outputs.  Each one is computed once and
+// shared by all outputs that use it.  The last one computed takes over the pixel
+// coordinates rather than copying them.
+static void project_shape(
+	Mpoly &xy_poly, Mpoly &en_poly, Mpoly &ll_poly,
+	const bool *need_cs, const GeoRef &georef, double llproj_toler
+) {
+	if(need_cs[CS_LL]) {
+		if(need_cs[CS_XY] || need_cs[CS_EN]) ll_poly = xy_poly;
+		else ll_poly.swap(xy_poly);
+		ll_poly.xy2ll_with_interp(georef, llproj_toler);
+	}
+	if(need_cs[CS_EN]) {
+		if(need_cs[CS_XY]) en_poly = xy_poly;
+		else en_poly.swap(xy_poly);
+		en_poly.xy2en(georef);
+	}
+}
+
+void take_largest_ring(Mpoly &mp);
 
-Mpoly remove_holes(const Mpoly &mp_in);
+void remove_holes(Mpoly &mp);
 
-Mpoly containment_filters(
-	const Mpoly &mp_in,
+void containment_filters(
+	Mpoly &mp,
 	const std::vector<ContainingOption> &containing_options,
 	const GeoRef &georef,
 	DebugPlot *dbuf
 );
 
-int main(int argc, char **argv) {
+static int tool_main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string input_raster_fn;
 	bool classify = 0;
@@ -200,6 +395,8 @@ int main(int argc, char **argv) {
 	bool split_polys = 0;
 	CoordSystem cur_out_cs = CS_UNKNOWN;
 	std::string cur_ogr_fmt = "ESRI Shapefile";
+	bool cur_wkt_exact = false;
+	size_t ogr_batch_size = 10000;
 	std::vector<GeomOutput> geom_outputs;
 	std::string mask_out_fn;
 	bool major_ring_only = 0;
@@ -207,8 +404,12 @@ int main(int argc, char **argv) {
 	bool output_no_donuts = 0;
 	int64_t min_ring_area = 0;
 	double reduction_tolerance = 2;
-	bool do_erosion = 0;
 	bool do_invert = 0;
+	size_t stripe_rows = 0;
+	bool stream = 0;
+	int pyramid_factor = 0;
+	bool use_rle = 0;
+	size_t num_threads = 1;
 	double llproj_toler = 1;
 	double bevel_size = .1;
 	bool do_pinch_excursions = 0;
@@ -216,6 +417,7 @@ int main(int argc, char **argv) {
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 	NdvDef ndv_def = NdvDef(arg_list);
+	MorphologyOpts morph_opts = MorphologyOpts(arg_list);
 
 	size_t argp = 1;
 	while(argp < arg_list.size()) {
@@ -234,17 +436,34 @@ int main(int argc, char **argv) {
 					if(argp == arg_list.size()) usage(cmdname);
 					int bandid = boost::lexical_cast<int>(arg_list[argp++]);
 					inspect_bandids.push_back(bandid);
-				} else if(arg == "-erosion") {
-					do_erosion = 1;
 				} else if(arg == "-invert") {
 					do_invert = 1;
+				} else if(arg == "-threads") {
+					if(argp == arg_list.size()) usage(cmdname);
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!num_threads) fatal_error("-threads must be positive");
+				} else if(arg == "-stripe-rows") {
+					if(argp == arg_list.size()) usage(cmdname);
+					stripe_rows = boost::lexical_cast<size_t>(arg_list[argp++]);
+					if(!stripe_rows) fatal_error("-stripe-rows must be positive");
+				} else if(arg == "-stream") {
+					stream = 1;
+				} else if(arg == "-rle") {
+					use_rle = 1;
+				} else if(arg == "-pyramid") {
+					if(argp == arg_list.size()) usage(cmdname);
+					pyramid_factor = boost::lexical_cast<int>(arg_list[argp++]);
+					if(pyramid_factor < 1) fatal_error("-pyramid must be positive");
 				} else if(arg == "-split-polys") {
 					split_polys = 1;
 				} else if(arg == "-wkt-out") {
 					if(argp == arg_list.size()) usage(cmdname);
 					GeomOutput go(cur_out_cs);
 					go.wkt_fn = arg_list[argp++];
+					go.wkt_exact = cur_wkt_exact;
 					geom_outputs.push_back(go);
+				} else if(arg == "-wkt-exact") {
+					cur_wkt_exact = true;
 				} else if(arg == "-wkb-out") {
 					if(argp == arg_list.size()) usage(cmdname);
 					GeomOutput go(cur_out_cs);
@@ -259,6 +478,9 @@ int main(int argc, char **argv) {
 				} else if(arg == "-ogr-fmt") {
 					if(argp == arg_list.size()) usage(cmdname);
 					cur_ogr_fmt = arg_list[argp++];
+				} else if(arg == "-ogr-batch-size") {
+					if(argp == arg_list.size()) usage(cmdname);
+					ogr_batch_size = boost::lexical_cast<size_t>(arg_list[argp++]);
 				} else if(arg == "-out-cs") {
 					if(argp == arg_list.size()) usage(cmdname);
 					std::string cs = arg_list[argp++];
@@ -335,6 +557,37 @@ int main(int argc, char **argv) {
 	if(classify) {
 		if(do_invert) fatal_error("-classify option is not compatible with -invert option");
 		if(mask_out_fn.size()) fatal_error("-classify option is not compatible with -mask-out option");
+		if(stripe_rows) fatal_error("-classify option is not compatible with -stripe-rows option");
+		if(morph_opts.dilate_passes) fatal_error("-classify option is not compatible with -dilation or -opening options");
+	}
+
+	if(pyramid_factor) {
+		if(classify) fatal_error("-pyramid option is not compatible with -classify option");
+		if(stripe_rows) fatal_error("-pyramid option is not compatible with -stripe-rows option");
+		if(!morph_opts.empty()) fatal_error(
+			"-pyramid option is not compatible with -erosion, -dilation or -opening options");
+		if(pyramid_factor > reduction_tolerance) fatal_error(
+			"-pyramid factor can't be more than the -dp-toler value");
+		if(int64_t(pyramid_factor) * pyramid_factor > min_ring_area) fatal_error(
+			"-pyramid factor squared can't be more than the -min-ring-area value");
+	}
+
+	if(use_rle) {
+		if(classify) fatal_error("-rle option is not compatible with -classify option");
+		if(stripe_rows) fatal_error("-rle option is not compatible with -stripe-rows option");
+		if(!morph_opts.empty()) fatal_error(
+			"-rle option is not compatible with -erosion, -dilation or -opening options");
+	}
+
+	if(stream) {
+		// These all need to see the whole trace at once.
+		if(!split_polys) fatal_error("-stream option requires -split-polys option");
+		if(classify) fatal_error("-stream option is not compatible with -classify option");
+		if(stripe_rows) fatal_error("-stream option is not compatible with -stripe-rows option");
+		if(major_ring_only) fatal_error("-stream option is not compatible with -major-ring option");
+		if(mask_out_fn.size()) fatal_error("-stream option is not compatible with -mask-out option");
+		if(!containing_options.empty()) fatal_error(
+			"-stream option is not compatible with -containing or -not-containing options");
 	}
 
 	GDALAllRegister();
@@ -376,7 +629,9 @@ int main(int argc, char **argv) {
 
 	FeatureBitmap *features_bitmap = NULL;
 	if(classify) {
-		features_bitmap = FeatureBitmap::from_raster(ds, inspect_bandids, ndv_def, dbuf);
+		StageTimer timer("read", "pixels");
+		features_bitmap = FeatureBitmap::from_raster(ds, inspect_bandids, ndv_def, dbuf, num_threads);
+		timer.add_items(uint64_t(georef.w) * georef.h);
 	}
 
 	for(size_t go_idx=0; go_idx<geom_outputs.size(); go_idx++) {
@@ -419,6 +674,7 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	GeomWriter geom_writer(geom_outputs, feature_interp, classify, ogr_batch_size);
 	int num_shapes_written = 0;
 
 	std::map<FeatureRawVal, FeatureBitmap::Index> features_list;
@@ -430,47 +686,138 @@ int main(int argc, char **argv) {
 		features_list[FeatureRawVal()];
 	}
 
+	if(!containing_options.empty()) {
+		// We need to trace donuts even if not outputting them, in order to
+		// see if the polygons satisfy the containment options.  Ideally
+		// the user should be able to specify which happens first, hole
+		// removal or containment options.  Maybe there needs to be a
+		// rudimentary scripting language?  Or maybe just process the
+		// options in the order they are specified on the command line.
+
+		// Note: in this case, donuts must be removed later on!
+		trace_no_donuts = 0;
+	} else {
+		trace_no_donuts = output_no_donuts;
+		// If taking only the major ring, no holes are needed.
+		trace_no_donuts |= major_ring_only;
+	}
+	// If we are only taking the largest ring, and don't need to compute
+	// containments, then skip donuts for speed.
+	if(major_ring_only && containing_options.empty()) {
+		trace_no_donuts = 1;
+	}
+
+	// In classify mode all features are traced at once, rather than
+	// building and tracing a mask for each feature.
+	std::vector<Mpoly> traced_features;
+	if(classify) {
+		if(morph_opts.erode_passes) {
+			StageTimer timer("morphology", "pixels");
+			features_bitmap->erode(morph_opts.erode_passes);
+			timer.add_items(uint64_t(georef.w) * georef.h);
+		}
+		StageTimer timer("trace", "vertices");
+		traced_features = trace_features(*features_bitmap,
+			georef.w, georef.h, min_ring_area, trace_no_donuts);
+		BOOST_FOREACH(const Mpoly &mp, traced_features) timer.add_items(mp.num_vertices());
+	}
+
+	bool need_cs[CS_PERCENT+1] = { false };
+	for(size_t go_idx=0; go_idx<geom_outputs.size(); go_idx++) {
+		need_cs[geom_outputs[go_idx].out_cs] = true;
+	}
+
 	typedef std::map<FeatureRawVal, FeatureBitmap::Index>::value_type feature_pair_t;
 	size_t feature_idx = 0;
 	BOOST_FOREACH(const feature_pair_t &feature, features_list) {
 		Mpoly feature_poly;
-		{
-			BitGrid mask(0, 0);
-			if(classify) {
-				printf("\nTracing feature %s (%zd of %zd)\n",
-					feature_interp.pixel_to_string(feature.first).c_str(),
-					(++feature_idx), features_list.size());
-				mask = features_bitmap->get_mask_for_feature(feature.second);
+		// with -stream, everything after tracing is done by this as the trace goes on
+		ComponentPipeline *pipeline = NULL;
+		if(stream) {
+			ComponentPipeline::Params params;
+			params.bevel_size = bevel_size;
+			params.do_pinch_excursions = do_pinch_excursions;
+			params.reduction_tolerance = reduction_tolerance;
+			params.do_geom_output = do_geom_output;
+			params.need_cs = need_cs;
+			params.llproj_toler = llproj_toler;
+			params.val = feature.first;
+			pipeline = new ComponentPipeline(params, georef, dbuf, geom_writer, num_threads);
+		}
+		// the work of the pipeline can't be timed apart from the tracing
+		const char *trace_stage = pipeline ? "trace_and_process" : "trace";
+
+		if(classify) {
+			printf("\nProcessing feature %s (%zd of %zd)\n",
+				feature_interp.pixel_to_string(feature.first).c_str(),
+				(++feature_idx), features_list.size());
+			feature_poly.swap(traced_features[feature.second]);
+		} else if(stripe_rows) {
+			// reading and tracing are interleaved, so they can't be timed apart
+			StageTimer timer("read_and_trace", "vertices");
+			MaskStripeReader reader(ds, inspect_bandids, ndv_def, dbuf,
+				stripe_rows, do_invert, morph_opts);
+			trace_mask_striped(reader, min_ring_area, trace_no_donuts).swap(feature_poly);
+			timer.add_items(feature_poly.num_vertices());
+		} else {
+			printf("Reading raster.\n");
+			const uint64_t num_pixels = uint64_t(georef.w) * georef.h;
+			// A bitmap is one bit per pixel whatever the image holds, whereas runs can
+			// take many times that on noisy masks and are slower to look up while
+			// tracing, so runs are only used when asked for (-pyramid always reads
+			// runs).  Erosion/dilation needs the bitmap.
+			if(!morph_opts.empty() || (!use_rle && !pyramid_factor)) {
+				StageTimer read_timer("read", "pixels");
+				BitGrid mask = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, dbuf, num_threads);
+				if(do_invert) mask.invert();
+				read_timer.add_items(num_pixels);
+				read_timer.stop();
+				{
+					StageTimer timer("morphology", "pixels");
+					morph_opts.apply(mask);
+					timer.add_items(num_pixels);
+				}
+				StageTimer timer(trace_stage, "vertices");
+				if(pipeline) {
+					trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts, *pipeline);
+					pipeline->finish();
+					timer.add_items(pipeline->total_pts);
+				} else {
+					trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts).swap(feature_poly);
+					timer.add_items(feature_poly.num_vertices());
+				}
 			} else {
-				printf("Reading raster.\n");
-				mask = get_bitgrid_for_dataset(ds, inspect_bandids, ndv_def, dbuf);
+				StageTimer read_timer("read", "pixels");
+				// the pyramid reader inverts as it goes, since it traces what it reads
+				RleMask mask = pyramid_factor ?
+					get_rlemask_pyramid(ds, inspect_bandids, ndv_def,
+						pyramid_factor, do_invert, min_ring_area) :
+					get_rlemask_for_dataset(ds, inspect_bandids, ndv_def, dbuf, num_threads);
+				if(do_invert && !pyramid_factor) mask.invert();
+				read_timer.add_items(num_pixels);
+				read_timer.stop();
+				StageTimer timer(trace_stage, "vertices");
+				if(pipeline) {
+					trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts, *pipeline);
+					pipeline->finish();
+					timer.add_items(pipeline->total_pts);
+				} else {
+					trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts).swap(feature_poly);
+					timer.add_items(feature_poly.num_vertices());
+				}
 			}
-
-			if(do_invert)  mask.invert();
-			if(do_erosion) mask.erode();
-
-			feature_poly = trace_mask(mask, georef.w, georef.h, min_ring_area, trace_no_donuts);
 		}
 
-		if(!containing_options.empty()) {
-			// We need to trace donuts even if not outputting them, in order to
-			// see if the polygons satisfy the containment options.  Ideally
-			// the user should be able to specify which happens first, hole
-			// removal or containment options.  Maybe there needs to be a
-			// rudimentary scripting language?  Or maybe just process the
-			// options in the order they are specified on the command line.
-
-			// Note: in this case, donuts must be removed later on!
-			trace_no_donuts = 0;
-		} else {
-			trace_no_donuts = output_no_donuts;
-			// If taking only the major ring, no holes are needed.
-			trace_no_donuts |= major_ring_only;
-		}
-		// If we are only taking the largest ring, and don't need to compute
-		// containments, then skip donuts for speed.
-		if(major_ring_only && containing_options.empty()) {
-			trace_no_donuts = 1;
+		if(pipeline) {
+			if(!pipeline->num_outer) {
+				printf("WARNING! No rings found!\n");
+			} else {
+				printf("Found %zd outer rings and %zd holes with a total of %zd vertices.\n",
+					pipeline->num_outer, pipeline->num_holes, pipeline->total_pts);
+			}
+			num_shapes_written += pipeline->num_shapes;
+			delete(pipeline);
+			continue;
 		}
 
 		if(VERBOSE) {
@@ -485,39 +832,46 @@ int main(int argc, char **argv) {
 		}
 
 		if(!feature_poly.rings.empty() && !containing_options.empty()) {
-			feature_poly = containment_filters(feature_poly, containing_options, georef, dbuf);
+			containment_filters(feature_poly, containing_options, georef, dbuf);
 		}
 
 		if(major_ring_only && feature_poly.rings.size() > 1) {
 			printf("Taking largest ring.\n");
-			feature_poly = take_largest_ring(feature_poly);
+			take_largest_ring(feature_poly);
 		}
 
 		if(output_no_donuts && !trace_no_donuts) {
 			// Hole removal was deferred until now.
 			printf("Removing donut holes.\n");
-			feature_poly = remove_holes(feature_poly);
+			remove_holes(feature_poly);
 		}
 
 		if(!feature_poly.rings.empty() && bevel_size > 0) {
 			// the topology cannot be resolved by us or by geos/jump/postgis if
 			// there are self-intersections
-			bevel_self_intersections(feature_poly, bevel_size);
+			StageTimer timer("bevel", "vertices");
+			timer.add_items(feature_poly.num_vertices());
+			bevel_self_intersections(feature_poly, bevel_size, num_threads);
 		}
 
 		if(feature_poly.rings.size() && do_pinch_excursions) {
 			printf("Pinching excursions...\n");
-			feature_poly = pinch_excursions2(feature_poly, dbuf);
+			StageTimer timer("pinch", "vertices");
+			timer.add_items(feature_poly.num_vertices());
+			pinch_excursions2(feature_poly, dbuf).swap(feature_poly);
 			printf("Done pinching excursions.\n");
 		}
 
 		if(mask_out_fn.size()) {
+			StageTimer timer("mask_out", "pixels");
 			mask_from_mpoly(feature_poly, georef.w, georef.h, mask_out_fn);
+			timer.add_items(uint64_t(georef.w) * georef.h);
 		}
 
 		if(feature_poly.rings.size() && reduction_tolerance > 0) {
-			Mpoly reduced_poly = compute_reduced_pointset(feature_poly, reduction_tolerance);
-			feature_poly = reduced_poly;
+			StageTimer timer("reduce", "vertices");
+			timer.add_items(feature_poly.num_vertices());
+			compute_reduced_pointset(feature_poly, reduction_tolerance, num_threads).swap(feature_poly);
 		}
 
 		if(feature_poly.rings.empty()) {
@@ -541,76 +895,55 @@ int main(int argc, char **argv) {
 
 				std::vector<Mpoly> shapes;
 				if(split_polys) {
-					shapes = split_mpoly_to_polys(feature_poly);
+					split_mpoly_to_polys(feature_poly).swap(shapes);
 				} else {
-					shapes.push_back(feature_poly);
+					shapes.resize(1);
+					shapes[0].swap(feature_poly);
 				}
 
 				for(size_t shape_idx=0; shape_idx<shapes.size(); shape_idx++) {
-					const Mpoly &poly_in = shapes[shape_idx];
-
-					for(size_t go_idx=0; go_idx<geom_outputs.size(); go_idx++) {
-						GeomOutput &go = geom_outputs[go_idx];
-
-						Mpoly proj_poly = poly_in;
-						if(go.out_cs == CS_XY) {
-							// no-op
-						} else if(go.out_cs == CS_EN) {
-							proj_poly.xy2en(georef);
-						} else if(go.out_cs == CS_LL) {
-							proj_poly.xy2ll_with_interp(georef, llproj_toler);
-						} else {
-							fatal_error("bad val for out_cs");
-						}
-
-						OGRGeometryH ogr_geom = mpoly_to_ogr(proj_poly);
-
-						if(go.wkt_fh) {
-							char *wkt_out;
-							OGR_G_ExportToWkt(ogr_geom, &wkt_out);
-							fprintf(go.wkt_fh, "%s\n", wkt_out);
-						}
-						if(go.wkb_fh) {
-							size_t wkb_size = OGR_G_WkbSize(ogr_geom);
-							printf("WKB size = %zd\n", wkb_size);
-							std::vector<unsigned char> wkb_out(wkb_size);
-							OGR_G_ExportToWkb(ogr_geom, WKB_BYTE_ORDER, &wkb_out[0]);
-							fwrite(&wkb_out[0], wkb_size, 1, go.wkb_fh);
-						}
-
-						if(go.ogr_ds) {
-							OGRFeatureH ogr_feat = OGR_F_Create(OGR_L_GetLayerDefn(go.ogr_layer));
-
-							if(classify) {
-								feature_interp.set_ogr_fields(go.ogr_layer, ogr_feat, feature.first);
-							}
-
-							OGR_F_SetGeometryDirectly(ogr_feat, ogr_geom); // assumes ownership of geom
-							OGR_L_CreateFeature(go.ogr_layer, ogr_feat);
-							OGR_F_Destroy(ogr_feat);
-						} else {
-							OGR_G_DestroyGeometry(ogr_geom);
-						}
+					Mpoly xy_poly;
+					xy_poly.swap(shapes[shape_idx]);
+					Mpoly en_poly, ll_poly;
+					if(need_cs[CS_LL] || need_cs[CS_EN]) {
+						StageTimer timer("project", "vertices");
+						timer.add_items(xy_poly.num_vertices());
+						project_shape(xy_poly, en_poly, ll_poly, need_cs, georef, llproj_toler);
 					}
 
+					StageTimer timer("write", "vertices");
+					timer.add_items(xy_poly.num_vertices() + en_poly.num_vertices() +
+						ll_poly.num_vertices());
+					geom_writer.push(xy_poly, en_poly, ll_poly, feature.first);
 					num_shapes_written++;
 				}
 			}
 		}
 	}
 
+	{
+		StageTimer timer("write", "vertices");
+		geom_writer.finish();
+	}
+
 	printf("\n");
 
 	delete(features_bitmap);
 
-	for(size_t go_idx=0; go_idx<geom_outputs.size(); go_idx++) {
-		GeomOutput &go = geom_outputs[go_idx];
-		if(go.wkt_fh) fclose(go.wkt_fh);
-		if(go.wkb_fh) fclose(go.wkb_fh);
-		if(go.ogr_ds) OGR_DS_Destroy(go.ogr_ds);
+	{
+		StageTimer timer("write", "vertices");
+		for(size_t go_idx=0; go_idx<geom_outputs.size(); go_idx++) {
+			GeomOutput &go = geom_outputs[go_idx];
+			if(go.wkt_fh) fclose(go.wkt_fh);
+			if(go.wkb_fh) fclose(go.wkb_fh);
+			if(go.ogr_ds) OGR_DS_Destroy(go.ogr_ds);
+		}
 	}
 
-	if(dbuf) dbuf->writePlot(debug_report);
+	if(dbuf) {
+		StageTimer timer("report");
+		dbuf->writePlot(debug_report);
+	}
 
 	if(do_geom_output) {
 		if(num_shapes_written) printf("Wrote %d shapes.\n", num_shapes_written);
@@ -624,42 +957,345 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-Mpoly take_largest_ring(const Mpoly &mp_in) {
+GeomWriter::GeomWriter(
+	std::vector<GeomOutput> &_outputs,
+	const FeatureInterpreter &_feature_interp,
+	bool _classify,
+	size_t _batch_size
+) :
+	outputs(_outputs),
+	feature_interp(_feature_interp),
+	classify(_classify),
+	batch_size(_batch_size),
+	txn_count(_outputs.size(), -1),
+	queued_pts(0),
+	done(false),
+	failed(false),
+	thread(NULL)
+{
+	if(outputs.size()) {
+		thread = new boost::thread(&GeomWriter::run_thread, this);
+	}
+}
+
+GeomWriter::~GeomWriter() {
+	// Normally finish() has been called already.  If not (e.g. the tracer threw), the
+	// writer is stopped without raising any error that it had.
+	stop();
+}
+
+void GeomWriter::push(Mpoly &xy_poly, Mpoly &en_poly, Mpoly &ll_poly, const FeatureRawVal &val) {
+	if(!thread) fatal_error("GeomWriter::push called after finish");
+
+	Shape *shape = new Shape();
+	shape->xy_poly.swap(xy_poly);
+	shape->en_poly.swap(en_poly);
+	shape->ll_poly.swap(ll_poly);
+	shape->val = val;
+	shape->num_pts = 0;
+	const Mpoly *polys[3] = { &shape->xy_poly, &shape->en_poly, &shape->ll_poly };
+	for(size_t i=0; i<3; i++) {
+		for(size_t r_idx=0; r_idx<polys[i]->rings.size(); r_idx++) {
+			shape->num_pts += polys[i]->rings[r_idx].pts.size();
+		}
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	while(!failed && queued_pts && queued_pts + shape->num_pts > WRITER_MAX_QUEUED_PTS) {
+		not_full.wait(lock);
+	}
+	if(failed) {
+		delete(shape);
+		fatal_error(error);
+	}
+	queue.push_back(shape);
+	queued_pts += shape->num_pts;
+	not_empty.notify_one();
+}
+
+void GeomWriter::stop() {
+	if(!thread) return;
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		done = true;
+		not_empty.notify_one();
+	}
+	thread->join();
+	delete(thread);
+	thread = NULL;
+	BOOST_FOREACH(Shape *shape, queue) delete(shape);
+	queue.clear();
+}
+
+void GeomWriter::finish() {
+	if(!thread) return;
+	stop();
+	if(failed) fatal_error(error);
+
+	for(size_t go_idx=0; go_idx<outputs.size(); go_idx++) {
+		commit(go_idx);
+	}
+}
+
+void GeomWriter::run() {
+	for(;;) {
+		Shape *shape;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			while(queue.empty() && !done) not_empty.wait(lock);
+			if(queue.empty()) return;
+			shape = queue.front();
+		}
+
+		try {
+			write(*shape);
+		} catch(const std::exception &e) {
+			boost::mutex::scoped_lock lock(mutex);
+			failed = true;
+			error = e.what();
+			not_full.notify_one();
+			return;
+		}
+
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			queue.pop_front();
+			queued_pts -= shape->num_pts;
+			not_full.notify_one();
+		}
+		delete(shape);
+	}
+}
+
+void GeomWriter::commit(size_t go_idx) {
+	if(txn_count[go_idx] < 0) return;
+	if(OGR_L_CommitTransaction(outputs[go_idx].ogr_layer) != OGRERR_NONE) {
+		fatal_error("cannot commit OGR transaction");
+	}
+	txn_count[go_idx] = -1;
+}
+
+void GeomWriter::write(const Shape &shape) {
+	for(size_t go_idx=0; go_idx<outputs.size(); go_idx++) {
+		GeomOutput &go = outputs[go_idx];
+
+		const Mpoly *proj_poly;
+		if(go.out_cs == CS_XY) {
+			proj_poly = &shape.xy_poly;
+		} else if(go.out_cs == CS_EN) {
+			proj_poly = &shape.en_poly;
+		} else if(go.out_cs == CS_LL) {
+			proj_poly = &shape.ll_poly;
+		} else {
+			fatal_error("bad val for out_cs");
+		}
+
+		if(go.wkt_fh) {
+			mpoly_write_wkt(*proj_poly, go.wkt_fh, go.wkt_exact);
+		}
+		if(go.wkb_fh) {
+			mpoly_write_wkb(*proj_poly, go.wkb_fh, WKB_BYTE_ORDER);
+		}
+
+		if(go.ogr_ds) {
+			if(batch_size && txn_count[go_idx] < 0 &&
+				OGR_L_TestCapability(go.ogr_layer, OLCTransactions) &&
+				OGR_L_StartTransaction(go.ogr_layer) == OGRERR_NONE
+			) {
+				txn_count[go_idx] = 0;
+			}
+
+			OGRGeometryH ogr_geom = mpoly_to_ogr(*proj_poly);
+			OGRFeatureH ogr_feat = OGR_F_Create(OGR_L_GetLayerDefn(go.ogr_layer));
+
+			if(classify) {
+				feature_interp.set_ogr_fields(go.ogr_layer, ogr_feat, shape.val);
+			}
+
+			OGR_F_SetGeometryDirectly(ogr_feat, ogr_geom); // assumes ownership of geom
+			OGR_L_CreateFeature(go.ogr_layer, ogr_feat);
+			OGR_F_Destroy(ogr_feat);
+
+			if(txn_count[go_idx] >= 0 && size_t(++txn_count[go_idx]) >= batch_size) {
+				commit(go_idx);
+			}
+		}
+	}
+}
+
+ComponentPipeline::ComponentPipeline(
+	const Params &_params, const GeoRef &_georef, DebugPlot *_dbuf,
+	GeomWriter &_writer, size_t num_threads
+) :
+	num_outer(0), num_holes(0), total_pts(0), num_shapes(0),
+	params(_params),
+	georef(_georef),
+	dbuf(_dbuf),
+	writer(_writer),
+	max_in_flight(num_threads * 4),
+	stopping(false)
+{
+	if(num_threads <= 1) return;
+	for(size_t i=0; i<num_threads; i++) {
+		threads.add_thread(new boost::thread(&ComponentPipeline::run_thread, this));
+	}
+}
+
+ComponentPipeline::~ComponentPipeline() {
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		stopping = true;
+		have_todo.notify_all();
+	}
+	threads.join_all();
+	BOOST_FOREACH(Job *job, in_flight) delete(job);
+}
+
+void ComponentPipeline::push(Mpoly &component) {
+	if(!threads.size()) {
+		process(component, dbuf);
+		write(component);
+		return;
+	}
+
+	Job *job = new Job();
+	job->poly.swap(component);
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		in_flight.push_back(job);
+		todo.push_back(job);
+		have_todo.notify_one();
+	}
+	write_finished(max_in_flight - 1);
+}
+
+void ComponentPipeline::finish() {
+	write_finished(0);
+}
+
+void ComponentPipeline::write_finished(size_t max_left) {
+	boost::mutex::scoped_lock lock(mutex);
+	for(;;) {
+		while(!in_flight.empty() && in_flight.front()->done) {
+			Job *job = in_flight.front();
+			in_flight.pop_front();
+			lock.unlock();
+			if(job->failed) {
+				std::string error = job->error;
+				delete(job);
+				fatal_error(error);
+			}
+			write(job->poly);
+			delete(job);
+			lock.lock();
+		}
+		if(in_flight.size() <= max_left) return;
+		job_done.wait(lock);
+	}
+}
+
+void ComponentPipeline::run() {
+	for(;;) {
+		Job *job;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			while(todo.empty() && !stopping) have_todo.wait(lock);
+			if(todo.empty() || stopping) return;
+			job = todo.front();
+			todo.pop_front();
+		}
+
+		// The report can't be drawn on from several threads.
+		std::string error;
+		bool failed = false;
+		try {
+			process(job->poly, NULL);
+		} catch(const std::exception &e) {
+			error = e.what();
+			failed = true;
+		}
+
+		boost::mutex::scoped_lock lock(mutex);
+		job->failed = failed;
+		job->error = error;
+		job->done = true;
+		job_done.notify_all();
+	}
+}
+
+void ComponentPipeline::process(Mpoly &poly, DebugPlot *pinch_dbuf) const {
+	if(poly.rings.empty()) return;
+	if(params.bevel_size > 0) {
+		bevel_self_intersections(poly, params.bevel_size, 1, false);
+	}
+	if(params.do_pinch_excursions) {
+		pinch_excursions2(poly, pinch_dbuf).swap(poly);
+	}
+	if(params.reduction_tolerance > 0) {
+		compute_reduced_pointset(poly, params.reduction_tolerance, 1, false).swap(poly);
+	}
+}
+
+void ComponentPipeline::write(Mpoly &poly) {
+	for(size_t r_idx=0; r_idx<poly.rings.size(); r_idx++) {
+		if(poly.rings[r_idx].is_hole) num_holes++;
+		else num_outer++;
+		total_pts += poly.rings[r_idx].pts.size();
+	}
+
+	if(dbuf && dbuf->mode == PLOT_CONTOURS) {
+		dbuf->debugPlotMpoly(poly);
+	}
+
+	if(!params.do_geom_output || poly.rings.empty()) return;
+
+	std::vector<Mpoly> shapes = split_mpoly_to_polys(poly);
+	for(size_t shape_idx=0; shape_idx<shapes.size(); shape_idx++) {
+		Mpoly xy_poly;
+		xy_poly.swap(shapes[shape_idx]);
+		Mpoly en_poly, ll_poly;
+		project_shape(xy_poly, en_poly, ll_poly, params.need_cs, georef, params.llproj_toler);
+		writer.push(xy_poly, en_poly, ll_poly, params.val);
+		num_shapes++;
+	}
+}
+
+void take_largest_ring(Mpoly &mp) {
+	// Each ring lies within its top-level ancestor, so only those need to be looked at.
+	const RingHierarchy hier(mp);
 	double biggest_area = 0;
-	size_t best_idx = 0;
-	for(size_t i=0; i<mp_in.rings.size(); i++) {
-		double area = mp_in.rings[i].area();
+	size_t best_idx = hier.roots().empty() ? 0 : hier.roots()[0];
+	BOOST_FOREACH(size_t i, hier.roots()) {
+		double area = mp.rings[i].area();
 		if(area > biggest_area) {
 			biggest_area = area;
 			best_idx = i;
 		}
 	}
 	if(VERBOSE) printf("major ring was %zd with %zd pts, %.1f area\n",
-		best_idx, mp_in.rings[best_idx].pts.size(), biggest_area);
-	if(mp_in.rings[best_idx].parent_id >= 0) fatal_error("largest ring should not have a parent");
+		best_idx, mp.rings[best_idx].pts.size(), biggest_area);
+	if(mp.rings[best_idx].parent_id >= 0) fatal_error("largest ring should not have a parent");
 
-	Mpoly new_mp;
-	new_mp.rings.push_back(mp_in.rings[best_idx]);
-	return new_mp;
+	if(best_idx) mp.rings[0].swap(mp.rings[best_idx]);
+	mp.rings.resize(1);
 }
 
-Mpoly remove_holes(const Mpoly &mp_in) {
-	Mpoly new_mp;
+void remove_holes(Mpoly &mp) {
+	const RingHierarchy hier(mp);
+	size_t num_kept = 0;
 
-	for(size_t i=0; i<mp_in.rings.size(); i++) {
-		const Ring &ring = mp_in.rings[i];
-		// Take only top-level rings.  Since we are filling holes, it doesn't
-		// make sense to keep an island within a hole.
-		if(ring.parent_id < 0) {
-			new_mp.rings.push_back(ring);
-		}
+	// Take only top-level rings.  Since we are filling holes, it doesn't
+	// make sense to keep an island within a hole.
+	BOOST_FOREACH(size_t i, hier.roots()) {
+		if(i != num_kept) mp.rings[num_kept].swap(mp.rings[i]);
+		num_kept++;
 	}
 
-	return new_mp;
+	mp.rings.resize(num_kept);
 }
 
-Mpoly containment_filters(
-	const Mpoly &mp_in,
+void containment_filters(
+	Mpoly &mp,
 	const std::vector<ContainingOption> &containing_options,
 	const GeoRef &georef,
 	DebugPlot *dbuf
@@ -715,53 +1351,54 @@ Mpoly containment_filters(
 	printf("\n");
 
 	Mpoly new_mp;
-	std::map<int, int> relabeling;
+	// new index of each kept ring, -1 for dropped rings
+	std::vector<int> relabeling(mp.rings.size(), -1);
 
 	int num_outer=0, num_holes=0;
 
-	for(size_t outer_idx=0; outer_idx<mp_in.rings.size(); outer_idx++) {
-		const Ring &outer = mp_in.rings[outer_idx];
-		if(outer.is_hole) continue;
-
-		bool contains_wanted_pt = false;
-		BOOST_FOREACH(const Vertex &v, wanted_pts) {
-			if(mp_in.component_contains(v, outer_idx)) {
-				if(VERBOSE) printf("ring %zd contains wanted point %g,%g\n",
-					outer_idx, v.x, v.y);
-				contains_wanted_pt = true;
-				break;
-			}
+	// Decide which components to keep before touching the rings, since
+	// mp_prep refers to them.  Each point is located once, with a single
+	// pass over the edges near it, rather than being tested against every
+	// outer ring.
+	const PreparedMpoly mp_prep(mp);
+	const RingHierarchy hier(mp);
+	std::vector<bool> has_wanted_pt(mp.rings.size());
+	std::vector<bool> has_unwanted_pt(mp.rings.size());
+
+	BOOST_FOREACH(const Vertex &v, wanted_pts) {
+		BOOST_FOREACH(int outer_idx, mp_prep.containing_components(v)) {
+			if(VERBOSE) printf("ring %d contains wanted point %g,%g\n",
+				outer_idx, v.x, v.y);
+			has_wanted_pt[outer_idx] = true;
 		}
-		if(!wanted_pts.empty() && !contains_wanted_pt) {
-			// not interested in this ring
-			continue;
+	}
+	BOOST_FOREACH(const Vertex &v, unwanted_pts) {
+		BOOST_FOREACH(int outer_idx, mp_prep.containing_components(v)) {
+			if(VERBOSE) printf("ring %d contains unwanted point %g,%g\n",
+				outer_idx, v.x, v.y);
+			has_unwanted_pt[outer_idx] = true;
 		}
+	}
 
-		bool contains_unwanted_pt = false;
-		BOOST_FOREACH(const Vertex &v, unwanted_pts) {
-			if(mp_in.component_contains(v, outer_idx)) {
-				if(VERBOSE) printf("ring %zd contains unwanted point %g,%g\n",
-					outer_idx, v.x, v.y);
-				contains_unwanted_pt = true;
-				break;
-			}
-		}
-		if(contains_unwanted_pt) {
-			// not interested in this ring
-			continue;
-		}
+	// The pts of the kept rings are moved into new_mp.  The metadata stays
+	// behind since the relabeling below needs the parent_id of dropped rings.
+	for(size_t outer_idx=0; outer_idx<mp.rings.size(); outer_idx++) {
+		if(mp.rings[outer_idx].is_hole) continue;
+		// not interested in this ring
+		if(!wanted_pts.empty() && !has_wanted_pt[outer_idx]) continue;
+		if(has_unwanted_pt[outer_idx]) continue;
 
 		relabeling[outer_idx] = int(new_mp.rings.size());
-		new_mp.rings.push_back(outer);
+		new_mp.rings.push_back(mp.rings[outer_idx].copyMetadata());
+		new_mp.rings.back().pts.swap(mp.rings[outer_idx].pts);
 		num_outer++;
 
-		for(size_t j=0; j<mp_in.rings.size(); j++) {
-			Ring inner = mp_in.rings[j];
-			// take children of outer ring
-			if(inner.parent_id != int(outer_idx)) continue;
-
+		// take children of outer ring
+		for(size_t c=0; c<hier.num_children(outer_idx); c++) {
+			size_t j = hier.child(outer_idx, c);
 			relabeling[j] = int(new_mp.rings.size());
-			new_mp.rings.push_back(inner);
+			new_mp.rings.push_back(mp.rings[j].copyMetadata());
+			new_mp.rings.back().pts.swap(mp.rings[j].pts);
 			num_holes++;
 		}
 	}
@@ -771,11 +1408,11 @@ Mpoly containment_filters(
 		// Compute new parent.  Iterate outwards through the ring hierarchy
 		// until a ring is found that has been kept.
 		while(ring.parent_id >= 0) {
-			if(relabeling.count(ring.parent_id)) {
+			if(relabeling[ring.parent_id] >= 0) {
 				ring.parent_id = relabeling[ring.parent_id];
 				break;
 			} else {
-				ring.parent_id = mp_in.rings[ring.parent_id].parent_id;
+				ring.parent_id = mp.rings[ring.parent_id].parent_id;
 			}
 		}
 	}
@@ -786,5 +1423,12 @@ Mpoly containment_filters(
 		printf("   Found %d connected components (with %d holes).\n", num_outer, num_holes);
 	}
 
-	return new_mp;
+	mp.swap(new_mp);
+}
+
+int main(int argc, char **argv) {
+	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	BatchOpts batch_opts = BatchOpts(arg_list);
+	if(batch_opts.empty()) return tool_main(argc, argv);
+	return batch_opts.run(arg_list, tool_main) ? 1 : 0;
 }
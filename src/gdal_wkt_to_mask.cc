@@ -26,6 +26,8 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <boost/lexical_cast.hpp>
+
 #include "common.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
@@ -39,6 +41,38 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 using namespace dangdal;
 
+GDALDatasetH create_mask_tiff(const std::string &fn, const GeoRef &georef,
+	bool byte_output, const std::vector<std::string> &create_options
+) {
+	GDALDriverH driver = GDALGetDriverByName("GTiff");
+	if(!driver) fatal_error("unrecognized output format (GTiff)");
+
+	char **opts = NULL;
+	opts = CSLSetNameValue(opts, "TILED", "YES");
+	opts = CSLSetNameValue(opts, "COMPRESS", "DEFLATE");
+	if(!byte_output) opts = CSLSetNameValue(opts, "NBITS", "1");
+	for(size_t i=0; i<create_options.size(); i++) {
+		const std::string &opt = create_options[i];
+		size_t eq = opt.find('=');
+		if(eq == std::string::npos) fatal_error("creation option must be NAME=VALUE (%s)", opt.c_str());
+		opts = CSLSetNameValue(opts, opt.substr(0, eq).c_str(), opt.substr(eq+1).c_str());
+	}
+	GDALDatasetH ds = GDALCreate(driver, fn.c_str(), georef.w, georef.h, 1, GDT_Byte, opts);
+	CSLDestroy(opts);
+	if(!ds) fatal_error("cannot open mask output");
+
+	std::vector<double> affine = georef.fwd_affine;
+	GDALSetGeoTransform(ds, &affine[0]);
+	if(georef.spatial_ref) {
+		char *wkt = NULL;
+		if(OSRExportToWkt(georef.spatial_ref, &wkt) == OGRERR_NONE) {
+			GDALSetProjection(ds, wkt);
+		}
+		CPLFree(wkt);
+	}
+	return ds;
+}
+
 void usage(const std::string &cmdname) {
 	printf("Usage:\n  %s [options] \n", cmdname.c_str());
 	printf("\n");
@@ -47,7 +81,14 @@ void usage(const std::string &cmdname) {
 	printf("  -geo-from <fn>                  Get georeference from this raster file\n");
 	printf("\nOptions:\n");
 	printf("  -wkt <fn>                       File containing WKT def in easting/northing units\n");
-	printf("  -mask-out <fn.pbm>              Filename for mask output in PBM format\n");
+	printf("  -mask-out <fn.pbm>              Filename for mask output in PBM format, or\n");
+	printf("                                  GeoTIFF format if the name ends in .tif\n");
+	printf("\nGeoTIFF output:\n");
+	printf("  -byte                           Write 0 and 255 as bytes rather than a 1-bit mask\n");
+	printf("  -co NAME=VALUE                  Creation option (default TILED=YES, COMPRESS=DEFLATE)\n");
+	printf("  -threads N                      Rasterize using N threads\n");
+	printf("\n");
+	StageTimer::printUsage();
 
 	exit(1);
 }
@@ -56,10 +97,14 @@ int main(int argc, char **argv) {
 	const std::string cmdname = argv[0];
 	if(argc == 1) usage(cmdname);
 	std::vector<std::string> arg_list = argv_to_list(argc, argv);
+	StageTimer::parseArgs(arg_list);
 
 	std::string wkt_fn;
 	std::string mask_fn;
 	std::string geo_fn;
+	bool byte_output = false;
+	std::vector<std::string> create_options;
+	size_t num_threads = 1;
 
 	GeoOpts geo_opts = GeoOpts(arg_list);
 
@@ -79,6 +124,19 @@ int main(int argc, char **argv) {
 			} else if(arg == "-geo-from") {
 				if(argp == arg_list.size()) usage(cmdname);
 				geo_fn = arg_list[argp++];
+			} else if(arg == "-byte") {
+				byte_output = true;
+			} else if(arg == "-co") {
+				if(argp == arg_list.size()) usage(cmdname);
+				create_options.push_back(arg_list[argp++]);
+			} else if(arg == "-threads") {
+				if(argp == arg_list.size()) usage(cmdname);
+				try {
+					num_threads = boost::lexical_cast<size_t>(arg_list[argp++]);
+				} catch(boost::bad_lexical_cast &e) {
+					fatal_error("cannot parse number given on command line");
+				}
+				if(!num_threads) fatal_error("-threads must be positive");
 			} else {
 				usage(cmdname);
 			}
@@ -104,11 +162,30 @@ int main(int argc, char **argv) {
 
 	if(!georef.hasAffine()) fatal_error("missing affine transform");
 
-	Mpoly mp = mpoly_from_wktfile(wkt_fn);
+	Mpoly mp;
+	{
+		StageTimer timer("read", "vertices");
+		mpoly_from_wktfile(wkt_fn).swap(mp);
+		timer.add_items(mp.num_vertices());
+	}
 
-	mp.en2xy(georef);
+	{
+		StageTimer timer("project", "vertices");
+		mp.en2xy(georef);
+		timer.add_items(mp.num_vertices());
+	}
 
-	mask_from_mpoly(mp, georef.w, georef.h, mask_fn);
+	StageTimer timer("rasterize_and_write", "pixels");
+	timer.add_items(uint64_t(georef.w) * georef.h);
+	const char *ext = CPLGetExtension(mask_fn.c_str());
+	if(EQUAL(ext, "tif") || EQUAL(ext, "tiff")) {
+		GDALDatasetH dst_ds = create_mask_tiff(mask_fn, georef, byte_output, create_options);
+		mask_from_mpoly_to_band(mp, GDALGetRasterBand(dst_ds, 1),
+			byte_output ? 255 : 1, num_threads);
+		GDALClose(dst_ds);
+	} else {
+		mask_from_mpoly(mp, georef.w, georef.h, mask_fn);
+	}
 
 	return 0;
 }
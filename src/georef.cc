@@ -27,6 +27,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <string>
+#include <algorithm>
 #include <cassert>
 
 #include <boost/lexical_cast.hpp>
@@ -36,10 +37,18 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 static const double EPSILON = 1e-9;
 
-void usage(const std::string &cmdname); // externally defined
-
 namespace dangdal {
 
+static bool lonlat_in_range(double lon, double lat) {
+	if(lat < -90.0-EPSILON || lat > 90.0+EPSILON) return false; //fatal_error("latitude out of range (%lf)", lat);
+	// images in latlong projection that cross the dateline can
+	// have numbers outside of this range...
+	//if(lon < -180.0 || lon > 180.0) return false; //fatal_error("longitude out of range");
+	// but it shouldn't be outside of *this* range no matter what!
+	if(lon < -360.0-EPSILON || lon > 540.0+EPSILON) return false; //fatal_error("longitude out of range (%lf)", lon);
+	return true;
+}
+
 void GeoOpts::printUsage() {
 	printf(
 "Geocoding:\n"
@@ -75,30 +84,30 @@ GeoOpts::GeoOpts(std::vector<std::string> &arg_list) :
 		if(arg[0] == '-') {
 			try {
 				if(arg == "-s_srs") {
-					if(argp == arg_list.size()) usage(cmdname);
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
 					s_srs = arg_list[argp++];
 				} else if(arg == "-geo_srs") {
-					if(argp == arg_list.size()) usage(cmdname);
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
 					geo_srs = arg_list[argp++];
 				} else if(arg == "-ll_en") {
-					if(argp+2 > arg_list.size()) usage(cmdname);
+					if(argp+2 > arg_list.size()) fatal_error("%s needs two arguments", arg.c_str());
 					given_left_e = boost::lexical_cast<double>(arg_list[argp++]);
 					given_lower_n = boost::lexical_cast<double>(arg_list[argp++]);
 					got_ll_en = true;
 				} else if(arg == "-ul_en") {
-					if(argp+2 > arg_list.size()) usage(cmdname);
+					if(argp+2 > arg_list.size()) fatal_error("%s needs two arguments", arg.c_str());
 					given_left_e = boost::lexical_cast<double>(arg_list[argp++]);
 					given_upper_n = boost::lexical_cast<double>(arg_list[argp++]);
 					got_ul_en = true;
 				} else if(arg == "-wh") {
-					if(argp+2 > arg_list.size()) usage(cmdname);
+					if(argp+2 > arg_list.size()) fatal_error("%s needs two arguments", arg.c_str());
 					w = boost::lexical_cast<size_t>(arg_list[argp++]);
 					h = boost::lexical_cast<size_t>(arg_list[argp++]);
 				} else if(arg == "-res") {
-					if(argp == arg_list.size()) usage(cmdname);
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
 					res_x = boost::lexical_cast<double>(arg_list[argp++]);
 
-					if(argp == arg_list.size()) usage(cmdname);
+					if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
 					res_y = boost::lexical_cast<double>(arg_list[argp++]);
 				} else {
 					args_out.push_back(arg);
@@ -343,12 +352,7 @@ bool GeoRef::en2ll(
 	double lon = u;
 	double lat = v;
 
-	if(lat < -90.0-EPSILON || lat > 90.0+EPSILON) return 1; //fatal_error("latitude out of range (%lf)", lat);
-	// images in latlong projection that cross the dateline can
-	// have numbers outside of this range...
-	//if(lon < -180.0 || lon > 180.0) return 1; //fatal_error("longitude out of range");
-	// but it shouldn't be outside of *this* range no matter what!
-	if(lon < -360.0-EPSILON || lon > 540.0+EPSILON) return 1; //fatal_error("longitude out of range (%lf)", lon);
+	if(!lonlat_in_range(lon, lat)) return 1;
 
 	*lon_out = lon;
 	*lat_out = lat;
@@ -364,40 +368,38 @@ void GeoRef::en2ll_or_die(
 	}
 }
 
+// This will add a multiple of 360 degrees in order to bring the
+// coordinate into the proper range.  This is needed because
+// OCTTransform will usually return a number in the -180..180
+// range, but the raster may be defined on, for example, a range
+// of 0..360.
+double GeoRef::wrap_east(double east) const {
+	if(lon_loopsize) {
+		double east_orig = east;
+		while(east < lon_range1) east += lon_loopsize;
+		while(east > lon_range2) east -= lon_loopsize;
+		if(east < lon_range1) east = east_orig;
+		//printf("%g => %g\n", east_orig, east);
+	}
+	return east;
+}
+
 bool GeoRef::ll2en(
 	double lon, double lat,
 	double *e_out, double *n_out
 ) const {
 	if(!inv_xform) fatal_error("missing xform");
 
-	if(lat < -90.0-EPSILON || lat > 90.0+EPSILON) return 1; //fatal_error("latitude out of range (%lf)", lat);
-	// images in latlong projection that cross the dateline can
-	// have numbers outside of this range...
-	//if(lon < -180.0 || lon > 180.0) return 1; //fatal_error("longitude out of range");
-	// but it shouldn't be outside of *this* range no matter what!
-	if(lon < -360.0-EPSILON || lon > 540.0+EPSILON) return 1; //fatal_error("longitude out of range (%lf)", lon);
+	if(!lonlat_in_range(lon, lat)) return 1;
 
 	double u = lon;
 	double v = lat;
 	if(!OCTTransform(inv_xform, 1, &u, &v, NULL)) {
 		return 1;
 	}
-	double east = u;
+	double east = wrap_east(u);
 	double north = v;
 
-	// This will add a multiple of 360 degrees in order to bring the
-	// coordinate into the proper range.  This is needed because
-	// OCTTransform will usually return a number in the -180..180
-	// range, but the raster may be defined on, for example, a range
-	// of 0..360.
-	if(lon_loopsize) {
-		double east_orig = east;
-		while(east < lon_range1) east += lon_loopsize;
-		while(east > lon_range2) east -= lon_loopsize;
-		if(east < lon_range1) east = east_orig;
-		//printf("%g => %g\n", east_orig, east);
-	}
-
 	*e_out = east;
 	*n_out = north;
 	return 0;
@@ -450,4 +452,187 @@ void GeoRef::ll2xy_or_die(
 	en2xy(east, north, x_out, y_out);
 }
 
+static void check_sizes(const std::vector<double> &x, const std::vector<double> &y) {
+	if(x.size() != y.size()) fatal_error("x and y arrays differ in size (%zd vs %zd)", x.size(), y.size());
+}
+
+static void apply_affine(
+	const std::vector<double> &A,
+	std::vector<double> &x, std::vector<double> &y
+) {
+	check_sizes(x, y);
+	const double a0 = A[0], a1 = A[1], a2 = A[2];
+	const double a3 = A[3], a4 = A[4], a5 = A[5];
+	const size_t n = x.size();
+	double *px = n ? &x[0] : NULL;
+	double *py = n ? &y[0] : NULL;
+	for(size_t i=0; i<n; i++) {
+		const double xi = px[i];
+		const double yi = py[i];
+		px[i] = a0 + a1 * xi + a2 * yi;
+		py[i] = a3 + a4 * xi + a5 * yi;
+	}
+}
+
+void GeoRef::transform_many(
+	OGRCoordinateTransformationH xform,
+	std::vector<double> &x, std::vector<double> &y,
+	std::vector<bool> &ok
+) {
+	std::vector<size_t> idx;
+	for(size_t i=0; i<ok.size(); i++) {
+		if(ok[i]) idx.push_back(i);
+	}
+	if(idx.empty()) return;
+
+	const size_t n = idx.size();
+	std::vector<double> u(n), v(n);
+	for(size_t k=0; k<n; k++) {
+		u[k] = x[idx[k]];
+		v[k] = y[idx[k]];
+	}
+
+	// OCTTransformEx takes an int count
+	const size_t max_chunk = 1 << 30;
+	std::vector<int> success(n, 0);
+	for(size_t k=0; k<n; k+=max_chunk) {
+		int chunk = (int)std::min(max_chunk, n-k);
+		// The return value is not consistent between GDAL versions when
+		// only some points fail, so rely on the per-point flags.
+		OCTTransformEx(xform, chunk, &u[k], &v[k], NULL, &success[k]);
+	}
+
+	for(size_t k=0; k<n; k++) {
+		if(success[k]) {
+			x[idx[k]] = u[k];
+			y[idx[k]] = v[k];
+		} else {
+			ok[idx[k]] = false;
+		}
+	}
+}
+
+static void die_on_failure(
+	const char *what,
+	const std::vector<double> &x, const std::vector<double> &y,
+	const std::vector<bool> &ok
+) {
+	for(size_t i=0; i<ok.size(); i++) {
+		if(!ok[i]) fatal_error("%s transform failed [%g,%g]", what, x[i], y[i]);
+	}
+}
+
+void GeoRef::xy2en_many(std::vector<double> &x, std::vector<double> &y) const {
+	if(!hasAffine()) fatal_error("missing affine");
+	apply_affine(fwd_affine, x, y);
+}
+
+void GeoRef::en2xy_many(std::vector<double> &x, std::vector<double> &y) const {
+	if(!hasAffine()) fatal_error("missing affine");
+	apply_affine(inv_affine, x, y);
+}
+
+size_t GeoRef::en2ll_many(
+	std::vector<double> &x, std::vector<double> &y,
+	std::vector<bool> &ok
+) const {
+	if(!fwd_xform) fatal_error("missing xform");
+	check_sizes(x, y);
+
+	std::vector<double> u(x), v(y);
+	ok.assign(x.size(), true);
+	transform_many(fwd_xform, u, v, ok);
+
+	size_t num_failed = 0;
+	for(size_t i=0; i<x.size(); i++) {
+		if(ok[i] && lonlat_in_range(u[i], v[i])) {
+			x[i] = u[i];
+			y[i] = v[i];
+		} else {
+			ok[i] = false;
+			num_failed++;
+		}
+	}
+	return num_failed;
+}
+
+size_t GeoRef::ll2en_many(
+	std::vector<double> &x, std::vector<double> &y,
+	std::vector<bool> &ok
+) const {
+	if(!inv_xform) fatal_error("missing xform");
+	check_sizes(x, y);
+
+	ok.resize(x.size());
+	for(size_t i=0; i<x.size(); i++) {
+		ok[i] = lonlat_in_range(x[i], y[i]);
+	}
+
+	std::vector<double> u(x), v(y);
+	transform_many(inv_xform, u, v, ok);
+
+	size_t num_failed = 0;
+	for(size_t i=0; i<x.size(); i++) {
+		if(ok[i]) {
+			x[i] = wrap_east(u[i]);
+			y[i] = v[i];
+		} else {
+			num_failed++;
+		}
+	}
+	return num_failed;
+}
+
+size_t GeoRef::xy2ll_many(
+	std::vector<double> &x, std::vector<double> &y,
+	std::vector<bool> &ok
+) const {
+	std::vector<double> u(x), v(y);
+	xy2en_many(u, v);
+	size_t num_failed = en2ll_many(u, v, ok);
+	for(size_t i=0; i<x.size(); i++) {
+		if(ok[i]) {
+			x[i] = u[i];
+			y[i] = v[i];
+		}
+	}
+	return num_failed;
+}
+
+size_t GeoRef::ll2xy_many(
+	std::vector<double> &x, std::vector<double> &y,
+	std::vector<bool> &ok
+) const {
+	std::vector<double> u(x), v(y);
+	size_t num_failed = ll2en_many(u, v, ok);
+	en2xy_many(u, v);
+	for(size_t i=0; i<x.size(); i++) {
+		if(ok[i]) {
+			x[i] = u[i];
+			y[i] = v[i];
+		}
+	}
+	return num_failed;
+}
+
+void GeoRef::en2ll_many_or_die(std::vector<double> &x, std::vector<double> &y) const {
+	std::vector<bool> ok;
+	if(en2ll_many(x, y, ok)) die_on_failure("en2ll", x, y, ok);
+}
+
+void GeoRef::ll2en_many_or_die(std::vector<double> &x, std::vector<double> &y) const {
+	std::vector<bool> ok;
+	if(ll2en_many(x, y, ok)) die_on_failure("ll2en", x, y, ok);
+}
+
+void GeoRef::xy2ll_many_or_die(std::vector<double> &x, std::vector<double> &y) const {
+	xy2en_many(x, y);
+	en2ll_many_or_die(x, y);
+}
+
+void GeoRef::ll2xy_many_or_die(std::vector<double> &x, std::vector<double> &y) const {
+	ll2en_many_or_die(x, y);
+	en2xy_many(x, y);
+}
+
 } // namespace dangdal
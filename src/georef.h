@@ -65,6 +65,28 @@ public:
 	void xy2ll_or_die(double x, double y, double *lon_out, double *lat_out) const;
 	void ll2xy_or_die(double lon, double lat, double *x_out, double *y_out) const;
 
+	// Batch versions of the above.  The points in x/y are transformed in
+	// place, with a single call into OGR for the whole array.  ok[i] tells
+	// whether point i was transformed; points that fail are left untouched.
+	// The return value is the number of failures.
+	void xy2en_many(std::vector<double> &x, std::vector<double> &y) const;
+	void en2xy_many(std::vector<double> &x, std::vector<double> &y) const;
+	size_t en2ll_many(std::vector<double> &x, std::vector<double> &y, std::vector<bool> &ok) const;
+	size_t ll2en_many(std::vector<double> &x, std::vector<double> &y, std::vector<bool> &ok) const;
+	size_t xy2ll_many(std::vector<double> &x, std::vector<double> &y, std::vector<bool> &ok) const;
+	size_t ll2xy_many(std::vector<double> &x, std::vector<double> &y, std::vector<bool> &ok) const;
+	void en2ll_many_or_die(std::vector<double> &x, std::vector<double> &y) const;
+	void ll2en_many_or_die(std::vector<double> &x, std::vector<double> &y) const;
+	void xy2ll_many_or_die(std::vector<double> &x, std::vector<double> &y) const;
+	void ll2xy_many_or_die(std::vector<double> &x, std::vector<double> &y) const;
+
+	// Sends the points which have ok[i] set through xform, in as few
+	// OCTTransformEx calls as possible, and clears ok[i] for each point that
+	// fails.  Points that already have ok[i] cleared are skipped.  The
+	// contents of x/y are undefined for the failed points.
+	static void transform_many(OGRCoordinateTransformationH xform,
+		std::vector<double> &x, std::vector<double> &y, std::vector<bool> &ok);
+
 	std::string s_srs;
 	std::string geo_srs;
 	double res_x, res_y; // zero if there is rotation
@@ -81,6 +103,9 @@ public:
 	std::vector<double> fwd_affine;
 	std::vector<double> inv_affine;
 	double lon_range1, lon_range2, lon_loopsize;
+
+private:
+	double wrap_east(double east) const;
 };
 
 } // namespace dangdal
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+
+#include <cstddef>
+
+#include "hillshade.h"
+
+namespace dangdal {
+
+static inline int shade_table_index(double dx2, double dy2) {
+	int st_col = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dx2);
+	if(st_col < 0) st_col = 0;
+	if(st_col > SHADE_TABLE_SIZE*2) st_col = SHADE_TABLE_SIZE*2;
+	int st_row = SHADE_TABLE_SIZE + (int)(SHADE_TABLE_SCALE * dy2);
+	if(st_row < 0) st_row = 0;
+	if(st_row > SHADE_TABLE_SIZE*2) st_row = SHADE_TABLE_SIZE*2;
+	return st_row * SHADE_TABLE_WIDTH + st_col;
+}
+
+void shade_row_reference(const ShadeSettings &ss, const ShadeRow &sr,
+	double *brite_out, double *spec_out
+) {
+	for(size_t col=0; col<sr.n; col++) {
+		double val = sr.cur[col];
+		double dx;
+		bool mid_good = sr.good_this[col];
+		bool left_good = sr.good_this[(ptrdiff_t)col-1];
+		bool right_good = sr.good_this[col+1];
+		bool up_good = sr.good_prev[col];
+		bool down_good = sr.good_next[col];
+		if(left_good && right_good) {
+			dx = (sr.cur[col+1] - sr.cur[(ptrdiff_t)col-1]) / 2.0;
+		} else if(mid_good && right_good) {
+			dx = sr.cur[col+1] - val;
+		} else if(mid_good && left_good) {
+			dx = val - sr.cur[(ptrdiff_t)col-1];
+		} else {
+			dx = 0;
+		}
+		double dy;
+		if(up_good && down_good) {
+			dy = (sr.next[col] - sr.prev[col]) / 2.0;
+		} else if(mid_good && down_good) {
+			dy = sr.next[col] - val;
+		} else if(mid_good && up_good) {
+			dy = val - sr.prev[col];
+		} else {
+			dy = 0;
+		}
+
+		// convert from elevation per pixel to elevation per meter (unitless)
+		double invaffine[4];
+		if(sr.constant_invaffine) {
+			for(int i=0; i<4; i++) invaffine[i] = sr.constant_invaffine[i];
+		} else {
+			for(int i=0; i<4; i++) {
+				invaffine[i] = sr.invaffine_above[col*4 + i] * (1.0 - sr.grid_fraction) +
+					sr.invaffine_below[col*4 + i] * sr.grid_fraction;
+			}
+		}
+		// FIXME - why the minus signs?
+		double dx2 = invaffine[0] * (-dx) + invaffine[1] * (-dy);
+		double dy2 = invaffine[2] * (-dx) + invaffine[3] * (-dy);
+		dx2 *= ss.slope_exageration;
+		dy2 *= ss.slope_exageration;
+
+		int idx = shade_table_index(dx2, dy2);
+		brite_out[col] = ss.shade_table[idx];
+		spec_out[col] = ss.spec_table[idx];
+	}
+}
+
+// Same result as shade_row_reference(), but done in passes over the row that
+// have no data-dependent branches, so that the compiler can vectorize them.
+// The stencil is picked with selects rather than branches, and the table
+// lookups are gathered in a pass of their own.
+void shade_row(const ShadeSettings &ss, const ShadeRow &sr,
+	std::vector<double> &dx_buf, std::vector<double> &dy_buf, std::vector<int> &idx_buf,
+	double *brite_out, double *spec_out
+) {
+	const size_t n = sr.n;
+	dx_buf.resize(n);
+	dy_buf.resize(n);
+	idx_buf.resize(n);
+	double *dx_out = &dx_buf[0];
+	double *dy_out = &dy_buf[0];
+	int *idx_out = &idx_buf[0];
+
+	const double *prev = sr.prev;
+	const double *cur = sr.cur;
+	const double *next = sr.next;
+	const uint8_t *gp = sr.good_prev;
+	const uint8_t *gt = sr.good_this;
+	const uint8_t *gn = sr.good_next;
+	for(size_t col=0; col<n; col++) {
+		int m = gt[col];
+		int l = gt[(ptrdiff_t)col-1];
+		int r = gt[col+1];
+		int u = gp[col];
+		int d = gn[col];
+		double left = cur[(ptrdiff_t)col-1];
+		double mid = cur[col];
+		double right = cur[col+1];
+		// Dividing by two is exact, so the half step is the same as in the
+		// reference version.
+		double dx_both = (right - left) / 2.0;
+		double dx_right = right - mid;
+		double dx_left = mid - left;
+		double dx = (l & r) ? dx_both : (m & r) ? dx_right : (m & l) ? dx_left : 0.0;
+		double up = prev[col];
+		double down = next[col];
+		double dy_both = (down - up) / 2.0;
+		double dy_down = down - mid;
+		double dy_up = mid - up;
+		double dy = (u & d) ? dy_both : (m & d) ? dy_down : (m & u) ? dy_up : 0.0;
+		dx_out[col] = dx;
+		dy_out[col] = dy;
+	}
+
+	const double exag = ss.slope_exageration;
+	if(sr.constant_invaffine) {
+		const double a0 = sr.constant_invaffine[0];
+		const double a1 = sr.constant_invaffine[1];
+		const double a2 = sr.constant_invaffine[2];
+		const double a3 = sr.constant_invaffine[3];
+		for(size_t col=0; col<n; col++) {
+			double dx2 = a0 * (-dx_out[col]) + a1 * (-dy_out[col]);
+			double dy2 = a2 * (-dx_out[col]) + a3 * (-dy_out[col]);
+			idx_out[col] = shade_table_index(dx2 * exag, dy2 * exag);
+		}
+	} else {
+		const double f = sr.grid_fraction;
+		const double g = 1.0 - f;
+		const double *above = sr.invaffine_above;
+		const double *below = sr.invaffine_below;
+		for(size_t col=0; col<n; col++) {
+			double a0 = above[col*4 + 0] * g + below[col*4 + 0] * f;
+			double a1 = above[col*4 + 1] * g + below[col*4 + 1] * f;
+			double a2 = above[col*4 + 2] * g + below[col*4 + 2] * f;
+			double a3 = above[col*4 + 3] * g + below[col*4 + 3] * f;
+			double dx2 = a0 * (-dx_out[col]) + a1 * (-dy_out[col]);
+			double dy2 = a2 * (-dx_out[col]) + a3 * (-dy_out[col]);
+			idx_out[col] = shade_table_index(dx2 * exag, dy2 * exag);
+		}
+	}
+
+	const double *shade_table = &ss.shade_table[0];
+	const double *spec_table = &ss.spec_table[0];
+	for(size_t col=0; col<n; col++) {
+		brite_out[col] = shade_table[idx_out[col]];
+		spec_out[col] = spec_table[idx_out[col]];
+	}
+}
+
+} // namespace dangdal
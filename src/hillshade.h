@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+
+
+#ifndef DANGDAL_HILLSHADE_H
+#define DANGDAL_HILLSHADE_H
+
+#include <vector>
+
+#include "common.h"
+
+namespace dangdal {
+
+// The shading done by gdal_dem2rgb.  The slope at each pixel, converted to easting and
+// northing gradients, picks an entry of the shade tables, which hold the diffuse
+// brightness and the specular intensity for that slope.
+
+static const int SHADE_TABLE_SIZE = 500;
+static const double SHADE_TABLE_SCALE = 100.0;
+// the shade tables are SHADE_TABLE_WIDTH x SHADE_TABLE_WIDTH, stored by row
+static const int SHADE_TABLE_WIDTH = SHADE_TABLE_SIZE*2+1;
+
+struct ShadeSettings {
+	double slope_exageration;
+	std::vector<double> shade_table;
+	std::vector<double> spec_table;
+};
+
+// The part of a row that is being shaded, and its neighbors.  The -1 and n
+// entries of the elevation rows and of good_this are valid too.
+struct ShadeRow {
+	const double *prev, *cur, *next;
+	// nonzero for pixels that are valid and inside the image
+	const uint8_t *good_prev, *good_this, *good_next;
+	// interpolated between these for each column, unless constant_invaffine
+	// is given
+	const double *invaffine_above, *invaffine_below;
+	double grid_fraction;
+	const double *constant_invaffine;
+	size_t n;
+};
+
+// Shades one pixel at a time.  This is the straightforward version, which
+// shade_row() must agree with exactly (dangdal_lib_test checks this).
+void shade_row_reference(const ShadeSettings &ss, const ShadeRow &sr,
+	double *brite_out, double *spec_out);
+
+// The version used by gdal_dem2rgb.  dx, dy and table_idx are scratch space,
+// kept by the caller so that they are not allocated for each row.
+void shade_row(const ShadeSettings &ss, const ShadeRow &sr,
+	std::vector<double> &dx, std::vector<double> &dy, std::vector<int> &table_idx,
+	double *brite_out, double *spec_out);
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_HILLSHADE_H
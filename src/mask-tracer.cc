@@ -27,12 +27,17 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <queue>
+#include <functional>
 
 #include "mask.h"
 #include "mask-tracer.h"
 #include "common.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
+#include "raster_features.h"
 
 namespace dangdal {
 
@@ -46,7 +51,8 @@ enum Direction {
 typedef int pixquad_t;
 
 int dbg_idx = 0;
-static void debug_write_mask(const BitGrid &mask, size_t w, size_t h) {
+template <typename MaskType>
+static void debug_write_mask(const MaskType &mask, size_t w, size_t h) {
 	char fn[1000];
 	snprintf(fn, sizeof(fn), "zz-debug-%04d.pgm", dbg_idx++);
 
@@ -76,20 +82,6 @@ static Ring make_enclosing_ring(size_t w, size_t h) {
 	return ring;
 }
 
-static int64_t compute_area(const std::vector<row_crossings_t> &crossings) {
-	int64_t area = 0;
-	for(size_t y=0; y<crossings.size(); y++) {
-		const row_crossings_t &rc = crossings[y];
-		size_t nc = rc.size();
-		for(size_t cidx=0; cidx<nc/2; cidx++) {
-			int from = rc[cidx*2  ];
-			int to   = rc[cidx*2+1];
-			area += to - from;
-		}
-	}
-	return area;
-}
-
 /*
 static int is_inside_crossings(row_crossings_t *c, int x) {
 	int inside = 0;
@@ -101,13 +93,49 @@ static int is_inside_crossings(row_crossings_t *c, int x) {
 */
 
 static inline pixquad_t get_quad(const BitGrid &mask, int x, int y, bool select_color) {
+	// 1 2
+	// 8 4
+	pixquad_t quad = mask.get_quad(x, y);
+	if(!select_color) quad ^= 0xf;
+	return quad;
+}
+
+static inline pixquad_t get_quad(const RleMask &mask, int x, int y, bool select_color) {
+	pixquad_t quad = mask.get_quad(x, y);
+	if(!select_color) quad ^= 0xf;
+	return quad;
+}
+
+// Presents one feature of a FeatureBitmap as if it were a BitGrid.  Pixels that
+// have already been traced (cleared in 'pending') are treated as not belonging
+// to the feature, just as trace_mask erases them from its mask.
+struct FeatureMask {
+	FeatureMask(
+		const FeatureBitmap::IndexRaster &_raster, const BitGrid &_pending,
+		int _w, int _h, FeatureBitmap::Index _wanted
+	) :
+		raster(_raster), pending(_pending), w(_w), h(_h), wanted(_wanted)
+	{ }
+
+	bool get(int x, int y) const {
+		if(x<0 || y<0 || x>=w || y>=h) return false;
+		return raster(x, y) == wanted && pending(x, y);
+	}
+
+	const FeatureBitmap::IndexRaster &raster;
+	const BitGrid &pending;
+	int w, h;
+	FeatureBitmap::Index wanted;
+};
+
+static inline pixquad_t get_quad(const FeatureMask &mask, int x, int y, bool select_color) {
 	// 1 2
 	// 8 4
 	pixquad_t quad =
-		(mask.get(x-1, y-1, 0) ? 1 : 0) +
-		(mask.get(x  , y-1, 0) ? 2 : 0) +
-		(mask.get(x  , y  , 0) ? 4 : 0) +
-		(mask.get(x-1, y  , 0) ? 8 : 0);
+		(mask.get(x-1, y-1) ? 1 : 0) +
+		(mask.get(x  , y-1) ? 2 : 0) +
+		(mask.get(x  , y  ) ? 4 : 0) +
+		(mask.get(x-1, y  ) ? 8 : 0);
 	if(!select_color) quad ^= 0xf;
 	return quad;
 }
@@ -116,7 +144,8 @@ static inline pixquad_t rotate_quad(pixquad_t q, int dir) {
 	return ((q + (q<<4)) >> dir) & 0xf;
 }
 
-static Ring trace_single_mpoly(const BitGrid &mask, size_t w, size_t h,
+template <typename MaskType>
+static Ring trace_single_mpoly(const MaskType &mask, size_t w, size_t h,
 int initial_x, int initial_y, bool select_color) {
 	//printf("trace_single_mpoly enter (%d,%d)\n", initial_x, initial_y);
 
@@ -165,107 +194,1284 @@ int initial_x, int initial_y, bool select_color) {
 	return ring;
 }
 
-static int recursive_trace(BitGrid &mask, size_t w, size_t h,
-const Ring &bounding_ring, int depth, Mpoly &out_poly, int parent_id,
-int64_t min_area, bool no_donuts) {
-	//printf("recursive_trace enter: depth=%d\n", depth);
+// A ring found by trace_ring_hierarchy.  'depth' is what recursive tracing
+// would have passed down when looking inside of this ring: the children of a
+// ring of depth d are traced at depth d+1.
+struct NestedRing {
+	NestedRing(const Ring &_ring, int _parent, int _depth, bool _color) :
+		ring(_ring), parent(_parent), depth(_depth), color(_color),
+		keep(true), trace_children(true) { }
 
-	bool select_color = !(depth & 1);
+	Ring ring;
+	int parent;
+	int depth;
+	// color of the pixels just inside of the ring
+	bool color;
+	// false if the ring is smaller than min_area
+	bool keep;
+	bool trace_children;
+	std::vector<int> children;
+};
+
+// A vertical edge of a ring, crossing pixel row y between x-1 and x.
+struct RowCrossing {
+	RowCrossing(int _x, int _ring) : x(_x), ring(_ring) { }
+
+	bool operator<(const RowCrossing &other) const { return x < other.x; }
+	bool operator>(const RowCrossing &other) const { return x > other.x; }
+
+	int x;
+	int ring;
+};
+
+typedef std::priority_queue<RowCrossing, std::vector<RowCrossing>,
+	std::greater<RowCrossing> > crossing_heap_t;
+
+static void add_ring_crossings(
+	const Ring &ring, int ring_id, int seed_x, int seed_y,
+	std::vector<std::vector<RowCrossing> > &rows, crossing_heap_t &seed_row
+) {
+	const int h = int(rows.size());
+	const size_t npts = ring.pts.size();
+	for(size_t i=0; i<npts; i++) {
+		const Vertex &v0 = ring.pts[i];
+		const Vertex &v1 = ring.pts[(i+1) % npts];
+		if(v0.x != v1.x) continue;
+		int x = int(v0.x);
+		int y0 = int(std::min(v0.y, v1.y));
+		int y1 = int(std::max(v0.y, v1.y));
+		for(int y=std::max(y0, 0); y<std::min(y1, h); y++) {
+			if(y == seed_y) {
+				// The seed's own edge has already been crossed.
+				if(x != seed_x) seed_row.push(RowCrossing(x, ring_id));
+			} else {
+				rows[y].push_back(RowCrossing(x, ring_id));
+			}
+		}
+	}
+}
+
+// Appends ring root_id and the kept rings nested within it to out_poly, depth-first, with
+// the children of each ring in the order in which they were found.  The rings are moved
+// rather than copied.  parent_id of root_id is -1, the others are indices into out_poly.
+static void emit_component(std::vector<NestedRing> &rings, int root_id, Mpoly &out_poly) {
+	// (ring, index of its parent in out_poly)
+	std::vector<std::pair<int, int> > todo;
+	todo.push_back(std::make_pair(root_id, -1));
+	while(!todo.empty()) {
+		const int ring_id = todo.back().first;
+		const int out_parent = todo.back().second;
+		todo.pop_back();
+		NestedRing &nr = rings[ring_id];
+		const int out_id = int(out_poly.rings.size());
+		out_poly.rings.push_back(Ring());
+		Ring &r = out_poly.rings.back();
+		std::swap(r, nr.ring);
+		r.parent_id = out_parent;
+		r.is_hole = (nr.depth - 1) % 2;
+		for(size_t i=nr.children.size(); i>0; i--) {
+			if(rings[nr.children[i-1]].keep) {
+				todo.push_back(std::make_pair(nr.children[i-1], out_id));
+			}
+		}
+	}
+}
 
-	Bbox bounding_bbox = bounding_ring.getBbox();
+// Collects the components into one Mpoly, which is what trace_mask returns.  The
+// top-level rings get parent_id as their parent.
+class CollectingSink : public TraceSink {
+public:
+	CollectingSink(Mpoly &_out_poly, int _parent_id) :
+		out_poly(_out_poly), parent_id(_parent_id) { }
 
-	Mpoly bounds_mp;
-	bounds_mp.rings.push_back(bounding_ring);
+	void push(Mpoly &component) {
+		const int base = int(out_poly.rings.size());
+		for(size_t i=0; i<component.rings.size(); i++) {
+			out_poly.rings.push_back(Ring());
+			Ring &r = out_poly.rings.back();
+			r.swap(component.rings[i]);
+			r.parent_id = (r.parent_id < 0) ? parent_id : r.parent_id + base;
+		}
+	}
 
-	std::vector<row_crossings_t> crossings =
-		get_row_crossings(bounds_mp, bounding_bbox.min_y, bounding_bbox.height());
-	assert(crossings.size() == size_t(bounding_bbox.height()));
-	int skip_this = min_area && (compute_area(crossings) < min_area);
-	int skip_child = skip_this || (depth && no_donuts);
+private:
+	Mpoly &out_poly;
+	int parent_id;
+};
+
+// Gives the same rings, in the same order, as recursively tracing inside of
+// each ring and then erasing it from the mask.  Instead, the mask is scanned
+// once in row-major order, keeping track of which rings enclose the current
+// pixel by watching for the vertical edges of the rings that have been traced
+// so far.  If the innermost of these has the other color than the pixel, the
+// pixel is the top-left corner of a not yet traced child of that ring.
+//
+// Each child of the bounding ring is given to the sink, along with everything
+// nested within it, as soon as the scan has passed its bottom edge.  Nothing
+// within it can be found after that.  The children are given in the order in
+// which they were found.  The bounding ring itself is not given to the sink.
+//
+// Returns true if the bounding ring is smaller than min_area.
+template <typename MaskType>
+static bool trace_ring_hierarchy(const MaskType &mask, size_t w, size_t h,
+const Ring &bounding_ring, int depth, TraceSink &sink,
+int64_t min_area, bool no_donuts) {
+	std::vector<NestedRing> rings;
+	rings.push_back(NestedRing(bounding_ring, -1, depth, depth & 1));
+	rings[0].keep = !min_area || int64_t(bounding_ring.area()) >= min_area;
+	rings[0].trace_children = rings[0].keep && !(depth && no_donuts);
+	const bool skip_this = !rings[0].keep;
+
+	std::vector<std::vector<RowCrossing> > row_crossings(h);
+	crossing_heap_t seed_crossings;
+	add_ring_crossings(bounding_ring, 0, -1, -1, row_crossings, seed_crossings);
 
 	if(!depth) {
-		printf("Tracing: ");
-		GDALTermProgress(0, NULL, NULL);
+		report_message("Tracing: ");
+		report_progress(0);
 	}
 
-	if(!skip_child) {
-		for(int y=bounding_bbox.min_y+1; y<bounding_bbox.max_y; y++) {
-			if(!depth) {
-				GDALTermProgress((double)y/(double)(bounding_bbox.height()-1), NULL, NULL);
+	// rings enclosing the current position, innermost last
+	std::vector<int> enclosing;
+
+	// kept children of the bounding ring not yet given to the sink, with the
+	// row after their last one
+	std::deque<std::pair<int, int> > pending;
+
+	for(int y=0; y<int(h); y++) {
+		if(!depth) {
+			report_progress((double)y/(double)h);
+		}
+
+		std::vector<RowCrossing> crossings;
+		std::swap(crossings, row_crossings[y]);
+		std::sort(crossings.begin(), crossings.end());
+		size_t next_crossing = 0;
+
+		for(int x=0; x<int(w); ) {
+			// step over the ring edges to the left of pixel x
+			int span_end;
+			for(;;) {
+				bool from_seeds = !seed_crossings.empty() && (
+					next_crossing == crossings.size() ||
+					seed_crossings.top().x < crossings[next_crossing].x);
+				if(!from_seeds && next_crossing == crossings.size()) {
+					span_end = int(w);
+					break;
+				}
+				const RowCrossing &c = from_seeds ?
+					seed_crossings.top() : crossings[next_crossing];
+				if(c.x > x) {
+					span_end = std::min(c.x, int(w));
+					break;
+				}
+				if(!enclosing.empty() && enclosing.back() == c.ring) {
+					enclosing.pop_back();
+				} else {
+					enclosing.push_back(c.ring);
+				}
+				if(from_seeds) seed_crossings.pop();
+				else next_crossing++;
+			}
+
+			if(enclosing.empty() || !rings[enclosing.back()].trace_children) {
+				x = span_end;
+				continue;
+			}
+
+			const int parent = enclosing.back();
+			const bool select_color = !rings[parent].color;
+			int seed_x = select_color ? mask.next_set(y, x) : mask.next_unset(y, x);
+			if(seed_x < 0 || seed_x >= span_end) {
+				x = span_end;
+				continue;
 			}
 
-			// make sure the range (y-1,y)*(x-1,x) is in bounds
-			row_crossings_t cross_both = crossings_intersection(
-				crossings[y-bounding_bbox.min_y-1], crossings[y-bounding_bbox.min_y]);
-			for(size_t cidx=0; cidx<cross_both.size()/2; cidx++) {
-				// make sure the range (y-1,y)*(x-1,x) is in bounds
-				int from = 1+cross_both[cidx*2  ];
-				int to   =   cross_both[cidx*2+1];
+			Ring r = trace_single_mpoly(mask, w, h, seed_x, y, select_color);
+			const int ring_id = int(rings.size());
+			rings.push_back(NestedRing(r, parent, rings[parent].depth+1, select_color));
+			NestedRing &nr = rings.back();
+			nr.keep = !min_area || int64_t(nr.ring.area()) >= min_area;
+			nr.trace_children = nr.keep && !no_donuts;
+			rings[parent].children.push_back(ring_id);
+			if(!parent && nr.keep) {
+				pending.push_back(std::make_pair(ring_id, int(nr.ring.getBbox().max_y)));
+			}
+
+			add_ring_crossings(nr.ring, ring_id, seed_x, y, row_crossings, seed_crossings);
+			enclosing.push_back(ring_id);
+			x = seed_x + 1;
+		}
+
+		// the remaining edges are at x=w
+		while(!seed_crossings.empty()) seed_crossings.pop();
+		enclosing.clear();
+
+		while(!pending.empty() && pending.front().second <= y+1) {
+			Mpoly component;
+			emit_component(rings, pending.front().first, component);
+			pending.pop_front();
+			sink.push(component);
+		}
+	}
+
+	while(!pending.empty()) {
+		Mpoly component;
+		emit_component(rings, pending.front().first, component);
+		pending.pop_front();
+		sink.push(component);
+	}
+
+	if(!depth) {
+		report_progress(1);
+	}
+
+	return skip_this;
+}
+
+template <typename MaskType>
+static Mpoly trace_mask_impl(const MaskType &mask, size_t w, size_t h, int64_t min_area, bool no_donuts) {
+	if(VERBOSE >= 4) debug_write_mask(mask, w, h);
+
+	Mpoly out_poly;
+	CollectingSink sink(out_poly, -1);
+
+	trace_ring_hierarchy(mask, w, h, make_enclosing_ring(w, h), 0, sink, min_area, no_donuts);
+	report_message("Trace found %zd rings.\n", out_poly.rings.size());
+
+	return out_poly;
+}
+
+// Passes the components on, keeping count of the rings.
+class CountingSink : public TraceSink {
+public:
+	explicit CountingSink(TraceSink &_sink) : sink(_sink), num_rings(0) { }
 
-				for(int x=from; x<to; x++) {
-					pixquad_t quad = get_quad(mask, x, y, select_color);
-					int is_seed = (quad != 0);
+	void push(Mpoly &component) {
+		num_rings += component.rings.size();
+		sink.push(component);
+	}
+
+	TraceSink &sink;
+	size_t num_rings;
+};
+
+template <typename MaskType>
+static size_t trace_mask_impl(const MaskType &mask, size_t w, size_t h, int64_t min_area,
+bool no_donuts, TraceSink &sink) {
+	if(VERBOSE >= 4) debug_write_mask(mask, w, h);
+
+	CountingSink counter(sink);
+
+	trace_ring_hierarchy(mask, w, h, make_enclosing_ring(w, h), 0, counter, min_area, no_donuts);
+	report_message("Trace found %zd rings.\n", counter.num_rings);
+
+	return counter.num_rings;
+}
+
+Mpoly trace_mask(const BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts) {
+	return trace_mask_impl(mask, w, h, min_area, no_donuts);
+}
+
+Mpoly trace_mask(const RleMask &mask, size_t w, size_t h, int64_t min_area, bool no_donuts) {
+	return trace_mask_impl(mask, w, h, min_area, no_donuts);
+}
+
+size_t trace_mask(const BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts,
+TraceSink &sink) {
+	return trace_mask_impl(mask, w, h, min_area, no_donuts, sink);
+}
+
+size_t trace_mask(const RleMask &mask, size_t w, size_t h, int64_t min_area, bool no_donuts,
+TraceSink &sink) {
+	return trace_mask_impl(mask, w, h, min_area, no_donuts, sink);
+}
+
+// This gives the same result as calling trace_mask on get_mask_for_feature for
+// each feature, but scans the raster only once.  Scanning in row-major order,
+// the first pixel of each feature that hasn't been traced yet is the top-left
+// corner of an outer ring of that feature (this is also where trace_mask would
+// seed it).  The ring is traced straight off the index raster.  Then the
+// pixels inside of it are copied to a small BitGrid on which the holes and
+// islands are traced as usual, and the pixels belonging to the feature are
+// marked as done so that they are not seen again.  Since every pixel belongs
+// to only one feature, a single bit per pixel is enough to keep track of this
+// for all of the features at once.
+std::vector<Mpoly> trace_features(
+	const FeatureBitmap &features, size_t w, size_t h, int64_t min_area, bool no_donuts
+) {
+	const FeatureBitmap::IndexRaster &raster = features.index_raster();
+	const size_t num_features = features.num_features();
+
+	std::vector<Mpoly> out_polys(num_features);
+
+	if(min_area && int64_t(make_enclosing_ring(w, h).area()) < min_area) return out_polys;
 
-					if(is_seed) {
-						Ring r = trace_single_mpoly(mask, w, h, x, y, select_color);
+	BitGrid pending(w, h);
+	pending.invert();
 
-						r.parent_id = parent_id;
-						r.is_hole = depth % 2;
-						size_t outer_ring_id = out_poly.rings.size();
-						out_poly.rings.push_back(r);
+	// reused for the inside of each outer ring
+	RowCrossingScanner scanner;
 
-						int was_skip = recursive_trace(
-							mask, w, h, r, depth+1, out_poly, outer_ring_id,
-							min_area, no_donuts);
+	report_message("Tracing: ");
+	report_progress(0);
 
-						if(was_skip) {
-							out_poly.rings.pop_back();
+	for(size_t y=0; y<h; y++) {
+		report_progress((double)y/(double)h);
+
+		for(int x=pending.next_set(y, 0); x>=0; x=pending.next_set(y, x+1)) {
+			const FeatureBitmap::Index wanted = raster(x, y);
+			if(wanted >= num_features) {
+				// eroded pixel, not part of any feature
+				pending.set(x, y, false);
+				continue;
+			}
+
+			Mpoly &out_poly = out_polys[wanted];
+
+			FeatureMask fmask(raster, pending, w, h, wanted);
+			Ring r = trace_single_mpoly(fmask, w, h, x, y, true);
+			r.parent_id = -1;
+			r.is_hole = false;
+
+			Bbox bbox = r.getBbox();
+			int off_x = int(bbox.min_x);
+			int off_y = int(bbox.min_y);
+			int sub_w = int(bbox.width());
+			int sub_h = int(bbox.height());
+
+			// Copy this feature's pixels from the inside of the ring to a local
+			// mask, and mark them as done.  Other pixels inside of the ring aren't
+			// looked at by trace_ring_hierarchy.
+			BitGrid sub_mask(sub_w, sub_h);
+			{
+				scanner.reset(r);
+				for(int sub_y=0; sub_y<sub_h; sub_y++) {
+					const row_crossings_t &rc = scanner.row(sub_y+off_y);
+					for(size_t cidx=0; cidx<rc.size()/2; cidx++) {
+						for(int px=rc[cidx*2]; px<rc[cidx*2+1]; px++) {
+							if(raster(px, sub_y+off_y) == wanted) {
+								sub_mask.set(px-off_x, sub_y, true);
+								pending.set(px, sub_y+off_y, false);
+							}
 						}
 					}
 				}
 			}
-		}
-	}
 
-	if(depth>0) {
-		// erase this polygon from the raster by filling it with select_color
-		for(int y=bounding_bbox.min_y; y<bounding_bbox.max_y; y++) {
-			const row_crossings_t &r = crossings[y-bounding_bbox.min_y];
-			for(size_t cidx=0; cidx<r.size()/2; cidx++) {
-				int from = r[cidx*2  ];
-				int to   = r[cidx*2+1];
-				for(int x=from; x<=to; x++) {
-					if(x>=0 && y>=0 && size_t(x)<w && size_t(y)<h) {
-						mask.set(x, y, select_color);
+			Ring sub_r = r;
+			for(size_t i=0; i<sub_r.pts.size(); i++) {
+				sub_r.pts[i].x -= off_x;
+				sub_r.pts[i].y -= off_y;
+			}
+
+			size_t outer_ring_id = out_poly.rings.size();
+			out_poly.rings.push_back(r);
+
+			CollectingSink sink(out_poly, int(outer_ring_id));
+			bool was_skip = trace_ring_hierarchy(
+				sub_mask, sub_w, sub_h, sub_r, 1, sink, min_area, no_donuts);
+
+			if(was_skip) {
+				out_poly.rings.pop_back();
+			} else {
+				for(size_t i=outer_ring_id+1; i<out_poly.rings.size(); i++) {
+					Ring &child = out_poly.rings[i];
+					for(size_t j=0; j<child.pts.size(); j++) {
+						child.pts[j].x += off_x;
+						child.pts[j].y += off_y;
 					}
 				}
 			}
 		}
 	}
 
-	if(VERBOSE >= 4) debug_write_mask(mask, w, h);
+	report_progress(1);
 
-	if(!depth) {
-		GDALTermProgress(1, NULL, NULL);
+	for(size_t i=0; i<num_features; i++) {
+		report_message("Trace found %zd rings for feature %zd.\n", out_polys[i].rings.size(), i);
 	}
 
-	return skip_this;
+	return out_polys;
 }
 
-// this function has the side effect of erasing the mask
-Mpoly trace_mask(BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts) {
-	if(VERBOSE >= 4) debug_write_mask(mask, w, h);
+///////////////////////////////////////////////////////////////
+// Striped tracing
+//
+// trace_mask_striped never looks at more than two rows of the mask at once.  It walks
+// down the vertex rows (the grid lines between pixel rows) and builds up the pixel
+// boundaries as chains of vertices.  A chain stays open until its two ends meet, at
+// which point it is a finished ring.  Only the open chains are carried from one row to
+// the next.
+//
+// Set pixels are 4-connected, as in trace_mask.  While tracing, unset pixels are taken
+// to be 8-connected, so that each piece of boundary belongs to exactly one ring and goes
+// around the set pixels at corners where two of them touch diagonally.  trace_mask goes
+// around the unset pixels instead when it traces a hole, so each hole is redone that way
+// when it closes (see finish_component): holes that touch at a corner come apart, and
+// islands that touch a hole at a corner become part of the region around it.
+//
+// To figure out which ring is inside of which, the runs of each row are labeled as the
+// scan goes, with a union-find to merge labels of regions that turn out to be connected
+// further down.  The pixel above the first pixel (in row-major order) of a region is of
+// the other color, and belongs to the region that encloses it.  A region's ring closes
+// in the last vertex row the region touches, after everything inside of it has closed,
+// so the ring can take those as its children and be dropped along with them right away
+// if it is smaller than min_area.  Labels of regions that are finished are given out
+// again, so that only the regions that reach the current row take up any memory.
+
+struct StripeComponent {
+	StripeComponent(int label, bool _color, int _parent_label) :
+		uf_parent(label), color(_color), parent_label(_parent_label) { }
+
+	int uf_parent;
+	bool color;
+	int parent_label;
+	// finished rings that lie directly inside of this region's ring
+	std::vector<int> children;
+};
+
+struct PixelRun {
+	PixelRun(int _from, int _to, bool _color) :
+		from(_from), to(_to), color(_color), label(-1) { }
+
+	int from, to;
+	bool color;
+	int label;
+};
+
+struct ChainEnd {
+	ChainEnd() : chain(-1), end(0) { }
+	ChainEnd(int _chain, int _end) : chain(_chain), end(_end) { }
+
+	int chain; // -1 if there is none
+	int end; // 0 for the front of the chain, 1 for the back
+};
+
+struct OpenChain {
+	std::deque<Vertex> pts;
+	// Where each end of the chain is waiting: on the vertical edge below vertex 'slot'
+	// of the current row, or (if -1) on the horizontal edge being carried along the row.
+	int slot[2];
+	// topmost, then leftmost, vertex of the chain and the label of the pixel to its
+	// lower right
+	int top_x, top_y;
+	int top_label;
+	// vertices of the chain where two set pixels touch diagonally
+	std::vector<Vertex> corners;
+};
+
+// A finished ring, with the rings directly inside of it.
+struct StripeRing {
+	Ring ring;
+	std::vector<int> children;
+	// for an island, the corners where it touches itself or something else
+	std::vector<Vertex> corners;
+};
+
+static bool vertex_less(const Vertex &a, const Vertex &b) {
+	return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+static bool vertex_equal(const Vertex &a, const Vertex &b) {
+	return a.x == b.x && a.y == b.y;
+}
+
+struct RingSeedOrder {
+	explicit RingSeedOrder(const std::vector<StripeRing> &_rings) : rings(_rings) { }
+	bool operator()(int a, int b) const {
+		return vertex_less(rings[a].ring.pts[0], rings[b].ring.pts[0]);
+	}
+	const std::vector<StripeRing> &rings;
+};
+
+// The center of the top-left pixel of a ring, which lies inside of it and isn't on the
+// boundary of any other ring.
+static Vertex ring_seed(const Ring &r) {
+	return Vertex(r.pts[0].x + 0.5, r.pts[0].y + 0.5);
+}
+
+// Orders corners by vertex, then by whose they are.
+struct TouchOrder {
+	bool operator()(const std::pair<Vertex, int> &a, const std::pair<Vertex, int> &b) const {
+		if(vertex_less(a.first, b.first)) return true;
+		if(vertex_less(b.first, a.first)) return false;
+		return a.second < b.second;
+	}
+};
+
+class StripeTracer {
+public:
+	StripeTracer(int _w, int64_t _min_area, bool _no_donuts);
+
+	// Feed the next row of the mask, or NULL after the last row.
+	void add_row(const uint8_t *row);
+
+	Mpoly get_mpoly();
+
+private:
+	int find(int label);
+	void unite(int a, int b);
+	int label_at(const std::vector<PixelRun> &runs, int x) const;
+	void label_runs();
+	void recycle_labels();
+	void trace_vertex_row(const uint8_t *above, const uint8_t *below, int y);
+
+	void start_chain(int x, int y);
+	void push_point(const ChainEnd &e, int x, int y);
+	void set_slot(const ChainEnd &e, int slot);
+	void join(const ChainEnd &a, const ChainEnd &b, int x, int y);
+	void close_chain(int chain_id);
+	void finish_component(int comp, Ring &ring, const std::vector<Vertex> &corners);
+
+	int new_ring(Ring &r);
+	void drop_ring(int ring_idx);
+
+	int w;
+	int next_y;
+	int64_t min_area;
+	bool no_donuts;
+
+	std::vector<StripeComponent> comps, open_comps;
+	std::vector<int> label_map;
+	std::vector<PixelRun> prev_runs, curr_runs;
+	std::vector<uint8_t> prev_row, curr_row;
+	std::vector<int> vertex_xs, scratch_xs;
+
+	std::vector<OpenChain> chains;
+	std::vector<int> free_chains;
+	std::vector<ChainEnd> dangling;
+	ChainEnd carry;
+
+	std::vector<StripeRing> rings;
+	std::vector<int> free_rings;
+};
+
+StripeTracer::StripeTracer(int _w, int64_t _min_area, bool _no_donuts) :
+	w(_w), next_y(0), min_area(_min_area), no_donuts(_no_donuts),
+	prev_row(w), curr_row(w),
+	dangling(w+1)
+{
+	// label 0 is everything outside of the image, and the row above the image is part
+	// of it
+	comps.push_back(StripeComponent(0, false, 0));
+	prev_runs.push_back(PixelRun(0, w, false));
+	prev_runs.back().label = 0;
+}
+
+int StripeTracer::find(int label) {
+	while(comps[label].uf_parent != label) {
+		int up = comps[label].uf_parent;
+		comps[label].uf_parent = comps[up].uf_parent;
+		label = up;
+	}
+	return label;
+}
+
+void StripeTracer::unite(int a, int b) {
+	a = find(a);
+	b = find(b);
+	if(a == b) return;
+	// the lower label was seen first, so it keeps the parent_label
+	if(a > b) std::swap(a, b);
+	comps[b].uf_parent = a;
+	std::vector<int> &dst = comps[a].children;
+	std::vector<int> &src = comps[b].children;
+	if(dst.size() < src.size()) dst.swap(src);
+	dst.insert(dst.end(), src.begin(), src.end());
+	std::vector<int>().swap(src);
+}
+
+int StripeTracer::label_at(const std::vector<PixelRun> &runs, int x) const {
+	size_t lo = 0, hi = runs.size();
+	while(hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if(runs[mid].from <= x) lo = mid;
+		else hi = mid;
+	}
+	assert(runs[lo].from <= x && x < runs[lo].to);
+	return runs[lo].label;
+}
+
+void StripeTracer::label_runs() {
+	size_t j = 0;
+	for(size_t i=0; i<curr_runs.size(); i++) {
+		PixelRun &r = curr_runs[i];
+		while(j < prev_runs.size() && prev_runs[j].to < r.from) j++;
+
+		int label = -1;
+		for(size_t k=j; k<prev_runs.size() && prev_runs[k].from <= r.to; k++) {
+			const PixelRun &p = prev_runs[k];
+			if(p.color != r.color) continue;
+			// Set pixels are 4-connected, unset are 8-connected.  The loop bounds
+			// already take care of the 8-connected case.
+			if(r.color && !(p.from < r.to && r.from < p.to)) continue;
+			if(label < 0) label = p.label;
+			else unite(label, p.label);
+		}
+
+		if(!r.color && (r.from == 0 || r.to == w)) {
+			if(label < 0) label = 0;
+			else unite(label, 0);
+		}
+
+		if(label < 0) {
+			label = comps.size();
+			comps.push_back(StripeComponent(label, r.color, label_at(prev_runs, r.from)));
+		}
+		r.label = label;
+	}
+}
+
+// Renumbers the regions that reach the current row, which are the ones still open, as
+// 0, 1, 2... in the same order, so that lower labels are still the ones seen first.  The
+// rest are finished and forgotten.  The region enclosing an open region is open too.
+void StripeTracer::recycle_labels() {
+	label_map.assign(comps.size(), -1);
+	label_map[0] = 0;
+	for(size_t i=0; i<curr_runs.size(); i++) {
+		label_map[find(curr_runs[i].label)] = 0;
+	}
+	for(size_t i=0; i<chains.size(); i++) {
+		if(!chains[i].pts.empty()) label_map[find(chains[i].top_label)] = 0;
+	}
+
+	open_comps.clear();
+	for(size_t i=0; i<comps.size(); i++) {
+		if(label_map[i] < 0) {
+			assert(comps[i].children.empty());
+			continue;
+		}
+		int label = open_comps.size();
+		label_map[i] = label;
+		open_comps.push_back(StripeComponent(label, comps[i].color, find(comps[i].parent_label)));
+		open_comps.back().children.swap(comps[i].children);
+	}
+	for(size_t i=0; i<open_comps.size(); i++) {
+		open_comps[i].parent_label = label_map[open_comps[i].parent_label];
+		assert(open_comps[i].parent_label >= 0);
+	}
+
+	for(size_t i=0; i<curr_runs.size(); i++) {
+		curr_runs[i].label = label_map[find(curr_runs[i].label)];
+	}
+	for(size_t i=0; i<chains.size(); i++) {
+		if(!chains[i].pts.empty()) chains[i].top_label = label_map[find(chains[i].top_label)];
+	}
+	comps.swap(open_comps);
+}
+
+void StripeTracer::add_row(const uint8_t *row) {
+	int y = next_y++;
+
+	curr_runs.clear();
+	if(row) {
+		for(int x=0; x<w; x++) curr_row[x] = row[x] ? 1 : 0;
+		for(int x=0; x<w; ) {
+			int from = x;
+			uint8_t c = curr_row[x];
+			while(x<w && curr_row[x] == c) x++;
+			curr_runs.push_back(PixelRun(from, x, c));
+		}
+	} else {
+		// below the image
+		std::fill(curr_row.begin(), curr_row.end(), 0);
+		curr_runs.push_back(PixelRun(0, w, false));
+	}
+	label_runs();
+
+	trace_vertex_row(&prev_row[0], &curr_row[0], y);
+	recycle_labels();
+
+	std::swap(prev_runs, curr_runs);
+	std::swap(prev_row, curr_row);
+}
+
+void StripeTracer::trace_vertex_row(const uint8_t *above, const uint8_t *below, int y) {
+	// Only vertices where one of the two rows changes color can have anything other
+	// than a straight horizontal edge (or nothing) passing through them.
+	vertex_xs.clear();
+	for(int pass=0; pass<2; pass++) {
+		const std::vector<PixelRun> &runs = pass ? curr_runs : prev_runs;
+		scratch_xs.clear();
+		for(size_t i=0; i<runs.size(); i++) {
+			if(i || runs[i].color) scratch_xs.push_back(runs[i].from);
+		}
+		if(runs.back().color) scratch_xs.push_back(w);
+		size_t n = vertex_xs.size();
+		vertex_xs.insert(vertex_xs.end(), scratch_xs.begin(), scratch_xs.end());
+		std::inplace_merge(vertex_xs.begin(), vertex_xs.begin()+n, vertex_xs.end());
+	}
+	vertex_xs.erase(std::unique(vertex_xs.begin(), vertex_xs.end()), vertex_xs.end());
+
+	for(size_t i=0; i<vertex_xs.size(); i++) {
+		int x = vertex_xs[i];
+		bool ul = x>0 && above[x-1];
+		bool ur = x<w && above[x  ];
+		bool ll = x>0 && below[x-1];
+		bool lr = x<w && below[x  ];
+		bool e_up = ul != ur;
+		bool e_dn = ll != lr;
+		bool e_lf = ul != ll;
+		bool e_rt = ur != lr;
+
+		ChainEnd up = dangling[x];
+		ChainEnd left = carry;
+
+		if(e_up && e_dn && e_lf && e_rt) {
+			// Both pairs of edges go around a set pixel.  The corner is noted so that
+			// finish_component can pair them the other way if they are on a hole.
+			const Vertex v(x, y);
+			if(ul) {
+				// ul and lr are not connected, each gets its own corner
+				dangling[x] = ChainEnd();
+				carry = ChainEnd();
+				chains[up.chain].corners.push_back(v);
+				join(up, left, x, y);
+				start_chain(x, y);
+				chains[dangling[x].chain].corners.push_back(v);
+			} else {
+				// ur and ll are not connected
+				chains[up.chain].corners.push_back(v);
+				chains[left.chain].corners.push_back(v);
+				push_point(up, x, y);
+				push_point(left, x, y);
+				set_slot(up, -1);
+				set_slot(left, x);
+			}
+		} else if(e_up && e_lf) {
+			dangling[x] = ChainEnd();
+			carry = ChainEnd();
+			join(up, left, x, y);
+		} else if(e_up && e_rt) {
+			dangling[x] = ChainEnd();
+			push_point(up, x, y);
+			set_slot(up, -1);
+		} else if(e_lf && e_dn) {
+			carry = ChainEnd();
+			push_point(left, x, y);
+			set_slot(left, x);
+		} else if(e_rt && e_dn) {
+			start_chain(x, y);
+		}
+		// otherwise it is a straight edge or nothing at all
+	}
+
+	assert(carry.chain < 0);
+}
+
+void StripeTracer::start_chain(int x, int y) {
+	int id;
+	if(free_chains.empty()) {
+		id = chains.size();
+		chains.push_back(OpenChain());
+	} else {
+		id = free_chains.back();
+		free_chains.pop_back();
+	}
+	OpenChain &c = chains[id];
+	c.pts.push_back(Vertex(x, y));
+	c.top_x = x;
+	c.top_y = y;
+	c.top_label = label_at(curr_runs, x);
+	set_slot(ChainEnd(id, 0), x);
+	set_slot(ChainEnd(id, 1), -1);
+}
+
+void StripeTracer::push_point(const ChainEnd &e, int x, int y) {
+	assert(e.chain >= 0);
+	OpenChain &c = chains[e.chain];
+	if(e.end) c.pts.push_back(Vertex(x, y));
+	else      c.pts.push_front(Vertex(x, y));
+}
+
+void StripeTracer::set_slot(const ChainEnd &e, int slot) {
+	chains[e.chain].slot[e.end] = slot;
+	if(slot < 0) carry = e;
+	else dangling[slot] = e;
+}
+
+void StripeTracer::join(const ChainEnd &a, const ChainEnd &b, int x, int y) {
+	assert(a.chain >= 0 && b.chain >= 0);
+
+	if(a.chain == b.chain) {
+		push_point(a, x, y);
+		close_chain(a.chain);
+		return;
+	}
+
+	// copy the shorter chain onto the end of the longer one
+	ChainEnd dst = a, src = b;
+	if(chains[a.chain].pts.size() < chains[b.chain].pts.size()) std::swap(dst, src);
+	push_point(dst, x, y);
+
+	OpenChain &d = chains[dst.chain];
+	OpenChain &s = chains[src.chain];
+	size_t n = s.pts.size();
+	for(size_t i=0; i<n; i++) {
+		const Vertex &v = src.end ? s.pts[n-1-i] : s.pts[i];
+		if(dst.end) d.pts.push_back(v);
+		else        d.pts.push_front(v);
+	}
+	d.corners.insert(d.corners.end(), s.corners.begin(), s.corners.end());
+	// the far end of src is now the far end of dst
+	set_slot(dst, s.slot[1-src.end]);
+
+	if(s.top_y < d.top_y || (s.top_y == d.top_y && s.top_x < d.top_x)) {
+		d.top_x = s.top_x;
+		d.top_y = s.top_y;
+		d.top_label = s.top_label;
+	}
+
+	std::deque<Vertex>().swap(s.pts);
+	std::vector<Vertex>().swap(s.corners);
+	free_chains.push_back(src.chain);
+}
+
+void StripeTracer::close_chain(int chain_id) {
+	OpenChain &c = chains[chain_id];
+	size_t n = c.pts.size();
+
+	// Start at the top-left vertex and head right, like trace_mask does.  The pixel
+	// below the first edge belongs to the ring's region, so the region is on the right
+	// of every edge.
+	size_t t = 0;
+	while(c.pts[t].x != c.top_x || c.pts[t].y != c.top_y) t++;
+	bool fwd = c.pts[(t+1) % n].y == c.top_y;
+
+	Ring r;
+	r.pts.reserve(n);
+	for(size_t i=0; i<n; i++) {
+		r.pts.push_back(c.pts[fwd ? (t+i) % n : (t+n-i) % n]);
+	}
+
+	std::vector<Vertex> corners;
+	corners.swap(c.corners);
+	std::sort(corners.begin(), corners.end(), vertex_less);
+
+	int comp = find(c.top_label);
+	assert(comp != 0);
+
+	std::deque<Vertex>().swap(c.pts);
+	free_chains.push_back(chain_id);
+
+	finish_component(comp, r, corners);
+}
+
+// Called when the ring of a region closes, which is when the region is finished.  The
+// rings that closed inside of the region become the children of its ring, which goes to
+// the enclosing region in turn.
+//
+// trace_mask takes unset pixels to be 4-connected when it traces a hole, and so goes
+// around the unset pixels at each corner where two set pixels touch diagonally, rather
+// than around the set ones as is done here.  A hole's ring, together with the islands
+// in it that touch it or each other at such corners, is redone that way here: the
+// pairing of the edges is swapped at each of their corners, which gives the rings of
+// the holes that trace_mask would see.  The islands are then part of the region around
+// the hole, as far as trace_mask is concerned, and their own holes become holes of that
+// region.
+void StripeTracer::finish_component(int comp, Ring &ring, const std::vector<Vertex> &corners) {
+	const int parent = find(comps[comp].parent_label);
+	const bool color = comps[comp].color;
+	std::vector<int> inner;
+	inner.swap(comps[comp].children);
+
+	// With no_donuts only the outer rings at the top level are wanted.  The enclosing
+	// region may yet turn out to be the outside, so the ring is kept anyway.
+	if(no_donuts) {
+		for(size_t i=0; i<inner.size(); i++) drop_ring(inner[i]);
+		inner.clear();
+		if(!color) return;
+	}
+
+	const bool too_small = min_area && int64_t(ring.area()) < min_area;
+
+	if(color) {
+		// An island that touches something at a corner may yet become part of the
+		// region around its hole, so is kept until then even if it is too small.
+		bool may_merge = parent && !corners.empty() && !no_donuts;
+		if(too_small) {
+			for(size_t i=0; i<inner.size(); i++) drop_ring(inner[i]);
+			inner.clear();
+			if(!may_merge) return;
+		}
+		ring.is_hole = false;
+		int id = new_ring(ring);
+		rings[id].children.swap(inner);
+		if(may_merge) rings[id].corners = corners;
+		comps[parent].children.push_back(id);
+		return;
+	}
+
+	// Find the islands that are connected to the ring through corners: participant 0 is
+	// the ring, and i+1 is inner[i].
+	std::vector<std::pair<Vertex, int> > touches;
+	for(size_t i=0; i<corners.size(); i++) {
+		touches.push_back(std::make_pair(corners[i], 0));
+	}
+	for(size_t i=0; i<inner.size(); i++) {
+		const std::vector<Vertex> &ic = rings[inner[i]].corners;
+		for(size_t j=0; j<ic.size(); j++) {
+			touches.push_back(std::make_pair(ic[j], int(i+1)));
+		}
+	}
+	std::sort(touches.begin(), touches.end(), TouchOrder());
+
+	std::vector<int> group(inner.size()+1);
+	for(size_t i=0; i<group.size(); i++) group[i] = i;
+	for(size_t i=1; i<touches.size(); i++) {
+		if(!vertex_equal(touches[i-1].first, touches[i].first)) continue;
+		int a = touches[i-1].second, b = touches[i].second;
+		while(group[a] != a) a = group[a];
+		while(group[b] != b) b = group[b];
+		if(a < b) group[b] = a;
+		else      group[a] = b;
+	}
+	std::vector<bool> merged(group.size());
+	for(size_t i=0; i<group.size(); i++) {
+		int a = i;
+		while(group[a] != a) a = group[a];
+		merged[i] = !a;
+	}
+
+	// the corners where the edges of the ring and the merged islands get re-paired
+	std::vector<Vertex> swaps;
+	for(size_t i=1; i<touches.size(); i++) {
+		if(merged[touches[i].second] && vertex_equal(touches[i-1].first, touches[i].first)) {
+			swaps.push_back(touches[i].first);
+		}
+	}
+
+	std::vector<Ring> loops;
+	if(swaps.empty()) {
+		loops.push_back(Ring());
+		loops.back().swap(ring);
+	} else {
+		// All of the edges, as linked lists with the hole on the right, which means
+		// turning the islands around.
+		std::vector<Vertex> pts;
+		std::vector<size_t> next;
+		for(size_t i=0; i<merged.size(); i++) {
+			if(!merged[i]) continue;
+			std::vector<Vertex> &seq = i ? rings[inner[i-1]].ring.pts : ring.pts;
+			size_t start = pts.size();
+			if(i) pts.insert(pts.end(), seq.rbegin(), seq.rend());
+			else  pts.insert(pts.end(), seq.begin(), seq.end());
+			for(size_t j=start; j<pts.size(); j++) next.push_back(j+1);
+			next.back() = start;
+		}
+
+		std::vector<std::pair<Vertex, int> > at_swaps;
+		for(size_t i=0; i<pts.size(); i++) {
+			if(std::binary_search(swaps.begin(), swaps.end(), pts[i], vertex_less)) {
+				at_swaps.push_back(std::make_pair(pts[i], int(i)));
+			}
+		}
+		std::sort(at_swaps.begin(), at_swaps.end(), TouchOrder());
+		for(size_t i=0; i+1<at_swaps.size(); i+=2) {
+			assert(vertex_equal(at_swaps[i].first, at_swaps[i+1].first));
+			std::swap(next[at_swaps[i].second], next[at_swaps[i+1].second]);
+		}
+
+		std::vector<bool> seen(pts.size());
+		for(size_t i=0; i<pts.size(); i++) {
+			if(seen[i]) continue;
+			loops.push_back(Ring());
+			for(size_t j=i; !seen[j]; j=next[j]) {
+				seen[j] = true;
+				loops.back().pts.push_back(pts[j]);
+			}
+		}
+	}
+
+	// Positive area means that the hole is on the inside, since y points down.  Loops
+	// with the other color on the inside aren't expected, but would be islands.
+	std::vector<Ring> holes, islands;
+	for(size_t i=0; i<loops.size(); i++) {
+		Ring &r = loops[i];
+		bool is_hole = r.orientedArea() > 0;
+		if(!is_hole) r.reverse();
+		std::rotate(r.pts.begin(),
+			std::min_element(r.pts.begin(), r.pts.end(), vertex_less), r.pts.end());
+		r.is_hole = is_hole;
+		std::vector<Ring> &dst = is_hole ? holes : islands;
+		dst.push_back(Ring());
+		dst.back().swap(r);
+	}
+
+	// The holes only touch each other at corners, so the seed of anything inside of
+	// them is inside exactly one.
+	std::vector<std::vector<int> > hole_children(holes.size());
+	for(size_t i=0; i<inner.size(); i++) {
+		const int id = inner[i];
+		std::vector<Vertex>().swap(rings[id].corners);
+		if(merged[i+1]) {
+			comps[parent].children.insert(comps[parent].children.end(),
+				rings[id].children.begin(), rings[id].children.end());
+			std::vector<int>().swap(rings[id].children);
+			drop_ring(id);
+		} else if(min_area && int64_t(rings[id].ring.area()) < min_area) {
+			drop_ring(id);
+		} else {
+			size_t k = 0;
+			Vertex seed = ring_seed(rings[id].ring);
+			while(k+1 < holes.size() && !holes[k].contains(seed)) k++;
+			hole_children[k].push_back(id);
+		}
+	}
+	for(size_t i=0; i<islands.size(); i++) {
+		if(min_area && int64_t(islands[i].area()) < min_area) continue;
+		size_t k = 0;
+		Vertex seed = ring_seed(islands[i]);
+		while(k+1 < holes.size() && !holes[k].contains(seed)) k++;
+		hole_children[k].push_back(new_ring(islands[i]));
+	}
+
+	for(size_t k=0; k<holes.size(); k++) {
+		if(min_area && int64_t(holes[k].area()) < min_area) {
+			// too small, and so is everything inside of it
+			for(size_t i=0; i<hole_children[k].size(); i++) drop_ring(hole_children[k][i]);
+			continue;
+		}
+		int id = new_ring(holes[k]);
+		rings[id].children.swap(hole_children[k]);
+		comps[parent].children.push_back(id);
+	}
+}
+
+int StripeTracer::new_ring(Ring &r) {
+	int id;
+	if(free_rings.empty()) {
+		id = rings.size();
+		rings.push_back(StripeRing());
+	} else {
+		id = free_rings.back();
+		free_rings.pop_back();
+	}
+	rings[id].ring.swap(r);
+	return id;
+}
+
+// Drops a ring along with everything inside of it.
+void StripeTracer::drop_ring(int ring_idx) {
+	std::vector<int> stack(1, ring_idx);
+	while(!stack.empty()) {
+		int id = stack.back();
+		stack.pop_back();
+		StripeRing &r = rings[id];
+		stack.insert(stack.end(), r.children.begin(), r.children.end());
+		std::vector<int>().swap(r.children);
+		std::vector<Vertex>().swap(r.ring.pts);
+		std::vector<Vertex>().swap(r.corners);
+		free_rings.push_back(id);
+	}
+}
+
+Mpoly StripeTracer::get_mpoly() {
+	assert(free_chains.size() == chains.size());
+	assert(comps.size() == 1);
+
+	// Emit the rings in the same order that trace_mask would: depth first, with
+	// siblings in order of their top-left corner.
+	RingSeedOrder seed_order(rings);
+	std::vector<std::pair<int, int> > todo; // (ring, parent in output)
+	std::vector<int> &roots = comps[0].children;
+	std::sort(roots.begin(), roots.end(), seed_order);
+	for(size_t i=roots.size(); i; i--) {
+		todo.push_back(std::make_pair(roots[i-1], -1));
+	}
 
 	Mpoly out_poly;
+	while(!todo.empty()) {
+		int ring_idx = todo.back().first;
+		int parent_id = todo.back().second;
+		todo.pop_back();
+
+		// An island that was kept for its corners may have turned out to be at the
+		// top level.
+		Ring &r = rings[ring_idx].ring;
+		if(min_area && int64_t(r.area()) < min_area) continue;
+
+		int out_id = out_poly.rings.size();
+		out_poly.rings.push_back(Ring());
+		out_poly.rings.back().swap(r);
+		out_poly.rings.back().parent_id = parent_id;
+
+		if(no_donuts) continue;
+		std::vector<int> &kids = rings[ring_idx].children;
+		std::sort(kids.begin(), kids.end(), seed_order);
+		for(size_t i=kids.size(); i; i--) {
+			todo.push_back(std::make_pair(kids[i-1], out_id));
+		}
+	}
+
+	return out_poly;
+}
 
-	recursive_trace(mask, w, h, make_enclosing_ring(w, h), 0, out_poly, -1, min_area, no_donuts);
-	printf("Trace found %zd rings.\n", out_poly.rings.size());
+Mpoly trace_mask_striped(MaskStripeReader &reader, int64_t min_area, bool no_donuts) {
+	size_t w = reader.w;
+	size_t h = reader.h;
 
-	//free(mask_8bit);
+	Mpoly out_poly;
+	// trace_mask gives nothing in this case, since the enclosing ring is too small
+	if(min_area && int64_t(w*h) < min_area) return out_poly;
+	if(!w || !h) return out_poly;
 
-	//fatal_error("OK");
+	StripeTracer tracer(w, min_area, no_donuts);
+	for(size_t y=0; y<h; y++) {
+		tracer.add_row(reader.get_row(y));
+	}
+	tracer.add_row(NULL);
+
+	out_poly = tracer.get_mpoly();
+	report_message("Trace found %zd rings.\n", out_poly.rings.size());
 
 	return out_poly;
 }
 
+///////////////////////////////////////////////////////////////
+// Coarse-to-fine masks
+//
+// The mask is read reduced by the pyramid factor and traced, dropping the rings that are
+// too small.  The rings left are filled back in to get a cleaned up coarse mask.  Only the
+// coarse cells near a boundary of this mask (or near the edge of the image) are read at
+// full resolution, everything else being taken as uniform.  The cells are blocks of about
+// factor x factor pixels, with the block boundaries at x = cx*w/cw, y = cy*h/ch.
+//
+// Each coarse cell is a single sample of its block, so what this misses are the parts of
+// features that fall between the samples, which are less than a cell across.  The caller
+// keeps the factor within the simplification tolerance so that these are details the
+// output isn't expected to hold anyway.
+
+// Coarse cells within this many cells of a boundary are read at full resolution.  A
+// decimated pixel can come from anywhere in its block, so a boundary can be off by a cell
+// in the coarse mask.
+static const int PYRAMID_BAND_CELLS = 2;
+
+// Whether a ring of the coarse trace could belong to a feature with at least min_area
+// pixels.  Apart from parts less than a cell across, the feature lies within the blocks
+// next to the ring's cells, so its area is at most that of the ring's bounding box grown
+// by a cell on each side.
+static bool pyramid_ring_may_pass(const Ring &ring, double cell_w, double cell_h, int64_t min_area) {
+	Bbox bbox = ring.getBbox();
+	return (bbox.width() + 2) * cell_w * (bbox.height() + 2) * cell_h >= double(min_area);
+}
+
+RleMask get_rlemask_pyramid(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, int factor, bool invert, int64_t min_area
+) {
+	const int w = GDALGetRasterXSize(ds);
+	const int h = GDALGetRasterYSize(ds);
+	const int cw = std::max(1, (w + factor - 1) / factor);
+	const int ch = std::max(1, (h + factor - 1) / factor);
+	std::vector<int> block_x(cw+1), block_y(ch+1);
+	for(int i=0; i<=cw; i++) block_x[i] = int(int64_t(i) * w / cw);
+	for(int i=0; i<=ch; i++) block_y[i] = int(int64_t(i) * h / ch);
+
+	report_message("Reading %d x %d reduced mask...\n", cw, ch);
+	std::vector<uint8_t> buf;
+	read_valid_window(ds, bandlist, ndv_def, 0, 0, w, h, cw, ch, buf);
+	BitGrid raw_coarse(cw, ch);
+	for(int y=0; y<ch; y++) {
+		raw_coarse.set_row_span(0, y, &buf[size_t(y) * cw], cw, invert);
+	}
+
+	// Holes are kept even if the caller wants no_donuts: a hole in the coarse mask may be
+	// a bay that opens up through a channel narrower than a cell.  Rings come out of
+	// trace_mask after their parents, so a ring inside of a dropped ring is dropped too.
+	const Mpoly raw_poly = trace_mask(raw_coarse, cw, ch, 0, false);
+	Mpoly coarse_poly;
+	{
+		const double cell_w = double(w) / cw;
+		const double cell_h = double(h) / ch;
+		std::vector<int> new_id(raw_poly.rings.size(), -1);
+		for(size_t i=0; i<raw_poly.rings.size(); i++) {
+			const Ring &ring = raw_poly.rings[i];
+			const int parent = ring.parent_id;
+			if(parent >= 0 && new_id[parent] < 0) continue;
+			if(min_area && !pyramid_ring_may_pass(ring, cell_w, cell_h, min_area)) continue;
+			new_id[i] = int(coarse_poly.rings.size());
+			coarse_poly.rings.push_back(ring);
+			coarse_poly.rings.back().parent_id = (parent >= 0) ? new_id[parent] : -1;
+		}
+	}
+	const BitGrid coarse = RleMask(cw, ch, get_row_crossings(coarse_poly, 0, ch), 0).to_bitgrid();
+
+	// Cells next to a cell of the other color, or next to the outside of the image
+	// (which counts as unset), widened to PYRAMID_BAND_CELLS.
+	BitGrid edge(cw, ch);
+	for(int y=0; y<ch; y++) {
+		for(int x=0; x<cw; x++) {
+			const bool v = coarse(x, y);
+			bool is_edge = false;
+			for(int dy=-1; dy<=1 && !is_edge; dy++) {
+				for(int dx=-1; dx<=1; dx++) {
+					if(coarse.get(x+dx, y+dy, false) != v) {
+						is_edge = true;
+						break;
+					}
+				}
+			}
+			if(is_edge) edge.set(x, y, true);
+		}
+	}
+	BitGrid band(cw, ch);
+	for(int y=0; y<ch; y++) {
+		int x = edge.next_set(y, 0);
+		for(; x >= 0; x = (x+1 < cw) ? edge.next_set(y, x+1) : -1) {
+			for(int by=std::max(0, y-PYRAMID_BAND_CELLS+1); by<std::min(ch, y+PYRAMID_BAND_CELLS); by++) {
+				band.fill_span(by, x-PYRAMID_BAND_CELLS+1, x+PYRAMID_BAND_CELLS, true);
+			}
+		}
+	}
+
+	report_message("Reading full resolution pixels along boundaries: ");
+	report_progress(0);
+	RleMask mask(w, h);
+	size_t pixels_read = 0;
+	for(int cy=0; cy<ch; cy++) {
+		report_progress(double(cy) / ch);
+		const int y0 = block_y[cy];
+		const int bh = block_y[cy+1] - y0;
+		int cx = 0;
+		while(cx < cw) {
+			if(!band(cx, cy)) {
+				// cells taken from the coarse mask, up to the next band cell
+				int cx_end = band.next_set(cy, cx);
+				if(cx_end < 0) cx_end = cw;
+				for(int x=cx; x<cx_end; ) {
+					int run_end = coarse.next_unset(cy, x);
+					if(run_end < 0 || run_end > cx_end) run_end = cx_end;
+					if(coarse(x, cy)) {
+						for(int y=y0; y<y0+bh; y++) {
+							mask.append_run(y, block_x[x], block_x[run_end]);
+						}
+						x = run_end;
+					} else {
+						int next = coarse.next_set(cy, x);
+						x = (next < 0 || next > cx_end) ? cx_end : next;
+					}
+				}
+				cx = cx_end;
+			} else {
+				int cx_end = band.next_unset(cy, cx);
+				if(cx_end < 0) cx_end = cw;
+				const int x0 = block_x[cx];
+				const int bw = block_x[cx_end] - x0;
+				read_valid_window(ds, bandlist, ndv_def, x0, y0, bw, bh, bw, bh, buf);
+				pixels_read += buf.size();
+				for(int y=0; y<bh; y++) {
+					mask.set_row_span(x0, y0+y, &buf[size_t(y) * bw], bw, invert);
+				}
+				cx = cx_end;
+			}
+		}
+	}
+	report_progress(1);
+
+	report_message("Read %zd of %zd pixels at full resolution.\n", pixels_read, size_t(w) * h);
+
+	return mask;
+}
+
 } // namespace dangdal
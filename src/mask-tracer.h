@@ -29,13 +29,55 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #ifndef DANGDAL_MASK_TRACER_H
 #define DANGDAL_MASK_TRACER_H
 
+#include <vector>
+
 #include "mask.h"
 #include "polygon.h"
+#include "raster_features.h"
 
 namespace dangdal {
 
-// this function has the side effect of erasing the mask
-Mpoly trace_mask(BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts);
+Mpoly trace_mask(const BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts);
+Mpoly trace_mask(const RleMask &mask, size_t w, size_t h, int64_t min_area, bool no_donuts);
+
+// Receives the result of a trace one connected component at a time: a top-level ring
+// followed by the rings nested within it.  The order of the rings and their parent_id
+// (relative to the component) are the same as in the trace_mask result.
+class TraceSink {
+public:
+	virtual ~TraceSink() { }
+	// The rings may be swapped out of the component.
+	virtual void push(Mpoly &component) = 0;
+};
+
+// Like trace_mask, but each component is given to the sink as soon as the scan has gone
+// past it, so that it can be processed while the rest is traced.  The components come in
+// the order in which trace_mask would give them.  Returns the number of rings.
+size_t trace_mask(const BitGrid &mask, size_t w, size_t h, int64_t min_area, bool no_donuts,
+	TraceSink &sink);
+size_t trace_mask(const RleMask &mask, size_t w, size_t h, int64_t min_area, bool no_donuts,
+	TraceSink &sink);
+
+// Traces all features in a single pass.  The result is indexed by FeatureBitmap::Index, and
+// each entry is the same as what trace_mask would give for get_mask_for_feature.
+std::vector<Mpoly> trace_features(
+	const FeatureBitmap &features, size_t w, size_t h, int64_t min_area, bool no_donuts);
+
+// Like trace_mask, and giving the same rings, but reads the mask a row at a time so that
+// only the open parts of the rings, and the finished rings that pass min_area, need to be
+// kept in memory.
+Mpoly trace_mask_striped(MaskStripeReader &reader, int64_t min_area, bool no_donuts);
+
+// The valid mask of the dataset (inverted if invert is set), read coarse-to-fine so that
+// it can be traced with min_area at a fraction of the cost of reading the
+// whole thing.  The mask reduced by factor (from an overview if there is one) is traced,
+// and rings too small to pass min_area are dropped.  Full resolution pixels are read only
+// within a couple of reduced pixels of the boundaries of the rings left, and the rest of
+// the mask is filled in from the reduced one.  Parts of features less than factor pixels
+// across that are not near one of these boundaries are lost, so factor should be no more
+// than the simplification tolerance, and factor*factor no more than min_area.
+RleMask get_rlemask_pyramid(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, int factor, bool invert, int64_t min_area);
 
 } // namespace dangdal
 
@@ -30,6 +30,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include <algorithm>
 
 #include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
 
 #include "common.h"
 #include "mask.h"
@@ -37,189 +38,549 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "debugplot.h"
 #include "ndv.h"
 #include "datatype_conversion.h"
+#include "block_reader.h"
 
 namespace dangdal {
 
+// Plot row y of the input on the debug plot.  The row covers pixels x0 .. x0+n-1 and starts at
+// pixel index buf_offset of band_buf.  BandBufs is anything that can be indexed as
+// band_buf[band][byte].
+template <typename BandBufs>
+static void plot_input_row(
+	DebugPlot *dbuf, size_t y, size_t x0, size_t n, const uint8_t *ndv_row,
+	const BandBufs &band_buf,
+	const std::vector<GDALDataType> &datatypes, size_t buf_offset
+) {
+	if(!dbuf || (y % dbuf->stride_y) != 0) return;
+
+	for(size_t sub_x=0; sub_x<n; sub_x+=dbuf->stride_x) {
+		size_t x = sub_x + x0;
+		bool is_ndv = ndv_row[sub_x];
+
+		uint8_t val[3] = { 0, 0, 0 };
+		if(!is_ndv) {
+			for(size_t rgb_idx=0; rgb_idx<3; rgb_idx++) {
+				size_t band_idx = std::min(rgb_idx, band_buf.size()-1);
+				size_t dt_size = GDALGetDataTypeSize(datatypes[band_idx]) / 8;
+				double dbl_val = gdal_scalar_to_double(
+					const_cast<uint8_t *>(&band_buf[band_idx][(buf_offset + sub_x) * dt_size]),
+					datatypes[band_idx]);
+				// valid pixels have texture of the image, but with a cyanish hue
+				if(rgb_idx==0) {
+					val[rgb_idx] = std::max(0.0, std::min(127.0, dbl_val*0.5));
+				} else {
+					val[rgb_idx] = std::max(64.0, std::min(191.0, dbl_val*0.5+64));
+				}
+			}
+		}
+		dbuf->plotPoint(x, y, val[0], val[1], val[2]);
+
+		// Old color scheme:
+		//int val = gdal_scalar_to_int32(
+		//	&band_buf[0][sub_y*blocksize_x + sub_x], datatypes[0]);
+		//int db_v = 50 + val/3;
+		//if(db_v < 50) db_v = 50;
+		//if(db_v > 254) db_v = 254;
+		//uint8_t r = (uint8_t)(db_v*.75);
+		//dbuf->plotPoint(x, y, r, (uint8_t)db_v, (uint8_t)db_v);
+	}
+}
+
+// Blocks come from the reader in row-major order, so the spans of each row are
+// filled in from left to right, as RleMask needs.
+template <typename MaskType>
+static MaskType read_mask_for_dataset(
+	GDALDatasetH ds, const std::vector<size_t> &band_ids,
+	const NdvDef &ndv_def, DebugPlot *dbuf, size_t num_threads
+) {
+	BlockReader reader(ds, band_ids, &ndv_def, num_threads);
+	size_t w = reader.w;
+	size_t h = reader.h;
+	size_t blocksize_x = reader.blocksize_x;
+
+	MaskType mask(w, h);
+
+	size_t num_valid = 0;
+	size_t num_ndv = 0;
+
+	report_message("Reading input...\n");
+
+	while(BlockReader::Block *block = reader.next_block()) {
+		size_t boff_x = block->boff_x;
+		size_t boff_y = block->boff_y;
+		size_t bsize_x = block->bsize_x;
+		size_t bsize_y = block->bsize_y;
+
+		report_progress(reader.progress(block));
+
+		for(size_t sub_y=0; sub_y<bsize_y; sub_y++) {
+			size_t y = sub_y + boff_y;
+			const uint8_t *mask_row = &block->ndv_mask[sub_y*blocksize_x];
+
+			size_t row_valid = mask.set_row_span(boff_x, y, mask_row, bsize_x, true);
+			num_valid += row_valid;
+			num_ndv += bsize_x - row_valid;
+
+			plot_input_row(dbuf, y, boff_x, bsize_x, mask_row,
+				block->band_buf, reader.datatypes, sub_y*blocksize_x);
+		}
+	}
+
+	report_progress(1);
+
+	report_message("Found %zd valid and %zd NDV pixels.\n", num_valid, num_ndv);
+
+	return mask;
+}
+
 BitGrid get_bitgrid_for_dataset(
 	GDALDatasetH ds, const std::vector<size_t> &band_ids,
-	const NdvDef &ndv_def, DebugPlot *dbuf
+	const NdvDef &ndv_def, DebugPlot *dbuf, size_t num_threads
 ) {
+	return read_mask_for_dataset<BitGrid>(ds, band_ids, ndv_def, dbuf, num_threads);
+}
+
+RleMask get_rlemask_for_dataset(
+	GDALDatasetH ds, const std::vector<size_t> &band_ids,
+	const NdvDef &ndv_def, DebugPlot *dbuf, size_t num_threads
+) {
+	return read_mask_for_dataset<RleMask>(ds, band_ids, ndv_def, dbuf, num_threads);
+}
+
+BitGrid get_bitgrid_for_buffers(
+	const std::vector<const void *> &bands,
+	const std::vector<GDALDataType> &dt_list, int w, int h, const NdvDef &ndv_def
+) {
+	if(bands.size() != dt_list.size()) fatal_error("need a datatype for each band");
+
+	BitGrid mask(w, h);
+	std::vector<const void *> row_p(bands.size());
+	std::vector<uint8_t> ndv_row(w);
+	for(int y=0; y<h; y++) {
+		for(size_t i=0; i<bands.size(); i++) {
+			size_t row_bytes = size_t(w) * (GDALGetDataTypeSize(dt_list[i]) / 8);
+			row_p[i] = static_cast<const uint8_t *>(bands[i]) + size_t(y) * row_bytes;
+		}
+		ndv_def.getNdvMask(row_p, dt_list, &ndv_row[0], w);
+		mask.set_row_span(0, y, &ndv_row[0], w, true);
+	}
+	return mask;
+}
+
+MaskStripeReader::MaskStripeReader(
+	GDALDatasetH ds, const std::vector<size_t> &band_ids,
+	const NdvDef &_ndv_def, DebugPlot *_dbuf, size_t _stripe_height,
+	bool _do_invert, const MorphologyOpts &morph_opts
+) :
+	w(GDALGetRasterXSize(ds)),
+	h(GDALGetRasterYSize(ds)),
+	ndv_def(_ndv_def),
+	dbuf(_dbuf),
+	stripe_height(_stripe_height),
+	do_invert(_do_invert),
+	stripe_y0(0),
+	stripe_rows(0),
+	next_row(0),
+	morph(w, morph_opts.erode_passes, morph_opts.dilate_passes),
+	next_raw_row(0),
+	num_valid(0),
+	num_ndv(0)
+{
 	assert(!band_ids.empty());
+	assert(stripe_height > 0);
 
-	size_t w = GDALGetRasterXSize(ds);
-	size_t h = GDALGetRasterYSize(ds);
-	size_t band_count = GDALGetRasterCount(ds);
-	if(VERBOSE) printf("input is %zd x %zd x %zd\n", w, h, band_count);
+	if(VERBOSE) printf("input is %zd x %zd x %d\n", w, h, GDALGetRasterCount(ds));
 
-	std::vector<GDALRasterBandH> bands;
-	std::vector<GDALDataType> datatypes;
 	BOOST_FOREACH(const size_t band_id, band_ids) {
 		if(VERBOSE) printf("opening band %zd\n", band_id);
 		GDALRasterBandH band = GDALGetRasterBand(ds, band_id);
 		if(!band) fatal_error("Could not open band %zd.", band_id);
 		bands.push_back(band);
-		GDALDataType dt = GDALGetRasterDataType(band);
-		datatypes.push_back(dt);
+		datatypes.push_back(GDALGetRasterDataType(band));
 	}
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(bands[0], &blocksize_x_int, &blocksize_y_int);
-	// Out of laziness, I am hoping that images always have the same block size for each band.
-	BOOST_FOREACH(const GDALRasterBandH band, bands) {
-		int bx, by;
-		GDALGetBlockSize(band, &bx, &by);
-		if(bx != blocksize_x_int || by != blocksize_y_int) {
-			fatal_error(
-				"Bands have different block sizes.  Not currently implemented.  Please contact developer");
-		}
+	band_buf.resize(bands.size());
+	for(size_t i=0; i<bands.size(); i++) {
+		size_t dt_size = GDALGetDataTypeSize(datatypes[i]) / 8;
+		band_buf[i].resize(w * stripe_height * dt_size);
+	}
+	stripe_mask.resize(w * stripe_height);
+
+	if(!morph.empty()) {
+		packed_row.resize(morph.words_per_row);
+		morph_row.resize(w);
 	}
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t blocksize_xy = blocksize_x * blocksize_y;
+}
+
+void MaskStripeReader::read_stripe(size_t y0) {
+	stripe_y0 = y0;
+	stripe_rows = std::min(stripe_height, h - y0);
+	size_t num_pixels = w * stripe_rows;
+
+	if(!y0) report_message("Reading input...\n");
+	report_progress(double(y0) / h);
 
-	std::vector<std::vector<uint8_t> > band_buf(bands.size());
 	for(size_t i=0; i<bands.size(); i++) {
-		size_t dt_size = GDALGetDataTypeSize(datatypes[i]) / 8;
-		size_t num_bytes = blocksize_xy * dt_size;
-		band_buf[i].resize(num_bytes);
+		CPLErr err = GDALRasterIO(bands[i], GF_Read, 0, y0, w, stripe_rows,
+			&band_buf[i][0], w, stripe_rows, datatypes[i], 0, 0);
+		if(err != CE_None) fatal_error("read error at row %zd", y0);
 	}
+	// this is an NDV mask, converted to a valid mask below
+	ndv_def.getNdvMask(band_buf, datatypes, &stripe_mask[0], num_pixels);
 
-	std::vector<uint8_t> block_mask(blocksize_xy);
+	for(size_t sub_y=0; sub_y<stripe_rows; sub_y++) {
+		plot_input_row(dbuf, y0+sub_y, 0, w, &stripe_mask[sub_y*w],
+			band_buf, datatypes, sub_y*w);
+	}
 
-	BitGrid mask(w, h);
-	mask.zero();
+	size_t stripe_valid = 0;
+	for(size_t i=0; i<num_pixels; i++) {
+		uint8_t valid = !stripe_mask[i];
+		stripe_valid += valid;
+		stripe_mask[i] = valid ^ uint8_t(do_invert);
+	}
+	num_valid += stripe_valid;
+	num_ndv += num_pixels - stripe_valid;
 
-	size_t num_valid = 0;
-	size_t num_ndv = 0;
+	if(y0 + stripe_rows == h) {
+		report_progress(1);
+		report_message("Found %zd valid and %zd NDV pixels.\n", num_valid, num_ndv);
+	}
+}
 
-	printf("Reading input...\n");
-
-	size_t num_blocks_x = (w + blocksize_x - 1) / blocksize_x;
-	size_t num_blocks_y = (h + blocksize_y - 1) / blocksize_y;
-	for(size_t block_y=0; block_y<num_blocks_y; block_y++) {
-		size_t boff_y = blocksize_y * block_y;
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t block_x=0; block_x<num_blocks_x; block_x++) {
-			size_t boff_x = blocksize_x * block_x;
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
-
-			double progress =
-				double(
-					boff_y * w +
-					boff_x * bsize_y
-				) / (w * h);
-			GDALTermProgress(progress, NULL, NULL);
-
-			for(size_t band_idx=0; band_idx<bands.size(); band_idx++) {
-				GDALReadBlock(bands[band_idx], block_x, block_y, &band_buf[band_idx][0]);
-			}
-			ndv_def.getNdvMask(band_buf, datatypes, &block_mask[0], blocksize_xy);
-
-			for(size_t sub_y=0; sub_y<bsize_y; sub_y++) {
-				size_t y = sub_y + boff_y;
-				bool is_dbuf_stride_y = dbuf && ((y % dbuf->stride_y) == 0);
-				for(size_t sub_x=0; sub_x<bsize_x; sub_x++) {
-					size_t x = sub_x + boff_x;
-					bool is_dbuf_stride = is_dbuf_stride_y && ((sub_x % dbuf->stride_x) == 0);
-
-					bool is_ndv = block_mask[sub_y*blocksize_x + sub_x];
-					mask.set(x, y, !is_ndv);
-					if(is_ndv) {
-						num_ndv++;
-					} else {
-						num_valid++;
-					}
+const uint8_t *MaskStripeReader::get_raw_row(size_t y) {
+	assert(y < h);
+	if(y >= stripe_y0 + stripe_rows) read_stripe(y);
+	assert(y >= stripe_y0);
+	return &stripe_mask[(y - stripe_y0) * w];
+}
 
-					if(is_dbuf_stride) {
-						uint8_t val[3] = { 0, 0, 0 };
-						if(!is_ndv) {
-							for(size_t rgb_idx=0; rgb_idx<3; rgb_idx++) {
-								size_t band_idx = std::min(rgb_idx, bands.size()-1);
-								double dbl_val = gdal_scalar_to_double(
-									&band_buf[band_idx][sub_y*blocksize_x + sub_x], datatypes[band_idx]);
-								// valid pixels have texture of the image, but with a cyanish hue
-								if(rgb_idx==0) {
-									val[rgb_idx] = std::max(0.0, std::min(127.0, dbl_val*0.5));
-								} else {
-									val[rgb_idx] = std::max(64.0, std::min(191.0, dbl_val*0.5+64));
-								}
-							}
-						}
-						dbuf->plotPoint(x, y, val[0], val[1], val[2]);
-
-						// Old color scheme:
-						//int val = gdal_scalar_to_int32(
-						//	&band_buf[0][sub_y*blocksize_x + sub_x], datatypes[0]);
-						//int db_v = 50 + val/3;
-						//if(db_v < 50) db_v = 50;
-						//if(db_v > 254) db_v = 254;
-						//uint8_t r = (uint8_t)(db_v*.75);
-						//dbuf->plotPoint(x, y, r, (uint8_t)db_v, (uint8_t)db_v);
-					}
-				}
+const uint8_t *MaskStripeReader::get_row(size_t y) {
+	if(y != next_row) fatal_error("MaskStripeReader rows must be read in order");
+	next_row++;
+
+	if(morph.empty()) return get_raw_row(y);
+
+	// Push input rows until one comes out of the other end of the pipeline.  The
+	// packing is the same as for BitGrid rows: pixel x is at bit x+1.
+	const RowMorphology::word_t *out;
+	for(;;) {
+		if(next_raw_row < h) {
+			const uint8_t *src = get_raw_row(next_raw_row++);
+			std::fill(packed_row.begin(), packed_row.end(), 0);
+			for(size_t x=0; x<w; x++) {
+				RowMorphology::word_t bit = src[x] ? 1 : 0;
+				packed_row[(x+1) / BitGrid::WORD_BITS] |= bit << ((x+1) % BitGrid::WORD_BITS);
 			}
+			out = morph.push(&packed_row[0]);
+		} else {
+			out = morph.flush();
+			assert(out);
 		}
+		if(out) break;
 	}
 
-	GDALTermProgress(1, NULL, NULL);
+	for(size_t x=0; x<w; x++) {
+		morph_row[x] = (out[(x+1) / BitGrid::WORD_BITS] >> ((x+1) % BitGrid::WORD_BITS)) & 1;
+	}
+	return &morph_row[0];
+}
 
-	printf("Found %zd valid and %zd NDV pixels.\n", num_valid, num_ndv);
+void read_valid_window(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, int x0, int y0, int win_w, int win_h,
+	int buf_w, int buf_h, std::vector<uint8_t> &out
+) {
+	const size_t num_pixels = size_t(buf_w) * buf_h;
+	std::vector<std::vector<uint8_t> > band_buf(bandlist.size());
+	std::vector<GDALDataType> datatypes;
+	for(size_t i=0; i<bandlist.size(); i++) {
+		GDALRasterBandH band = GDALGetRasterBand(ds, bandlist[i]);
+		if(!band) fatal_error("Could not open band %zd.", bandlist[i]);
+		GDALDataType dt = GDALGetRasterDataType(band);
+		datatypes.push_back(dt);
+		band_buf[i].resize(num_pixels * (GDALGetDataTypeSize(dt) / 8));
+		CPLErr err = GDALRasterIO(band, GF_Read, x0, y0, win_w, win_h,
+			&band_buf[i][0], buf_w, buf_h, dt, 0, 0);
+		if(err != CE_None) fatal_error("read error at row %d", y0);
+	}
 
-	return mask;
+	out.resize(num_pixels);
+	ndv_def.getNdvMask(band_buf, datatypes, &out[0], num_pixels);
+	for(size_t i=0; i<num_pixels; i++) out[i] = !out[i];
+}
+
+const int BitGrid::WORD_BITS;
+
+typedef BitGrid::word_t word_t;
+
+static inline int popcount64(word_t v) {
+#ifdef __GNUC__
+	return __builtin_popcountll(v);
+#else
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return int((v * 0x0101010101010101ULL) >> 56);
+#endif
 }
 
-void BitGrid::erode() { // FIXME - untested
-	bool *rowu = new bool[w];
-	bool *rowm = new bool[w];
-	bool *rowl = new bool[w];
-	for(int i=0; i<w; i++) {
-		rowm[i] = 0;
-		rowl[i] = get(i, 0, 0);
+// index of lowest set bit, v must be nonzero
+static inline int lowest_bit(word_t v) {
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+	while(!(v & 1)) { v >>= 1; n++; }
+	return n;
+#endif
+}
+
+// index of highest set bit, v must be nonzero
+static inline int highest_bit(word_t v) {
+#ifdef __GNUC__
+	return BitGrid::WORD_BITS - 1 - __builtin_clzll(v);
+#else
+	int n = 0;
+	while(v >>= 1) n++;
+	return n;
+#endif
+}
+
+// bits lo <= i < hi, where 0 <= lo < hi <= WORD_BITS
+static inline word_t bit_range(int lo, int hi) {
+	word_t upper = (hi == BitGrid::WORD_BITS) ? ~word_t(0) : ((word_t(1) << hi) - 1);
+	return upper & ~((word_t(1) << lo) - 1);
+}
+
+void BitGrid::clear_padding(word_t *row) {
+	row[0] &= ~word_t(1);
+	size_t end = size_t(w) + 1;
+	size_t word_idx = end / WORD_BITS;
+	// note: end is strictly less than words_per_row*WORD_BITS
+	row[word_idx] &= (word_t(1) << (end % WORD_BITS)) - 1;
+	for(size_t i=word_idx+1; i<words_per_row; i++) {
+		row[i] = 0;
 	}
+}
 
+void BitGrid::invert() {
 	for(int y=0; y<h; y++) {
-		bool *tmp = rowu;
-		rowu = rowm; rowm = rowl; rowl = tmp;
-		for(int i=0; i<w; i++) {
-			rowl[i] = get(i, y+1, 0);
+		word_t *row = row_ptr(y);
+		for(size_t i=0; i<words_per_row; i++) {
+			row[i] = ~row[i];
 		}
+		clear_padding(row);
+	}
+}
+
+void BitGrid::erode(int passes) {
+	erode_dilate(passes, 0);
+}
+
+void BitGrid::dilate(int passes) {
+	erode_dilate(0, passes);
+}
 
-		bool ul = 0, um = rowu[0];
-		bool ml = 0, mm = rowm[0];
-		bool ll = 0, lm = rowl[0];
+void BitGrid::erode_dilate(int erode_passes, int dilate_passes) {
+	RowMorphology morph(w, erode_passes, dilate_passes);
+	if(morph.empty()) return;
 
-		for(int x=0; x<w; x++) {
-			bool ur = (x+1<w) ? rowu[x+1] : 0;
-			bool mr = (x+1<w) ? rowm[x+1] : 0;
-			bool lr = (x+1<w) ? rowl[x+1] : 0;
+	// Output row y_out is always above the last row pushed, and rows are copied when
+	// they are pushed, so the results can be written back in place.
+	int y_out = 0;
+	for(int y=0; y<h; y++) {
+		const word_t *out = morph.push(row_ptr(y));
+		if(out) std::copy(out, out + words_per_row, row_ptr(y_out++));
+	}
+	while(const word_t *out = morph.flush()) {
+		std::copy(out, out + words_per_row, row_ptr(y_out++));
+	}
+	assert(y_out == h);
+}
 
-			// remove pixels that don't have two consecutive filled neighbors
-			if(!(
-				(ul&&um) || (um&&ur) || (ur&&mr) || (mr&&lr) ||
-				(lr&&lm) || (lm&&ll) || (ll&&ml) || (ml&&ul)
-			)) set(x, y, false);
+RowMorphology::RowMorphology(int w, int erode_passes, int dilate_passes) :
+	words_per_row((size_t(w) + 2 + BitGrid::WORD_BITS - 1) / BitGrid::WORD_BITS),
+	valid_bits(words_per_row)
+{
+	for(int x=0; x<w; x++) {
+		size_t pos = size_t(x) + 1;
+		valid_bits[pos / BitGrid::WORD_BITS] |= word_t(1) << (pos % BitGrid::WORD_BITS);
+	}
+
+	Stage s;
+	s.have_curr = false;
+	s.flushed = false;
+	// the row above the first row is the border
+	s.prev.resize(words_per_row);
+	s.curr.resize(words_per_row);
+	s.next.resize(words_per_row);
+	s.out.resize(words_per_row);
+
+	s.dilate = false;
+	for(int i=0; i<erode_passes; i++) stages.push_back(s);
+	s.dilate = true;
+	for(int i=0; i<dilate_passes; i++) stages.push_back(s);
+}
+
+// Computes one output row of a stage from its prev, curr, and next rows.  Works on
+// 64 pixels at a time.  For each of the three rows, the left and right neighbors
+// are obtained by shifting the row by one bit.  The border bits are always zero, so
+// nothing special needs to be done at the edges.
+//
+// Erosion removes pixels that don't have two consecutive set neighbors.  Dilation
+// is erosion of the complement: rows are inverted as they enter the stage (leaving
+// the border zero) and the result is inverted back.
+void RowMorphology::run_stage(RowMorphology::Stage &s) {
+	const size_t nw = words_per_row;
+	const word_t flip = s.dilate ? ~word_t(0) : 0;
+	const word_t *pu = &s.prev[0];
+	const word_t *pm = &s.curr[0];
+	const word_t *pl = &s.next[0];
+
+	for(size_t i=0; i<nw; i++) {
+		// bit x of *l holds pixel x-1, bit x of *r holds pixel x+1
+		word_t um = pu[i];
+		word_t ul = (um << 1) | (i ? pu[i-1] >> (BitGrid::WORD_BITS-1) : 0);
+		word_t ur = (um >> 1) | (i+1<nw ? pu[i+1] << (BitGrid::WORD_BITS-1) : 0);
+		word_t mm = pm[i];
+		word_t ml = (mm << 1) | (i ? pm[i-1] >> (BitGrid::WORD_BITS-1) : 0);
+		word_t mr = (mm >> 1) | (i+1<nw ? pm[i+1] << (BitGrid::WORD_BITS-1) : 0);
+		word_t lm = pl[i];
+		word_t ll = (lm << 1) | (i ? pl[i-1] >> (BitGrid::WORD_BITS-1) : 0);
+		word_t lr = (lm >> 1) | (i+1<nw ? pl[i+1] << (BitGrid::WORD_BITS-1) : 0);
+
+		word_t keep =
+			(ul&um) | (um&ur) | (ur&mr) | (mr&lr) |
+			(lr&lm) | (lm&ll) | (ll&ml) | (ml&ul);
+		s.out[i] = ((mm & keep) ^ flip) & valid_bits[i];
+	}
+}
+
+void RowMorphology::load_row(const RowMorphology::Stage &s, const word_t *row,
+	std::vector<word_t> &dst) const
+{
+	if(s.dilate) {
+		for(size_t i=0; i<words_per_row; i++) dst[i] = ~row[i] & valid_bits[i];
+	} else {
+		std::copy(row, row + words_per_row, dst.begin());
+	}
+}
 
-			ul=um; ml=mm; ll=lm;
-			um=ur; mm=mr; lm=lr;
+const RowMorphology::word_t *RowMorphology::push_from(size_t first_stage, const word_t *row) {
+	for(size_t k=first_stage; k<stages.size(); k++) {
+		Stage &s = stages[k];
+		assert(!s.flushed);
+		if(!s.have_curr) {
+			load_row(s, row, s.curr);
+			s.have_curr = true;
+			return NULL;
 		}
+		load_row(s, row, s.next);
+		run_stage(s);
+		std::swap(s.prev, s.curr);
+		std::swap(s.curr, s.next);
+		row = &s.out[0];
 	}
+	return row;
+}
+
+const RowMorphology::word_t *RowMorphology::push(const word_t *row) {
+	return push_from(0, row);
+}
+
+const RowMorphology::word_t *RowMorphology::flush() {
+	// Each stage holds back one row.  Flushing a stage emits its last row (with the
+	// border below it), which is then pushed through the stages that follow.
+	for(size_t k=0; k<stages.size(); k++) {
+		Stage &s = stages[k];
+		if(s.flushed) continue;
+		s.flushed = true;
+		if(!s.have_curr) continue;
+		std::fill(s.next.begin(), s.next.end(), 0);
+		run_stage(s);
+		const word_t *out = push_from(k+1, &s.out[0]);
+		if(out) return out;
+	}
+	return NULL;
+}
+
+MorphologyOpts::MorphologyOpts(std::vector<std::string> &arg_list) :
+	erode_passes(0), dilate_passes(0)
+{
+	std::vector<std::string> args_out;
+	const std::string cmdname = arg_list[0];
+	args_out.push_back(cmdname);
+
+	size_t argp = 1;
+	while(argp < arg_list.size()) {
+		const std::string &arg = arg_list[argp++];
+		if(arg == "-erosion" || arg == "-dilation" || arg == "-opening") {
+			// The number of passes is optional and defaults to one.
+			int passes = 1;
+			if(argp < arg_list.size()) {
+				const std::string &next = arg_list[argp];
+				if(!next.empty() && next.find_first_not_of("0123456789") == std::string::npos) {
+					try {
+						passes = boost::lexical_cast<int>(next);
+					} catch(boost::bad_lexical_cast &e) {
+						fatal_error("cannot parse number given on command line");
+					}
+					argp++;
+				}
+			}
+			if(arg != "-dilation") erode_passes += passes;
+			if(arg != "-erosion") dilate_passes += passes;
+		} else {
+			args_out.push_back(arg);
+		}
+	}
+
+	if(VERBOSE >= 2) printf("erosion passes: %d, dilation passes: %d\n",
+		erode_passes, dilate_passes);
 
-	delete[] rowu;
-	delete[] rowm;
-	delete[] rowl;
+	arg_list = args_out;
+}
+
+void MorphologyOpts::printUsage() {
+	printf(
+"Erosion/dilation:\n"
+"  -erosion [N]                       Erode pixels that don't have two consecutive\n"
+"                                     neighbors (N times, default once)\n"
+"  -dilation [N]                      Fill pixels that don't have two consecutive\n"
+"                                     empty neighbors (N times, default once)\n"
+"  -opening [N]                       Same as -erosion N -dilation N\n"
+"                                     (all erosion is done before dilation)\n"
+);
 }
 
 Vertex BitGrid::centroid() {
+	// The sum of the bit indices of a word is computed from popcounts: bit k of
+	// the index of a set bit contributes 2^k, and pos_masks[k] selects the bits
+	// whose index has bit k set.
+	static const word_t pos_masks[6] = {
+		0xaaaaaaaaaaaaaaaaULL,
+		0xccccccccccccccccULL,
+		0xf0f0f0f0f0f0f0f0ULL,
+		0xff00ff00ff00ff00ULL,
+		0xffff0000ffff0000ULL,
+		0xffffffff00000000ULL
+	};
+
 	int64_t accum_x=0, accum_y=0, cnt=0;
 	for(int y=0; y<h; y++) {
-		for(int x=0; x<w; x++) {
-			if(get(x, y)) {
-				accum_x += x;
-				accum_y += y;
-				cnt++;
+		const word_t *row = row_ptr(y);
+		for(size_t i=0; i<words_per_row; i++) {
+			word_t v = row[i];
+			if(!v) continue;
+			int64_t n = popcount64(v);
+			int64_t sum = n * int64_t(i * WORD_BITS);
+			for(int k=0; k<6; k++) {
+				sum += int64_t(popcount64(v & pos_masks[k])) << k;
 			}
+			// subtract one for the border column
+			accum_x += sum - n;
+			accum_y += n * y;
+			cnt += n;
 		}
 	}
 	return Vertex(
@@ -228,4 +589,314 @@ Vertex BitGrid::centroid() {
 	);
 }
 
+size_t BitGrid::count() const {
+	size_t cnt = 0;
+	for(int y=0; y<h; y++) {
+		const word_t *row = row_ptr(y);
+		for(size_t i=0; i<words_per_row; i++) {
+			cnt += popcount64(row[i]);
+		}
+	}
+	return cnt;
+}
+
+size_t BitGrid::count_span(int y, int from, int to) const {
+	if(y < 0 || y >= h) return 0;
+	from = std::max(from, 0);
+	to = std::min(to, w);
+	if(from >= to) return 0;
+
+	const word_t *row = row_ptr(y);
+	size_t p0 = size_t(from) + 1;
+	size_t p1 = size_t(to) + 1;
+	size_t w0 = p0 / WORD_BITS;
+	size_t w1 = (p1-1) / WORD_BITS;
+	size_t cnt = 0;
+	for(size_t i=w0; i<=w1; i++) {
+		int lo = (i == w0) ? int(p0 % WORD_BITS) : 0;
+		int hi = (i == w1) ? int((p1-1) % WORD_BITS) + 1 : WORD_BITS;
+		cnt += popcount64(row[i] & bit_range(lo, hi));
+	}
+	return cnt;
+}
+
+void BitGrid::fill_span(int y, int from, int to, bool val) {
+	if(y < 0 || y >= h) return;
+	from = std::max(from, 0);
+	to = std::min(to, w);
+	if(from >= to) return;
+
+	word_t *row = row_ptr(y);
+	size_t p0 = size_t(from) + 1;
+	size_t p1 = size_t(to) + 1;
+	size_t w0 = p0 / WORD_BITS;
+	size_t w1 = (p1-1) / WORD_BITS;
+	for(size_t i=w0; i<=w1; i++) {
+		int lo = (i == w0) ? int(p0 % WORD_BITS) : 0;
+		int hi = (i == w1) ? int((p1-1) % WORD_BITS) + 1 : WORD_BITS;
+		word_t m = bit_range(lo, hi);
+		if(val) row[i] |= m;
+		else    row[i] &= ~m;
+	}
+}
+
+int BitGrid::first_set(int y) const {
+	return next_set(y, 0);
+}
+
+int BitGrid::next_set(int y, int from) const {
+	if(from >= w) return -1;
+	from = std::max(from, 0);
+
+	const word_t *row = row_ptr(y);
+	size_t pos = size_t(from) + 1;
+	size_t i = pos / WORD_BITS;
+	word_t v = row[i] & ~((word_t(1) << (pos % WORD_BITS)) - 1);
+	for(;;) {
+		if(v) return int(i * WORD_BITS) + lowest_bit(v) - 1;
+		if(++i == words_per_row) return -1;
+		v = row[i];
+	}
+}
+
+int BitGrid::next_unset(int y, int from) const {
+	if(from >= w) return -1;
+	from = std::max(from, 0);
+
+	const word_t *row = row_ptr(y);
+	size_t pos = size_t(from) + 1;
+	size_t i = pos / WORD_BITS;
+	word_t v = ~row[i] & ~((word_t(1) << (pos % WORD_BITS)) - 1);
+	for(;;) {
+		// the padding past the end of the row reads as unset
+		if(v) {
+			int x = int(i * WORD_BITS) + lowest_bit(v) - 1;
+			return x < w ? x : -1;
+		}
+		if(++i == words_per_row) return -1;
+		v = ~row[i];
+	}
+}
+
+int BitGrid::last_set(int y) const {
+	const word_t *row = row_ptr(y);
+	for(size_t i=words_per_row; i>0; i--) {
+		if(row[i-1]) return int((i-1) * WORD_BITS) + highest_bit(row[i-1]) - 1;
+	}
+	return -1;
+}
+
+size_t BitGrid::set_row_span(int x0, int y, const uint8_t *src, size_t n, bool invert_src) {
+	assert(x0>=0 && y>=0 && y<h && size_t(x0)+n <= size_t(w));
+
+	word_t *row = row_ptr(y);
+	size_t cnt = 0;
+	size_t i = 0;
+	while(i < n) {
+		size_t pos = size_t(x0) + 1 + i;
+		int shift = pos % WORD_BITS;
+		int nb = int(std::min(size_t(WORD_BITS - shift), n - i));
+		word_t bits = 0;
+		for(int k=0; k<nb; k++) {
+			if((src[i+k] != 0) != invert_src) {
+				bits |= word_t(1) << (shift + k);
+			}
+		}
+		cnt += popcount64(bits);
+		word_t &word = row[pos / WORD_BITS];
+		word = (word & ~bit_range(shift, shift + nb)) | bits;
+		i += nb;
+	}
+	return cnt;
+}
+
+///////////////////////////////////////////////////////////////
+// RleMask
+
+RleMask::RleMask(const BitGrid &grid) :
+	w(grid.w), h(grid.h), rows(grid.h)
+{
+	for(int y=0; y<h; y++) {
+		for(int x=grid.next_set(y, 0); x>=0; ) {
+			int end = grid.next_unset(y, x);
+			if(end < 0) end = w;
+			rows[y].push_back(x);
+			rows[y].push_back(end);
+			x = grid.next_set(y, end);
+		}
+	}
+}
+
+RleMask::RleMask(int _w, int _h, const std::vector<row_crossings_t> &crossings, int min_y) :
+	w(_w), h(_h), rows(_h)
+{
+	for(int y=0; y<h; y++) {
+		int row = y - min_y;
+		if(row < 0 || row >= int(crossings.size())) continue;
+		const row_crossings_t &rc = crossings[row];
+		for(size_t cidx=0; cidx<rc.size()/2; cidx++) {
+			append_run(y, rc[cidx*2], rc[cidx*2+1]);
+		}
+	}
+}
+
+size_t RleMask::num_runs() const {
+	size_t n = 0;
+	for(int y=0; y<h; y++) n += rows[y].size() / 2;
+	return n;
+}
+
+void RleMask::invert() {
+	row_crossings_t inv;
+	for(int y=0; y<h; y++) {
+		row_crossings_t &r = rows[y];
+		inv.clear();
+		int start = 0;
+		for(size_t i=0; i<r.size(); i+=2) {
+			if(r[i] > start) {
+				inv.push_back(start);
+				inv.push_back(r[i]);
+			}
+			start = r[i+1];
+		}
+		if(start < w) {
+			inv.push_back(start);
+			inv.push_back(w);
+		}
+		r.swap(inv);
+	}
+}
+
+void RleMask::intersect(const RleMask &other) {
+	assert(other.w == w && other.h == h);
+	for(int y=0; y<h; y++) {
+		row_crossings_t both = crossings_intersection(rows[y], other.rows[y]);
+		rows[y].clear();
+		for(size_t i=0; i<both.size(); i+=2) {
+			append_run(y, both[i], both[i+1]);
+		}
+	}
+}
+
+size_t RleMask::count() const {
+	size_t cnt = 0;
+	for(int y=0; y<h; y++) {
+		const row_crossings_t &r = rows[y];
+		for(size_t i=0; i<r.size(); i+=2) cnt += r[i+1] - r[i];
+	}
+	return cnt;
+}
+
+size_t RleMask::count_span(int y, int from, int to) const {
+	if(y < 0 || y >= h) return 0;
+	from = std::max(from, 0);
+	to = std::min(to, w);
+	if(from >= to) return 0;
+
+	const row_crossings_t &r = rows[y];
+	// first run that ends after 'from'
+	size_t i = std::upper_bound(r.begin(), r.end(), from) - r.begin();
+	i &= ~size_t(1);
+	size_t cnt = 0;
+	for(; i<r.size() && r[i]<to; i+=2) {
+		cnt += std::min(r[i+1], to) - std::max(r[i], from);
+	}
+	return cnt;
+}
+
+int RleMask::first_set(int y) const {
+	const row_crossings_t &r = rows[y];
+	return r.empty() ? -1 : r.front();
+}
+
+int RleMask::last_set(int y) const {
+	const row_crossings_t &r = rows[y];
+	return r.empty() ? -1 : r.back() - 1;
+}
+
+int RleMask::next_set(int y, int from) const {
+	if(from >= w) return -1;
+	from = std::max(from, 0);
+
+	const row_crossings_t &r = rows[y];
+	size_t i = std::upper_bound(r.begin(), r.end(), from) - r.begin();
+	if(i & 1) return from;
+	return i < r.size() ? r[i] : -1;
+}
+
+int RleMask::next_unset(int y, int from) const {
+	if(from >= w) return -1;
+	from = std::max(from, 0);
+
+	const row_crossings_t &r = rows[y];
+	size_t i = std::upper_bound(r.begin(), r.end(), from) - r.begin();
+	if(!(i & 1)) return from;
+	return r[i] < w ? r[i] : -1;
+}
+
+void RleMask::append_run(int y, int from, int to) {
+	assert(y>=0 && y<h);
+	from = std::max(from, 0);
+	to = std::min(to, w);
+	if(from >= to) return;
+
+	row_crossings_t &r = rows[y];
+	if(!r.empty() && from <= r.back()) {
+		assert(from >= r[r.size()-2]);
+		r.back() = std::max(r.back(), to);
+	} else {
+		r.push_back(from);
+		r.push_back(to);
+	}
+}
+
+size_t RleMask::set_row_span(int x0, int y, const uint8_t *src, size_t n, bool invert_src) {
+	assert(x0>=0 && y>=0 && y<h && size_t(x0)+n <= size_t(w));
+
+	size_t cnt = 0;
+	size_t i = 0;
+	while(i < n) {
+		while(i < n && (src[i] != 0) == invert_src) i++;
+		size_t run_start = i;
+		while(i < n && (src[i] != 0) != invert_src) i++;
+		if(i > run_start) {
+			append_run(y, x0 + int(run_start), x0 + int(i));
+			cnt += i - run_start;
+		}
+	}
+	return cnt;
+}
+
+BitGrid RleMask::to_bitgrid() const {
+	BitGrid grid(w, h);
+	for(int y=0; y<h; y++) {
+		const row_crossings_t &r = rows[y];
+		for(size_t i=0; i<r.size(); i+=2) {
+			grid.fill_span(y, r[i], r[i+1], true);
+		}
+	}
+	return grid;
+}
+
+void RleMask::write_pbm(const std::string &fn) const {
+	FILE *fout = fopen(fn.c_str(), "wb");
+	if(!fout) fatal_error("cannot open mask output");
+	fprintf(fout, "P4\n%d %d\n", w, h);
+	const size_t row_bytes = (size_t(w)+7)/8;
+	std::vector<uint8_t> buf(row_bytes);
+	for(int y=0; y<h; y++) {
+		// start out all black, with the bits past the end of the row cleared
+		buf.assign(row_bytes, 0xff);
+		if(w % 8) buf[row_bytes-1] = uint8_t(0xff << (8 - w % 8));
+		const row_crossings_t &r = rows[y];
+		for(size_t i=0; i<r.size(); i+=2) {
+			for(int x=r[i]; x<r[i+1]; x++) {
+				buf[x/8] &= ~uint8_t(0x80 >> (x % 8));
+			}
+		}
+		if(row_bytes) fwrite(&buf[0], row_bytes, 1, fout);
+	}
+	fclose(fout);
+}
+
 } // namespace dangdal
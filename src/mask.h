@@ -31,10 +31,15 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #define DANGDAL_MASK_H
 
 #include <cassert>
+#include <string>
 #include <vector>
+#include <algorithm>
+
+#include <stdint.h>
 
 #include "common.h"
 #include "polygon.h"
+#include "polygon-rasterizer.h"
 #include "debugplot.h"
 #include "ndv.h"
 
@@ -96,24 +101,344 @@ protected:
 	std::vector<T> grid;
 };
 
-class BitGrid : public GridArray<bool> {
+// A bitmap packed into 64-bit words.  Each row starts on a word boundary and
+// the image is surrounded by a one pixel border that is always zero, so pixel
+// (x,y) lives at bit x+1 of padded row y+1.  The border lets get_quad() and
+// erode() look at neighbors without any bounds checks.
+class BitGrid {
 public:
-	BitGrid(int _w, int _h) : GridArray<bool>(_w, _h) { }
+	typedef uint64_t word_t;
+	static const int WORD_BITS = 64;
 
-	void invert() {
-		for(size_t i=0; i<grid.size(); i++) {
-			grid[i] = !grid[i];
+	BitGrid(int _w, int _h) :
+		w(_w), h(_h),
+		words_per_row((size_t(w) + 2 + WORD_BITS - 1) / WORD_BITS),
+		grid(words_per_row * (size_t(h) + 2))
+	{ }
+
+// default dtor, copy, assign are OK
+
+public:
+	bool operator()(int x, int y) const {
+		assert(x>=0 && y>=0 && x<w && y<h);
+		size_t pos = size_t(x) + 1;
+		return (row_ptr(y)[pos / WORD_BITS] >> (pos % WORD_BITS)) & 1;
+	}
+
+	bool get(int x, int y, bool default_val) const {
+		if(x>=0 && y>=0 && x<w && y<h) {
+			return (*this)(x, y);
+		} else {
+			return default_val;
 		}
 	}
 
-	void erode();
+	// FIXME - deprecate
+	bool get(int x, int y) const {
+		return (*this)(x, y);
+	}
+
+	void set(int x, int y, bool val) {
+		assert(x>=0 && y>=0 && x<w && y<h);
+		size_t pos = size_t(x) + 1;
+		word_t bit = word_t(1) << (pos % WORD_BITS);
+		word_t &word = row_ptr(y)[pos / WORD_BITS];
+		if(val) word |= bit;
+		else    word &= ~bit;
+	}
+
+	// The four pixels (x-1,y-1), (x,y-1), (x,y), (x-1,y) packed as bits
+	// 1, 2, 4, 8 respectively.  Pixels outside the image count as zero.
+	// Valid for 0<=x<=w and 0<=y<=h.
+	int get_quad(int x, int y) const {
+		assert(x>=0 && y>=0 && x<=w && y<=h);
+		size_t word_idx = size_t(x) / WORD_BITS;
+		int shift = x % WORD_BITS;
+		int top = pair_at(row_ptr(y-1), word_idx, shift);
+		int bot = pair_at(row_ptr(y  ), word_idx, shift);
+		return top | ((bot & 1) << 3) | ((bot & 2) << 1);
+	}
+
+	void zero() {
+		std::fill(grid.begin(), grid.end(), 0);
+	}
+
+	void invert();
+
+	// Remove pixels that don't have two consecutive set neighbors, repeated the
+	// given number of times.
+	void erode(int passes=1);
+
+	// The dual of erode(): set pixels that don't have two consecutive unset
+	// neighbors, repeated the given number of times.  Same as inverting, eroding,
+	// and inverting again.
+	void dilate(int passes=1);
+
+	// Erosion passes followed by dilation passes (an opening if the counts are
+	// equal).  All passes are done in a single sweep over the grid (see
+	// RowMorphology).
+	void erode_dilate(int erode_passes, int dilate_passes);
 
 	Vertex centroid();
+
+	// Number of set pixels.
+	size_t count() const;
+
+	// Number of set pixels in row y for from<=x<to.  The range is clipped to
+	// the image.
+	size_t count_span(int y, int from, int to) const;
+
+	// Set pixels from<=x<to of row y to val.  The range is clipped to the image.
+	void fill_span(int y, int from, int to, bool val);
+
+	// Leftmost/rightmost set pixel of row y, or -1 if the row is empty.
+	int first_set(int y) const;
+	int last_set(int y) const;
+
+	// Leftmost set pixel of row y with x>=from, or -1 if there is none.
+	int next_set(int y, int from) const;
+
+	// Leftmost unset pixel of row y with x>=from, or -1 if there is none.
+	int next_unset(int y, int from) const;
+
+	// Set pixels x0 .. x0+n-1 of row y from a byte-per-pixel buffer, where a
+	// nonzero byte means 'true' (or 'false' if invert_src is set).  Returns
+	// the number of pixels that were set to 'true'.
+	size_t set_row_span(int x0, int y, const uint8_t *src, size_t n, bool invert_src);
+
+private:
+	// Rows are indexed from -1 to h inclusive.
+	const word_t *row_ptr(int y) const {
+		return &grid[size_t(y+1) * words_per_row];
+	}
+
+	word_t *row_ptr(int y) {
+		return &grid[size_t(y+1) * words_per_row];
+	}
+
+	// bits 'shift' and 'shift+1' of the given row, starting at word_idx
+	static int pair_at(const word_t *row, size_t word_idx, int shift) {
+		word_t v = row[word_idx] >> shift;
+		if(shift == WORD_BITS-1) v |= row[word_idx+1] << 1;
+		return int(v & 3);
+	}
+
+	void clear_padding(word_t *row);
+
+protected:
+	int w, h;
+	size_t words_per_row;
+	std::vector<word_t> grid;
+
+	friend class RleMask;
+};
+
+// Streams rows through a chain of erosion and dilation passes.  Rows are packed the
+// same way as the rows of a BitGrid of width w, border bits included.  Each pass only
+// looks at a window of three rows, so a row coming out of one pass is fed directly
+// into the next and the whole chain needs just a few rows of memory, regardless of
+// the number of passes.  Output lags input by one row per pass.
+class RowMorphology {
+public:
+	typedef BitGrid::word_t word_t;
+
+	RowMorphology(int w, int erode_passes, int dilate_passes);
+
+	// Feed the next input row.  Returns the next output row, or NULL if more input is
+	// needed first.  The returned row is valid until the next call.
+	const word_t *push(const word_t *row);
+
+	// Once all input rows are pushed, call this until it returns NULL to get the
+	// remaining output rows.
+	const word_t *flush();
+
+	// true if there are no passes, in which case rows come out unchanged
+	bool empty() const { return stages.empty(); }
+
+	size_t words_per_row;
+
+private:
+	struct Stage {
+		bool dilate;
+		bool have_curr, flushed;
+		std::vector<word_t> prev, curr, next, out;
+	};
+
+	const word_t *push_from(size_t first_stage, const word_t *row);
+	void load_row(const Stage &s, const word_t *row, std::vector<word_t> &dst) const;
+	void run_stage(Stage &s);
+
+	// pixels 0 <= x < w, i.e. everything except the border bits
+	std::vector<word_t> valid_bits;
+	std::vector<Stage> stages;
 };
 
-// Returns a BitGrid with 'true' values correspond to valid (not ndv) pixels.
+// Erosion and dilation options, parsed from (and removed from) the command line.
+class MorphologyOpts {
+public:
+	MorphologyOpts() : erode_passes(0), dilate_passes(0) { }
+	explicit MorphologyOpts(std::vector<std::string> &arg_list);
+
+	static void printUsage();
+
+	bool empty() const { return !erode_passes && !dilate_passes; }
+
+	void apply(BitGrid &mask) const {
+		if(!empty()) mask.erode_dilate(erode_passes, dilate_passes);
+	}
+
+	int erode_passes, dilate_passes;
+};
+
+// A bitmap stored as runs of set pixels.  Each row is a sorted list of
+// from,to pairs, in the same format given by get_row_crossings, covering the
+// pixels from<=x<to.  Runs are never empty and never touch each other.  Since
+// masks tend to be mostly large uniform areas, this takes space and time
+// proportional to the number of edges rather than the number of pixels.
+class RleMask {
+public:
+	RleMask(int _w, int _h) : w(_w), h(_h), rows(_h) { }
+
+	explicit RleMask(const BitGrid &grid);
+
+	// Row y of the mask is taken from the spans crossings[y-min_y].  The spans are
+	// clipped to the image, and rows that are not given are empty.
+	RleMask(int _w, int _h, const std::vector<row_crossings_t> &crossings, int min_y);
+
+// default dtor, copy, assign are OK
+
+	bool operator()(int x, int y) const {
+		assert(x>=0 && y>=0 && x<w && y<h);
+		const row_crossings_t &r = rows[y];
+		return (std::upper_bound(r.begin(), r.end(), x) - r.begin()) & 1;
+	}
+
+	bool get(int x, int y, bool default_val) const {
+		if(x>=0 && y>=0 && x<w && y<h) {
+			return (*this)(x, y);
+		} else {
+			return default_val;
+		}
+	}
+
+	// Same as BitGrid::get_quad.
+	int get_quad(int x, int y) const {
+		assert(x>=0 && y>=0 && x<=w && y<=h);
+		return
+			(get(x-1, y-1, false) ? 1 : 0) +
+			(get(x  , y-1, false) ? 2 : 0) +
+			(get(x  , y  , false) ? 4 : 0) +
+			(get(x-1, y  , false) ? 8 : 0);
+	}
+
+	const row_crossings_t &row_runs(int y) const {
+		assert(y>=0 && y<h);
+		return rows[y];
+	}
+
+	size_t num_runs() const;
+
+	void invert();
+
+	// Clear the pixels that are not set in 'other', which must be the same size.
+	void intersect(const RleMask &other);
+
+	// Number of set pixels.
+	size_t count() const;
+
+	// Number of set pixels in row y for from<=x<to.  The range is clipped to
+	// the image.
+	size_t count_span(int y, int from, int to) const;
+
+	// Leftmost/rightmost set pixel of row y, or -1 if the row is empty.
+	int first_set(int y) const;
+	int last_set(int y) const;
+
+	// Leftmost set (or unset) pixel of row y with x>=from, or -1 if there is none.
+	int next_set(int y, int from) const;
+	int next_unset(int y, int from) const;
+
+	// Set pixels from<=x<to of row y.  The range is clipped to the image.  Runs
+	// must be added from left to right, so from must not be less than the end of
+	// the last run of the row.
+	void append_run(int y, int from, int to);
+
+	// Same as BitGrid::set_row_span, for a mask that starts out empty.  Each row
+	// must be filled in from left to right.
+	size_t set_row_span(int x0, int y, const uint8_t *src, size_t n, bool invert_src);
+
+	BitGrid to_bitgrid() const;
+
+	// Write as a PBM, with the pixels that are not set being black.
+	void write_pbm(const std::string &fn) const;
+
+private:
+	int w, h;
+	std::vector<row_crossings_t> rows;
+};
+
+// Returns a BitGrid with 'true' values correspond to valid (not ndv) pixels.  Blocks are
+// decoded using num_threads threads (see BlockReader).
 BitGrid get_bitgrid_for_dataset(GDALDatasetH ds, const std::vector<size_t> &bandlist,
-	const NdvDef &ndv_def, DebugPlot *dbuf);
+	const NdvDef &ndv_def, DebugPlot *dbuf, size_t num_threads);
+
+// Same as get_bitgrid_for_dataset, but the mask is built up as runs.
+RleMask get_rlemask_for_dataset(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, DebugPlot *dbuf, size_t num_threads);
+
+// Same as get_bitgrid_for_dataset, for an image of w x h pixels held in memory by the
+// caller.  There is a buffer for each band, of type dt_list[i], with rows packed one after
+// another.  Nothing is printed.
+BitGrid get_bitgrid_for_buffers(const std::vector<const void *> &bands,
+	const std::vector<GDALDataType> &dt_list, int w, int h, const NdvDef &ndv_def);
+
+// The valid (not ndv) mask of the window x0<=x<x0+win_w, y0<=y<y0+win_h of the dataset,
+// one byte per pixel, nonzero meaning 'true'.  The window is resampled to buf_w x buf_h.
+// If that is smaller than the window, GDAL takes the pixels from an overview if there is
+// a suitable one, and otherwise decimates.
+void read_valid_window(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, int x0, int y0, int win_w, int win_h,
+	int buf_w, int buf_h, std::vector<uint8_t> &out);
+
+// Reads the same mask as get_bitgrid_for_dataset, but only a horizontal stripe of
+// the dataset is held in memory at a time.  Rows must be requested in order, from
+// top to bottom.
+class MaskStripeReader {
+public:
+	MaskStripeReader(GDALDatasetH ds, const std::vector<size_t> &band_ids,
+		const NdvDef &ndv_def, DebugPlot *dbuf, size_t stripe_height,
+		bool do_invert, const MorphologyOpts &morph);
+
+	// Row y of the mask, one byte per pixel, nonzero meaning 'true'.  The pointer is
+	// valid until the next call.
+	const uint8_t *get_row(size_t y);
+
+	size_t w, h;
+
+private:
+	const uint8_t *get_raw_row(size_t y);
+	void read_stripe(size_t y0);
+
+	const NdvDef &ndv_def;
+	DebugPlot *dbuf;
+	size_t stripe_height;
+	bool do_invert;
+
+	std::vector<GDALRasterBandH> bands;
+	std::vector<GDALDataType> datatypes;
+	std::vector<std::vector<uint8_t> > band_buf;
+	std::vector<uint8_t> stripe_mask;
+	size_t stripe_y0, stripe_rows;
+	size_t next_row;
+
+	// erosion/dilation, applied as rows are handed out
+	RowMorphology morph;
+	size_t next_raw_row;
+	std::vector<RowMorphology::word_t> packed_row;
+	std::vector<uint8_t> morph_row;
+
+	size_t num_valid, num_ndv;
+};
 
 } // namespace dangdal
 
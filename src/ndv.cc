@@ -29,6 +29,9 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include <algorithm>
 #include <cstring>
 #include <cassert>
+#include <cmath>
+#include <limits>
+#include <complex>
 
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
@@ -38,8 +41,6 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include "ndv.h"
 #include "datatype_conversion.h"
 
-void usage(const std::string &cmdname); // externally defined
-
 namespace dangdal {
 
 void NdvDef::printUsage() {
@@ -110,11 +111,11 @@ NdvDef::NdvDef(std::vector<std::string> &arg_list) :
 		const std::string &arg = arg_list[argp++];
 		if(arg[0] == '-') {
 			if(arg == "-ndv") {
-				if(argp == arg_list.size()) usage(cmdname);
+				if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
 				slabs.push_back(NdvSlab(arg_list[argp++]));
 				got_ndv = 1;
 			} else if(arg == "-valid-range") {
-				if(argp == arg_list.size()) usage(cmdname);
+				if(argp == arg_list.size()) fatal_error("%s needs an argument", arg.c_str());
 				slabs.push_back(NdvSlab(arg_list[argp++]));
 				got_dv = 1;
 			} else {
@@ -136,6 +137,14 @@ NdvDef::NdvDef(std::vector<std::string> &arg_list) :
 	arg_list = args_out;
 }
 
+NdvDef::NdvDef(const std::vector<std::string> &ranges, bool is_valid_range) :
+	invert(is_valid_range)
+{
+	BOOST_FOREACH(const std::string &range, ranges) {
+		slabs.push_back(NdvSlab(range));
+	}
+}
+
 NdvDef::NdvDef(const GDALDatasetH ds, const std::vector<size_t> &bandlist) :
 	invert(false)
 {
@@ -186,53 +195,184 @@ inline bool NdvInterval::contains(const void *p, GDALDataType dt) const {
 	return DANGDAL_RUNTIME_TEMPLATE(dt, contains_templated, this, p);
 }
 
+// The inner loops below work on one band at a time, for a chunk of pixels, and are simple
+// enough for the compiler to vectorize.  The datatype dispatch is done only once per call.
+
+enum MaskOp {
+	MASK_SET,
+	MASK_AND,
+	MASK_OR
+};
+
+// An interval converted to the datatype of the band, so that no conversions are needed in
+// the inner loop.  For integer types, the bounds are rounded inwards and clamped.
+template <typename T, bool IS_INT = std::numeric_limits<T>::is_integer>
+struct TypedInterval {
+	explicit TypedInterval(const NdvInterval &iv) :
+		lo(iv.first), hi(iv.second), empty(!(iv.first <= iv.second)) { }
+
+	bool contains(T v) const { return (v >= lo) & (v <= hi); }
+
+	double lo, hi;
+	bool empty;
+};
+
+template <typename T>
+struct TypedInterval<T, true> {
+	explicit TypedInterval(const NdvInterval &iv) {
+		const double tmin = std::numeric_limits<T>::min();
+		const double tmax = std::numeric_limits<T>::max();
+		empty = !(iv.first <= iv.second) || iv.first > tmax || iv.second < tmin;
+		lo = hi = 0;
+		if(empty) return;
+		lo = iv.first  <= tmin ? std::numeric_limits<T>::min() : T(std::ceil (iv.first ));
+		hi = iv.second >= tmax ? std::numeric_limits<T>::max() : T(std::floor(iv.second));
+	}
+
+	bool contains(T v) const { return (v >= lo) & (v <= hi); }
+
+	T lo, hi;
+	bool empty;
+};
+
+// Comparing in single precision rather than converting each value to double is much faster.
+// The bounds are rounded inwards to the nearest float, which gives the same result.
+template <>
+struct TypedInterval<float, false> {
+	explicit TypedInterval(const NdvInterval &iv) :
+		lo(float(iv.first)), hi(float(iv.second)), empty(!(iv.first <= iv.second))
+	{
+		if(double(lo) < iv.first ) lo = nextafterf(lo,  HUGE_VALF);
+		if(double(hi) > iv.second) hi = nextafterf(hi, -HUGE_VALF);
+	}
+
+	bool contains(float v) const { return (v >= lo) & (v <= hi); }
+
+	float lo, hi;
+	bool empty;
+};
+
+template <typename T>
+struct TypedInterval<std::complex<T>, false> {
+	explicit TypedInterval(const NdvInterval &_iv) :
+		iv(_iv), empty(!(iv.first <= iv.second)) { }
+
+	bool contains(std::complex<T> v) const { return iv.contains(v); }
+
+	NdvInterval iv;
+	bool empty;
+};
+
+template <typename T>
+static inline bool value_isnan(T v) { return v != v; }
+
+template <typename T>
+static inline bool value_isnan(std::complex<T> v) {
+	return value_isnan(v.real()) || value_isnan(v.imag());
+}
+
+template <typename T>
+static void mask_nan(const void *in, uint8_t *mask, size_t n) {
+	// integers can't be NaN
+	if(std::numeric_limits<T>::is_integer) return;
+	const T *p = reinterpret_cast<const T *>(in);
+	for(size_t i=0; i<n; i++) mask[i] |= value_isnan(p[i]);
+}
+
+template <typename T>
+static void mask_interval(
+	const NdvInterval &interval, const void *in, uint8_t *mask, size_t n, MaskOp op
+) {
+	const TypedInterval<T> ti(interval);
+	if(ti.empty) {
+		if(op != MASK_OR) memset(mask, 0, n);
+		return;
+	}
+	const T *p = reinterpret_cast<const T *>(in);
+	switch(op) {
+		case MASK_SET: for(size_t i=0; i<n; i++) mask[i]  = ti.contains(p[i]); break;
+		case MASK_AND: for(size_t i=0; i<n; i++) mask[i] &= ti.contains(p[i]); break;
+		case MASK_OR:  for(size_t i=0; i<n; i++) mask[i] |= ti.contains(p[i]); break;
+	}
+}
+
+struct BandKernels {
+	void (*nan)(const void *, uint8_t *, size_t);
+	void (*interval)(const NdvInterval &, const void *, uint8_t *, size_t, MaskOp);
+	bool can_be_nan;
+};
+
+template <typename T>
+static bool get_band_kernels(BandKernels *k) {
+	k->nan = mask_nan<T>;
+	k->interval = mask_interval<T>;
+	k->can_be_nan = !std::numeric_limits<T>::is_integer;
+	return true;
+}
+
 void NdvDef::getNdvMask(
 	const std::vector<const void *> &bands,
 	const std::vector<GDALDataType> &dt_list,
 	uint8_t *mask_out, size_t num_pixels
 ) const {
 	assert(bands.size() == dt_list.size());
+	const size_t num_bands = bands.size();
+
 	// use uint8_t to allow incrementing the pointer by bytes
 	std::vector<const uint8_t *> in_p;
 	std::vector<size_t> dt_sizes;
-	for(size_t i=0; i<bands.size(); i++) {
+	std::vector<BandKernels> kernels(num_bands);
+	for(size_t i=0; i<num_bands; i++) {
 		in_p.push_back(reinterpret_cast<const uint8_t *>(bands[i]));
 		dt_sizes.push_back(GDALGetDataTypeSize(dt_list[i]) / 8);
+		DANGDAL_RUNTIME_TEMPLATE(dt_list[i], get_band_kernels, &kernels[i]);
 	}
 
 	BOOST_FOREACH(const NdvSlab &slab, slabs) {
 		size_t num_intervals = slab.range_by_band.size();
-		assert(num_intervals == bands.size() || num_intervals == 1);
+		assert(num_intervals == num_bands || num_intervals == 1);
 	}
 
+	const size_t chunk_size = 4096;
+	std::vector<uint8_t> slab_match(num_bands > 1 ? std::min(chunk_size, num_pixels) : 0);
+
 	memset(mask_out, 0, num_pixels);
-	for(size_t pix_idx=0; pix_idx<num_pixels; pix_idx++) {
-		mask_out[pix_idx] = 0;
+	for(size_t chunk_start=0; chunk_start<num_pixels; chunk_start+=chunk_size) {
+		size_t n = std::min(chunk_size, num_pixels - chunk_start);
+		uint8_t *mask = mask_out + chunk_start;
+
+		std::vector<const uint8_t *> chunk_p(num_bands);
+		for(size_t i=0; i<num_bands; i++) {
+			chunk_p[i] = in_p[i] + chunk_start * dt_sizes[i];
+		}
 
 		// A NaN value on any band makes this pixel NDV.
-		for(size_t i=0; i<bands.size(); i++) {
-			if(gdal_scalar_pointer_isnan(in_p[i], dt_list[i])) {
-				mask_out[pix_idx] = 1;
-			}
+		for(size_t i=0; i<num_bands; i++) {
+			if(kernels[i].can_be_nan) kernels[i].nan(chunk_p[i], mask, n);
 		}
 
 		BOOST_FOREACH(const NdvSlab &slab, slabs) {
-			bool all_match = true;
-			for(size_t i=0; i<bands.size(); i++) {
-				size_t num_intervals = slab.range_by_band.size();
+			size_t num_intervals = slab.range_by_band.size();
+			if(num_bands == 0) {
+				memset(mask, 1, n);
+				continue;
+			}
+			if(num_bands == 1) {
+				// the common case, no need to combine bands
+				kernels[0].interval(slab.range_by_band[0], chunk_p[0], mask, n, MASK_OR);
+				continue;
+			}
+			for(size_t i=0; i<num_bands; i++) {
 				// if only one interval is given, use it for all bands
 				size_t j = num_intervals==1 ? 0 : i;
-				all_match &= slab.range_by_band[j].contains(in_p[i], dt_list[i]);
+				kernels[i].interval(slab.range_by_band[j], chunk_p[i], &slab_match[0], n,
+					i ? MASK_AND : MASK_SET);
 			}
-			mask_out[pix_idx] |= all_match;
+			for(size_t k=0; k<n; k++) mask[k] |= slab_match[k];
 		}
 
 		if(invert) {
-			mask_out[pix_idx] = mask_out[pix_idx] ? 0 : 1;
-		}
-
-		for(size_t band_idx=0; band_idx<bands.size(); band_idx++) {
-			in_p[band_idx] += dt_sizes[band_idx];
+			for(size_t k=0; k<n; k++) mask[k] ^= 1;
 		}
 	}
 }
@@ -74,6 +74,9 @@ class NdvDef {
 public:
 	static void printUsage();
 	explicit NdvDef(std::vector<std::string> &arg_list);
+	// The same as giving each of 'ranges' with the -ndv option (or with -valid-range if
+	// is_valid_range is set), for use without a command line.
+	NdvDef(const std::vector<std::string> &ranges, bool is_valid_range);
 	NdvDef(const GDALDatasetH ds, const std::vector<size_t> &bandlist);
 	void debugPrint() const;
 	bool empty() const { return slabs.empty(); }
@@ -0,0 +1,221 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/tokenizer.hpp>
+
+#include "common.h"
+#include "overview_builder.h"
+
+namespace dangdal {
+
+void OverviewBuilder::printUsage() {
+	printf(
+"Overviews:\n"
+"  -overviews 2,4,8,...               Build these overview levels while the output\n"
+"                                     is written, rather than running gdaladdo after\n"
+"  -overview-resampling average|nearest\n"
+"                                     How to compute the overviews (default is average)\n"
+	);
+}
+
+std::vector<int> OverviewBuilder::parseLevels(const std::string &s) {
+	std::vector<int> levels;
+	boost::char_separator<char> sep(",");
+	typedef boost::tokenizer<boost::char_separator<char> > toker;
+	toker tok(s, sep);
+	for(toker::iterator p=tok.begin(); p!=tok.end(); ++p) {
+		int level;
+		try {
+			level = boost::lexical_cast<int>(*p);
+		} catch(boost::bad_lexical_cast &e) {
+			fatal_error("could not parse overview level [%s]", p->c_str());
+		}
+		if(level < 2) fatal_error("overview levels must be at least 2");
+		levels.push_back(level);
+	}
+	if(levels.empty()) fatal_error("could not parse overview levels [%s]", s.c_str());
+	std::sort(levels.begin(), levels.end());
+	levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+	return levels;
+}
+
+bool OverviewBuilder::parseResampling(const std::string &s, bool *average) {
+	if(s == "average") {
+		*average = true;
+	} else if(s == "nearest") {
+		*average = false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+OverviewBuilder::OverviewBuilder(
+	GDALDatasetH ds, const std::vector<int> &factors,
+	bool _average, int _ndv_val
+) :
+	average(_average),
+	ndv_val(_ndv_val),
+	num_levels(factors.size())
+{
+	w = GDALGetRasterXSize(ds);
+	h = GDALGetRasterYSize(ds);
+	size_t num_bands = GDALGetRasterCount(ds);
+
+	// Resampling NONE just makes empty overviews, which are filled in below.
+	std::vector<int> factors_copy(factors);
+	CPLErr err = GDALBuildOverviews(ds, "NONE", int(factors_copy.size()), &factors_copy[0],
+		0, NULL, NULL, NULL);
+	if(err != CE_None) fatal_error("could not create overviews");
+
+	size_t max_w = 0;
+	for(size_t band_idx=0; band_idx<num_bands; band_idx++) {
+		GDALRasterBandH band = GDALGetRasterBand(ds, band_idx+1);
+		if(GDALGetRasterDataType(band) != GDT_Byte) {
+			fatal_error("overviews can only be built for 8-bit output");
+		}
+		for(size_t i=0; i<factors.size(); i++) {
+			Level l;
+			l.factor = factors[i];
+			l.w = (w + l.factor - 1) / l.factor;
+			l.h = (h + l.factor - 1) / l.factor;
+			l.band = NULL;
+			// GDAL doesn't say which overview got which level, but it goes by size.
+			for(int j=0; j<GDALGetOverviewCount(band); j++) {
+				GDALRasterBandH ov = GDALGetOverview(band, j);
+				if(
+					size_t(GDALGetRasterBandXSize(ov)) == l.w &&
+					size_t(GDALGetRasterBandYSize(ov)) == l.h
+				) {
+					l.band = ov;
+				}
+			}
+			if(!l.band) fatal_error("could not find overview level %d", l.factor);
+			l.row0 = 0;
+			levels.push_back(l);
+			max_w = std::max(max_w, l.w);
+		}
+	}
+	row_buf.resize(max_w);
+}
+
+OverviewBuilder::Row &OverviewBuilder::get_row(Level &l, size_t row) {
+	if(row < l.row0) fatal_error("overview row was written twice");
+	while(l.rows.size() <= row - l.row0) {
+		l.rows.push_back(Row());
+		Row &r = l.rows.back();
+		r.sum.assign(l.w, 0);
+		r.count.assign(l.w, 0);
+		r.pixels_seen = 0;
+	}
+	return l.rows[row - l.row0];
+}
+
+void OverviewBuilder::add_block(
+	size_t band_idx, size_t x0, size_t y0, size_t bw, size_t bh,
+	const uint8_t *buf, size_t stride
+) {
+	for(size_t level_idx=0; level_idx<num_levels; level_idx++) {
+		Level &l = levels[band_idx * num_levels + level_idx];
+		const size_t f = l.factor;
+		for(size_t j=0; j<bh; j++) {
+			size_t y = y0 + j;
+			size_t oy = y / f;
+			Row &r = get_row(l, oy);
+			const uint8_t *p = buf + j*stride;
+			if(average) {
+				size_t ox = x0 / f;
+				size_t k = x0 % f;
+				for(size_t i=0; i<bw; i++) {
+					uint8_t v = p[i];
+					if(ndv_val < 0 || v != ndv_val) {
+						r.sum[ox] += v;
+						r.count[ox]++;
+					}
+					if(++k == f) {
+						k = 0;
+						ox++;
+					}
+				}
+			} else {
+				size_t center_y = std::min(oy*f + f/2, h-1);
+				if(y == center_y) {
+					for(size_t ox=x0/f; ox*f<x0+bw; ox++) {
+						size_t center_x = std::min(ox*f + f/2, w-1);
+						if(center_x >= x0 && center_x < x0+bw) {
+							r.sum[ox] = p[center_x - x0];
+						}
+					}
+				}
+			}
+			r.pixels_seen += bw;
+		}
+		flush_rows(l);
+	}
+}
+
+void OverviewBuilder::flush_rows(Level &l) {
+	const size_t f = l.factor;
+	while(!l.rows.empty()) {
+		Row &r = l.rows.front();
+		size_t expected = w * (std::min((l.row0+1)*f, h) - l.row0*f);
+		if(r.pixels_seen < expected) break;
+		if(r.pixels_seen > expected) fatal_error("overview row was written twice");
+
+		for(size_t i=0; i<l.w; i++) {
+			if(!average) {
+				row_buf[i] = uint8_t(r.sum[i]);
+			} else if(r.count[i]) {
+				row_buf[i] = uint8_t((r.sum[i] + r.count[i]/2) / r.count[i]);
+			} else {
+				row_buf[i] = uint8_t(ndv_val);
+			}
+		}
+		CPLErr err = GDALRasterIO(l.band, GF_Write, 0, l.row0, l.w, 1,
+			&row_buf[0], l.w, 1, GDT_Byte, 0, 0);
+		if(err != CE_None) fatal_error("could not write overview");
+
+		l.rows.pop_front();
+		l.row0++;
+	}
+}
+
+void OverviewBuilder::finish() {
+	for(size_t i=0; i<levels.size(); i++) {
+		if(levels[i].row0 != levels[i].h) fatal_error("overview was not complete");
+	}
+}
+
+} // namespace dangdal
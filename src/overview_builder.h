@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+
+
+
+#ifndef DANGDAL_OVERVIEW_BUILDER_H
+#define DANGDAL_OVERVIEW_BUILDER_H
+
+#include <vector>
+#include <deque>
+#include <string>
+
+#include <gdal.h>
+
+#include "common.h"
+
+namespace dangdal {
+
+// Builds the overviews of an 8-bit output while it is being written, so that
+// it doesn't have to be read back afterwards (as gdaladdo would do).  Each
+// window of output is passed to add_block() as it is written, and each
+// overview row is written as soon as all of the pixels under it have been
+// seen.  Windows can come in any order, but only the overview rows that are
+// not yet complete are kept in memory, so for row-major order this is a strip
+// of each level.
+class OverviewBuilder {
+public:
+	static void printUsage();
+	// Parses a list like "2,4,8".
+	static std::vector<int> parseLevels(const std::string &s);
+	// Returns true and sets *average if s names a resampling method.
+	static bool parseResampling(const std::string &s, bool *average);
+
+	// Adds the given overview levels to the dataset.  With average, each
+	// overview pixel is the mean of the pixels under it, skipping ndv if one
+	// is given (ndv_val < 0 means none).  Otherwise the pixel nearest the
+	// center is used.
+	OverviewBuilder(GDALDatasetH ds, const std::vector<int> &levels,
+		bool average, int ndv_val);
+
+	// Adds a window of band band_idx (counting from zero), which starts at
+	// x0,y0 of the image.  Row j of the window starts at buf + j*stride.
+	void add_block(size_t band_idx, size_t x0, size_t y0, size_t bw, size_t bh,
+		const uint8_t *buf, size_t stride);
+
+	// Checks that the whole image was seen.
+	void finish();
+
+private:
+	struct Row {
+		std::vector<uint32_t> sum;
+		std::vector<uint32_t> count;
+		size_t pixels_seen;
+	};
+
+	struct Level {
+		int factor;
+		size_t w, h;
+		GDALRasterBandH band;
+		// rows row0, row0+1, ... which have not been written yet
+		size_t row0;
+		std::deque<Row> rows;
+	};
+
+	Row &get_row(Level &l, size_t row);
+	void flush_rows(Level &l);
+
+	size_t w, h;
+	bool average;
+	int ndv_val;
+	// levels for band 0, then for band 1, and so on
+	std::vector<Level> levels;
+	size_t num_levels;
+	std::vector<uint8_t> row_buf;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_OVERVIEW_BUILDER_H
@@ -26,6 +26,9 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <algorithm>
+#include <cstdlib>
+
 #include "common.h"
 #include "palette.h"
 #include "default_palette.h"
@@ -90,7 +93,81 @@ Palette Palette::createDefault() {
 	return fromLines(DEFAULT_PALETTE);
 }
 
-RGB Palette::get(double val) const {
+// The biggest table compile() will make.
+static const size_t PALETTE_TABLE_MAX_SIZE = 1 << 18;
+// How finely compile() divides the smallest step between palette values.
+static const double PALETTE_TABLE_STEPS_PER_GAP = 32;
+
+void Palette::compile(bool integer_vals) {
+	table.clear();
+	table_search.clear();
+
+	double lo = vals[0];
+	double hi = vals[vals.size()-1];
+	if(!(hi > lo)) return;
+
+	if(integer_vals && hi - lo < double(PALETTE_TABLE_MAX_SIZE - 2)) {
+		// one entry per value, which is exact
+		table_base = floor(lo);
+		table_scale = 1;
+		size_t size = size_t(ceil(hi) - table_base) + 1;
+		table.resize(size);
+		table_search.assign(size, 0);
+		for(size_t i=0; i<size; i++) {
+			table[i] = interpolate(table_base + double(i));
+		}
+		return;
+	}
+
+	// Space the entries so that no channel changes by more than one between
+	// them, except across a jump.  Then the nearest entry is within one half
+	// of the interpolated color before rounding, and within one after.  The
+	// entries around a jump use the slow path, so they are also kept to a
+	// small fraction of the gap between palette values.
+	double max_slope = 0;
+	double min_gap = hi - lo;
+	for(size_t i=0; i<vals.size()-1; i++) {
+		double dv = vals[i+1] - vals[i];
+		if(dv < 0) fatal_error("palette file out of sequence");
+		if(dv == 0) continue;
+		min_gap = std::min(min_gap, dv);
+		RGB c1 = colors[i];
+		RGB c2 = colors[i+1];
+		double dc = std::max(abs(int(c2.r) - int(c1.r)),
+			std::max(abs(int(c2.g) - int(c1.g)), abs(int(c2.b) - int(c1.b))));
+		max_slope = std::max(max_slope, dc / dv);
+	}
+	max_slope = std::max(max_slope, PALETTE_TABLE_STEPS_PER_GAP / min_gap);
+	double num_steps = ceil((hi - lo) * max_slope);
+	if(num_steps < 1) num_steps = 1;
+	if(num_steps > double(PALETTE_TABLE_MAX_SIZE - 1)) return;
+	size_t size = size_t(num_steps) + 1;
+
+	table_base = lo;
+	table_scale = num_steps / (hi - lo);
+	table.resize(size);
+	table_search.assign(size, 0);
+	for(size_t i=0; i<size; i++) {
+		table[i] = interpolate(lo + (hi - lo) * (double(i) / num_steps));
+	}
+	table[size-1] = interpolate(hi);
+
+	for(size_t i=0; i<vals.size()-1; i++) {
+		if(vals[i] != vals[i+1]) continue;
+		RGB c1 = colors[i];
+		RGB c2 = colors[i+1];
+		if(c1.r == c2.r && c1.g == c2.g && c1.b == c2.b) continue;
+		// the neighbors too, in case of rounding at the edge of an entry
+		size_t mid = size_t((vals[i] - lo) * table_scale + 0.5);
+		size_t from = mid ? mid-1 : 0;
+		size_t to = std::min(mid+1, size-1);
+		for(size_t j=from; j<=to; j++) table_search[j] = 1;
+	}
+}
+
+RGB Palette::interpolate(double val) const {
+	if(std::isnan(val)) return nan_color;
+
 	if(val < vals[0]) val = vals[0];
 	if(val > vals[vals.size()-1]) val = vals[vals.size()-1];
 
@@ -29,6 +29,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #ifndef DANGDAL_PALETTE_H
 #define DANGDAL_PALETTE_H
 
+#include <cmath>
 #include <string>
 #include <vector>
 
@@ -48,11 +49,43 @@ public:
 	static Palette fromFile(const std::string &fn);
 	static Palette createDefault();
 
-	RGB get(double val) const;
+	Palette() : table_base(0), table_scale(0) { }
+
+	// Precomputes a table of colors so that get() doesn't have to search the
+	// palette.  The colors are within one of what interpolate() gives.  If
+	// integer_vals is set, get() will only be passed whole numbers and the
+	// table gives exactly the same colors.  Nothing is done if the table
+	// would be too big.
+	void compile(bool integer_vals);
+	bool compiled() const { return !table.empty(); }
+
+	RGB get(double val) const {
+		if(table.empty() || std::isnan(val)) return interpolate(val);
+		double pos = (val - table_base) * table_scale + 0.5;
+		size_t idx;
+		if(pos <= 0) {
+			idx = 0;
+		} else if(pos >= double(table.size() - 1)) {
+			idx = table.size() - 1;
+		} else {
+			idx = size_t(pos);
+		}
+		// entries that straddle a jump in the palette need the slow path
+		if(table_search[idx]) return interpolate(val);
+		return table[idx];
+	}
+
+	RGB interpolate(double val) const;
 
 	RGB nan_color;
 	std::vector<double> vals;
 	std::vector<RGB> colors;
+
+private:
+	// entry i is the color of table_base + i / table_scale
+	std::vector<RGB> table;
+	std::vector<uint8_t> table_search;
+	double table_base, table_scale;
 };
 
 } // namespace dangdal
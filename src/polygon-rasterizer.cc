@@ -27,9 +27,13 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <algorithm>
+#include <climits>
+#include <map>
 #include <string>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 #include "common.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
@@ -38,11 +42,11 @@ static const double EPSILON = 1e-9;
 
 namespace dangdal {
 
-typedef std::vector<double> row_crossings_dbl_t;
-
-row_crossings_t crossings_dbl_to_int(const row_crossings_dbl_t &in) {
-	row_crossings_t out;
-	for(size_t i=0; i<in.size(); i+=2) {
+// Pairs of crossings are converted to the spans of pixels that lie entirely
+// between them.
+static void crossings_dbl_to_int(const std::vector<double> &in, row_crossings_t &out) {
+	out.clear();
+	for(size_t i=0; i+1<in.size(); i+=2) {
 		int from = (int)ceil(in[i] - EPSILON);
 		int to = (int)floor(in[i+1] + EPSILON);
 		if(to > from) {
@@ -50,115 +54,373 @@ row_crossings_t crossings_dbl_to_int(const row_crossings_dbl_t &in) {
 			out.push_back(to);
 		}
 	}
-	return out;
 }
 
-// This function returns a list of pixel ranges for each row.  The ranges
-// consist of pixels that are entirely contained within the polygon.  The
-// results will be slightly wrong for polygons whose vertices are not integers.
-std::vector<row_crossings_t> get_row_crossings(
-	const Mpoly &mpoly, int min_y, int num_rows
-) {
-	std::vector<row_crossings_dbl_t> rows_top(num_rows);
-	std::vector<row_crossings_dbl_t> rows_bot(num_rows);
-
+std::vector<PolyEdge> mpoly_edges(const Mpoly &mpoly) {
+	std::vector<PolyEdge> edges;
 	for(size_t i=0; i<mpoly.rings.size(); i++) {
 		const Ring &c = mpoly.rings[i];
 		size_t npts = c.pts.size();
 		for(size_t j=0; j<npts; j++) {
 			size_t j_plus1 = (j==npts-1) ? 0 : (j+1);
-			double x0 = c.pts[j].x;
-			double y0 = c.pts[j].y;
-			double x1 = c.pts[j_plus1].x;
-			double y1 = c.pts[j_plus1].y;
-			if(y0 == y1) continue;
-			if(y0 > y1) {
-				double tmp;
-				tmp=x0; x0=x1; x1=tmp; 
-				tmp=y0; y0=y1; y1=tmp; 
-			}
-			double alpha = (x1-x0) / (y1-y0);
-			int y0i = (int)round(y0);
-			int y1i = (int)round(y1);
-			for(int y=y0i; y<=y1i; y++) {
-				double x = x0 + ((double)y - y0)*alpha;
-
-				int row = y - min_y - 1;
-				if(y > y0i && row >= 0 && row < num_rows) {
-					row_crossings_dbl_t &r = rows_bot[row];
-					r.push_back(x);
-				}
-
-				row = y - min_y;
-				if(y < y1i && row >= 0 && row < num_rows) {
-					row_crossings_dbl_t &r = rows_top[row];
-					r.push_back(x);
-				}
+			PolyEdge e;
+			e.x0 = c.pts[j].x;
+			e.y0 = c.pts[j].y;
+			e.x1 = c.pts[j_plus1].x;
+			e.y1 = c.pts[j_plus1].y;
+			if(e.y0 == e.y1) continue;
+			if(e.y0 > e.y1) {
+				std::swap(e.x0, e.x1);
+				std::swap(e.y0, e.y1);
 			}
+			edges.push_back(e);
 		}
 	}
+	return edges;
+}
 
-	std::vector<row_crossings_t> rows_out(num_rows);
+void RowCrossingScanner::reset(const Mpoly &mpoly) {
+	edges.clear();
+	for(size_t i=0; i<mpoly.rings.size(); i++) {
+		add_ring(mpoly.rings[i]);
+	}
+	finish_reset();
+}
 
-	for(int row=0; row<num_rows; row++) {
-		std::sort(rows_top[row].begin(), rows_top[row].end());
-		std::sort(rows_bot[row].begin(), rows_bot[row].end());
-		row_crossings_t top = crossings_dbl_to_int(rows_top[row]);
-		row_crossings_t bot = crossings_dbl_to_int(rows_bot[row]);
-		if(top.size() && bot.size()) {
-			row_crossings_t c = crossings_intersection(top, bot);
-			std::swap(rows_out[row], c);
-		} else if(!top.empty()) {
-			std::swap(rows_out[row], top);
-		} else if(!bot.empty()) {
-			std::swap(rows_out[row], bot);
+void RowCrossingScanner::reset(const Ring &ring) {
+	edges.clear();
+	add_ring(ring);
+	finish_reset();
+}
+
+void RowCrossingScanner::reset(const std::vector<PolyEdge> &in_edges) {
+	edges.clear();
+	for(size_t i=0; i<in_edges.size(); i++) {
+		const PolyEdge &e = in_edges[i];
+		add_edge(e.x0, e.y0, e.x1, e.y1);
+	}
+	finish_reset();
+}
+
+void RowCrossingScanner::add_ring(const Ring &c) {
+	size_t npts = c.pts.size();
+	for(size_t j=0; j<npts; j++) {
+		size_t j_plus1 = (j==npts-1) ? 0 : (j+1);
+		add_edge(c.pts[j].x, c.pts[j].y, c.pts[j_plus1].x, c.pts[j_plus1].y);
+	}
+}
+
+void RowCrossingScanner::add_edge(double x0, double y0, double x1, double y1) {
+	if(y0 == y1) return;
+	if(y0 > y1) {
+		std::swap(x0, x1);
+		std::swap(y0, y1);
+	}
+	ScanEdge e;
+	e.x0 = x0;
+	e.y0 = y0;
+	e.alpha = (x1-x0) / (y1-y0);
+	e.y0i = (int)round(y0);
+	e.y1i = (int)round(y1);
+	// edges that don't span a whole row never give crossings
+	if(e.y1i > e.y0i) edges.push_back(e);
+}
+
+void RowCrossingScanner::finish_reset() {
+	std::sort(edges.begin(), edges.end());
+	next_edge = 0;
+	active.clear();
+	have_prev_y = false;
+	first_row = INT_MAX;
+	last_row = INT_MIN;
+	for(size_t i=0; i<edges.size(); i++) {
+		first_row = std::min(first_row, edges[i].y0i);
+		last_row = std::max(last_row, edges[i].y1i - 1);
+	}
+}
+
+// Row y gets the crossings of y on its top edge and of y+1 on its bottom edge.  The
+// pixels that are between a pair of crossings on both edges are inside the polygon.
+const row_crossings_t &RowCrossingScanner::row(int y) {
+	assert(!have_prev_y || y > prev_y);
+	have_prev_y = true;
+	prev_y = y;
+
+	// retire edges that end above this row
+	for(size_t i=0; i<active.size(); ) {
+		if(active[i].y1i <= y) {
+			active[i] = active.back();
+			active.pop_back();
 		} else {
-			// no-op: leave rows_out[row] empty
+			i++;
 		}
 	}
+	// and pick up the ones that start here (or that were skipped over)
+	while(next_edge < edges.size() && edges[next_edge].y0i <= y) {
+		if(edges[next_edge].y1i > y) active.push_back(edges[next_edge]);
+		next_edge++;
+	}
 
+	top_x.clear();
+	bot_x.clear();
+	for(size_t i=0; i<active.size(); i++) {
+		const ScanEdge &e = active[i];
+		top_x.push_back(e.x0 + ((double)y     - e.y0)*e.alpha);
+		bot_x.push_back(e.x0 + ((double)(y+1) - e.y0)*e.alpha);
+	}
+	std::sort(top_x.begin(), top_x.end());
+	std::sort(bot_x.begin(), bot_x.end());
+	crossings_dbl_to_int(top_x, top_i);
+	crossings_dbl_to_int(bot_x, bot_i);
+
+	if(top_i.size() && bot_i.size()) {
+		crossings_intersection(top_i, bot_i, out);
+	} else if(!top_i.empty()) {
+		out.swap(top_i);
+	} else {
+		out.swap(bot_i);
+	}
+	return out;
+}
+
+// This function returns a list of pixel ranges for each row.  The ranges
+// consist of pixels that are entirely contained within the polygon.  The
+// results will be slightly wrong for polygons whose vertices are not integers.
+std::vector<row_crossings_t> get_row_crossings(
+	const Mpoly &mpoly, int min_y, int num_rows
+) {
+	RowCrossingScanner scanner(mpoly);
+	std::vector<row_crossings_t> rows_out(num_rows);
+	for(int row=0; row<num_rows; row++) {
+		rows_out[row] = scanner.row(min_y + row);
+	}
 	return rows_out;
 }
 
-void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, const std::string &fn) {
-	printf("mask draw: begin\n");
+std::vector<row_crossings_t> get_row_crossings(
+	const std::vector<PolyEdge> &edges, int min_y, int num_rows
+) {
+	RowCrossingScanner scanner;
+	scanner.reset(edges);
+	std::vector<row_crossings_t> rows_out(num_rows);
+	for(int row=0; row<num_rows; row++) {
+		rows_out[row] = scanner.row(min_y + row);
+	}
+	return rows_out;
+}
 
-	std::vector<row_crossings_t> rows = get_row_crossings(mpoly, 0, h);
+void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, const std::string &fn) {
+	report_message("mask draw: begin\n");
 
-	printf("mask draw: write\n");
+	RowCrossingScanner scanner(mpoly);
 
 	FILE *fout = fopen(fn.c_str(), "wb");
 	if(!fout) fatal_error("cannot open mask output");
 	fprintf(fout, "P4\n%zd %zd\n", w, h);
-	std::vector<uint8_t> buf((w+7)/8);
+	const size_t row_bytes = (w+7)/8;
+	std::vector<uint8_t> buf(row_bytes);
 	for(size_t y=0; y<h; y++) {
-		buf.assign((w+7)/8, 0);
-		uint8_t *p = &buf[0];
-		uint8_t bitp = 128;
-		const row_crossings_t &r = rows[y];
-		for(size_t i=0; i<w; i++) {
-			uint8_t v = 1;
-			// not the fastest way...
-			for(size_t j=0; j<r.size(); j++) {
-				if(double(i) >= r[j]) v = !v;
-			}
-			if(v) *p |= bitp;
-			bitp >>= 1;
-			if(!bitp) {
-				p++;
-				bitp = 128;
+		// start out all black (outside), with the bits past the end of the row cleared
+		buf.assign(row_bytes, 0xff);
+		if(w % 8) buf[row_bytes-1] = uint8_t(0xff << (8 - w % 8));
+		const row_crossings_t &r = scanner.row(y);
+		for(size_t i=0; i<r.size(); i+=2) {
+			int from = std::max(r[i], 0);
+			int to = std::min(r[i+1], int(w));
+			for(int x=from; x<to; x++) {
+				buf[x/8] &= ~uint8_t(0x80 >> (x % 8));
 			}
 		}
-		fwrite(&buf[0], (w+7)/8, 1, fout);
+		if(row_bytes) fwrite(&buf[0], row_bytes, 1, fout);
 	}
 	fclose(fout);
-	printf("mask draw: done\n");
+	report_message("mask draw: done\n");
+}
+
+namespace {
+
+// Rasterizes the polygon one row of tiles at a time, handing the rows out in order.
+// The tile rows are done by worker threads, ahead of the consumer.
+class TileRowRasterizer {
+public:
+	TileRowRasterizer(const Mpoly &mpoly, size_t _w, size_t _h, size_t _tile_h,
+		uint8_t _inside_val, size_t num_threads);
+	~TileRowRasterizer();
+
+	// The next row of tiles as a num_rows*w array, or NULL after the last one.  It is
+	// valid until the next call.
+	const uint8_t *next_tile_row(size_t *row0_out, size_t *num_rows_out);
+
+private:
+	// not copyable
+	TileRowRasterizer(const TileRowRasterizer &);
+	TileRowRasterizer &operator=(const TileRowRasterizer &);
+
+	void rasterize(size_t job, std::vector<uint8_t> &out) const;
+	void worker_main();
+
+	size_t w, h, tile_h;
+	uint8_t inside_val;
+	size_t num_jobs;
+	size_t next_out;
+	std::vector<uint8_t> current;
+	// the edges that touch each row of tiles
+	std::vector<std::vector<PolyEdge> > buckets;
+
+	// these are only used when there are worker threads
+	boost::thread_group threads;
+	boost::mutex mutex;
+	boost::condition_variable cond;
+	size_t next_job;
+	size_t max_in_flight;
+	std::map<size_t, std::vector<uint8_t> > finished;
+	bool stopping;
+};
+
+TileRowRasterizer::TileRowRasterizer(
+	const Mpoly &mpoly, size_t _w, size_t _h, size_t _tile_h,
+	uint8_t _inside_val, size_t num_threads
+) :
+	w(_w), h(_h), tile_h(_tile_h),
+	inside_val(_inside_val),
+	next_out(0),
+	next_job(0),
+	max_in_flight(num_threads * 2),
+	stopping(false)
+{
+	num_jobs = (h + tile_h - 1) / tile_h;
+	buckets.resize(num_jobs);
+
+	// An edge puts crossings on rows round(y0) through round(y1)-1 (see
+	// get_row_crossings).
+	std::vector<PolyEdge> edges = mpoly_edges(mpoly);
+	for(size_t i=0; i<edges.size(); i++) {
+		const PolyEdge &e = edges[i];
+		int lo = std::max((int)round(e.y0), 0);
+		int hi = std::min((int)round(e.y1) - 1, int(h) - 1);
+		if(hi < lo) continue;
+		for(size_t t=lo/tile_h; t<=hi/tile_h; t++) {
+			buckets[t].push_back(e);
+		}
+	}
+
+	if(num_threads <= 1) return;
+
+	for(size_t i=0; i<num_threads; i++) {
+		threads.add_thread(new boost::thread(&TileRowRasterizer::worker_main, this));
+	}
+}
+
+TileRowRasterizer::~TileRowRasterizer() {
+	{
+		boost::mutex::scoped_lock lock(mutex);
+		stopping = true;
+		cond.notify_all();
+	}
+	threads.join_all();
+}
+
+void TileRowRasterizer::rasterize(size_t job, std::vector<uint8_t> &out) const {
+	size_t row0 = job * tile_h;
+	size_t num_rows = std::min(tile_h, h - row0);
+	out.assign(w * num_rows, 0);
+
+	RowCrossingScanner scanner;
+	scanner.reset(buckets[job]);
+	for(size_t y=0; y<num_rows; y++) {
+		const row_crossings_t &r = scanner.row(row0 + y);
+		uint8_t *p = &out[y * w];
+		for(size_t i=0; i<r.size(); i+=2) {
+			int from = std::max(r[i], 0);
+			int to = std::min(r[i+1], int(w));
+			if(to > from) std::fill(p + from, p + to, inside_val);
+		}
+	}
+}
+
+void TileRowRasterizer::worker_main() {
+	for(;;) {
+		size_t job;
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			// don't get too far ahead of the consumer
+			while(!stopping && next_job < num_jobs && next_job >= next_out + max_in_flight) {
+				cond.wait(lock);
+			}
+			if(stopping || next_job >= num_jobs) return;
+			job = next_job++;
+		}
+
+		std::vector<uint8_t> out;
+		rasterize(job, out);
+
+		boost::mutex::scoped_lock lock(mutex);
+		finished[job].swap(out);
+		cond.notify_all();
+	}
+}
+
+const uint8_t *TileRowRasterizer::next_tile_row(size_t *row0_out, size_t *num_rows_out) {
+	if(next_out == num_jobs) return NULL;
+	size_t job = next_out;
+	*row0_out = job * tile_h;
+	*num_rows_out = std::min(tile_h, h - *row0_out);
+
+	if(threads.size() == 0) {
+		rasterize(job, current);
+		next_out++;
+		return &current[0];
+	}
+
+	boost::mutex::scoped_lock lock(mutex);
+	std::map<size_t, std::vector<uint8_t> >::iterator it;
+	while((it = finished.find(job)) == finished.end()) cond.wait(lock);
+	current.swap(it->second);
+	finished.erase(it);
+	next_out++;
+	cond.notify_all();
+	return &current[0];
+}
+
+} // anonymous namespace
+
+void mask_from_mpoly_to_band(const Mpoly &mpoly, GDALRasterBandH band,
+	uint8_t inside_val, size_t num_threads
+) {
+	size_t w = GDALGetRasterBandXSize(band);
+	size_t h = GDALGetRasterBandYSize(band);
+	int block_w, block_h;
+	GDALGetBlockSize(band, &block_w, &block_h);
+	if(block_h < 1) block_h = 1;
+
+	report_message("mask draw: begin\n");
+
+	TileRowRasterizer rasterizer(mpoly, w, h, block_h, inside_val, num_threads);
+	size_t row0, num_rows;
+	const uint8_t *buf;
+	while((buf = rasterizer.next_tile_row(&row0, &num_rows))) {
+		report_progress(double(row0) / h);
+		if(GDALRasterIO(band, GF_Write, 0, row0, w, num_rows,
+			const_cast<uint8_t *>(buf), w, num_rows, GDT_Byte, 0, 0) != CE_None
+		) fatal_error("could not write mask output");
+	}
+	report_progress(1);
+
+	report_message("mask draw: done\n");
 }
 
 row_crossings_t crossings_intersection(
 	const row_crossings_t &in1, const row_crossings_t &in2
 ) {
 	row_crossings_t out;
+	crossings_intersection(in1, in2, out);
+	return out;
+}
+
+void crossings_intersection(
+	const row_crossings_t &in1, const row_crossings_t &in2, row_crossings_t &out
+) {
+	out.clear();
 	size_t n1 = in1.size();
 	size_t n2 = in2.size();
 	size_t p1=0, p2=0;
@@ -194,7 +456,6 @@ row_crossings_t crossings_intersection(
 		out.push_back(open);
 		out.push_back(close);
 	}
-	return out;
 }
 
 } // namespace dangdal
@@ -39,14 +39,85 @@ namespace dangdal {
 
 typedef std::vector<int> row_crossings_t;
 
+// A non-horizontal polygon edge, oriented so that y0 < y1.
+struct PolyEdge {
+	double x0, y0, x1, y1;
+};
+
+// The non-horizontal edges of all rings of the polygon.
+std::vector<PolyEdge> mpoly_edges(const Mpoly &mpoly);
+
+// Gives the crossings of a polygon one row at a time, from top to bottom.  The rows are
+// the same as those returned by get_row_crossings.  The edges are kept sorted by their
+// first row, and each row only looks at the edges that cross it (the active edges).
+// Buffers are reused from one row to the next, and from one polygon to the next after
+// reset(), so rows are produced without allocating memory.
+class RowCrossingScanner {
+public:
+	RowCrossingScanner() { reset(std::vector<PolyEdge>()); }
+	explicit RowCrossingScanner(const Mpoly &mpoly) { reset(mpoly); }
+
+	// Start over with a different polygon.
+	void reset(const Mpoly &mpoly);
+	void reset(const Ring &ring);
+	void reset(const std::vector<PolyEdge> &edges);
+
+	// The range of rows that can have crossings.  min_row() > max_row() if there are none.
+	int min_row() const { return first_row; }
+	int max_row() const { return last_row; }
+
+	// Crossings of row y, as from,to pairs.  Rows must be requested in increasing order,
+	// but may be skipped.  The result is valid until the next call.
+	const row_crossings_t &row(int y);
+
+private:
+	struct ScanEdge {
+		double x0, y0, alpha;
+		int y0i, y1i; // the edge puts crossings on rows y0i .. y1i-1
+		bool operator<(const ScanEdge &other) const { return y0i < other.y0i; }
+	};
+
+	void add_ring(const Ring &ring);
+	void add_edge(double x0, double y0, double x1, double y1);
+	void finish_reset();
+
+	// sorted by y0i
+	std::vector<ScanEdge> edges;
+	size_t next_edge;
+	std::vector<ScanEdge> active;
+	int first_row, last_row;
+	int prev_y;
+	bool have_prev_y;
+
+	std::vector<double> top_x, bot_x;
+	row_crossings_t top_i, bot_i, out;
+};
+
 std::vector<row_crossings_t> get_row_crossings(const Mpoly &mpoly, int min_y, int num_rows);
 
+// Same as above, for a subset of the edges of a polygon.  All edges that touch rows
+// min_y .. min_y+num_rows-1 must be given, others are ignored.
+std::vector<row_crossings_t> get_row_crossings(
+	const std::vector<PolyEdge> &edges, int min_y, int num_rows);
+
 void mask_from_mpoly(const Mpoly &mpoly, size_t w, size_t h, const std::string &fn);
 
+// Rasterizes the polygon into a Byte raster band, writing inside_val for pixels inside
+// and zero elsewhere.  The edges are bucketed by rows of blocks, and each row of blocks
+// is rasterized from just the edges that cross it, using num_threads threads.  Only a
+// few rows of blocks are held in memory at a time.
+void mask_from_mpoly_to_band(const Mpoly &mpoly, GDALRasterBandH band,
+	uint8_t inside_val, size_t num_threads);
+
 row_crossings_t crossings_intersection(
 	const row_crossings_t &in1, const row_crossings_t &in2
 );
 
+// Same as above, but puts the result in 'out', reusing its storage.
+void crossings_intersection(
+	const row_crossings_t &in1, const row_crossings_t &in2, row_crossings_t &out
+);
+
 } // namespace dangdal
 
 #endif // ifndef DANGDAL_POLYGON_RASTERIZER_H
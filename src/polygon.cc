@@ -27,6 +27,10 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 #include <string>
+#include <set>
+#include <cstdio>
+#include <cstring>
+#include <climits>
 
 #include "common.h"
 #include "polygon.h"
@@ -155,7 +159,221 @@ OGRGeometryH mpoly_to_ogr(const Mpoly &mpoly_in) {
 	return geom_out;
 }
 
-Mpoly ogr_to_mpoly(OGRGeometryH geom_in) {
+// Lists the holes of each outer ring, in the order mpoly_to_ogr emits them.
+static size_t group_holes(const Mpoly &mpoly, std::vector<std::vector<size_t> > &holes) {
+	const size_t num_rings = mpoly.rings.size();
+	holes.assign(num_rings, std::vector<size_t>());
+	size_t num_outer = 0;
+	for(size_t i=0; i<num_rings; i++) {
+		const Ring &ring = mpoly.rings[i];
+		if(ring.is_hole) {
+			if(ring.parent_id < 0 || size_t(ring.parent_id) >= num_rings ||
+				mpoly.rings[ring.parent_id].is_hole
+			) fatal_error("could not sort out holes");
+			holes[ring.parent_id].push_back(i);
+		} else {
+			num_outer++;
+		}
+	}
+	return num_outer;
+}
+
+// Compatibility mode: the same formatting as OGRFormatDouble, so that the
+// output is byte for byte what OGR_G_ExportToWkt gave in earlier versions
+// (and what the test goldens hold).  Fixed point with 15 decimals, with
+// trailing zeros trimmed.  A tail that looks like roundoff noise (...00001x)
+// is dropped, and one like ...99999x causes a retry with 9 decimals.  This
+// is lossy; see format_wkt_double_exact.
+static void format_wkt_double_ogr(char *buf, size_t buf_len, double val) {
+	bool truncated = false;
+	int precision = 15;
+	for(;;) {
+		snprintf(buf, buf_len, "%.*f", precision, val);
+		int i = 0;
+		int count_before_dot = 0;
+		int dot_pos = -1;
+		for(; buf[i]; i++) {
+			if(buf[i] == '.') dot_pos = i;
+			else if(dot_pos < 0 && buf[i] != '-') count_before_dot++;
+		}
+
+		if(i > 10 && dot_pos >= 0) {
+			if(!strncmp(buf+i-6, "00000", 5)) {
+				buf[--i] = 0;
+			} else if(i - 8 > dot_pos &&
+				(count_before_dot >= 4 || buf[i-3] == '0') &&
+				(count_before_dot >= 5 || buf[i-4] == '0') &&
+				(count_before_dot >= 6 || buf[i-5] == '0') &&
+				(count_before_dot >= 7 || buf[i-6] == '0') &&
+				(count_before_dot >= 8 || buf[i-7] == '0') &&
+				buf[i-8] == '0' && buf[i-9] == '0'
+			) {
+				i -= 8;
+				buf[i] = 0;
+			}
+		}
+
+		while(i > 2 && buf[i-1] == '0' && buf[i-2] != '.') {
+			buf[--i] = 0;
+		}
+
+		if(!truncated && i > 10 && dot_pos >= 0 && (
+			!strncmp(buf+i-6, "99999", 5) || (i - 9 > dot_pos &&
+				(count_before_dot >= 4 || buf[i-3] == '9') &&
+				(count_before_dot >= 5 || buf[i-4] == '9') &&
+				(count_before_dot >= 6 || buf[i-5] == '9') &&
+				(count_before_dot >= 7 || buf[i-6] == '9') &&
+				(count_before_dot >= 8 || buf[i-7] == '9') &&
+				buf[i-8] == '9' && buf[i-9] == '9')
+		)) {
+			precision = 9;
+			truncated = true;
+			continue;
+		}
+		return;
+	}
+}
+
+// The shortest of %.15g, %.16g and %.17g that reads back as the same double.
+static void format_wkt_double_exact(char *buf, size_t buf_len, double val) {
+	for(int precision=15; precision<17; precision++) {
+		snprintf(buf, buf_len, "%.*g", precision, val);
+		if(strtod(buf, NULL) == val) return;
+	}
+	snprintf(buf, buf_len, "%.17g", val);
+}
+
+static void write_wkt_ring(const Ring &ring, bool exact_floats, FILE *fh) {
+	fputc('(', fh);
+	const size_t npts = ring.pts.size();
+	for(size_t i=0; i<npts+1; i++) {
+		const Vertex &v = ring.pts[i==npts ? 0 : i];
+		char buf[128];
+		if(
+			v.x >= INT_MIN && v.x <= INT_MAX && v.x == int(v.x) &&
+			v.y >= INT_MIN && v.y <= INT_MAX && v.y == int(v.y)
+		) {
+			snprintf(buf, sizeof(buf), "%d %d", int(v.x), int(v.y));
+		} else {
+			char bx[64], by[64];
+			if(exact_floats) {
+				format_wkt_double_exact(bx, sizeof(bx), v.x);
+				format_wkt_double_exact(by, sizeof(by), v.y);
+			} else {
+				format_wkt_double_ogr(bx, sizeof(bx), v.x);
+				format_wkt_double_ogr(by, sizeof(by), v.y);
+			}
+			snprintf(buf, sizeof(buf), "%s %s", bx, by);
+		}
+		if(i) fputc(',', fh);
+		fputs(buf, fh);
+	}
+	fputc(')', fh);
+}
+
+static void write_wkt_poly(
+	const Mpoly &mpoly, size_t outer_idx,
+	const std::vector<size_t> &holes, bool exact_floats, FILE *fh
+) {
+	fputc('(', fh);
+	write_wkt_ring(mpoly.rings[outer_idx], exact_floats, fh);
+	for(size_t i=0; i<holes.size(); i++) {
+		fputc(',', fh);
+		write_wkt_ring(mpoly.rings[holes[i]], exact_floats, fh);
+	}
+	fputc(')', fh);
+}
+
+void mpoly_write_wkt(const Mpoly &mpoly, FILE *fh, bool exact_floats) {
+	std::vector<std::vector<size_t> > holes;
+	const size_t num_outer = group_holes(mpoly, holes);
+	const bool use_multi = num_outer > 1;
+
+	if(!num_outer) {
+		fputs("POLYGON EMPTY\n", fh);
+		return;
+	}
+
+	fputs(use_multi ? "MULTIPOLYGON (" : "POLYGON ", fh);
+	bool first = true;
+	for(size_t i=0; i<mpoly.rings.size(); i++) {
+		if(mpoly.rings[i].is_hole) continue;
+		if(!first) fputc(',', fh);
+		first = false;
+		write_wkt_poly(mpoly, i, holes[i], exact_floats, fh);
+	}
+	if(use_multi) fputc(')', fh);
+	fputc('\n', fh);
+}
+
+static bool host_is_little_endian() {
+	const uint16_t one = 1;
+	return *reinterpret_cast<const uint8_t *>(&one) == 1;
+}
+
+static void write_wkb_bytes(const void *p, size_t n, bool swap, FILE *fh) {
+	const uint8_t *bytes = static_cast<const uint8_t *>(p);
+	if(swap) {
+		uint8_t tmp[8];
+		for(size_t i=0; i<n; i++) tmp[i] = bytes[n-1-i];
+		fwrite(tmp, n, 1, fh);
+	} else {
+		fwrite(bytes, n, 1, fh);
+	}
+}
+
+static void write_wkb_uint32(uint32_t val, bool swap, FILE *fh) {
+	write_wkb_bytes(&val, 4, swap, fh);
+}
+
+static void write_wkb_poly(
+	const Mpoly &mpoly, size_t outer_idx, const std::vector<size_t> &holes,
+	uint8_t order_byte, bool swap, FILE *fh
+) {
+	fputc(order_byte, fh);
+	write_wkb_uint32(wkbPolygon, swap, fh);
+	write_wkb_uint32(uint32_t(holes.size() + 1), swap, fh);
+	for(size_t r=0; r<holes.size()+1; r++) {
+		const Ring &ring = mpoly.rings[r ? holes[r-1] : outer_idx];
+		const size_t npts = ring.pts.size();
+		write_wkb_uint32(uint32_t(npts + 1), swap, fh);
+		for(size_t i=0; i<npts+1; i++) {
+			const Vertex &v = ring.pts[i==npts ? 0 : i];
+			write_wkb_bytes(&v.x, 8, swap, fh);
+			write_wkb_bytes(&v.y, 8, swap, fh);
+		}
+	}
+}
+
+void mpoly_write_wkb(const Mpoly &mpoly, FILE *fh, OGRwkbByteOrder byte_order) {
+	std::vector<std::vector<size_t> > holes;
+	const size_t num_outer = group_holes(mpoly, holes);
+	const bool use_multi = num_outer > 1;
+
+	const bool swap = (byte_order == wkbNDR) != host_is_little_endian();
+	const uint8_t order_byte = (byte_order == wkbNDR) ? 1 : 0;
+
+	if(!num_outer) {
+		fputc(order_byte, fh);
+		write_wkb_uint32(wkbPolygon, swap, fh);
+		write_wkb_uint32(0, swap, fh);
+		return;
+	}
+
+	if(use_multi) {
+		fputc(order_byte, fh);
+		write_wkb_uint32(wkbMultiPolygon, swap, fh);
+		write_wkb_uint32(uint32_t(num_outer), swap, fh);
+	}
+	for(size_t i=0; i<mpoly.rings.size(); i++) {
+		if(mpoly.rings[i].is_hole) continue;
+		write_wkb_poly(mpoly, i, holes[i], order_byte, swap, fh);
+	}
+}
+
+// The rings as OGR gives them: each polygon's first ring is outer and the rest are its
+// holes.
+static Mpoly ogr_to_mpoly_as_given(OGRGeometryH geom_in) {
 	OGRwkbGeometryType type = OGR_G_GetGeometryType(geom_in);
 	if(type == wkbPolygon) {
 		Mpoly mpoly_out;
@@ -177,7 +395,7 @@ Mpoly ogr_to_mpoly(OGRGeometryH geom_in) {
 		size_t total_rings = 0;
 		for(size_t i=0; i<num_geom; i++) {
 			OGRGeometryH g = OGR_G_GetGeometryRef(geom_in, i);
-			polys[i] = ogr_to_mpoly(g);
+			polys[i] = ogr_to_mpoly_as_given(g);
 			total_rings += polys[i].rings.size();
 		}
 		if(total_rings < 1) fatal_error("num_rings<1 in ogr_to_mpoly");
@@ -200,50 +418,61 @@ Mpoly ogr_to_mpoly(OGRGeometryH geom_in) {
 	}
 }
 
-std::vector<Mpoly> split_mpoly_to_polys(const Mpoly &mpoly_in) {
-	size_t num_rings_in = mpoly_in.rings.size();
+Mpoly ogr_to_mpoly(OGRGeometryH geom_in) {
+	Mpoly mpoly = ogr_to_mpoly_as_given(geom_in);
+	// Which rings are holes, and of which polygon, is as OGR gives it.  The nesting is
+	// only used to give an outer ring that lies within a hole of another polygon that
+	// hole as its parent, as trace_mask does.
+	const RingNesting nesting(mpoly);
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		Ring &ring = mpoly.rings[r_idx];
+		const int parent = nesting.parent_id[r_idx];
+		if(!ring.is_hole && parent >= 0 && mpoly.rings[parent].is_hole) {
+			ring.parent_id = parent;
+		}
+	}
+	return mpoly;
+}
 
-	std::vector<std::vector<int> > holes;
-	holes.resize(num_rings_in);
+std::vector<Mpoly> split_mpoly_to_polys(Mpoly &mpoly_in) {
+	size_t num_rings_in = mpoly_in.rings.size();
+	const RingHierarchy hier(mpoly_in);
 
 	size_t num_geom_out = 0;
 	for(size_t outer_idx=0; outer_idx<num_rings_in; outer_idx++) {
-		const Ring &ring = mpoly_in.rings[outer_idx];
-		if(ring.is_hole) {
-			int parent = ring.parent_id;
-			holes[parent].push_back(outer_idx);
-		} else {
-			num_geom_out++;
-		}
+		if(!mpoly_in.rings[outer_idx].is_hole) num_geom_out++;
 	}
 
 	std::vector<Mpoly> polys(num_geom_out);
 	size_t poly_out_idx = 0;
 
 	for(size_t outer_idx=0; outer_idx<num_rings_in; outer_idx++) {
-		const Ring &ring = mpoly_in.rings[outer_idx];
+		Ring &ring = mpoly_in.rings[outer_idx];
 		if(ring.is_hole) continue;
 
 		Mpoly &out_poly = polys[poly_out_idx];
-		out_poly.rings.resize(holes[outer_idx].size()+1);
-		size_t ring_out_idx = 0;
-
-		Ring dup_ring(ring);
-		dup_ring.parent_id = -1;
-		out_poly.rings[ring_out_idx++] = dup_ring;
-
-		for(size_t hole_idx=0; hole_idx<holes[outer_idx].size(); hole_idx++) {
-			const Ring &hole = mpoly_in.rings[holes[outer_idx][hole_idx]];
-			if(hole.parent_id != int(outer_idx)) fatal_error("could not sort out holes");
-
-			Ring dup_ring(hole);
-			dup_ring.parent_id = 0;
-			out_poly.rings[ring_out_idx++] = dup_ring;
+		const size_t num_children = hier.num_children(outer_idx);
+		out_poly.rings.reserve(num_children+1);
+
+		// Only the pts are moved, the loop above still needs is_hole of the
+		// input rings.
+		out_poly.rings.push_back(ring.copyMetadata());
+		out_poly.rings.back().pts.swap(ring.pts);
+		out_poly.rings.back().parent_id = -1;
+
+		for(size_t c=0; c<num_children; c++) {
+			Ring &hole = mpoly_in.rings[hier.child(outer_idx, c)];
+			if(!hole.is_hole) continue;
+
+			out_poly.rings.push_back(hole.copyMetadata());
+			out_poly.rings.back().pts.swap(hole.pts);
+			out_poly.rings.back().parent_id = 0;
 		}
 
 		poly_out_idx++;
 	}
 
+	mpoly_in.rings.clear();
 	return polys;
 }
 
@@ -430,10 +659,231 @@ bool Mpoly::component_contains(Vertex p, int outer_ring_id) const {
 	return true;
 }
 
+// Same crossing test as Ring::contains, for a single edge.
+static inline bool ray_crosses_edge(
+	double px, double py, double x0, double y0, double x1, double y1
+) {
+	if(x0 < px && x1 < px) return false;
+
+	int y0above = y0 >= py;
+	int y1above = y1 >= py;
+	if(y0above && y1above) return false;
+	if(!y0above && !y1above) return false;
+
+	double alpha = (py-y0)/(y1-y0);
+	double cx = x0 + (x1-x0)*alpha;
+	return cx > px;
+}
+
+PreparedMpoly::PreparedMpoly(const Mpoly &_mpoly) :
+	mpoly(_mpoly),
+	bbox(_mpoly.getBbox()),
+	band_height(0)
+{
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		const std::vector<Vertex> &pts = mpoly.rings[r_idx].pts;
+		const size_t npts = pts.size();
+		for(size_t i=0; i<npts; i++) {
+			size_t i2 = (i==npts-1) ? 0 : (i+1);
+			Edge e;
+			e.x0 = pts[i].x;
+			e.y0 = pts[i].y;
+			e.x1 = pts[i2].x;
+			e.y1 = pts[i2].y;
+			e.ring_id = int(r_idx);
+			// horizontal edges are never crossed
+			if(e.y0 != e.y1) edges.push_back(e);
+		}
+	}
+	if(edges.empty()) return;
+
+	// Aim for a few edges per band, but use fewer bands if long edges would have to be
+	// listed in too many of them.
+	size_t num_bands = std::max(edges.size() / 4, size_t(1));
+	while(num_bands > 1 && count_band_entries(num_bands) > 16 * edges.size()) {
+		num_bands /= 2;
+	}
+	build_bands(num_bands);
+}
+
+static inline size_t band_index(double y, double min_y, double band_height, size_t num_bands) {
+	double f = (y - min_y) / band_height;
+	if(!(f > 0)) return 0;
+	if(f >= double(num_bands)) return num_bands-1;
+	return size_t(f);
+}
+
+size_t PreparedMpoly::band_of(double y) const {
+	return band_index(y, bbox.min_y, band_height, band_start.size() - 1);
+}
+
+size_t PreparedMpoly::count_band_entries(size_t num_bands) const {
+	double height = (bbox.max_y - bbox.min_y) / double(num_bands);
+	size_t total = 0;
+	for(size_t i=0; i<edges.size(); i++) {
+		const Edge &e = edges[i];
+		total += band_index(std::max(e.y0, e.y1), bbox.min_y, height, num_bands)
+			- band_index(std::min(e.y0, e.y1), bbox.min_y, height, num_bands) + 1;
+	}
+	return total;
+}
+
+void PreparedMpoly::build_bands(size_t num_bands) {
+	band_height = (bbox.max_y - bbox.min_y) / double(num_bands);
+	band_start.assign(num_bands+1, 0);
+
+	// An edge can only be crossed by a ray at height y if min(y0,y1) < y <= max(y0,y1), and
+	// band_of is nondecreasing, so listing it in the bands from band_of(min) to
+	// band_of(max) is enough.  Edges are already in order of ring.
+	for(size_t i=0; i<edges.size(); i++) {
+		const Edge &e = edges[i];
+		size_t b0 = band_of(std::min(e.y0, e.y1));
+		size_t b1 = band_of(std::max(e.y0, e.y1));
+		for(size_t b=b0; b<=b1; b++) band_start[b+1]++;
+	}
+	for(size_t b=0; b<num_bands; b++) band_start[b+1] += band_start[b];
+
+	band_edges.resize(band_start[num_bands]);
+	std::vector<size_t> fill_pos(band_start.begin(), band_start.end() - 1);
+	for(size_t i=0; i<edges.size(); i++) {
+		const Edge &e = edges[i];
+		size_t b0 = band_of(std::min(e.y0, e.y1));
+		size_t b1 = band_of(std::max(e.y0, e.y1));
+		for(size_t b=b0; b<=b1; b++) band_edges[fill_pos[b]++] = e;
+	}
+}
+
+bool PreparedMpoly::contains(Vertex p) const {
+	if(band_edges.empty()) return false;
+	if(p.y <= bbox.min_y || p.y > bbox.max_y) return false;
+
+	// The parity of the number of rings containing the point is the same as the parity
+	// of the total number of crossings.
+	size_t b = band_of(p.y);
+	int num_crossings = 0;
+	for(size_t i=band_start[b]; i<band_start[b+1]; i++) {
+		const Edge &e = band_edges[i];
+		if(ray_crosses_edge(p.x, p.y, e.x0, e.y0, e.x1, e.y1)) num_crossings++;
+	}
+	return num_crossings & 1;
+}
+
+std::vector<bool> PreparedMpoly::contains(const std::vector<Vertex> &pts) const {
+	std::vector<bool> ret(pts.size());
+	for(size_t i=0; i<pts.size(); i++) {
+		ret[i] = contains(pts[i]);
+	}
+	return ret;
+}
+
+bool PreparedMpoly::component_contains(Vertex p, int outer_ring_id) const {
+	const Ring &outer = mpoly.rings[outer_ring_id];
+	if(outer.is_hole) fatal_error("ring was a hole in Mpoly::component_contains");
+
+	if(band_edges.empty()) return false;
+	if(p.y <= bbox.min_y || p.y > bbox.max_y) return false;
+
+	// Edges of the same ring are next to each other, so the crossings are counted for one
+	// ring at a time.
+	size_t b = band_of(p.y);
+	bool in_outer = false;
+	size_t i = band_start[b];
+	while(i < band_start[b+1]) {
+		const int ring_id = band_edges[i].ring_id;
+		int num_crossings = 0;
+		for(; i<band_start[b+1] && band_edges[i].ring_id == ring_id; i++) {
+			const Edge &e = band_edges[i];
+			if(ray_crosses_edge(p.x, p.y, e.x0, e.y0, e.x1, e.y1)) num_crossings++;
+		}
+		if(!(num_crossings & 1)) continue;
+		if(ring_id == outer_ring_id) {
+			in_outer = true;
+		} else if(mpoly.rings[ring_id].parent_id == outer_ring_id) {
+			// in one of the holes
+			return false;
+		}
+	}
+	return in_outer;
+}
+
+std::vector<int> PreparedMpoly::containing_components(Vertex p) const {
+	std::vector<int> ret;
+	if(band_edges.empty()) return ret;
+	if(p.y <= bbox.min_y || p.y > bbox.max_y) return ret;
+
+	// First find every ring containing the point, then drop the outer rings having one
+	// of their children among them.
+	std::vector<int> in_rings;
+	size_t b = band_of(p.y);
+	size_t i = band_start[b];
+	while(i < band_start[b+1]) {
+		const int ring_id = band_edges[i].ring_id;
+		int num_crossings = 0;
+		for(; i<band_start[b+1] && band_edges[i].ring_id == ring_id; i++) {
+			const Edge &e = band_edges[i];
+			if(ray_crosses_edge(p.x, p.y, e.x0, e.y0, e.x1, e.y1)) num_crossings++;
+		}
+		if(num_crossings & 1) in_rings.push_back(ring_id);
+	}
+
+	std::vector<int> excluded;
+	for(size_t j=0; j<in_rings.size(); j++) {
+		int parent_id = mpoly.rings[in_rings[j]].parent_id;
+		if(parent_id >= 0) excluded.push_back(parent_id);
+	}
+	std::sort(excluded.begin(), excluded.end());
+	for(size_t j=0; j<in_rings.size(); j++) {
+		const int ring_id = in_rings[j];
+		if(mpoly.rings[ring_id].is_hole) continue;
+		if(std::binary_search(excluded.begin(), excluded.end(), ring_id)) continue;
+		ret.push_back(ring_id);
+	}
+	return ret;
+}
+
+RingHierarchy::RingHierarchy(const Mpoly &mpoly) {
+	const size_t num_rings = mpoly.rings.size();
+	child_start.assign(num_rings+1, 0);
+	for(size_t i=0; i<num_rings; i++) {
+		int parent_id = mpoly.rings[i].parent_id;
+		if(parent_id < 0) {
+			root_ids.push_back(i);
+		} else {
+			if(size_t(parent_id) >= num_rings) fatal_error("ring has invalid parent_id");
+			child_start[parent_id+1]++;
+		}
+	}
+	for(size_t i=0; i<num_rings; i++) child_start[i+1] += child_start[i];
+
+	child_ids.resize(child_start[num_rings]);
+	std::vector<size_t> fill_pos(child_start.begin(), child_start.end() - 1);
+	for(size_t i=0; i<num_rings; i++) {
+		int parent_id = mpoly.rings[i].parent_id;
+		if(parent_id >= 0) child_ids[fill_pos[parent_id]++] = i;
+	}
+}
+
 void Mpoly::deleteRing(size_t idx) {
 	rings.erase(rings.begin() + idx);
 }
 
+// ring_ring_relation compares every pair of edges if there are no more than this many
+// pairs, since that is quicker than building a BboxTree.
+static const size_t RINGREL_BRUTE_FORCE_PAIRS = 1024;
+
+static Bbox edge_bbox(const Vertex &a, const Vertex &b) {
+	return Bbox(
+		std::min(a.x, b.x), std::max(a.x, b.x),
+		std::min(a.y, b.y), std::max(a.y, b.y));
+}
+
+// Collects the edges that could touch a given edge, as they come out of the BboxTree.
+struct EdgeIdxCollector {
+	explicit EdgeIdxCollector(std::vector<size_t> &_out) : out(_out) { }
+	void operator()(size_t idx) { out.push_back(idx); }
+	std::vector<size_t> &out;
+};
+
 RingRelation ring_ring_relation(const Ring &r1, const Ring &r2) {
 	Bbox bb1 = r1.getBbox();
 	Bbox bb2 = r2.getBbox();
@@ -444,22 +894,59 @@ RingRelation ring_ring_relation(const Ring &r1, const Ring &r2) {
 	if(n1==0 || n2==0) return RINGREL_DISJOINT;
 
 	// test for crossings
-	for(size_t i1=0; i1<n1; i1++) {
-		size_t i1_plus1 = (i1==n1-1) ? 0 : i1+1;
-		Vertex p1a = r1.pts[i1];
-		Vertex p1b = r1.pts[i1_plus1];
-		if(
-			(p1a.x < bb2.min_x && p1b.x < bb2.min_x) ||
-			(p1a.y < bb2.min_y && p1b.y < bb2.min_y) ||
-			(p1a.x > bb2.max_x && p1b.x > bb2.max_x) ||
-			(p1a.y > bb2.max_y && p1b.y > bb2.max_y)
-		) continue;
-		for(size_t i2=0; i2<n2; i2++) {
-			size_t i2_plus1 = (i2==n2-1) ? 0 : i2+1;
-			Vertex p2a = r2.pts[i2];
-			Vertex p2b = r2.pts[i2_plus1];
-			if(line_intersects_line(p1a, p1b, p2a, p2b, false)) {
-				return RINGREL_CROSSES;
+	if(n1 * n2 <= RINGREL_BRUTE_FORCE_PAIRS) {
+		for(size_t i1=0; i1<n1; i1++) {
+			size_t i1_plus1 = (i1==n1-1) ? 0 : i1+1;
+			Vertex p1a = r1.pts[i1];
+			Vertex p1b = r1.pts[i1_plus1];
+			if(
+				(p1a.x < bb2.min_x && p1b.x < bb2.min_x) ||
+				(p1a.y < bb2.min_y && p1b.y < bb2.min_y) ||
+				(p1a.x > bb2.max_x && p1b.x > bb2.max_x) ||
+				(p1a.y > bb2.max_y && p1b.y > bb2.max_y)
+			) continue;
+			for(size_t i2=0; i2<n2; i2++) {
+				size_t i2_plus1 = (i2==n2-1) ? 0 : i2+1;
+				Vertex p2a = r2.pts[i2];
+				Vertex p2b = r2.pts[i2_plus1];
+				if(line_intersects_line(p1a, p1b, p2a, p2b, false)) {
+					return RINGREL_CROSSES;
+				}
+			}
+		}
+	} else {
+		// Index the edges of the bigger ring and look up each edge of the smaller one.
+		const bool swap_rings = n1 > n2;
+		const Ring &small = swap_rings ? r2 : r1;
+		const Ring &big   = swap_rings ? r1 : r2;
+		const Bbox &big_bb = swap_rings ? bb1 : bb2;
+		const size_t n_small = small.pts.size();
+		const size_t n_big = big.pts.size();
+
+		std::vector<std::pair<Bbox, size_t> > items;
+		items.reserve(n_big);
+		for(size_t i=0; i<n_big; i++) {
+			size_t i_plus1 = (i==n_big-1) ? 0 : i+1;
+			items.push_back(std::make_pair(edge_bbox(big.pts[i], big.pts[i_plus1]), i));
+		}
+		const BboxTree<size_t> tree(items);
+
+		std::vector<size_t> hits;
+		EdgeIdxCollector collector(hits);
+		for(size_t i1=0; i1<n_small; i1++) {
+			size_t i1_plus1 = (i1==n_small-1) ? 0 : i1+1;
+			Vertex p1a = small.pts[i1];
+			Vertex p1b = small.pts[i1_plus1];
+			Bbox bb = edge_bbox(p1a, p1b);
+			if(is_disjoint(bb, big_bb)) continue;
+			hits.clear();
+			tree.visit_intersecting_items(bb, collector);
+			for(size_t h=0; h<hits.size(); h++) {
+				size_t i2 = hits[h];
+				size_t i2_plus1 = (i2==n_big-1) ? 0 : i2+1;
+				if(line_intersects_line(p1a, p1b, big.pts[i2], big.pts[i2_plus1], false)) {
+					return RINGREL_CROSSES;
+				}
 			}
 		}
 	}
@@ -469,106 +956,386 @@ RingRelation ring_ring_relation(const Ring &r1, const Ring &r2) {
 	else return RINGREL_DISJOINT;
 }
 
-/*
-void compute_containments(mpoly_t *mp) {
-	int i;
-	int nrings = mp->num_rings;
+// twice the signed area of the triangle abc
+static inline double orient(const Vertex &a, const Vertex &b, const Vertex &c) {
+	return (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+}
 
-	bbox_t *bboxes = make_bboxes(mp);
+// True if the edges cross at a point inside of both.  Edges that only touch, such as
+// consecutive edges of a ring, don't cross.
+static bool edges_cross(const Vertex &p1, const Vertex &p2, const Vertex &p3, const Vertex &p4) {
+	double o1 = orient(p1, p2, p3);
+	double o2 = orient(p1, p2, p4);
+	double o3 = orient(p3, p4, p1);
+	double o4 = orient(p3, p4, p2);
+	return
+		((o1 > 0 && o2 < 0) || (o1 < 0 && o2 > 0)) &&
+		((o3 > 0 && o4 < 0) || (o3 < 0 && o4 > 0));
+}
 
-	int **ancestors = MYALLOC(int *, nrings);
-	int *num_ancestors = MYALLOC(int, nrings);
+// True if the edges are collinear and overlap by more than a point.
+static bool edges_overlap(const Vertex &p1, const Vertex &p2, const Vertex &p3, const Vertex &p4) {
+	if(orient(p1, p2, p3) || orient(p1, p2, p4)) return false;
+
+	// compare the extents along the axis in which the first edge is longest
+	bool use_x = fabs(p2.x-p1.x) >= fabs(p2.y-p1.y);
+	double a0 = use_x ? p1.x : p1.y;
+	double a1 = use_x ? p2.x : p2.y;
+	double b0 = use_x ? p3.x : p3.y;
+	double b1 = use_x ? p4.x : p4.y;
+	if(a0 > a1) std::swap(a0, a1);
+	if(b0 > b1) std::swap(b0, b1);
+	return std::min(a1, b1) > std::max(a0, b0);
+}
 
-	int64_t num_hits = 0;
+// The sweep in RingNesting goes across x, and within each x upwards in y, as though the
+// plane had been sheared very slightly so that no edge is vertical.  Points are ordered
+// this way by lex_less.
+static inline bool lex_less(double x0, double y0, double x1, double y1) {
+	return x0 < x1 || (x0 == x1 && y0 < y1);
+}
 
-	printf("Computing containments: ");
-	for(i=0; i<nrings; i++) {
-		GDALTermProgress((double)i/(double)nrings, NULL, NULL);
+// An edge of the sweep in RingNesting, directed so that (x0,y0) comes before (x1,y1).
+struct SweepEdge {
+	// The height of the edge at the sweep position, which has to lie within the span of
+	// the edge.  A vertical edge is met by the sweep at the height of the sweep position.
+	double y_at(double sx, double sy) const {
+		if(x0 == x1) return std::min(std::max(sy, y0), y1);
+		if(sx <= x0) return y0;
+		if(sx >= x1) return y1;
+		return y0 + (y1-y0)*(sx-x0)/(x1-x0);
+	}
 
-		bbox_t bbox1 = bboxes[i];
-		if(bbox1.empty) continue;
+	double x0, y0, x1, y1;
+	// HUGE_VAL for vertical edges
+	double slope;
+	int ring_id;
+	// whether the inside of the ring is just below this edge
+	bool interior_below;
+	// Breaks the remaining ties.  Probes have idx 0 and edges count up from 1.
+	size_t idx;
+};
+
+// Orders the edges that span the sweep position from bottom to top.  Edges meeting at the
+// sweep position are ordered as they are just past it.  Since the edges in the sweep
+// never cross, this order doesn't change as the sweep moves along.  Probes sort before
+// the edges they coincide with.  Coinciding edges belong to neighboring rings touching
+// along that line, and the one with its inside below sorts first, so that a probe just
+// below the line finds the ring it is in.
+struct SweepOrder {
+	SweepOrder(const double *_sweep_x, const double *_sweep_y) :
+		sweep_x(_sweep_x), sweep_y(_sweep_y) { }
+	bool operator()(const SweepEdge *a, const SweepEdge *b) const {
+		double ya = a->y_at(*sweep_x, *sweep_y);
+		double yb = b->y_at(*sweep_x, *sweep_y);
+		if(ya != yb) return ya < yb;
+		if(a->slope != b->slope) return a->slope < b->slope;
+		if(!a->idx || !b->idx) return a->idx < b->idx;
+		if(a->interior_below != b->interior_below) return a->interior_below;
+		return a->idx < b->idx;
+	}
+	const double *sweep_x, *sweep_y;
+};
 
-		num_ancestors[i] = 0;
-		ancestors[i] = NULL;
+struct SweepEdgeStartLess {
+	bool operator()(const SweepEdge *a, const SweepEdge *b) const {
+		return lex_less(a->x0, a->y0, b->x0, b->y0);
+	}
+	bool operator()(const SweepEdge &a, const SweepEdge &b) const {
+		return lex_less(a.x0, a.y0, b.x0, b.y0);
+	}
+};
+struct SweepEdgeEndLess {
+	bool operator()(const SweepEdge *a, const SweepEdge *b) const {
+		return lex_less(a->x1, a->y1, b->x1, b->y1);
+	}
+};
 
-		int j;
-		for(j=0; j<nrings; j++) {
-			bbox_t bbox2 = bboxes[j];
-			if(bboxes_disjoint(&bbox1, &bbox2)) continue;
+static inline double sweep_slope(const Vertex &from, const Vertex &to) {
+	return (to.x == from.x) ? HUGE_VAL : (to.y-from.y) / (to.x-from.x);
+}
 
-			int contains = (i != j) && ring_contains_ring(
-				mp->rings + j, mp->rings + i);
-			if(contains) {
-				if(VERBOSE) printf("%d contains %d\n", j, i);
-				ancestors[i] = REMYALLOC(int, ancestors[i], (num_ancestors[i]+1));
-				ancestors[i][ num_ancestors[i]++ ] = j;
-				num_hits++;
-			}
+// The first vertex of a ring in sweep order, as a degenerate edge lying along the upper
+// of the two edges leaving that vertex.  The probe sorts just below that edge.  Rings
+// that touch this ring at this vertex from the inside lie below the probe, so the first
+// edge above the probe that isn't part of this ring belongs to a ring that isn't inside
+// of this one.  This ring lies entirely inside or entirely outside of that ring.
+static SweepEdge ring_probe(const Ring &ring, int ring_id) {
+	const std::vector<Vertex> &pts = ring.pts;
+	const size_t npts = pts.size();
+	size_t first = 0;
+	for(size_t i=1; i<npts; i++) {
+		if(lex_less(pts[i].x, pts[i].y, pts[first].x, pts[first].y)) first = i;
+	}
+	const Vertex &p = pts[first];
+
+	// the nearest distinct vertices on either side (the ring has nonzero area, so they
+	// exist)
+	size_t prev = first, next = first;
+	do { prev = prev ? prev-1 : npts-1; } while(pts[prev].x == p.x && pts[prev].y == p.y);
+	do { next = (next==npts-1) ? 0 : next+1; } while(pts[next].x == p.x && pts[next].y == p.y);
+
+	SweepEdge probe;
+	probe.x0 = probe.x1 = p.x;
+	probe.y0 = probe.y1 = p.y;
+	probe.slope = std::max(sweep_slope(p, pts[prev]), sweep_slope(p, pts[next]));
+	probe.ring_id = ring_id;
+	probe.interior_below = false;
+	probe.idx = 0;
+	return probe;
+}
+
+RingNesting::RingNesting(const Mpoly &mpoly) : num_crossing(0) {
+	const size_t num_rings = mpoly.rings.size();
+	parent_id.assign(num_rings, -1);
+	depth.assign(num_rings, 0);
+	crosses.assign(num_rings, false);
+
+	// All edges of nonzero length (rings from OGR repeat the first vertex at the end).
+	std::vector<Vertex> edge_a, edge_b;
+	std::vector<int> edge_ring;
+	std::vector<std::pair<Bbox, size_t> > items;
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		const std::vector<Vertex> &pts = mpoly.rings[r_idx].pts;
+		const size_t npts = pts.size();
+		for(size_t i=0; i<npts; i++) {
+			size_t i2 = (i==npts-1) ? 0 : (i+1);
+			if(pts[i].x == pts[i2].x && pts[i].y == pts[i2].y) continue;
+			items.push_back(std::make_pair(edge_bbox(pts[i], pts[i2]), edge_a.size()));
+			edge_a.push_back(pts[i]);
+			edge_b.push_back(pts[i2]);
+			edge_ring.push_back(int(r_idx));
 		}
 	}
-	GDALTermProgress(1, NULL, NULL);
+	const size_t num_edges = edge_a.size();
 
-	free(bboxes);
+	std::vector<bool> ring_ccw(num_rings);
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		ring_ccw[r_idx] = mpoly.rings[r_idx].orientedArea() > 0;
+	}
 
-	if(VERBOSE) {
-		printf("containment hits = %ld/%ld\n", num_hits, (int64_t)nrings*(int64_t)nrings);
-		if(VERBOSE >= 2) {
-			for(i=0; i<nrings; i++) {
-				printf("num_ancestors[%d] = %d\n", i, num_ancestors[i]);
+	// Find the crossing rings.  Each pair of edges is tested once.  Two rings that share
+	// part of an edge with their insides on opposite sides of it are neighbors touching
+	// along that edge, which the sweep handles.  If their insides are on the same side
+	// then one ring is either inside of the other and touching it, or the two overlap.
+	// These can't be told apart from the edge alone, so they count as crossing, as do
+	// overlapping edges of a single ring.
+	{
+		const BboxTree<size_t> tree(items);
+		std::vector<size_t> hits;
+		EdgeIdxCollector collector(hits);
+		for(size_t e1=0; e1<num_edges; e1++) {
+			hits.clear();
+			tree.visit_intersecting_items(items[e1].first, collector);
+			for(size_t h=0; h<hits.size(); h++) {
+				size_t e2 = hits[h];
+				if(e2 <= e1) continue;
+				if(crosses[edge_ring[e1]] && crosses[edge_ring[e2]]) continue;
+				const Vertex &a1 = edge_a[e1], &b1 = edge_b[e1];
+				const Vertex &a2 = edge_a[e2], &b2 = edge_b[e2];
+				bool cross = edges_cross(a1, b1, a2, b2);
+				if(!cross && edges_overlap(a1, b1, a2, b2)) {
+					const int r1 = edge_ring[e1], r2 = edge_ring[e2];
+					// the inside of a ring is on the left of its edges if it is
+					// counterclockwise
+					const bool same_dir = (b1.x-a1.x)*(b2.x-a2.x) + (b1.y-a1.y)*(b2.y-a2.y) > 0;
+					const bool same_side = (ring_ccw[r1] == ring_ccw[r2]) == same_dir;
+					cross = (r1 == r2) || same_side;
+				}
+				if(cross) {
+					crosses[edge_ring[e1]] = true;
+					crosses[edge_ring[e2]] = true;
+				}
 			}
 		}
 	}
+	items.clear();
 
-	for(i=0; i<nrings; i++) {
-		// only odd levels are holes
-		mp->rings[i].is_hole = num_ancestors[i] % 2;
+	// The rings taking part in the sweep.
+	std::vector<bool> in_sweep(num_rings);
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		if(crosses[r_idx]) num_crossing++;
+		in_sweep[r_idx] = !crosses[r_idx] && mpoly.rings[r_idx].orientedArea() != 0;
 	}
 
-	for(i=0; i<nrings; i++) {
-		mp->rings[i].parent_id = -1;
+	std::vector<SweepEdge> edges;
+	edges.reserve(num_edges);
+	for(size_t e=0; e<num_edges; e++) {
+		const int r_idx = edge_ring[e];
+		if(!in_sweep[r_idx]) continue;
+		const Vertex &a = edge_a[e];
+		const Vertex &b = edge_b[e];
+		SweepEdge se;
+		const bool rightward = lex_less(a.x, a.y, b.x, b.y);
+		se.x0 = rightward ? a.x : b.x;
+		se.y0 = rightward ? a.y : b.y;
+		se.x1 = rightward ? b.x : a.x;
+		se.y1 = rightward ? b.y : a.y;
+		se.slope = sweep_slope(Vertex(se.x0, se.y0), Vertex(se.x1, se.y1));
+		se.ring_id = r_idx;
+		// the inside is on the left of the ring's direction if it is counterclockwise
+		se.interior_below = (rightward != ring_ccw[r_idx]);
+		se.idx = edges.size() + 1;
+		edges.push_back(se);
+	}
+	edge_a.clear();
+	edge_b.clear();
+	edge_ring.clear();
 
-		int a;
-		for(a=0; a<num_ancestors[i]; a++) {
-			int j = ancestors[i][a];
-			if(num_ancestors[i] == num_ancestors[j] + 1) {
-				mp->rings[i].parent_id = j;
+	std::vector<SweepEdge> probes;
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		if(in_sweep[r_idx]) probes.push_back(ring_probe(mpoly.rings[r_idx], int(r_idx)));
+	}
+	std::sort(probes.begin(), probes.end(), SweepEdgeStartLess());
+
+	std::vector<const SweepEdge *> by_start(edges.size()), by_end(edges.size());
+	for(size_t e=0; e<edges.size(); e++) by_start[e] = by_end[e] = &edges[e];
+	std::sort(by_start.begin(), by_start.end(), SweepEdgeStartLess());
+	std::sort(by_end.begin(), by_end.end(), SweepEdgeEndLess());
+
+	// The sweep only needs to stop at the probes.  At each of these it holds the edges
+	// that start at or before the probe and end after it, taking in the new ones after
+	// dropping the finished ones.  A ring's parent is the ring of the first edge above
+	// its probe (skipping the ring's own edges) if the probe is on the inside of that
+	// edge, and otherwise is the parent of that ring.  The latter isn't always known
+	// yet, so those are linked up afterwards.
+	typedef std::set<const SweepEdge *, SweepOrder> active_t;
+	double sweep_x = 0, sweep_y = 0;
+	active_t active((SweepOrder(&sweep_x, &sweep_y)));
+	// indexed by SweepEdge::idx
+	std::vector<active_t::iterator> handles(edges.size() + 1);
+	std::vector<bool> is_active(edges.size() + 1, false);
+	std::vector<int> same_parent_as(num_rings, -1);
+	size_t next_in = 0, next_out = 0;
+	for(size_t p_idx=0; p_idx<probes.size(); p_idx++) {
+		const SweepEdge &probe = probes[p_idx];
+		sweep_x = probe.x0;
+		sweep_y = probe.y0;
+		for(; next_out < by_end.size(); next_out++) {
+			const SweepEdge *se = by_end[next_out];
+			if(lex_less(sweep_x, sweep_y, se->x1, se->y1)) break;
+			if(is_active[se->idx]) {
+				active.erase(handles[se->idx]);
+				is_active[se->idx] = false;
 			}
 		}
+		for(; next_in < by_start.size(); next_in++) {
+			const SweepEdge *se = by_start[next_in];
+			if(lex_less(sweep_x, sweep_y, se->x0, se->y0)) break;
+			if(!lex_less(sweep_x, sweep_y, se->x1, se->y1)) continue;
+			handles[se->idx] = active.insert(se).first;
+			is_active[se->idx] = true;
+		}
+
+		// Probes sort before the edges they coincide with.
+		active_t::const_iterator it = active.lower_bound(&probe);
+		while(it != active.end() && (*it)->ring_id == probe.ring_id) ++it;
+		if(it == active.end()) continue;
+		if((*it)->interior_below) {
+			parent_id[probe.ring_id] = (*it)->ring_id;
+		} else {
+			same_parent_as[probe.ring_id] = (*it)->ring_id;
+		}
 	}
 
-	for(i=0; i<nrings; i++) {
-		if(ancestors[i]) free(ancestors[i]);
+	// Follow the same_parent_as links, pointing each ring on the way directly at the
+	// result.  A cycle can only come from degenerate input; its rings are left at the
+	// top level.
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		int root = int(r_idx);
+		size_t steps = 0;
+		while(same_parent_as[root] >= 0 && steps++ <= num_rings) root = same_parent_as[root];
+		const int parent = (same_parent_as[root] >= 0) ? -1 : parent_id[root];
+		int cur = int(r_idx);
+		while(same_parent_as[cur] >= 0) {
+			int next = same_parent_as[cur];
+			same_parent_as[cur] = -1;
+			parent_id[cur] = parent;
+			cur = next;
+		}
+	}
+
+	// Depths, working down from the outermost ring of each chain of parents.  Again a
+	// cycle is broken by putting a ring at the top level.
+	std::vector<int> known(num_rings, 0); // 0=no, 1=in progress, 2=yes
+	std::vector<int> chain;
+	for(size_t r_idx=0; r_idx<num_rings; r_idx++) {
+		chain.clear();
+		int cur = int(r_idx);
+		while(cur >= 0 && !known[cur]) {
+			known[cur] = 1;
+			chain.push_back(cur);
+			cur = parent_id[cur];
+		}
+		int d;
+		if(cur < 0) {
+			d = 0;
+		} else if(known[cur] == 1) {
+			parent_id[chain.back()] = -1;
+			d = 0;
+		} else {
+			d = depth[cur] + 1;
+		}
+		for(size_t i=chain.size(); i>0; i--) {
+			depth[chain[i-1]] = d++;
+			known[chain[i-1]] = 2;
+		}
+	}
+
+	if(VERBOSE) printf("ring nesting: %zd rings, %zd crossing\n", num_rings, num_crossing);
+}
+
+bool compute_containments(Mpoly &mpoly) {
+	const RingNesting nesting(mpoly);
+	if(nesting.num_crossing) return false;
+	for(size_t r_idx=0; r_idx<mpoly.rings.size(); r_idx++) {
+		Ring &ring = mpoly.rings[r_idx];
+		ring.parent_id = nesting.parent_id[r_idx];
+		ring.is_hole = nesting.depth[r_idx] % 2;
+	}
+	return true;
+}
+
+static void split_coords(
+	const std::vector<Vertex> &pts,
+	std::vector<double> &x, std::vector<double> &y
+) {
+	x.resize(pts.size());
+	y.resize(pts.size());
+	for(size_t i=0; i<pts.size(); i++) {
+		x[i] = pts[i].x;
+		y[i] = pts[i].y;
+	}
+}
+
+static void join_coords(
+	const std::vector<double> &x, const std::vector<double> &y,
+	std::vector<Vertex> &pts
+) {
+	pts.resize(x.size());
+	for(size_t i=0; i<pts.size(); i++) {
+		pts[i].x = x[i];
+		pts[i].y = y[i];
 	}
-	free(ancestors);
-	free(num_ancestors);
 }
-*/
 
 void Mpoly::xy2en(const GeoRef &georef) {
+	std::vector<double> x, y;
 	for(size_t r_idx=0; r_idx<rings.size(); r_idx++) {
 		Ring &ring = rings[r_idx];
-		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
-			double x = ring.pts[v_idx].x;
-			double y = ring.pts[v_idx].y;
-			double east, north;
-			georef.xy2en(x, y, &east, &north);
-			ring.pts[v_idx].x = east;
-			ring.pts[v_idx].y = north;
-		}
+		split_coords(ring.pts, x, y);
+		georef.xy2en_many(x, y);
+		join_coords(x, y, ring.pts);
 	}
 }
 
 void Mpoly::en2xy(const GeoRef &georef) {
+	std::vector<double> x, y;
 	for(size_t r_idx=0; r_idx<rings.size(); r_idx++) {
 		Ring &ring = rings[r_idx];
-		for(size_t v_idx=0; v_idx<ring.pts.size(); v_idx++) {
-			double east  = ring.pts[v_idx].x;
-			double north = ring.pts[v_idx].y;
-			double x, y;
-			georef.en2xy(east, north, &x, &y);
-			ring.pts[v_idx].x = x;
-			ring.pts[v_idx].y = y;
-		}
+		split_coords(ring.pts, x, y);
+		georef.en2xy_many(x, y);
+		join_coords(x, y, ring.pts);
 	}
 }
 
@@ -657,9 +1424,7 @@ static double estimate_canvas_size_sq(const GeoRef &georef, double semi_major) {
 
 void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 	size_t nrings = rings.size();
-	Mpoly ll_poly;
-	ll_poly.rings.resize(nrings);
-	
+
 	double semi_major;
 	if(georef.have_semi_major) {
 		semi_major = georef.semi_major;
@@ -678,24 +1443,36 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 	double shrink = ((double)georef.w - 2.0*epsilon) / (double)georef.w;
 
 	for(size_t r_idx=0; r_idx<nrings; r_idx++) {
-		// note that this is *not* a reference, since it will potentially
-		// be modified
-		Ring xy_ring = rings[r_idx];
-		// this will be the output
-		Ring &ll_ring = ll_poly.rings[r_idx];
-		ll_ring = xy_ring.copyMetadata();
+		// The input ring is taken out of the Mpoly since it will potentially
+		// be modified, and the output is put back in its place when done.
+		Ring xy_ring;
+		xy_ring.swap(rings[r_idx]);
+		Ring ll_ring = xy_ring.copyMetadata();
 		ll_ring.pts.resize(xy_ring.pts.size());
 
-		for(size_t v_idx=0; v_idx<ll_ring.pts.size(); v_idx++) {
-			double x = xy_ring.pts[v_idx].x;
-			double y = xy_ring.pts[v_idx].y;
-			double lon, lat;
-			georef.xy2ll_or_die(x*shrink+epsilon, y, &lon, &lat);
-			ll_ring.pts[v_idx].x = lon;
-			ll_ring.pts[v_idx].y = lat;
+		// Project the vertices and the midpoints of the original segments
+		// in one batch.  Only the segments created by inserting midpoints
+		// below need to be projected one at a time.
+		const size_t orig_npts = xy_ring.pts.size();
+		std::vector<double> proj_x(orig_npts*2), proj_y(orig_npts*2);
+		for(size_t v_idx=0; v_idx<orig_npts; v_idx++) {
+			const Vertex xy1 = xy_ring.pts[v_idx];
+			const Vertex xy2 = xy_ring.pts[(v_idx + 1) % orig_npts];
+			proj_x[v_idx] = xy1.x*shrink+epsilon;
+			proj_y[v_idx] = xy1.y;
+			proj_x[orig_npts+v_idx] = ((xy1.x + xy2.x)/2.0)*shrink+epsilon;
+			proj_y[orig_npts+v_idx] = (xy1.y + xy2.y)/2.0;
+		}
+		georef.xy2ll_many_or_die(proj_x, proj_y);
+		for(size_t v_idx=0; v_idx<orig_npts; v_idx++) {
+			ll_ring.pts[v_idx].x = proj_x[v_idx];
+			ll_ring.pts[v_idx].y = proj_y[v_idx];
 		}
 
 		int num_consec = 0;
+		// the next original segment, and its current position in the ring
+		size_t next_orig = 0;
+		size_t next_orig_pos = 0;
 
 		for(size_t v_idx=0; v_idx<ll_ring.pts.size(); ) {
 			if(xy_ring.pts.size() != ll_ring.pts.size()) {
@@ -710,9 +1487,16 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 				(xy1.y + xy2.y)/2.0);
 
 			Vertex ll_m_proj;
-			georef.xy2ll_or_die(
-				xy_m.x*shrink+epsilon, xy_m.y,
-				&ll_m_proj.x, &ll_m_proj.y);
+			if(next_orig < orig_npts && v_idx == next_orig_pos) {
+				ll_m_proj.x = proj_x[orig_npts+next_orig];
+				ll_m_proj.y = proj_y[orig_npts+next_orig];
+				next_orig++;
+				next_orig_pos = v_idx + 1;
+			} else {
+				georef.xy2ll_or_die(
+					xy_m.x*shrink+epsilon, xy_m.y,
+					&ll_m_proj.x, &ll_m_proj.y);
+			}
 
 			Vertex &ll1 = ll_ring.pts[v_idx];
 			Vertex &ll2 = ll_ring.pts[(v_idx + 1) % npts];
@@ -791,6 +1575,7 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 				}
 				xy_ring.pts.insert(xy_ring.pts.begin()+v_idx+1, xy_m);
 				ll_ring.pts.insert(ll_ring.pts.begin()+v_idx+1, ll_m_proj);
+				next_orig_pos++;
 			} else {
 				v_idx++;
 				num_consec = 0;
@@ -801,19 +1586,12 @@ void Mpoly::xy2ll_with_interp(const GeoRef &georef, double toler) {
 		// kludge.  We no longer care whether the projection is
 		// single-valued and we don't want the loss of accuracy
 		// that comes from multiplying by shrink.
-		for(size_t v_idx=0; v_idx<ll_ring.pts.size(); v_idx++) {
-			double x = xy_ring.pts[v_idx].x;
-			double y = xy_ring.pts[v_idx].y;
+		split_coords(xy_ring.pts, proj_x, proj_y);
+		georef.xy2ll_many_or_die(proj_x, proj_y);
+		join_coords(proj_x, proj_y, ll_ring.pts);
 
-			double lon, lat;
-			georef.xy2ll_or_die(x, y, &lon, &lat);
-
-			ll_ring.pts[v_idx].x = lon;
-			ll_ring.pts[v_idx].y = lat;
-		}
+		rings[r_idx].swap(ll_ring);
 	}
-
-	*this = ll_poly;
 }
 
 static std::string read_whole_file(FILE *fin) {
@@ -32,6 +32,7 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <cstdio>
 #include <utility>
 #include <cassert>
 
@@ -113,138 +114,181 @@ static inline bool is_disjoint(const Bbox &bb1, const Bbox &bb2) {
 		bb2.min_y >  bb1.max_y;
 }
 
-// BboxBinarySpacePartition helps you quickly find which of a list of items (that have bounding
-// boxes) intersect a given bounding box.  Think of it as a std::map whose keys are bounding
-// boxes.  Since several items may intersect a given query box, query returns a list of
-// matches.
-//
-// When many object have overlapping bbox, this tree may not be so efficient and maybe
-// something better should be cooked up if it turns out to be slow.
+// BboxTree helps you quickly find which of a list of items (that have bounding boxes)
+// intersect a given bounding box.  It is a bounding volume hierarchy stored in two flat
+// arrays: the items, sorted so that each node covers a contiguous range of them, and the
+// nodes in depth-first order.  A node's first child immediately follows it and 'skip'
+// gives the index just past its subtree, so a query walks the array front to back without
+// recursion or a stack.  Building it takes O(n log n) time and allocates nothing per node.
 template <typename T>
-class BboxBinarySpacePartition {
+class BboxTree {
 public:
-	BboxBinarySpacePartition(
-		std::vector<std::pair<Bbox, T> > items,
-		size_t max_leaf_size = 20,
-		bool axis = 0
-	) :
-		left(NULL),
-		right(NULL)
-	{
-		leaf_items = items;
-
-		// Compute bbox containing all items.
+	explicit BboxTree(const std::vector<std::pair<Bbox, T> > &items, size_t max_leaf_size = 8) {
+		std::vector<BuildItem> build_items;
+		build_items.reserve(items.size());
 		for(size_t i=0; i<items.size(); i++) {
-			node_bbox.expand(items[i].first);
+			const Bbox &bb = items[i].first;
+			// empty boxes never intersect anything
+			if(bb.empty) continue;
+			BuildItem bi;
+			bi.box = Extent(bb);
+			bi.cx = (bb.min_x + bb.max_x) / 2.0;
+			bi.cy = (bb.min_y + bb.max_y) / 2.0;
+			bi.idx = i;
+			build_items.push_back(bi);
 		}
 
-		if(items.size() > max_leaf_size) {
-			subdivide(max_leaf_size, axis);
+		if(!build_items.empty()) {
+			nodes.reserve(2 * build_items.size() / std::max(max_leaf_size, size_t(1)) + 1);
+			build(build_items, 0, build_items.size(), std::max(max_leaf_size, size_t(1)));
 		}
-	}
 
-	~BboxBinarySpacePartition() {
-		delete(left);
-		delete(right);
-	}
-
-	std::vector<T> get_intersecting_items(Bbox needle) const {
-		std::vector<T> ret;
-		append_intersecting_items(ret, needle);
-		return ret;
+		boxes.reserve(build_items.size());
+		values.reserve(build_items.size());
+		for(size_t i=0; i<build_items.size(); i++) {
+			boxes.push_back(build_items[i].box);
+			values.push_back(items[build_items[i].idx].second);
+		}
 	}
 
-private:
-	void append_intersecting_items(
-		std::vector<T> &out,
-		Bbox needle
-	) const {
-		if(left) {
-			assert(right);
-			if(!is_disjoint(needle, left->node_bbox)) {
-				left ->append_intersecting_items(out, needle);
-			}
-			if(!is_disjoint(needle, right->node_bbox)) {
-				right->append_intersecting_items(out, needle);
-			}
-		} else {
-			for(size_t i=0; i<leaf_items.size(); i++) {
-				if(!is_disjoint(needle, leaf_items[i].first)) {
-					out.push_back(leaf_items[i].second);
+	// Calls visitor(item) for each item whose bbox intersects the needle.
+	template <typename Visitor>
+	void visit_intersecting_items(const Bbox &needle, Visitor &visitor) const {
+		if(needle.empty) return;
+		const Extent n(needle);
+		size_t i = 0;
+		while(i < nodes.size()) {
+			const Node &node = nodes[i];
+			if(!node.box.intersects(n)) {
+				i = node.skip;
+			} else if(node.skip == i+1) {
+				// leaf
+				for(size_t k=node.begin; k<node.end; k++) {
+					if(boxes[k].intersects(n)) visitor(values[k]);
 				}
+				i = node.skip;
+			} else {
+				i++;
 			}
 		}
 	}
 
-	void subdivide(size_t max_leaf_size, bool axis) {
-		std::vector<double> midpts(leaf_items.size());
-		double cmin = 0, cmax = 0, cavg = 0;
-		size_t num_nonempty = 0;
-		for(size_t i=0; i<leaf_items.size(); i++) {
-			const Bbox &ibb = leaf_items[i].first;
-			if(ibb.empty) continue;
-			num_nonempty++;
-			node_bbox.expand(ibb);
-			double item_mid = axis ?
-				(ibb.min_y + ibb.max_y) / 2.0 :
-				(ibb.min_x + ibb.max_x) / 2.0;
-			if(i == 0) cmin = cmax = item_mid;
-			cmin = std::min(cmin, item_mid);
-			cmax = std::max(cmax, item_mid);
-			cavg += item_mid;
+	// Appends the items whose bbox intersects the needle to 'out'.
+	void get_intersecting_items(const Bbox &needle, std::vector<T> &out) const {
+		Appender a(out);
+		visit_intersecting_items(needle, a);
+	}
+
+private:
+	struct Extent {
+		Extent() : min_x(0), max_x(0), min_y(0), max_y(0) { }
+		explicit Extent(const Bbox &bb) :
+			min_x(bb.min_x), max_x(bb.max_x), min_y(bb.min_y), max_y(bb.max_y) { }
+
+		void expand(const Extent &e) {
+			min_x = std::min(min_x, e.min_x);
+			max_x = std::max(max_x, e.max_x);
+			min_y = std::min(min_y, e.min_y);
+			max_y = std::max(max_y, e.max_y);
 		}
-		cavg /= num_nonempty;
-
-		// Subdivide space into two halves.  Note: this is used to decide which branch of the
-		// tree each item goes into.  However, each branch will then compute the exact Bbox
-		// that contains each of its items (it won't use these ones we compute here).
-		Bbox left_bbox, right_bbox;
-		if(axis) {
-			left_bbox = Bbox(
-				node_bbox.min_x, node_bbox.max_x,
-				cmin, cavg);
-			right_bbox = Bbox(
-				node_bbox.min_x, node_bbox.max_x,
-				cavg, cmax);
-		} else {
-			left_bbox = Bbox(
-				cmin, cavg,
-				node_bbox.min_y, node_bbox.max_y);
-			right_bbox = Bbox(
-				cavg, cmax,
-				node_bbox.min_y, node_bbox.max_y);
+
+		// same test as !is_disjoint
+		bool intersects(const Extent &e) const {
+			return !(
+				min_x > e.max_x || min_y > e.max_y ||
+				e.min_x > max_x || e.min_y > max_y);
 		}
 
-		// Find which items go in each box.
-		//
-		// Note: it would be possible to just move items to the left and right side of the
-		// original array like with quicksort, and never have to allocate all of these little
-		// vectors for every node.
-		std::vector<std::pair<Bbox, T> > left_items, right_items;
-		for(size_t i=0; i<leaf_items.size(); i++) {
-			const Bbox &ibb = leaf_items[i].first;
-			Vertex item_mid = Vertex(
-				(ibb.min_x + ibb.max_x) / 2.0,
-				(ibb.min_y + ibb.max_y) / 2.0);
-			if(left_bbox.contains(item_mid)) {
-				left_items.push_back(leaf_items[i]);
-			} else {
-				right_items.push_back(leaf_items[i]);
-			}
+		double min_x, max_x, min_y, max_y;
+	};
+
+	struct Node {
+		Extent box;
+		size_t begin, end;
+		size_t skip;
+	};
+
+	struct BuildItem {
+		Extent box;
+		double cx, cy;
+		size_t idx;
+	};
+
+	struct CenterLess {
+		explicit CenterLess(bool _axis) : axis(_axis) { }
+		bool operator()(const BuildItem &a, const BuildItem &b) const {
+			return axis ? (a.cy < b.cy) : (a.cx < b.cx);
 		}
+		bool axis;
+	};
+
+	struct Appender {
+		explicit Appender(std::vector<T> &_out) : out(_out) { }
+		void operator()(const T &v) { out.push_back(v); }
+		std::vector<T> &out;
+	};
+
+	// Makes a node for items begin..end, split at the median along the axis in which the
+	// item centers are most spread out.
+	void build(std::vector<BuildItem> &items, size_t begin, size_t end, size_t max_leaf_size) {
+		size_t node_idx = nodes.size();
+		nodes.push_back(Node());
+
+		Extent box = items[begin].box;
+		double cmin_x = items[begin].cx, cmax_x = cmin_x;
+		double cmin_y = items[begin].cy, cmax_y = cmin_y;
+		for(size_t i=begin+1; i<end; i++) {
+			box.expand(items[i].box);
+			cmin_x = std::min(cmin_x, items[i].cx);
+			cmax_x = std::max(cmax_x, items[i].cx);
+			cmin_y = std::min(cmin_y, items[i].cy);
+			cmax_y = std::max(cmax_y, items[i].cy);
+		}
+		nodes[node_idx].box = box;
+		nodes[node_idx].begin = begin;
+		nodes[node_idx].end = end;
+
+		if(end - begin > max_leaf_size) {
+			bool axis = (cmax_y - cmin_y) > (cmax_x - cmin_x);
+			size_t mid = begin + (end - begin) / 2;
+			std::nth_element(items.begin() + begin, items.begin() + mid,
+				items.begin() + end, CenterLess(axis));
+			build(items, begin, mid, max_leaf_size);
+			build(items, mid, end, max_leaf_size);
+		}
+
+		nodes[node_idx].skip = nodes.size();
+	}
 
-		// free memory
-		leaf_items.clear();
+	std::vector<Node> nodes;
+	std::vector<Extent> boxes;
+	std::vector<T> values;
+};
+
+// Old interface to BboxTree.  Think of it as a std::map whose keys are bounding boxes.
+// Since several items may intersect a given query box, query returns a list of matches.
+template <typename T>
+class BboxBinarySpacePartition {
+public:
+	// The axis is accepted for compatibility, but the tree picks its own split axis.
+	BboxBinarySpacePartition(
+		const std::vector<std::pair<Bbox, T> > &items,
+		size_t max_leaf_size = 20,
+		bool axis = 0
+	) :
+		tree(items, max_leaf_size)
+	{
+		(void)axis;
+	}
 
-		left  = new BboxBinarySpacePartition<T>(left_items,  max_leaf_size, !axis);
-		right = new BboxBinarySpacePartition<T>(right_items, max_leaf_size, !axis);
+	std::vector<T> get_intersecting_items(Bbox needle) const {
+		std::vector<T> ret;
+		tree.get_intersecting_items(needle, ret);
+		return ret;
 	}
 
 private:
-	Bbox node_bbox;
-	BboxBinarySpacePartition<T> *left, *right;
-	// only used by leafs
-	std::vector<std::pair<Bbox, T> > leaf_items;
+	BboxTree<T> tree;
 };
 
 class Ring {
@@ -266,6 +310,12 @@ public:
 		return ret;
 	}
 
+	void swap(Ring &other) {
+		pts.swap(other.pts);
+		std::swap(is_hole, other.is_hole);
+		std::swap(parent_id, other.parent_id);
+	}
+
 	void debug_dump_binary(FILE *fh) const;
 	static Ring debug_load_binary(FILE *fh);
 
@@ -288,17 +338,125 @@ public:
 	void en2xy(const GeoRef &georef);
 	void xy2ll_with_interp(const GeoRef &georef, double toler);
 
+	void swap(Mpoly &other) { rings.swap(other.rings); }
+
+	size_t num_vertices() const {
+		size_t n = 0;
+		for(size_t i=0; i<rings.size(); i++) n += rings[i].pts.size();
+		return n;
+	}
+
 	void debug_dump_binary(FILE *fh) const;
 	static Mpoly debug_load_binary(FILE *fh);
 
 	std::vector<Ring> rings;
 };
 
+// The parent->children links of an Mpoly's rings, built from parent_id in one pass
+// and stored as flat arrays, so that walking the ring tree doesn't require scanning all
+// rings for each parent.  Children are listed in increasing order, as are the roots (the
+// rings with no parent).  The Mpoly must not be restructured while this is in use.
+class RingHierarchy {
+public:
+	explicit RingHierarchy(const Mpoly &mpoly);
+
+	size_t num_children(size_t ring_id) const {
+		return child_start[ring_id+1] - child_start[ring_id];
+	}
+	size_t child(size_t ring_id, size_t i) const {
+		return child_ids[child_start[ring_id] + i];
+	}
+	const std::vector<size_t> &roots() const { return root_ids; }
+
+private:
+	// the children of ring i are child_ids[child_start[i] .. child_start[i+1]-1]
+	std::vector<size_t> child_start;
+	std::vector<size_t> child_ids;
+	std::vector<size_t> root_ids;
+};
+
+// How the rings of an Mpoly are nested, worked out from the geometry alone (parent_id and
+// is_hole of the input are ignored).  Rings are found to cross if an edge of one properly
+// crosses an edge of another (or a non-adjacent edge of the same ring); rings that only
+// touch at a point don't count.  Rings sharing part of an edge don't count either if they
+// lie on opposite sides of it, but do if they lie on the same side, since then they may
+// overlap.  Crossings are found with a BboxTree of the
+// edges, and the nesting of the other rings with a single sweep across x, so the whole
+// thing takes O((n + k) log n) time for n edges and k pairs of edges with overlapping
+// bounding boxes, rather than comparing every pair of rings.
+struct RingNesting {
+	explicit RingNesting(const Mpoly &mpoly);
+
+	// The innermost ring containing each ring, or -1.  Rings that cross, or that have
+	// no area, are given -1 and are never parents.
+	std::vector<int> parent_id;
+	// number of rings containing each ring
+	std::vector<int> depth;
+	std::vector<bool> crosses;
+	size_t num_crossing;
+};
+
+// Sets parent_id and is_hole (odd depth) of each ring from RingNesting, giving the same
+// structure as trace_mask.  If any rings cross the nesting isn't well defined, and false is
+// returned with the Mpoly left unchanged.
+bool compute_containments(Mpoly &mpoly);
+
+// An Mpoly prepared for many point-in-polygon queries.  The edges are sorted into
+// horizontal bands, so a query only looks at the edges that span the band the point falls
+// in rather than at every edge of every ring.  Results are exactly the same as those of
+// Mpoly::contains and Mpoly::component_contains.  The Mpoly must not be changed while the
+// PreparedMpoly is in use.
+class PreparedMpoly {
+public:
+	explicit PreparedMpoly(const Mpoly &_mpoly);
+
+	bool contains(Vertex p) const;
+	bool component_contains(Vertex p, int outer_ring_id) const;
+	// The outer rings for which component_contains(p, ring) is true, in increasing
+	// order.  This costs about the same as a single component_contains call.
+	std::vector<int> containing_components(Vertex p) const;
+
+	// Same as calling contains for each point.
+	std::vector<bool> contains(const std::vector<Vertex> &pts) const;
+
+private:
+	struct Edge {
+		double x0, y0, x1, y1;
+		int ring_id;
+	};
+
+	size_t band_of(double y) const;
+	void build_bands(size_t num_bands);
+	// number of edge entries that num_bands bands would need
+	size_t count_band_entries(size_t num_bands) const;
+
+	const Mpoly &mpoly;
+	std::vector<Edge> edges;
+	Bbox bbox;
+	double band_height;
+	// The edges crossing band i are band_edges[band_start[i] .. band_start[i+1]-1], sorted
+	// by ring.
+	std::vector<size_t> band_start;
+	std::vector<Edge> band_edges;
+};
+
 OGRGeometryH ring_to_ogr(const Ring &ring);
 Ring ogr_to_ring(OGRGeometryH ogr);
 OGRGeometryH mpoly_to_ogr(const Mpoly &mpoly_in);
+// Holes and the polygon they belong to are as given by OGR.  An outer ring lying within a
+// hole of another polygon gets that hole as its parent_id, as with trace_mask.
 Mpoly ogr_to_mpoly(OGRGeometryH geom_in);
-std::vector<Mpoly> split_mpoly_to_polys(const Mpoly &mpoly);
+// Write the same WKT/WKB that OGR would produce for mpoly_to_ogr(mpoly),
+// without building the OGR geometry.  WKT gets a trailing newline.  By default
+// WKT coordinates are rounded the way OGR does (15 decimals with cleanup of
+// roundoff noise), for compatibility with earlier output.  With exact_floats
+// each coordinate is written with enough digits (at most 17) to read back as
+// the same double.
+void mpoly_write_wkt(const Mpoly &mpoly, FILE *fh, bool exact_floats=false);
+void mpoly_write_wkb(const Mpoly &mpoly, FILE *fh, OGRwkbByteOrder byte_order);
+// Splits into one Mpoly per outer ring, each with its holes.  The rings are
+// moved rather than copied, leaving mpoly empty.
+std::vector<Mpoly> split_mpoly_to_polys(Mpoly &mpoly);
 bool line_intersects_line(
 	Vertex p1, Vertex p2,
 	Vertex p3, Vertex p4,
@@ -26,12 +26,29 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <cstring>
+
 #include <boost/foreach.hpp>
 
 #include "raster_features.h"
+#include "block_reader.h"
 
 namespace dangdal {
 
+const FeatureBitmap::Index FeatureBitmap::NO_FEATURE;
+const uint16_t FeatureBitmap::IndexRaster::NARROW_NO_FEATURE;
+
+void FeatureBitmap::IndexRaster::widen() {
+	if(is_wide) return;
+	if(VERBOSE) printf("more than %d features, switching to 32-bit indices\n", int(NARROW_NO_FEATURE));
+	wide.resize(narrow.size());
+	for(size_t i=0; i<narrow.size(); i++) {
+		wide[i] = (narrow[i] == NARROW_NO_FEATURE) ? NO_FEATURE : narrow[i];
+	}
+	std::vector<uint16_t>().swap(narrow);
+	is_wide = true;
+}
+
 FeatureInterpreter::BandInfo::BandInfo() :
 	raw_val_offset(0),
 	raw_val_size(0),
@@ -215,28 +232,110 @@ void FeatureInterpreter::set_ogr_fields(OGRLayerH ogr_layer, OGRFeatureH ogr_fea
 FeatureBitmap::FeatureBitmap(const size_t _w, const size_t _h, const size_t _raw_vals_size) :
 	w(_w), h(_h),
 	raw_vals_size(_raw_vals_size),
-	raster(w, h)
-{ }
+	raster(w, h),
+	num_keys(0),
+	last_index(NO_FEATURE)
+{
+	if(raw_vals_size <= 2) {
+		direct.resize(size_t(1) << (8*raw_vals_size), NO_FEATURE);
+	} else {
+		slots.resize(1024, NO_FEATURE);
+	}
+}
 
-FeatureBitmap::Index FeatureBitmap::get_index(const FeatureRawVal &pixel) {
-	std::map<FeatureRawVal, Index>::iterator it = table.find(pixel);
-	if(it == table.end()) {
-		if(table.size() >= std::numeric_limits<FeatureBitmap::Index>::max()) {
-			fatal_error("Input had too many feature values (max is %zd)",
-				size_t(std::numeric_limits<FeatureBitmap::Index>::max()));
-		}
-		FeatureBitmap::Index v = table.size();
-		table[pixel] = v;
-		return v;
+static inline uint64_t mix_hash(uint64_t h) {
+	// finalizer from MurmurHash3
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline uint64_t hash_bytes(const uint8_t *p, size_t n) {
+	uint64_t h = n;
+	while(n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		h = mix_hash(h ^ v);
+		p += 8;
+		n -= 8;
+	}
+	if(n) {
+		uint64_t v = 0;
+		memcpy(&v, p, n);
+		h = mix_hash(h ^ v);
+	}
+	return h;
+}
+
+FeatureBitmap::Index FeatureBitmap::add_key(const uint8_t *pixel) {
+	if(num_keys >= NO_FEATURE) {
+		fatal_error("Input had too many feature values (max is %zd)", size_t(NO_FEATURE));
+	}
+	if(num_keys > raster.max_index()) raster.widen();
+	keys.insert(keys.end(), pixel, pixel + raw_vals_size);
+	return Index(num_keys++);
+}
+
+// Double the size of the hash table, keeping it at most half full.
+void FeatureBitmap::grow_slots() {
+	std::vector<Index> new_slots(slots.size() * 2, NO_FEATURE);
+	const size_t mask = new_slots.size() - 1;
+	for(size_t i=0; i<num_keys; i++) {
+		size_t pos = hash_bytes(&keys[i * raw_vals_size], raw_vals_size) & mask;
+		while(new_slots[pos] != NO_FEATURE) pos = (pos + 1) & mask;
+		new_slots[pos] = Index(i);
+	}
+	slots.swap(new_slots);
+}
+
+FeatureBitmap::Index FeatureBitmap::get_index(const uint8_t *pixel) {
+	if(last_index != NO_FEATURE && !memcmp(pixel, &last_key[0], raw_vals_size)) {
+		return last_index;
+	}
+
+	Index v;
+	if(!direct.empty()) {
+		size_t key = pixel[0];
+		if(raw_vals_size == 2) key |= size_t(pixel[1]) << 8;
+		v = direct[key];
+		if(v == NO_FEATURE) v = direct[key] = add_key(pixel);
 	} else {
-		return it->second;
+		const size_t mask = slots.size() - 1;
+		size_t pos = hash_bytes(pixel, raw_vals_size) & mask;
+		for(;;) {
+			v = slots[pos];
+			if(v == NO_FEATURE) {
+				v = slots[pos] = add_key(pixel);
+				if(num_keys * 2 > slots.size()) grow_slots();
+				break;
+			}
+			if(!memcmp(pixel, &keys[size_t(v) * raw_vals_size], raw_vals_size)) break;
+			pos = (pos + 1) & mask;
+		}
+	}
+
+	last_key.assign(pixel, pixel + raw_vals_size);
+	last_index = v;
+	return v;
+}
+
+std::map<FeatureRawVal, FeatureBitmap::Index> FeatureBitmap::feature_table() const {
+	std::map<FeatureRawVal, Index> table;
+	for(size_t i=0; i<num_keys; i++) {
+		FeatureRawVal val;
+		val.assign(keys.begin() + i * raw_vals_size, keys.begin() + (i+1) * raw_vals_size);
+		table[val] = Index(i);
 	}
+	return table;
 }
 
 void FeatureBitmap::dump_feature_table() const {
 	typedef std::map<FeatureRawVal, Index>::value_type table_pair_t;
-	BOOST_FOREACH(const table_pair_t &f, table) {
-		printf("feature %d:", f.second);
+	BOOST_FOREACH(const table_pair_t &f, feature_table()) {
+		printf("feature %u:", f.second);
 		for(size_t i=0; i<f.first.size(); i++) {
 			if(i) printf(",");
 			printf(" %d", f.first[i]);
@@ -257,46 +356,115 @@ BitGrid FeatureBitmap::get_mask_for_feature(FeatureBitmap::Index wanted) const {
 	return mask;
 }
 
-FeatureBitmap *FeatureBitmap::from_raster(
-	GDALDatasetH ds, std::vector<size_t> band_ids, const NdvDef &ndv_def, DebugPlot *dbuf
+// One erosion pass in a chain of passes (see FeatureBitmap::erode).  Rows have a one
+// pixel border of NO_FEATURE on each side.
+struct FeatureErodeStage {
+	typedef FeatureBitmap::Index Index;
+
+	explicit FeatureErodeStage(size_t w) :
+		prev(w+2, FeatureBitmap::NO_FEATURE),
+		curr(w+2, FeatureBitmap::NO_FEATURE),
+		next(w+2, FeatureBitmap::NO_FEATURE),
+		out(w+2, FeatureBitmap::NO_FEATURE),
+		have_curr(false)
+	{ }
+
+	// Computes out from prev, curr, and next, then moves the window down a row.
+	void run() {
+		const size_t w = curr.size() - 2;
+		const Index *rowu = &prev[0];
+		const Index *rowm = &curr[0];
+		const Index *rowl = &next[0];
+		for(size_t x=0; x<w; x++) {
+			const Index v = rowm[x+1];
+			out[x+1] = v;
+			if(v == FeatureBitmap::NO_FEATURE) continue;
+
+			bool ul = rowu[x]==v, um = rowu[x+1]==v, ur = rowu[x+2]==v;
+			bool ml = rowm[x]==v,                    mr = rowm[x+2]==v;
+			bool ll = rowl[x]==v, lm = rowl[x+1]==v, lr = rowl[x+2]==v;
+
+			// remove pixels that don't have two consecutive neighbors of the same feature
+			if(!(
+				(ul&&um) || (um&&ur) || (ur&&mr) || (mr&&lr) ||
+				(lr&&lm) || (lm&&ll) || (ll&&ml) || (ml&&ul)
+			)) out[x+1] = FeatureBitmap::NO_FEATURE;
+		}
+		std::swap(prev, curr);
+		std::swap(curr, next);
+	}
+
+	std::vector<Index> prev, curr, next, out;
+	bool have_curr;
+};
+
+// Push a row through the stages starting with stages[first].  Returns the row that comes out of the last
+// stage, or NULL if some stage still needs more input.
+static const FeatureBitmap::Index *push_erode_row(
+	std::vector<FeatureErodeStage> &stages, size_t first, const FeatureBitmap::Index *row
 ) {
-	assert(!band_ids.empty());
+	for(size_t k=first; k<stages.size(); k++) {
+		FeatureErodeStage &s = stages[k];
+		if(!s.have_curr) {
+			std::copy(row, row + s.curr.size(), s.curr.begin());
+			s.have_curr = true;
+			return NULL;
+		}
+		std::copy(row, row + s.next.size(), s.next.begin());
+		s.run();
+		row = &s.out[0];
+	}
+	return row;
+}
 
-	size_t w = GDALGetRasterXSize(ds);
-	size_t h = GDALGetRasterYSize(ds);
-	size_t band_count = GDALGetRasterCount(ds);
-	if(VERBOSE) printf("input is %zd x %zd x %zd\n", w, h, band_count);
+// All passes are done in a single sweep, the same way as RowMorphology does it for
+// BitGrid: each pass keeps a window of three rows and feeds its output directly to
+// the next pass.
+void FeatureBitmap::erode(int passes) {
+	if(passes <= 0 || !h) return;
 
-	std::vector<GDALRasterBandH> bands;
-	BOOST_FOREACH(const size_t band_id, band_ids) {
-		if(VERBOSE) printf("opening band %zd\n", band_id);
-		GDALRasterBandH band = GDALGetRasterBand(ds, band_id);
-		if(!band) fatal_error("Could not open band %zd.", band_id);
-		bands.push_back(band);
+	std::vector<FeatureErodeStage> stages(passes, FeatureErodeStage(w));
+	std::vector<Index> row(w+2, NO_FEATURE);
+	size_t y_out = 0;
+
+	// Output rows are above the last input row, which has already been copied, so
+	// they can be written back to the raster right away.
+	for(size_t y=0; y<h; y++) {
+		for(size_t x=0; x<w; x++) row[x+1] = raster(x, y);
+		const Index *out = push_erode_row(stages, 0, &row[0]);
+		if(out) {
+			for(size_t x=0; x<w; x++) raster.set(x, y_out, out[x+1]);
+			y_out++;
+		}
 	}
 
-	int blocksize_x_int, blocksize_y_int;
-	GDALGetBlockSize(bands[0], &blocksize_x_int, &blocksize_y_int);
-	// Out of laziness, I am hoping that images always have the same block size for each band.
-	BOOST_FOREACH(const GDALRasterBandH band, bands) {
-		int bx, by;
-		GDALGetBlockSize(band, &bx, &by);
-		if(bx != blocksize_x_int || by != blocksize_y_int) {
-			fatal_error(
-				"Bands have different block sizes.  Not currently implemented.  Please contact developer");
+	// Each stage holds back its last row until it gets the border row below it.
+	std::fill(row.begin(), row.end(), NO_FEATURE);
+	for(size_t k=0; k<stages.size(); k++) {
+		if(!stages[k].have_curr) continue;
+		const Index *out = push_erode_row(stages, k, &row[0]);
+		if(out) {
+			for(size_t x=0; x<w; x++) raster.set(x, y_out, out[x+1]);
+			y_out++;
 		}
 	}
-	size_t blocksize_x = blocksize_x_int;
-	size_t blocksize_y = blocksize_y_int;
-	size_t blocksize_xy = blocksize_x * blocksize_y;
+	assert(y_out == h);
+}
+
+FeatureBitmap *FeatureBitmap::from_raster(
+	GDALDatasetH ds, std::vector<size_t> band_ids, const NdvDef &ndv_def, DebugPlot *dbuf,
+	size_t num_threads
+) {
+	BlockReader reader(ds, band_ids, ndv_def.empty() ? NULL : &ndv_def, num_threads);
+	size_t w = reader.w;
+	size_t h = reader.h;
+	size_t blocksize_x = reader.blocksize_x;
+	size_t num_bands = band_ids.size();
 
-	std::vector<GDALDataType> datatypes;
 	std::vector<size_t> dt_sizes;
 	size_t dt_total_size = 0;
 	if(VERBOSE >= 2) printf("datatype sizes:");
-	BOOST_FOREACH(const GDALRasterBandH band, bands) {
-		GDALDataType dt = GDALGetRasterDataType(band);
-		datatypes.push_back(dt);
+	BOOST_FOREACH(const GDALDataType dt, reader.datatypes) {
 		size_t s = GDALGetDataTypeSize(dt) / 8;
 		dt_sizes.push_back(s);
 		dt_total_size += s;
@@ -304,97 +472,70 @@ FeatureBitmap *FeatureBitmap::from_raster(
 	}
 	if(VERBOSE >= 2) printf("\n");
 
-	std::vector<std::vector<uint8_t> > band_buf(bands.size());
-	for(size_t i=0; i<bands.size(); i++) {
-		size_t num_bytes = blocksize_xy * dt_sizes[i];
-		band_buf[i].resize(num_bytes);
-	}
-
-	std::vector<uint8_t> ndv_mask(blocksize_xy);
-
 	FeatureBitmap *fbm = new FeatureBitmap(w, h, dt_total_size);
 
 	size_t num_valid = 0;
 	size_t num_ndv = 0;
 
-	printf("Reading input...\n");
-
-	size_t num_blocks_x = (w + blocksize_x - 1) / blocksize_x;
-	size_t num_blocks_y = (h + blocksize_y - 1) / blocksize_y;
-	for(size_t block_y=0; block_y<num_blocks_y; block_y++) {
-		size_t boff_y = blocksize_y * block_y;
-		size_t bsize_y = blocksize_y;
-		if(bsize_y + boff_y > h) bsize_y = h - boff_y;
-		for(size_t block_x=0; block_x<num_blocks_x; block_x++) {
-			size_t boff_x = blocksize_x * block_x;
-			size_t bsize_x = blocksize_x;
-			if(bsize_x + boff_x > w) bsize_x = w - boff_x;
-
-			double progress =
-				double(
-					boff_y * w +
-					boff_x * bsize_y
-				) / (w * h);
-			GDALTermProgress(progress, NULL, NULL);
-
-			for(size_t band_idx=0; band_idx<bands.size(); band_idx++) {
-				GDALReadBlock(bands[band_idx], block_x, block_y, &band_buf[band_idx][0]);
-			}
-			if(!ndv_def.empty()) {
-				ndv_def.getNdvMask(band_buf, datatypes, &ndv_mask[0], blocksize_xy);
-			}
+	report_message("Reading input...\n");
 
-			FeatureRawVal pixel;
-			pixel.resize(dt_total_size);
+	std::vector<uint8_t> pixel(dt_total_size);
 
-			for(size_t sub_y=0; sub_y<bsize_y; sub_y++) {
-				size_t y = sub_y + boff_y;
-				bool is_dbuf_stride_y = dbuf && ((y % dbuf->stride_y) == 0);
+	while(BlockReader::Block *block = reader.next_block()) {
+		size_t boff_x = block->boff_x;
+		size_t boff_y = block->boff_y;
+		size_t bsize_x = block->bsize_x;
+		size_t bsize_y = block->bsize_y;
+		const std::vector<uint8_t> &ndv_mask = block->ndv_mask;
 
-				for(size_t sub_x=0; sub_x<bsize_x; sub_x++) {
-					size_t x = sub_x + boff_x;
-					bool is_dbuf_stride = is_dbuf_stride_y && ((sub_x % dbuf->stride_x) == 0);
+		report_progress(reader.progress(block));
 
-					size_t in_idx = blocksize_x*sub_y + sub_x;
+		for(size_t sub_y=0; sub_y<bsize_y; sub_y++) {
+			size_t y = sub_y + boff_y;
+			bool is_dbuf_stride_y = dbuf && ((y % dbuf->stride_y) == 0);
 
-					if(ndv_mask[in_idx]) {
-						num_ndv++;
+			for(size_t sub_x=0; sub_x<bsize_x; sub_x++) {
+				size_t x = sub_x + boff_x;
+				bool is_dbuf_stride = is_dbuf_stride_y && ((sub_x % dbuf->stride_x) == 0);
 
-						if(is_dbuf_stride) {
-							dbuf->plotPoint(x, y, 0, 0, 0);
-						}
-					} else {
-						num_valid++;
-
-						size_t j = 0;
-						for(size_t band_id=0; band_id<bands.size(); band_id++) {
-							uint8_t *p = &band_buf[band_id][in_idx*dt_sizes[band_id]];
-							for(size_t i=0; i<dt_sizes[band_id]; i++) {
-								pixel[j++] = *(p++);
-							}
-						}
-						assert(j == dt_total_size);
-
-						FeatureBitmap::Index index_val = fbm->get_index(pixel);
-						fbm->raster(x, y) = index_val;
-
-						if(is_dbuf_stride) {
-							size_t x = sub_x + boff_x;
-							// assign a random palette for the debug report
-							uint8_t r = index_val * 100 + 100;
-							uint8_t g = index_val * 173 + 36;
-							uint8_t b = index_val * 47  + 202;
-							dbuf->plotPoint(x, y, r, g, b);
+				size_t in_idx = blocksize_x*sub_y + sub_x;
+
+				if(ndv_mask[in_idx]) {
+					num_ndv++;
+
+					if(is_dbuf_stride) {
+						dbuf->plotPoint(x, y, 0, 0, 0);
+					}
+				} else {
+					num_valid++;
+
+					size_t j = 0;
+					for(size_t band_id=0; band_id<num_bands; band_id++) {
+						const uint8_t *p = &block->band_buf[band_id][in_idx*dt_sizes[band_id]];
+						for(size_t i=0; i<dt_sizes[band_id]; i++) {
+							pixel[j++] = *(p++);
 						}
 					}
+					assert(j == dt_total_size);
+
+					FeatureBitmap::Index index_val = fbm->get_index(&pixel[0]);
+					fbm->raster.set(x, y, index_val);
+
+					if(is_dbuf_stride) {
+						// assign a random palette for the debug report
+						uint8_t r = index_val * 100 + 100;
+						uint8_t g = index_val * 173 + 36;
+						uint8_t b = index_val * 47  + 202;
+						dbuf->plotPoint(x, y, r, g, b);
+					}
 				}
 			}
 		}
 	}
 
-	GDALTermProgress(1, NULL, NULL);
+	report_progress(1);
 
-	printf("Found %zd valid and %zd NDV pixels.\n", num_valid, num_ndv);
+	report_message("Found %zd valid and %zd NDV pixels.\n", num_valid, num_ndv);
 
 	return fbm;
 }
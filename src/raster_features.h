@@ -32,11 +32,15 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 // pixel value.  Also, the pixel values can be formatted as strings or as fields in an OGR
 // file.
 
+#ifndef DANGDAL_RASTER_FEATURES_H
+#define DANGDAL_RASTER_FEATURES_H
+
 #include <vector>
 #include <map>
 #include <utility>
 #include <limits>
 #include <string>
+#include <cassert>
 
 #include <boost/format.hpp>
 
@@ -93,26 +97,97 @@ private:
 // A bitmap of features.  Features are stored as type Index in a bitmap, and can be mapped to
 // FeatureRawVal.
 struct FeatureBitmap {
-	typedef uint16_t Index;
+	typedef uint32_t Index;
+	// Marks pixels that belong to no feature (e.g. after erosion).  get_index never hands
+	// out this value.
+	static const Index NO_FEATURE = 0xffffffff;
+
+	// The index of each pixel.  These are stored in 16 bits until there are too many
+	// features for that, and from then on in 32 bits, so that the usual case of a modest
+	// number of classes takes half of the memory.
+	class IndexRaster {
+	public:
+		IndexRaster(size_t _w, size_t _h) : w(_w), h(_h), narrow(_w*_h, 0), is_wide(false) { }
+
+		Index operator()(size_t x, size_t y) const {
+			assert(x<w && y<h);
+			if(is_wide) return wide[y*w + x];
+			const uint16_t v = narrow[y*w + x];
+			return v == NARROW_NO_FEATURE ? NO_FEATURE : v;
+		}
+
+		void set(size_t x, size_t y, Index v) {
+			assert(x<w && y<h);
+			if(is_wide) {
+				wide[y*w + x] = v;
+			} else {
+				assert(v < NARROW_NO_FEATURE || v == NO_FEATURE);
+				narrow[y*w + x] = (v == NO_FEATURE) ? NARROW_NO_FEATURE : uint16_t(v);
+			}
+		}
+
+		// Largest index that can be stored before widen() is needed.
+		Index max_index() const { return is_wide ? NO_FEATURE-1 : NARROW_NO_FEATURE-1; }
+		void widen();
+
+	private:
+		static const uint16_t NARROW_NO_FEATURE = 0xffff;
+
+		size_t w, h;
+		std::vector<uint16_t> narrow;
+		std::vector<Index> wide;
+		bool is_wide;
+	};
 
 	FeatureBitmap(const size_t _w, const size_t _h, const size_t _raw_vals_size);
 
+	// Blocks are decoded using num_threads threads (see BlockReader).
 	static FeatureBitmap *from_raster(
-		GDALDatasetH ds, std::vector<size_t> band_ids, const NdvDef &ndv_def, DebugPlot *dbuf);
+		GDALDatasetH ds, std::vector<size_t> band_ids, const NdvDef &ndv_def, DebugPlot *dbuf,
+		size_t num_threads);
 
-	const std::map<FeatureRawVal, Index> &feature_table() const {
-		return table;
+	// Maps each feature value to its index, in order of value.
+	std::map<FeatureRawVal, Index> feature_table() const;
+
+	size_t num_features() const {
+		return num_keys;
 	}
 
-	Index get_index(const FeatureRawVal &pixel);
+	const IndexRaster &index_raster() const {
+		return raster;
+	}
+
+	// The index for a value of raw_vals_size bytes, allocating a new one if this value
+	// hasn't been seen yet.
+	Index get_index(const uint8_t *pixel);
 	void dump_feature_table() const;
 	BitGrid get_mask_for_feature(Index wanted) const;
+	// Same as running BitGrid::erode(passes) on the mask of each feature.  Eroded pixels
+	// are set to NO_FEATURE.
+	void erode(int passes=1);
 
 private:
+	Index add_key(const uint8_t *pixel);
+	void grow_slots();
+
 	const size_t w, h;
 	const size_t raw_vals_size;
-	GridArray<Index> raster;
-	std::map<FeatureRawVal, Index> table;
+	IndexRaster raster;
+
+	// The value of each feature, raw_vals_size bytes each, in order of index.
+	std::vector<uint8_t> keys;
+	size_t num_keys;
+	// Open addressing hash table (linear probing) of indices into keys, with NO_FEATURE
+	// marking empty slots.  The size is a power of two.
+	std::vector<Index> slots;
+	// Values of at most two bytes (i.e. a single Byte or 16-bit band) are looked up
+	// directly in this table instead of hashed.
+	std::vector<Index> direct;
+	// Neighboring pixels tend to have the same value, so the last lookup is remembered.
+	std::vector<uint8_t> last_key;
+	Index last_index;
 };
 
 } // namespace dangdal
+
+#endif // ifndef DANGDAL_RASTER_FEATURES_H
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2013, Regents of the University of Alaska
+
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+    * Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+    * Neither the name of the Geographic Information Network of Alaska nor the names of its contributors may be used to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+This code was developed by Dan Stahlke for the Geographic Information Network of Alaska.
+*/
+
+#ifndef DANGDAL_READ_AHEAD_H
+#define DANGDAL_READ_AHEAD_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <exception>
+
+#include <boost/thread.hpp>
+#include <boost/foreach.hpp>
+
+#include "common.h"
+
+namespace dangdal {
+
+// Runs numbered jobs (typically reading a window of a raster) on background threads and
+// hands the results back in job order, so that the caller can work on one result while the
+// next ones are being read.  Workers stay at most 'depth' jobs ahead of the caller.  Results
+// are recycled: the T given to a job is one that the caller has finished with (or a new
+// one), so buffers in it can be reused without being reallocated.
+//
+// The workers start as soon as this is constructed, so the Producer must be ready by then.
+//
+// An exception thrown by a job (e.g. a FatalError from a failed read, with
+// throw_fatal_errors) is caught on the worker and passed to fatal_error by next() when the
+// caller reaches that job, so it is raised on the caller's thread.
+template <typename T>
+class ReadAhead {
+public:
+	class Producer {
+	public:
+		virtual ~Producer() { }
+		// Called on worker thread worker_idx (less than num_workers).  Calls with different
+		// worker_idx may happen at the same time.
+		virtual void produce(size_t job, size_t worker_idx, T &out) = 0;
+	};
+
+	ReadAhead(Producer *_producer, size_t _num_jobs, size_t num_workers, size_t _depth) :
+		producer(_producer),
+		num_jobs(_num_jobs),
+		depth(std::max(_depth, size_t(1))),
+		next_job(0),
+		next_out(0),
+		current(NULL),
+		stopping(false)
+	{
+		for(size_t i=0; i<std::max(num_workers, size_t(1)); i++) {
+			threads.add_thread(new boost::thread(&ReadAhead::worker_main, this, i));
+		}
+	}
+
+	~ReadAhead() {
+		{
+			boost::mutex::scoped_lock lock(mutex);
+			stopping = true;
+			cond.notify_all();
+		}
+		threads.join_all();
+
+		delete current;
+		typedef typename std::map<size_t, T *>::value_type finished_pair_t;
+		BOOST_FOREACH(const finished_pair_t &f, finished) delete f.second;
+		BOOST_FOREACH(T *t, free_items) delete t;
+	}
+
+	// The result of the next job, or NULL after the last one.  It is valid until the next
+	// call.
+	T *next() {
+		boost::mutex::scoped_lock lock(mutex);
+		if(current) {
+			free_items.push_back(current);
+			current = NULL;
+		}
+		if(next_out == num_jobs) return NULL;
+
+		typename std::map<size_t, T *>::iterator it;
+		for(;;) {
+			std::map<size_t, std::string>::iterator err = errors.find(next_out);
+			if(err != errors.end()) fatal_error(err->second);
+			if((it = finished.find(next_out)) != finished.end()) break;
+			cond.wait(lock);
+		}
+		current = it->second;
+		finished.erase(it);
+		next_out++;
+		cond.notify_all();
+		return current;
+	}
+
+private:
+	// not copyable
+	ReadAhead(const ReadAhead &);
+	ReadAhead &operator=(const ReadAhead &);
+
+	void worker_main(size_t worker_idx) {
+		for(;;) {
+			size_t job;
+			T *t;
+			{
+				boost::mutex::scoped_lock lock(mutex);
+				// don't get too far ahead of the consumer
+				while(!stopping && next_job < num_jobs && next_job >= next_out + depth) {
+					cond.wait(lock);
+				}
+				if(stopping || next_job >= num_jobs) return;
+				job = next_job++;
+				if(free_items.empty()) {
+					t = new T();
+				} else {
+					t = free_items.back();
+					free_items.pop_back();
+				}
+			}
+
+			std::string error;
+			bool failed = false;
+			try {
+				producer->produce(job, worker_idx, *t);
+			} catch(const std::exception &e) {
+				error = e.what();
+				failed = true;
+			} catch(...) {
+				error = "unknown error on reader thread";
+				failed = true;
+			}
+
+			boost::mutex::scoped_lock lock(mutex);
+			if(failed) {
+				errors[job] = error;
+				free_items.push_back(t);
+			} else {
+				finished[job] = t;
+			}
+			cond.notify_all();
+		}
+	}
+
+	Producer *producer;
+	size_t num_jobs;
+	size_t depth;
+	size_t next_job;
+	size_t next_out;
+	T *current;
+	std::map<size_t, T *> finished;
+	// messages of the jobs that threw
+	std::map<size_t, std::string> errors;
+	std::vector<T *> free_items;
+	boost::thread_group threads;
+	boost::mutex mutex;
+	boost::condition_variable cond;
+	bool stopping;
+};
+
+} // namespace dangdal
+
+#endif // ifndef DANGDAL_READ_AHEAD_H
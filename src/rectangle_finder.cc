@@ -26,6 +26,10 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 
 
 
+#include <vector>
+#include <algorithm>
+#include <climits>
+
 #include "common.h"
 #include "polygon.h"
 #include "polygon-rasterizer.h"
@@ -61,7 +65,8 @@ double ang_diff(double a1, double a2) {
 	return d<=180.0 ? d : 360.0-d;
 }
 
-Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *dbuf) {
+template <typename MaskType>
+static Ring calc_rect4_from_convex_hull(const MaskType &mask, int w, int h, DebugPlot *dbuf) {
 	std::vector<int> chrows_left(h);
 	std::vector<int> chrows_right(h);
 	for(int j=0; j<h; j++) {
@@ -69,13 +74,11 @@ Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *d
 		chrows_right[j] = -1;
 	}
 	for(int j=0; j<h; j++) {
-		int left = w;
-		int right = -1;
-		for(int i=0; i<w; i++) {
-			if(mask(i, j)) {
-				if(left > i) left = i;
-				if(right < i) right = i;
-			}
+		int left = mask.first_set(j);
+		int right = mask.last_set(j);
+		if(left < 0) {
+			left = w;
+			right = -1;
 		}
 		if(chrows_left[j] > left) chrows_left[j] = left;
 		if(chrows_right[j] < right) chrows_right[j] = right;
@@ -314,43 +317,132 @@ Ring calc_rect4_from_convex_hull(const BitGrid &mask, int w, int h, DebugPlot *d
 	}
 }
 
-//static int is_in_crossings(row_crossings_t *r, int x) {
-//	int v = 0;
-//	// not the fastest way...
-//	for(int j=0; j<r->num_crossings; j++) {
-//		if(x >= r->crossings[j]) v = !v;
-//	}
-//	return v;
-//}
-
-static int ringdiff(const Ring &r1, const Ring &r2, const BitGrid &mask) {
-	Mpoly mp1, mp2;
-	mp1.rings.push_back(r1);
-	mp2.rings.push_back(r2);
-
-	Bbox bb = box_union(r1.getBbox(), r2.getBbox());
-	//int min_x = (int)floor(bb.min_x);
-	int min_y = (int)floor(bb.min_y);
-	int max_x = (int)ceil (bb.max_x);
-	int max_y = (int)ceil (bb.max_y);
-
-	std::vector<row_crossings_t> rcs1 = get_row_crossings(mp1, min_y, max_y-min_y+1);
-	std::vector<row_crossings_t> rcs2 = get_row_crossings(mp2, min_y, max_y-min_y+1);
+// Set pixels of each row counted at every SPAN_TABLE_STEP pixels, so that the
+// number in any span can be had from two lookups plus at most two partial
+// blocks, rather than by walking the whole span.
+static const int SPAN_TABLE_STEP = 256;
+
+template <typename MaskType>
+class SpanCounter {
+public:
+	SpanCounter(const MaskType &_mask, int _w, int _h) :
+		mask(_mask), w(_w), h(_h),
+		stride(size_t(_w) / SPAN_TABLE_STEP + 1),
+		table(stride * size_t(std::max(_h, 0)))
+	{
+		for(int y=0; y<h; y++) {
+			uint32_t *row = &table[size_t(y) * stride];
+			uint32_t cnt = 0;
+			row[0] = 0;
+			for(size_t k=1; k<stride; k++) {
+				int x = int(k-1) * SPAN_TABLE_STEP;
+				cnt += mask.count_span(y, x, x + SPAN_TABLE_STEP);
+				row[k] = cnt;
+			}
+		}
+	}
+
+	// Same as MaskType::count_span.
+	int count_span(int y, int from, int to) const {
+		if(y < 0 || y >= h) return 0;
+		from = std::max(from, 0);
+		to = std::min(to, w);
+		if(from >= to) return 0;
+		return int(prefix(y, to) - prefix(y, from));
+	}
+
+private:
+	// number of set pixels in row y with x<pos
+	size_t prefix(int y, int pos) const {
+		int k = pos / SPAN_TABLE_STEP;
+		int x0 = k * SPAN_TABLE_STEP;
+		return table[size_t(y) * stride + k] + mask.count_span(y, x0, pos);
+	}
+
+	const MaskType &mask;
+	int w, h;
+	size_t stride;
+	std::vector<uint32_t> table;
+};
+
+// The row crossings of a quadrilateral, from a RowCrossingScanner, kept in flat
+// arrays that are reused from one call to the next.  The annealer rasterizes one
+// of these per iteration and compares it to the best one so far, whose rows are
+// kept rather than scanned again.
+class QuadRows {
+public:
+	QuadRows() : min_y(0), num_rows(0) { }
+
+	void rasterize(const Ring &ring) {
+		assert(ring.pts.size() == NUM_EDGES);
+
+		scanner.reset(ring);
+		if(scanner.min_row() > scanner.max_row()) {
+			min_y = 0;
+			num_rows = 0;
+			return;
+		}
+		min_y = scanner.min_row();
+		num_rows = scanner.max_row() - min_y + 1;
+
+		xs.resize(size_t(num_rows) * MAX_CROSSINGS);
+		xs_n.resize(num_rows);
+
+		for(int row=0; row<num_rows; row++) {
+			const row_crossings_t &r = scanner.row(min_y + row);
+			assert(r.size() <= MAX_CROSSINGS);
+			std::copy(r.begin(), r.end(), &xs[size_t(row) * MAX_CROSSINGS]);
+			xs_n[row] = r.size();
+		}
+	}
+
+	void swap(QuadRows &other) {
+		std::swap(min_y, other.min_y);
+		std::swap(num_rows, other.num_rows);
+		xs.swap(other.xs);
+		xs_n.swap(other.xs_n);
+	}
+
+	int get_min_y() const { return min_y; }
+	int get_max_y() const { return min_y + num_rows - 1; }
+
+	// Crossings of row y, with their count in 'n' (zero outside the ring).
+	const int *row(int y, size_t &n) const {
+		if(y < min_y || y >= min_y + num_rows) {
+			n = 0;
+			return NULL;
+		}
+		n = xs_n[y - min_y];
+		return &xs[size_t(y - min_y) * MAX_CROSSINGS];
+	}
+
+private:
+	static const size_t NUM_EDGES = 4;
+	static const size_t MAX_CROSSINGS = 2*NUM_EDGES;
+
+	RowCrossingScanner scanner;
+	int min_y, num_rows;
+	std::vector<int> xs;
+	std::vector<size_t> xs_n;
+};
+
+template <typename MaskType>
+static int ringdiff(const QuadRows &r1, const QuadRows &r2, const SpanCounter<MaskType> &mask) {
+	const int min_y = std::min(r1.get_min_y(), r2.get_min_y());
+	const int max_y = std::max(r1.get_max_y(), r2.get_max_y());
 
 	int tally = 0;
 	for(int y=min_y; y<=max_y; y++) {
-		const row_crossings_t &row1 = rcs1[y - min_y];
-		const row_crossings_t &row2 = rcs2[y - min_y];
+		size_t n1, n2;
+		const int *row1 = r1.row(y, n1);
+		const int *row2 = r2.row(y, n2);
 
 		bool in1=0, in2=0;
 		size_t ci1=0, ci2=0;
 		for(;;) {
-			int cx1 = ci1 < row1.size() ? row1[ci1] : max_x+1;
-			int cx2 = ci2 < row2.size() ? row2[ci2] : max_x+1;
-			// FIXME
-			//if(cx1 > max_x+1 || cx2 > max_x+1) fatal_error("cx > max_x+1 (%d,%d,%d)", cx1, cx2, max_x+1);
-			//if(cx1 == max_x+1 && cx2 == max_x+1) break;
-			if(cx1 >= max_x+1 && cx2 >= max_x+1) break;
+			if(ci1 == n1 && ci2 == n2) break;
+			int cx1 = ci1 < n1 ? row1[ci1] : INT_MAX;
+			int cx2 = ci2 < n2 ? row2[ci2] : INT_MAX;
 
 			int x_from = std::min(cx1, cx2);
 			if(cx1 < cx2) {
@@ -363,27 +455,18 @@ static int ringdiff(const Ring &r1, const Ring &r2, const BitGrid &mask) {
 
 			if((in1 && in2) || (!in1 && !in2)) continue;
 
-			cx1 = ci1 < row1.size() ? row1[ci1] : max_x+1;
-			cx2 = ci2 < row2.size() ? row2[ci2] : max_x+1;
+			cx1 = ci1 < n1 ? row1[ci1] : INT_MAX;
+			cx2 = ci2 < n2 ? row2[ci2] : INT_MAX;
 			int x_to = std::min(cx1, cx2);
 			
 			int gain=1, penalty=2; // FIXME - arbitrary
-			for(int x=x_from; x<x_to; x++) {
-				uint8_t m = mask(x, y) ? 1 : 0;
-				if(in1) tally += m ? -penalty : gain;
-				if(in2) tally += m ? gain : -penalty;
+			if(x_to > x_from) {
+				int num_on = mask.count_span(y, x_from, x_to);
+				int num_off = (x_to - x_from) - num_on;
+				if(in1) tally += num_off * gain - num_on * penalty;
+				if(in2) tally += num_on * gain - num_off * penalty;
 			}
 		}
-
-		//for(int x=min_x; x<=max_x; x++) {
-		//	int in1 = is_in_crossings(row1, x);
-		//	int in2 = is_in_crossings(row2, x);
-		//	if((in1 && !in2) || (in2 && !in1)) {
-		//		uint8_t m = mask(x, y) ? 1 : 0;
-		//		if(in1) tally += m ? -1 :  1;
-		//		if(in2) tally += m ?  1 : -1;
-		//	}
-		//}
 	}
 	return tally;
 }
@@ -470,29 +553,36 @@ static ring_t anneal(ring_t *input, int recurse, const BitGrid &mask, int w, int
 }
 */
 
-static Ring anneal(const Ring &input, const BitGrid &mask) {
+template <typename MaskType>
+static Ring anneal(const Ring &input, const MaskType &mask, int w, int h) {
+	SpanCounter<MaskType> counter(mask, w, h);
+
 	Ring best = input;
 	Ring pert = input;
+	QuadRows best_rows, pert_rows;
+	best_rows.rasterize(best);
 
 	for(int iter=0; iter<10000; iter++) { // FIXME - arbitrary
 		int amt = (int)ceil(200.0 * exp(-iter / 50.0)); // FIXME - arbitrary
 		perturb(best, pert, amt);
-		int diff = ringdiff(best, pert, mask);
+		pert_rows.rasterize(pert);
+		int diff = ringdiff(best_rows, pert_rows, counter);
 		if(diff > 0) {
-			// swap best and pert
-			Ring t = best; best = pert; pert = t;
+			std::swap(best.pts, pert.pts);
+			best_rows.swap(pert_rows);
 		}
 	}
 
 	return best;
 }
 
-Ring calc_rect4_from_mask(const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai) {
+template <typename MaskType>
+static Ring calc_rect4_impl(const MaskType &mask, int w, int h, DebugPlot *dbuf, bool use_ai) {
 	Ring best = calc_rect4_from_convex_hull(mask, w, h, dbuf);
 	if(best.pts.size() == 0) return best;
 
 	if(use_ai) {
-		best = anneal(best, mask);
+		best = anneal(best, mask, w, h);
 
 		if(dbuf && dbuf->mode == PLOT_RECT4) {
 			for(size_t i=0; i<best.pts.size(); i++) {
@@ -507,4 +597,179 @@ Ring calc_rect4_from_mask(const BitGrid &mask, int w, int h, DebugPlot *dbuf, bo
 	return best;
 }
 
+Ring calc_rect4_from_mask(const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai) {
+	return calc_rect4_impl(mask, w, h, dbuf, use_ai);
+}
+
+Ring calc_rect4_from_mask(const RleMask &mask, int w, int h, DebugPlot *dbuf, bool use_ai) {
+	return calc_rect4_impl(mask, w, h, dbuf, use_ai);
+}
+
+// Left and right ends of the quadrilateral at height y.  Heights above or below it are
+// clamped to its top or bottom.
+static void quad_x_range(const Ring &quad, double y, double *left, double *right) {
+	Bbox bb = quad.getBbox();
+	y = std::max(bb.min_y, std::min(bb.max_y, y));
+	*left = bb.max_x;
+	*right = bb.min_x;
+	for(size_t i=0; i<quad.pts.size(); i++) {
+		const Vertex &p0 = quad.pts[i];
+		const Vertex &p1 = quad.pts[(i+1) % quad.pts.size()];
+		if(y < std::min(p0.y, p1.y) || y > std::max(p0.y, p1.y)) continue;
+		double x0, x1;
+		if(p0.y == p1.y) {
+			x0 = p0.x;
+			x1 = p1.x;
+		} else {
+			x0 = x1 = p0.x + (y - p0.y) * (p1.x - p0.x) / (p1.y - p0.y);
+		}
+		*left = std::min(*left, std::min(x0, x1));
+		*right = std::max(*right, std::max(x0, x1));
+	}
+}
+
+// Rows of the full resolution image are searched this many at a time.
+static const int PYRAMID_STRIP_ROWS = 64;
+
+Ring calc_rect4_pyramid(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, int factor, DebugPlot *dbuf, bool use_ai, Vertex *centroid_out
+) {
+	const int w = GDALGetRasterXSize(ds);
+	const int h = GDALGetRasterYSize(ds);
+	const int cw = std::max(1, (w + factor - 1) / factor);
+	const int ch = std::max(1, (h + factor - 1) / factor);
+	const double sx = double(w) / cw;
+	const double sy = double(h) / ch;
+
+	report_message("Reading %d x %d reduced mask...\n", cw, ch);
+	std::vector<uint8_t> buf;
+	read_valid_window(ds, bandlist, ndv_def, 0, 0, w, h, cw, ch, buf);
+	BitGrid coarse(cw, ch);
+	for(int y=0; y<ch; y++) {
+		coarse.set_row_span(0, y, &buf[size_t(y) * cw], cw, false);
+	}
+
+	Vertex c = coarse.centroid();
+	*centroid_out = Vertex((c.x + 0.5) * sx - 0.5, (c.y + 0.5) * sy - 0.5);
+
+	Ring quad = calc_rect4_from_mask(coarse, cw, ch, NULL, use_ai);
+	if(quad.pts.size() != 4) return quad;
+	for(size_t i=0; i<quad.pts.size(); i++) {
+		quad.pts[i].x = (quad.pts[i].x + 0.5) * sx - 0.5;
+		quad.pts[i].y = (quad.pts[i].y + 0.5) * sy - 0.5;
+	}
+	if(use_ai) return quad;
+
+	// The decimated mask can be off by about a reduced pixel in any direction.
+	const int margin = 2 * factor;
+	Bbox quad_bb = quad.getBbox();
+	int y_from = std::max(0, int(floor(quad_bb.min_y)) - margin);
+	int y_to = std::min(h, int(ceil(quad_bb.max_y)) + margin + 1);
+
+	report_message("Searching for edges at full resolution...\n");
+	RleMask edges(w, h);
+	size_t pixels_read = 0;
+	for(int y0=y_from; y0<y_to; y0+=PYRAMID_STRIP_ROWS) {
+		report_progress(double(y0 - y_from) / (y_to - y_from));
+		const int sh = std::min(PYRAMID_STRIP_ROWS, y_to - y0);
+
+		// The sides are linear between vertices, so their range over the strip is
+		// found at the ends of the strip and at the vertices within it.
+		double l_min = w, l_max = 0, r_min = w, r_max = 0;
+		std::vector<double> probe_y;
+		probe_y.push_back(y0);
+		probe_y.push_back(y0 + sh - 1);
+		for(size_t i=0; i<quad.pts.size(); i++) {
+			if(quad.pts[i].y > y0 && quad.pts[i].y < y0 + sh - 1) probe_y.push_back(quad.pts[i].y);
+		}
+		for(size_t i=0; i<probe_y.size(); i++) {
+			double l, r;
+			quad_x_range(quad, probe_y[i], &l, &r);
+			l_min = std::min(l_min, l); l_max = std::max(l_max, l);
+			r_min = std::min(r_min, r); r_max = std::max(r_max, r);
+		}
+		int l_lo = std::max(0, int(floor(l_min)) - margin);
+		int l_hi = std::min(w, int(ceil(l_max)) + margin + 1);
+		int r_lo = std::max(0, int(floor(r_min)) - margin);
+		int r_hi = std::min(w, int(ceil(r_max)) + margin + 1);
+
+		std::vector<int> first(sh), last(sh);
+		for(;;) {
+			// one window if the sides are close together
+			const bool split = l_hi < r_lo;
+			if(!split) {
+				l_hi = r_hi;
+				r_lo = l_lo;
+			}
+
+			std::fill(first.begin(), first.end(), -1);
+			std::fill(last.begin(), last.end(), -1);
+			read_valid_window(ds, bandlist, ndv_def, l_lo, y0, l_hi - l_lo, sh,
+				l_hi - l_lo, sh, buf);
+			pixels_read += buf.size();
+			for(int y=0; y<sh; y++) {
+				const uint8_t *row = &buf[size_t(y) * (l_hi - l_lo)];
+				for(int x=0; x<l_hi-l_lo; x++) {
+					if(row[x]) {
+						if(first[y] < 0) first[y] = l_lo + x;
+						last[y] = l_lo + x;
+					}
+				}
+			}
+			bool merge = false;
+			if(split) {
+				std::vector<int> left_last(last);
+				std::fill(last.begin(), last.end(), -1);
+				read_valid_window(ds, bandlist, ndv_def, r_lo, y0, r_hi - r_lo, sh,
+					r_hi - r_lo, sh, buf);
+				pixels_read += buf.size();
+				for(int y=0; y<sh; y++) {
+					const uint8_t *row = &buf[size_t(y) * (r_hi - r_lo)];
+					for(int x=r_hi-r_lo-1; x>=0; x--) {
+						if(row[x]) {
+							last[y] = r_lo + x;
+							break;
+						}
+					}
+					// Data on just one side means the other side is in that window too,
+					// unless the data runs up to the inner edge of the window.
+					if(first[y] < 0 && last[y] >= 0) {
+						for(int x=0; x<r_hi-r_lo; x++) {
+							if(row[x]) { first[y] = r_lo + x; break; }
+						}
+						if(first[y] == r_lo) merge = true;
+					} else if(first[y] >= 0 && last[y] < 0) {
+						last[y] = left_last[y];
+						if(last[y] == l_hi-1) merge = true;
+					}
+				}
+			}
+			if(merge) {
+				// look at everything between the sides
+				l_hi = r_lo;
+				continue;
+			}
+
+			// If there is valid data at the outer edge of a window, the side of the
+			// image might be further out, so look again with a wider window.
+			bool widen_l = false, widen_r = false;
+			for(int y=0; y<sh; y++) {
+				if(first[y] == l_lo && l_lo > 0) widen_l = true;
+				if(last[y] == r_hi-1 && r_hi < w) widen_r = true;
+			}
+			if(!widen_l && !widen_r) break;
+			if(widen_l) l_lo = std::max(0, l_lo - (l_hi - l_lo));
+			if(widen_r) r_hi = std::min(w, r_hi + (r_hi - r_lo));
+		}
+
+		for(int y=0; y<sh; y++) {
+			if(first[y] >= 0) edges.append_run(y0 + y, first[y], last[y] + 1);
+		}
+	}
+	report_progress(1);
+	if(VERBOSE) printf("read %zd of %zd pixels\n", pixels_read, size_t(w) * h);
+
+	return calc_rect4_from_mask(edges, w, h, dbuf, false);
+}
+
 } // namespace dangdal
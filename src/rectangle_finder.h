@@ -33,6 +33,18 @@ This code was developed by Dan Stahlke for the Geographic Information Network of
 namespace dangdal {
 
 Ring calc_rect4_from_mask(const BitGrid &mask, int w, int h, DebugPlot *dbuf, bool use_ai);
+Ring calc_rect4_from_mask(const RleMask &mask, int w, int h, DebugPlot *dbuf, bool use_ai);
+
+// Finds the same quadrilateral as calc_rect4_from_mask does for the valid mask of the
+// dataset, but reads only a small part of the dataset.  The quadrilateral is first found
+// on the mask reduced by 'factor' (taken from an overview if there is one).  Then the
+// leftmost and rightmost valid pixel of each row is found by reading full resolution
+// windows along the sides of that quadrilateral, which is all that the convex hull needs.
+// With use_ai the annealing is done on the reduced mask, and those corners are returned.
+// The centroid of the reduced mask, in full resolution pixel coordinates, goes in
+// centroid_out.
+Ring calc_rect4_pyramid(GDALDatasetH ds, const std::vector<size_t> &bandlist,
+	const NdvDef &ndv_def, int factor, DebugPlot *dbuf, bool use_ai, Vertex *centroid_out);
 
 } // namespace dangdal
 
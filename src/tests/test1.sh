@@ -1,6 +1,6 @@
 #!/bin/bash
 
-rm -f out_test1_*
+rm -f out_test1_* out_threads_test1_* out_stripe_test1_* out_stream_test1_* out_stream_threads_test1_* out_tif_test1_* out_direct_test1_* out_full_test1_* out_pyramid_test1_* out_striped_test1_* out_rle_test1_*
 
 #BINDIR="valgrind -q .."
 BINDIR=..
@@ -21,9 +21,52 @@ $BINDIR/gdal_trace_outline testcase_features.png -out-cs xy -wkt-out out_test1_f
 $BINDIR/gdal_trace_outline testcase_double.tif -out-cs xy -wkt-out out_test1_double.wkt -ogr-out out_test1_double.shp -dp-toler 0 -classify
 $BINDIR/gdal_trace_outline testcase_double.tif -out-cs xy -wkt-out out_test1_double_clip.wkt -dp-toler 0 -classify -valid-range '3..6'
 
+# Multithreaded reading should give exactly the same output as above.
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_threads_test1_3.wkt -split-polys -dp-toler 0 -threads 4
+$BINDIR/gdal_trace_outline testcase_3.tif -out-cs xy -wkt-out out_threads_test1_3_classify.wkt -dp-toler 0 -classify -threads 4
+
+# So should reading in stripes, and writing each component as it is traced.
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_stripe_test1_3.wkt -split-polys -dp-toler 0 -stripe-rows 7
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_stream_test1_3.wkt -split-polys -dp-toler 0 -stream
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_stream_threads_test1_3.wkt -split-polys -dp-toler 0 -stream -threads 4
+
+# Holes that touch at a corner, and islands that touch a hole at a corner, must come out
+# of the striped tracer the same as out of the default one.
+python <<END
+import numpy as np
+import osgeo.gdal as gdal
+
+driver = gdal.GetDriverByName('GTiff')
+(w, h) = (64, 48)
+vals = (np.random.RandomState(1).rand(h, w) < 0.6).astype(np.uint8)
+# a checkerboard inside of a frame: each unset square is a hole touching the others
+vals[4:14, 4:14] = 1
+vals[5:13, 5:13] = (np.add.outer(range(8), range(8)) % 2).astype(np.uint8)
+dst_ds = driver.Create('corners.tif', w, h, 1, gdal.GDT_Byte)
+dst_ds.GetRasterBand(1).WriteArray(vals, 0, 0)
+dst_ds = None
+END
+$BINDIR/gdal_trace_outline corners.tif -ndv 0 -out-cs xy -wkt-out out_full_test1_corners.wkt -split-polys -dp-toler 0
+$BINDIR/gdal_trace_outline corners.tif -ndv 0 -out-cs xy -wkt-out out_striped_test1_corners.wkt -split-polys -dp-toler 0 -stripe-rows 5
+$BINDIR/gdal_trace_outline corners.tif -ndv 0 -out-cs xy -wkt-out out_full_test1_corners_min3.wkt -split-polys -dp-toler 0 -min-ring-area 3
+$BINDIR/gdal_trace_outline corners.tif -ndv 0 -out-cs xy -wkt-out out_striped_test1_corners_min3.wkt -split-polys -dp-toler 0 -min-ring-area 3 -stripe-rows 5
+
+# Reading coarse-to-fine should find the same outline as reading everything, when the
+# factor is within the tolerances.
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_full_test1_3_dp4.wkt -split-polys -dp-toler 4 -min-ring-area 16
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_pyramid_test1_3_dp4.wkt -split-polys -dp-toler 4 -min-ring-area 16 -pyramid 4
+
+# Holding the mask as runs rather than a bitmap must not change the output.
+$BINDIR/gdal_trace_outline testcase_3.tif -ndv 255 -out-cs xy -wkt-out out_rle_test1_3.wkt -split-polys -dp-toler 0 -rle
+$BINDIR/gdal_trace_outline testcase_noise.png -b 1 -ndv   0 -out-cs xy -wkt-out out_rle_test1_noise.wkt -split-polys -dp-toler 0 -rle
+$BINDIR/gdal_make_ndv_mask -rle -ndv '155 52 52' -ndv '24 173 79' testcase_3.tif out_rle_test1_3_ndvmask.pbm
+
 $BINDIR/gdal_list_corners -inspect-rect4 -erosion -ndv 0 testcase_4.png -report out_test1_4-rect.ppm > out_test1_4-rect.wkt
 
 $BINDIR/gdal_wkt_to_mask -wkt good_test1_1_en.wkt -geo-from testcase_1.tif -mask-out out_test1_1_mask.ppm
+# The GeoTIFF mask, read back as a mask of its nonzero pixels, must match the PBM one.
+$BINDIR/gdal_wkt_to_mask -wkt good_test1_1_en.wkt -geo-from testcase_1.tif -mask-out out_tif_test1_1_mask.tif
+$BINDIR/gdal_make_ndv_mask -ndv 0 out_tif_test1_1_mask.tif out_tif_test1_1_mask.ppm
 
 $BINDIR/gdal_get_projected_bounds -s_wkt good_test1_1_en.wkt -s_srs '+proj=utm +zone=6 +ellps=WGS84 +units=m +no_defs ' -t_srs '+proj=stere +lat_ts=80 +lat_0=90 +lon_0=0 +ellps=WGS84' -report out_test1_projbounds_report.ppm > out_test1_projbounds.yml
 
@@ -72,6 +115,28 @@ $BINDIR/gdal_make_ndv_mask \
 	-invert \
     gradient3.tif out_test1_gradient_ndv_inv.pbm
 
+# A VRT written directly from the file headers must read the same.
+$BINDIR/gdal_merge_vrt -in gradient1.tif -in gradient2.tif -out gradient3_direct.vrt -direct
+$BINDIR/gdal_make_ndv_mask \
+    -ndv '10..30 30..70 *' \
+    -ndv '* * 4..Inf' \
+    -ndv '100..140 50..80 0.5..Inf' \
+    -ndv '* * 0.8..0.3' \
+    -ndv '* * 0.3..0.4' \
+    gradient3_direct.vrt out_direct_test1_gradient_ndv.pbm
+
+# The streaming version must give the same masks.
+$BINDIR/gdal_make_ndv_mask -stripe-rows 7 -ndv '155 52 52' -ndv '24 173 79' testcase_3.tif out_stripe_test1_3_ndvmask.pbm
+$BINDIR/gdal_make_ndv_mask \
+    -stripe-rows 7 \
+    -ndv '10..30 30..70 *' \
+    -ndv '* * 4..Inf' \
+    -ndv '100..140 50..80 0.5..Inf' \
+    -ndv '* * 0.8..0.3' \
+    -ndv '* * 0.3..0.4' \
+	-invert \
+    gradient3.tif out_stripe_test1_gradient_ndv_inv.pbm
+
 $BINDIR/gdal_make_ndv_mask \
     -valid-range '10..30 30..70 *' \
     -valid-range '* * 4..Inf' \
@@ -124,3 +189,53 @@ for i in good_test1_* ; do
 		echo "BAD ${i/good_/}"
 	fi
 done
+
+for i in out_threads_test1_* ; do
+	if diff --brief ${i/out_threads/good} $i ; then
+		echo "GOOD ${i/out_/}"
+	else
+		echo "BAD ${i/out_/}"
+	fi
+done
+
+for i in out_stripe_test1_* ; do
+	if diff --brief ${i/out_stripe/good} $i ; then
+		echo "GOOD ${i/out_/}"
+	else
+		echo "BAD ${i/out_/}"
+	fi
+done
+
+for i in out_stream_test1_* out_stream_threads_test1_* out_direct_test1_* out_tif_test1_*.ppm out_rle_test1_* ; do
+	if diff --brief ${i/out_*_test1/good_test1} $i ; then
+		echo "GOOD ${i/out_/}"
+	else
+		echo "BAD ${i/out_/}"
+	fi
+done
+
+for i in out_striped_test1_* ; do
+	if diff --brief ${i/out_striped/out_full} $i ; then
+		echo "GOOD ${i/out_/}"
+	else
+		echo "BAD ${i/out_/}"
+	fi
+done
+
+for i in out_pyramid_test1_* ; do
+	if diff --brief ${i/out_pyramid/out_full} $i ; then
+		echo "GOOD ${i/out_/}"
+	else
+		echo "BAD ${i/out_/}"
+	fi
+done
+
+# Checks of libdangdal itself: errors on the reader threads must be thrown to the
+# caller, progress must go to the hook, the excursion pincher must give the expected
+# rings, and the fast hillshading must match the per-pixel version.
+# dangdal_lib_test is built by 'make check'.
+if [ -e ../dangdal_lib_test ] ; then
+	../dangdal_lib_test | grep -E '^(GOOD|BAD) '
+else
+	echo "!!! dangdal_lib_test not built (run 'make check')"
+fi